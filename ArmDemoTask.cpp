@@ -2,8 +2,10 @@
 #include <iostream>
 #include <vector>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <math.h>
+#include <algorithm>
 
 #include "Aria.h"
 #include "ArNetworking.h"
@@ -26,20 +28,205 @@ ArmDemoTask::ArmDemoTask(ArClientBase *client, ArPTZ * _ptu) :
   demoWaitingToFinish(false),
   numDemoCartesianVelocities(0),
   numDemoCartesianPositions(0),
+  graspTargetFunctor(NULL),
+  graspTargetWait(0),
+  parkTimeout(15000),
   armCount(0),
-  ptu(_ptu)
+  readArmStateFunctor(this, &ArmDemoTask::read_arm_state),
+  armStateSampledFunctor(this, &ArmDemoTask::arm_state_sampled),
+  stateSampler(&readArmStateFunctor),
+  armStateRing(NULL),
+  ptu(_ptu),
+  ptuTrackInterval(100),
+  demoRunning(false),
+  demoRunningFunctor(NULL),
+  trajectoryCheckInterval(50)
 {
+  stateSampler.addSampleCallback(&armStateSampledFunctor);
+  for(int i = 0; i < MAX_ARMS; ++i)
+  {
+    armTrajectorySent[i] = 0;
+    armTrajectoryNext[i] = 0;
+    armTrajectoryActive[i] = false;
+    armSpeed[i] = ArmSpeedNormal;
+    armModelWarned[i] = false;
+    generalInfoFailures[i] = 0;
+  }
+  setSlowSpeeds(0.05, 0.3, 10, 0.25);
   init_demo();
 }
 
 void ArmDemoTask::clear_all_arm_trajectories()
 {
-  for(int i = 0; i < armCount; ++i)
-  { 
-    Kinova::SetActiveDevice(armList[i]);
+  // both arms at once, on the arbiter
+  ArFunctor1C<ArmDemoTask, int> left(this, &ArmDemoTask::erase_trajectories_job, LEFT);
+  ArFunctor1C<ArmDemoTask, int> right(this, &ArmDemoTask::erase_trajectories_job, RIGHT);
+  ArFunctor *jobs[MAX_ARMS] = { &left, &right };
+  arbiter.callEach(jobs, armCount);
+  puts("Cleared old arm trajectory commands.");
+}
+
+void ArmDemoTask::erase_trajectories_job(int arm)
+{
+  Kinova::EraseAllTrajectories();
+  armTrajectory[arm].clear();
+  armTrajectorySent[arm] = armTrajectoryNext[arm] = 0;
+  armTrajectoryActive[arm] = false;
+}
+
+/** Replace arm @a arm's trajectory with @a points, at its current speed
+ * (nothing is sent while it is stopped; set_arm_speed() sends it later).
+ * Returns once the first points are in the arm's FIFO; see
+ * trajectory_done() for when it has got to the end. */
+void ArmDemoTask::send_trajectory(int arm, const Kinova::TrajectoryPoint *points, int n)
+{
+  ArFunctor3C<ArmDemoTask, int, const Kinova::TrajectoryPoint*, int> job(
+    this, &ArmDemoTask::send_trajectory_job, arm, points, n);
+  arbiter.call(arm, &job);
+}
+
+void ArmDemoTask::send_trajectory_job(int arm, const Kinova::TrajectoryPoint *points, int n)
+{
+  armTrajectory[arm].assign(points, points + n);
+  armTrajectorySent[arm] = armTrajectoryNext[arm] = 0;
+  armTrajectoryActive[arm] = n > 0;
+  Kinova::EraseAllTrajectories();
+  if(armSpeed[arm] != ArmSpeedStopped)
+    top_up_trajectory(arm);
+}
+
+/** Points kept in an arm's trajectory FIFO ahead of the one it is moving to:
+ * enough that it never runs dry between checks, few enough that the FIFO
+ * (which holds more) never fills. */
+static const int trajectoryLookahead = 8;
+
+/** Put arm @a arm's next points into its FIFO, up to trajectoryLookahead
+ * ahead of the first it has not reached, with the slow speed limits if it
+ * is slowed. Called by jobs, with the arm active. */
+void ArmDemoTask::top_up_trajectory(int arm)
+{
+  const int n = (int)armTrajectory[arm].size();
+  const int end = std::min(n, armTrajectoryNext[arm] + trajectoryLookahead);
+  for(; armTrajectorySent[arm] < end; ++armTrajectorySent[arm])
+  {
+    Kinova::TrajectoryPoint p = armTrajectory[arm][armTrajectorySent[arm]];
+    if(armSpeed[arm] == ArmSpeedSlow)
+    {
+      p.LimitationsActive = 1;
+      if(p.Position.Type == Kinova::ANGULAR_POSITION)
+        p.Limitations.speedParameter1 = p.Limitations.speedParameter2 = slowJointSpeed;
+      else
+      {
+        p.Limitations.speedParameter1 = slowLinearSpeed;
+        p.Limitations.speedParameter2 = slowAngularSpeed;
+      }
+    }
+    Kinova::SendBasicTrajectory(p);
+  }
+}
+
+/** Whether the arm's last sample @a state is at @a point: within 1 cm and
+ * 0.05 rad for a Cartesian position, 1 degree per joint for an angular
+ * one. Anything else (velocities) counts as reached. */
+bool ArmDemoTask::reached_point(const ArmState& state, const Kinova::TrajectoryPoint& point)
+{
+  const Kinova::UserPosition& p = point.Position;
+  if(p.Type == Kinova::CARTESIAN_POSITION)
+  {
+    const float dx = state.x - p.CartesianPosition.X;
+    const float dy = state.y - p.CartesianPosition.Y;
+    const float dz = state.z - p.CartesianPosition.Z;
+    return dx*dx + dy*dy + dz*dz <= 0.01f * 0.01f &&
+      fabsf(remainderf(state.thetaX - p.CartesianPosition.ThetaX, 2 * M_PI)) <= 0.05f &&
+      fabsf(remainderf(state.thetaY - p.CartesianPosition.ThetaY, 2 * M_PI)) <= 0.05f &&
+      fabsf(remainderf(state.thetaZ - p.CartesianPosition.ThetaZ, 2 * M_PI)) <= 0.05f;
+  }
+  if(p.Type == Kinova::ANGULAR_POSITION)
+  {
+    const float target[6] = { p.Actuators.Actuator1, p.Actuators.Actuator2, p.Actuators.Actuator3,
+      p.Actuators.Actuator4, p.Actuators.Actuator5, p.Actuators.Actuator6 };
+    for(int j = 0; j < 6; ++j)
+      if(fabsf(remainderf(state.angles[j] - target[j], 360)) > 1)
+        return false;
+  }
+  return true;
+}
+
+/** Keep arm @a arm's FIFO topped up from its trajectory, and notice when it
+ * has finished: the FIFO is empty (it counts the point being moved to)
+ * and the arm is at the last point. */
+void ArmDemoTask::feed_trajectory_job(int arm)
+{
+  if(!armTrajectoryActive[arm])
+    return;
+  Kinova::TrajectoryFIFO fifo;
+  if(Kinova::GetGlobalTrajectoryInfo(fifo) != 1)
+    return;
+  const int queued = (int)fifo.TrajectoryCount;
+  armTrajectoryNext[arm] = std::max(armTrajectoryNext[arm], armTrajectorySent[arm] - queued);
+  if(armSpeed[arm] == ArmSpeedStopped)
+    return;
+  top_up_trajectory(arm);
+  ArmState state;
+  if(queued == 0 && armTrajectorySent[arm] == (int)armTrajectory[arm].size() &&
+     get_arm_state(arm, &state) && reached_point(state, armTrajectory[arm].back()))
+  {
+    armTrajectoryActive[arm] = false;
+    trajectoryDoneCondition.broadcast();
+  }
+}
+
+void ArmDemoTask::set_arm_speed(int arm, ArmSpeed speed)
+{
+  // ahead of anything else queued for the arm
+  ArFunctor2C<ArmDemoTask, int, ArmSpeed> job(this, &ArmDemoTask::set_arm_speed_job, arm, speed);
+  arbiter.call(arm, &job, true);
+}
+
+void ArmDemoTask::set_arm_speed_job(int arm, ArmSpeed speed)
+{
+  const ArmSpeed old = armSpeed[arm];
+  if(speed == old)
+    return;
+  armSpeed[arm] = speed;
+  if(old != ArmSpeedStopped)
+  {
+    // the arm's FIFO holds the points it has not reached yet, including
+    // the one it is moving to
+    Kinova::TrajectoryFIFO fifo;
+    const int left = Kinova::GetGlobalTrajectoryInfo(fifo) == 1 ? (int)fifo.TrajectoryCount : 0;
     Kinova::EraseAllTrajectories();
+    armTrajectoryNext[arm] = std::max(armTrajectoryNext[arm], armTrajectorySent[arm] - left);
   }
-  puts("Cleared old arm trajectory commands.");
+  armTrajectorySent[arm] = armTrajectoryNext[arm];
+  if(speed != ArmSpeedStopped)
+    top_up_trajectory(arm);
+}
+
+ArmSpeed ArmDemoTask::get_arm_speed(int arm)
+{
+  return armSpeed[arm];
+}
+
+void ArmDemoTask::send_point_job(int /* arm, already active */, const Kinova::TrajectoryPoint *point)
+{
+  Kinova::SendBasicTrajectory(*point);
+}
+
+void ArmDemoTask::move_home_job(int arm)
+{
+  Kinova::MoveHome();
+  armTrajectory[arm].clear();
+  armTrajectorySent[arm] = armTrajectoryNext[arm] = 0;
+  armTrajectoryActive[arm] = false;
+}
+
+void ArmDemoTask::force_control_job(bool start)
+{
+  if(start)
+    Kinova::StartForceControl();
+  else
+    Kinova::StopForceControl();
 }
 
 void ArmDemoTask::set_demo_mode(DemoMode newMode)
@@ -51,14 +238,17 @@ void ArmDemoTask::set_demo_mode(DemoMode newMode)
     puts("\nSet demo mode to CartesianPos.");
   }
 
+  // (on the demo's arm)
   if(newMode == Reactive && oldMode != Reactive)
   {
-    Kinova::StartForceControl();
+    ArFunctor1C<ArmDemoTask, bool> job(this, &ArmDemoTask::force_control_job, true);
+    arbiter.call(LEFT, &job);
     puts("\nSet demo mode to Reactive. Enabled reactive force control.");
   }
   else if(newMode != Reactive && oldMode == Reactive)
   {
-    Kinova::StopForceControl();
+    ArFunctor1C<ArmDemoTask, bool> job(this, &ArmDemoTask::force_control_job, false);
+    arbiter.call(LEFT, &job);
     puts("\nDisabled reactive force control.");
   }
 
@@ -114,6 +304,16 @@ void ArmDemoTask::set_fingers_closed(Kinova::FingersPosition& f)
   f.Finger3 = 3700;
 }
 
+void ArmDemoTask::set_joints(Kinova::AngularInfo& a, float a1, float a2, float a3, float a4, float a5, float a6)
+{
+  a.Actuator1 = a1;
+  a.Actuator2 = a2;
+  a.Actuator3 = a3;
+  a.Actuator4 = a4;
+  a.Actuator5 = a5;
+  a.Actuator6 = a6;
+}
+
 void ArmDemoTask::init_demo()
 {
   set_demo_mode(DEFAULT_MODE);
@@ -145,6 +345,19 @@ void ArmDemoTask::init_demo()
 //  set_pose(demoCartesianPositions[i++], -0.013, -0.53, 0.08,  1.855, 1.383, -2.711);
     set_pose(demoCartesianPositions[i++], -0.23, -0.69, -0.15,  2.954, -0.195, 2.445); // move down
   numDemoCartesianPositions = i;
+
+  // park positions, each reached through a pre-park position
+  for(int a = 0; a < MAX_ARMS; ++a)
+  {
+    parkTrajectory[a][0].InitStruct();
+    parkTrajectory[a][0].Position.Type = Kinova::ANGULAR_POSITION;
+    set_fingers_closed(parkTrajectory[a][0].Position.Fingers);
+    parkTrajectory[a][1] = parkTrajectory[a][0];
+  }
+  set_joints(parkTrajectory[LEFT][0].Position.Actuators,   56.360,  54.797, 227.607, 207.614,  28.722, 236.295);
+  set_joints(parkTrajectory[LEFT][1].Position.Actuators,   92.426,  45.609, 235.147, 204.273,   6.409, 286.159);
+  set_joints(parkTrajectory[RIGHT][0].Position.Actuators, 317.715, 293.638, 122.578, 122.033, 349.920, 289.153);
+  set_joints(parkTrajectory[RIGHT][1].Position.Actuators, 280.864, 312.281, 119.559, 150.545, 357.204, 290.454);
 }
   
 
@@ -161,12 +374,10 @@ void ArmDemoTask::close_arms_and_exit()
 void ArmDemoTask::rehome_all_arms()
 {
   printf("\nRehoming all %d arms... ", armCount); fflush(stdout);
-  for(int i = 0; i < armCount; ++i)
-  {
-    printf("#%d...", i); fflush(stdout);
-    Kinova::SetActiveDevice(armList[i]);
-    Kinova::MoveHome();
-  }
+  ArFunctor1C<ArmDemoTask, int> left(this, &ArmDemoTask::move_home_job, LEFT);
+  ArFunctor1C<ArmDemoTask, int> right(this, &ArmDemoTask::move_home_job, RIGHT);
+  ArFunctor *jobs[MAX_ARMS] = { &left, &right };
+  arbiter.callEach(jobs, armCount);
   demoTime.setToNow();
   puts(""); fflush(stdout);
 }
@@ -241,10 +452,10 @@ void ArmDemoTask::armEENetDrawingCallback(ArServerClient *client, ArNetPacket *p
   reply.byte4ToBuf(armCount);
   for(int i = 0; i < armCount; ++i)
   {
-    currentArmPositionMutex[i].lock();
-    float ax = currentArmPositions[i].Coordinates.X;
-    float ay = currentArmPositions[i].Coordinates.Y;
-    currentArmPositionMutex[i].unlock();
+    ArmState s;
+    get_arm_state(i, &s);
+    float ax = s.x;
+    float ay = s.y;
     int rx = 1000.0 * (-1*armOffset[i].y + -1*ay);    // arm -Y m -> robot X mm
     int ry = 1000.0 * (-1*armOffset[i].x + -1*ax);    // arm -X m -> robot Y mm 
 //  printf("arm pos %d = %d, %d\n", i, rx, ry);
@@ -256,6 +467,330 @@ void ArmDemoTask::armEENetDrawingCallback(ArServerClient *client, ArNetPacket *p
 
 
 
+bool ArmDemoTask::getEndEffectorInCamera(float *x, float *y, float *z)
+{
+  if(!ptu)
+    return false;
+  ArmState s;
+  if(!get_arm_state(LEFT, &s))
+    return false;
+  // relative to the PTU, as passed to ptu_look_at()
+  const float ax = s.x + armOffset[LEFT].x;
+  const float ay = s.y + armOffset[LEFT].y;
+  const float az = s.z + armOffset[LEFT].z;
+
+  // arm axes (-y forward, +x left, +z up) to forward, left, up, then undo
+  // the pan (positive right) and the tilt (positive up)
+  const float forward = -ay, left = ax, up = az;
+  const float p = ArMath::degToRad(ptu->getPan()), t = ArMath::degToRad(ptu->getTilt());
+  const float f1 = forward * cosf(p) - left * sinf(p);
+  const float l1 = forward * sinf(p) + left * cosf(p);
+  const float f2 = f1 * cosf(t) + up * sinf(t);
+  const float u2 = -f1 * sinf(t) + up * cosf(t);
+
+  // libfreenect2's images are mirrored, so camera x is to the left
+  *x = l1;
+  *y = -u2;
+  *z = f2;
+  return true;
+}
+
+
+bool ArmDemoTask::getCameraRotation(float r[9])
+{
+  if(!ptu)
+    return false;
+  // as getEndEffectorInCamera(), backwards: camera (left, down, forward) to
+  // left, up, forward, redo the tilt then the pan, and back to arm axes
+  // (+x left, -y forward, +z up)
+  const float p = ArMath::degToRad(ptu->getPan()), t = ArMath::degToRad(ptu->getTilt());
+  const float cp = cosf(p), sp = sinf(p), ct = cosf(t), st = sinf(t);
+  r[0] = cp;  r[1] = -sp * st; r[2] = -sp * ct;
+  r[3] = -sp; r[4] = -cp * st; r[5] = -cp * ct;
+  r[6] = 0;   r[7] = -ct;      r[8] = st;
+  return true;
+}
+
+bool ArmDemoTask::cameraToArm(int arm, float cx, float cy, float cz, float *ax, float *ay, float *az)
+{
+  float r[9];
+  if(!getCameraRotation(r))
+    return false;
+  *ax = r[0] * cx + r[1] * cy + r[2] * cz - armOffset[arm].x;
+  *ay = r[3] * cx + r[4] * cy + r[5] * cz - armOffset[arm].y;
+  *az = r[6] * cx + r[7] * cy + r[8] * cz - armOffset[arm].z;
+  return true;
+}
+
+/** Forward kinematics of a Jaco 2 with the curved (60 degree) wrist, from
+ * Kinova's DH parameters: the origins of the shoulder, elbow, both wrist
+ * joints and the end effector, in the arm's base frame (the frame of
+ * GetCartesianPosition()), from the actuator angles in degrees. */
+static void jaco_links(const float angles[6], float points[ARM_LINK_POINTS - 1][3])
+{
+  const double D1 = 0.2755, D2 = 0.41, D3 = 0.2073, D4 = 0.0741, D5 = 0.0741, D6 = 0.16, e2 = 0.0098;
+  const double aa = M_PI / 6, k = sin(aa) / sin(2 * aa);
+  const double d4b = D3 + k * D4, d5b = k * D4 + k * D5, d6b = k * D5 + D6;
+  double q[6];
+  for(int j = 0; j < 6; ++j)
+    q[j] = angles[j] * M_PI / 180;
+  const double dh[6][4] = {  // alpha, a, d, theta
+    { M_PI / 2, 0, D1, -q[0] },
+    { M_PI, D2, 0, q[1] - M_PI / 2 },
+    { M_PI / 2, 0, -e2, q[2] + M_PI / 2 },
+    { 2 * aa, 0, -d4b, q[3] },
+    { 2 * aa, 0, -d5b, q[4] + M_PI },
+    { M_PI, 0, -d6b, q[5] - M_PI / 2 } };
+  double t[3][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } };
+  int n = 0;
+  for(int j = 0; j < 6; ++j)
+  {
+    const double ca = cos(dh[j][0]), sa = sin(dh[j][0]), ct = cos(dh[j][3]), st = sin(dh[j][3]);
+    const double a[3][4] = {
+      { ct, -st * ca, st * sa, dh[j][1] * ct },
+      { st, ct * ca, -ct * sa, dh[j][1] * st },
+      { 0, sa, ca, dh[j][2] } };
+    double r[3][4];
+    for(int i = 0; i < 3; ++i)
+    {
+      for(int c = 0; c < 4; ++c)
+        r[i][c] = t[i][0] * a[0][c] + t[i][1] * a[1][c] + t[i][2] * a[2][c];
+      r[i][3] += t[i][3];
+    }
+    memcpy(t, r, sizeof(t));
+    // the third joint's origin is only the elbow's 1 cm offset
+    if(j == 2)
+      continue;
+    for(int i = 0; i < 3; ++i)
+      points[n][i] = t[i][3];
+    ++n;
+  }
+}
+
+bool ArmDemoTask::getArmLinksRelativeToPTU(int arm, float points[ARM_LINK_POINTS][3])
+{
+  const float base[3] = { armOffset[arm].x, armOffset[arm].y, armOffset[arm].z };
+  ArmState s;
+  if(!get_arm_state(arm, &s))
+  {
+    for(int p = 0; p < ARM_LINK_POINTS; ++p)
+      memcpy(points[p], base, sizeof(base));
+    return false;
+  }
+  jaco_links(s.angles, points + 1);
+  const float *ee = points[ARM_LINK_POINTS - 1];
+  const float dx = ee[0] - s.x, dy = ee[1] - s.y, dz = ee[2] - s.z;
+  if(dx * dx + dy * dy + dz * dz > 0.05f * 0.05f)
+  {
+    if(!armModelWarned[arm])
+    {
+      printf("ArmDemoTask: Warning: the Jaco 2 model puts arm %d's end effector %.0f mm from where the arm says, using a straight line from base to end effector instead\n",
+        arm, 1000 * sqrtf(dx * dx + dy * dy + dz * dz));
+      armModelWarned[arm] = true;
+    }
+    for(int p = 1; p < ARM_LINK_POINTS; ++p)
+    {
+      const float f = (float)p / (ARM_LINK_POINTS - 1);
+      points[p][0] = f * s.x;
+      points[p][1] = f * s.y;
+      points[p][2] = f * s.z;
+    }
+  }
+  points[0][0] = points[0][1] = points[0][2] = 0;
+  for(int p = 0; p < ARM_LINK_POINTS; ++p)
+    for(int i = 0; i < 3; ++i)
+      points[p][i] += base[i];
+  return true;
+}
+
+bool ArmDemoTask::read_arm_state(int arm, ArmState *state)
+{
+  bool ok = false;
+  ArFunctor3C<ArmDemoTask, int, ArmState*, bool*> job(this, &ArmDemoTask::read_arm_state_job, arm, state, &ok);
+  return arbiter.call(arm, &job) && ok;
+}
+
+static void copy_angular(float *to, const Kinova::AngularInfo& from)
+{
+  to[0] = from.Actuator1;
+  to[1] = from.Actuator2;
+  to[2] = from.Actuator3;
+  to[3] = from.Actuator4;
+  to[4] = from.Actuator5;
+  to[5] = from.Actuator6;
+}
+
+// GetGeneralInformations() failures in a row before an arm is read with
+// separate calls, and how often to try it again then (ms)
+static const int GENERAL_INFO_MAX_FAILURES = 5;
+static const int GENERAL_INFO_RETRY_INTERVAL = 10000;
+
+void ArmDemoTask::read_arm_state_job(int arm, ArmState *state, bool *ok)
+{
+  // everything in one USB transaction where the firmware supports it; a
+  // failure now and then is read separately just that once
+  Kinova::GeneralInformations info;
+  int& failures = generalInfoFailures[arm];
+  const bool tryGeneral = failures < GENERAL_INFO_MAX_FAILURES ||
+    generalInfoRetryTime[arm].mSecSince() >= GENERAL_INFO_RETRY_INTERVAL;
+  if(tryGeneral && Kinova::GetGeneralInformations(info) == 1)
+  {
+    if(failures >= GENERAL_INFO_MAX_FAILURES)
+      printf("ArmDemoTask: GetGeneralInformations works again for arm %d\n", arm);
+    failures = 0;
+    const Kinova::CartesianInfo& position = info.Position.CartesianPosition;
+    state->x = position.X;
+    state->y = position.Y;
+    state->z = position.Z;
+    state->thetaX = position.ThetaX;
+    state->thetaY = position.ThetaY;
+    state->thetaZ = position.ThetaZ;
+    state->fingers[0] = info.Position.Fingers.Finger1;
+    state->fingers[1] = info.Position.Fingers.Finger2;
+    state->fingers[2] = info.Position.Fingers.Finger3;
+    copy_angular(state->torques, info.Force);
+    copy_angular(state->angles, info.ActualAngularPosition);
+    *ok = true;
+    return;
+  }
+  if(tryGeneral)
+  {
+    if(++failures == GENERAL_INFO_MAX_FAILURES)
+      printf("ArmDemoTask: GetGeneralInformations failed %d times for arm %d, reading its state with separate calls and trying again every %d s\n",
+        failures, arm, GENERAL_INFO_RETRY_INTERVAL / 1000);
+    if(failures >= GENERAL_INFO_MAX_FAILURES)
+      generalInfoRetryTime[arm].setToNow();
+  }
+  *ok = read_arm_state_separately(state);
+}
+
+/** Read the active arm's state with one call per value. The joint angles
+ * are needed by reached_point() for joint trajectories (parking), by the
+ * safety monitor's arm model and by the shared memory arm state. */
+bool ArmDemoTask::read_arm_state_separately(ArmState *state)
+{
+  Kinova::CartesianPosition position;
+  Kinova::AngularPosition torqueData, angles;
+  if(Kinova::GetCartesianPosition(position) != 1 ||
+     Kinova::GetAngularForce(torqueData) != 1 ||
+     Kinova::GetAngularPosition(angles) != 1)
+    return false;
+  state->x = position.Coordinates.X;
+  state->y = position.Coordinates.Y;
+  state->z = position.Coordinates.Z;
+  state->thetaX = position.Coordinates.ThetaX;
+  state->thetaY = position.Coordinates.ThetaY;
+  state->thetaZ = position.Coordinates.ThetaZ;
+  state->fingers[0] = position.Fingers.Finger1;
+  state->fingers[1] = position.Fingers.Finger2;
+  state->fingers[2] = position.Fingers.Finger3;
+  copy_angular(state->torques, torqueData.Actuators);
+  copy_angular(state->angles, angles.Actuators);
+  return true;
+}
+
+/** After each round of sampling, on the sampler's thread: publish the
+ * state, feed the arms' trajectories and, while a demo runs, point the PTU
+ * at the left arm now and then. */
+void ArmDemoTask::arm_state_sampled()
+{
+  publish_arm_state();
+  if(trajectoryCheckTime.mSecSince() >= trajectoryCheckInterval)
+  {
+    ArFunctor1C<ArmDemoTask, int> left(this, &ArmDemoTask::feed_trajectory_job, LEFT);
+    ArFunctor1C<ArmDemoTask, int> right(this, &ArmDemoTask::feed_trajectory_job, RIGHT);
+    ArFunctor *jobs[MAX_ARMS] = { NULL, NULL };
+    for(int a = 0; a < armCount; ++a)
+      if(armTrajectoryActive[a])
+        jobs[a] = a == LEFT ? (ArFunctor*)&left : (ArFunctor*)&right;
+    arbiter.callEach(jobs, armCount);
+    trajectoryCheckTime.setToNow();
+  }
+  ArmState s;
+  if(ptu && demoRunning && ptuTrackInterval > 0 && ptuTrackTime.mSecSince() >= ptuTrackInterval &&
+     get_arm_state(LEFT, &s))
+  {
+    ptu_look_at(s.x + armOffset[LEFT].x, s.y + armOffset[LEFT].y, s.z + armOffset[LEFT].z);
+    ptuTrackTime.setToNow();
+  }
+}
+
+bool ArmDemoTask::enableSharedMemory(const char *name)
+{
+  SharedMemoryRingWriter *ring = new SharedMemoryRingWriter(name, sizeof(ArmSharedState), 8, ARM_SHARED_STATE_FORMAT);
+  if(!ring->open())
+  {
+    delete ring;
+    return false;
+  }
+  printf("Publishing arm state in shared memory %s\n", name);
+  armStateRing = ring;
+  return true;
+}
+
+/** Write the arms' latest samples straight into the next slot of the
+ * shared memory ring */
+void ArmDemoTask::publish_arm_state()
+{
+  if(!armStateRing)
+    return;
+  ArmSharedState *s = (ArmSharedState*)armStateRing->beginWrite();
+  memset(s, 0, sizeof(ArmSharedState));
+  s->armCount = armCount;
+  long long latest = 0;
+  for(int i = 0; i < armCount && i < ArmSharedState::MaxArms; ++i)
+  {
+    ArmSharedState::Arm& a = s->arms[i];
+    ArmState state;
+    a.valid = get_arm_state(i, &state);
+    a.timeUSec = state.timeUSec;
+    a.x = state.x;
+    a.y = state.y;
+    a.z = state.z;
+    a.thetaX = state.thetaX;
+    a.thetaY = state.thetaY;
+    a.thetaZ = state.thetaZ;
+    for(int j = 0; j < 3; ++j)
+      a.fingers[j] = state.fingers[j];
+    for(int j = 0; j < 6; ++j)
+    {
+      a.torques[j] = state.torques[j];
+      a.angles[j] = state.angles[j];
+    }
+    a.base[0] = armOffset[i].x;
+    a.base[1] = armOffset[i].y;
+    a.base[2] = armOffset[i].z;
+    latest = std::max(latest, (long long)a.timeUSec);
+  }
+  armStateRing->endWrite(sizeof(ArmSharedState), latest);
+}
+
+/** Poses for the left arm to pick up whatever graspTargetFunctor points at:
+ * above it, down to it, close the fingers, lift. The fingers are open for
+ * the first two and closed after, as run_demo() does for the fixed poses.
+ * @return number of poses, or 0 if there is no target or it is out of reach */
+int ArmDemoTask::make_grasp_poses(Kinova::CartesianInfo *poses)
+{
+  float cx, cy, cz, x, y, z;
+  if(!graspTargetFunctor || !graspTargetFunctor->invokeR(&cx, &cy, &cz) ||
+     !cameraToArm(LEFT, cx, cy, cz, &x, &y, &z))
+    return 0;
+  if(sqrtf(x*x + y*y + z*z) > 0.8 || y > -0.2)
+  {
+    printf("\nGrasp target (%.2f, %.2f, %.2f) out of reach, using fixed poses.\n", x, y, z);
+    return 0;
+  }
+  printf("\nReaching for object at (%.2f, %.2f, %.2f).\n", x, y, z);
+  // grip 3 cm below its top, pointing down
+  const float grip = z - 0.03;
+  int i = 0;
+  set_pose(poses[i++], x, y, grip + 0.12, 2.954, -0.195, 2.445); // above
+  set_pose(poses[i++], x, y, grip,        2.954, -0.195, 2.445); // down to it
+  set_pose(poses[i++], x, y, grip,        2.954, -0.195, 2.445); // close fingers
+  set_pose(poses[i++], x, y, grip + 0.15, 2.954, -0.195, 2.445); // lift
+  return i;
+}
+
 
 bool ArmDemoTask::init_arms()
 {
@@ -304,6 +839,9 @@ bool ArmDemoTask::init_arms()
   armOffset[RIGHT].z = 0;// -0.1;
   // TODO move to call from main
 
+  // from here on the arbiter makes every Kinova call
+  arbiter.start(armList, armCount);
+  stateSampler.start(armCount);
   return true;
 }
 
@@ -336,65 +874,43 @@ void ArmDemoTask::arm_demo_done()
   park_arms();
 }
 
-void ArmDemoTask::park_arms()
+bool ArmDemoTask::park_arms()
 {
+  // both arms at once, on the arbiter
+  typedef ArFunctor3C<ArmDemoTask, int, const Kinova::TrajectoryPoint*, int> SendJob;
+  SendJob left(this, &ArmDemoTask::send_trajectory_job, LEFT, parkTrajectory[LEFT], 2);
+  SendJob right(this, &ArmDemoTask::send_trajectory_job, RIGHT, parkTrajectory[RIGHT], 2);
+  ArFunctor *jobs[MAX_ARMS] = { &left, &right };
+  ArTime started;
+  arbiter.callEach(jobs, armCount);
+
+  // the feeder says when each arm is at its park position; the timed wait
+  // covers a missed signal
+  long parkedMSec[MAX_ARMS];
+  int waiting = armCount;
+  for(int a = 0; a < armCount; ++a)
+    parkedMSec[a] = -1;
+  while(true)
+  {
+    for(int a = 0; a < armCount; ++a)
+      if(parkedMSec[a] < 0 && trajectory_done(a))
+      {
+        parkedMSec[a] = started.mSecSince();
+        --waiting;
+      }
+    if(waiting == 0 || started.mSecSince() >= parkTimeout)
+      break;
+    trajectoryDoneCondition.timedWait(50);
+  }
 
-  Kinova::TrajectoryPoint cmd;
-  cmd.InitStruct();
-  cmd.Position.Type = Kinova::ANGULAR_POSITION;
-
-  // left arm
-  Kinova::SetActiveDevice(armList[LEFT]);
-  Kinova::EraseAllTrajectories();
-
-  // pre-park position, left arm
-  cmd.Position.Actuators.Actuator1 = 56.360; 
-  cmd.Position.Actuators.Actuator2 = 54.797;
-  cmd.Position.Actuators.Actuator3 = 227.607;
-  cmd.Position.Actuators.Actuator4 = 207.614;
-  cmd.Position.Actuators.Actuator5 = 28.722;
-  cmd.Position.Actuators.Actuator6 = 236.295;
-  set_fingers_closed(cmd.Position.Fingers);
-  Kinova::SendBasicTrajectory(cmd);
-
-  // park position, left arm
-  cmd.Position.Actuators.Actuator1 = 92.426;
-  cmd.Position.Actuators.Actuator2 = 45.609;
-  cmd.Position.Actuators.Actuator3 = 235.147;
-  cmd.Position.Actuators.Actuator4 = 204.273;
-  cmd.Position.Actuators.Actuator5 = 6.409;
-  cmd.Position.Actuators.Actuator6 = 286.159;
-  Kinova::SendBasicTrajectory(cmd);
-
-  // delay a bit
-  ArUtil::sleep(5000);
-
-  // right arm
-  Kinova::SetActiveDevice(armList[RIGHT]);
-  Kinova::EraseAllTrajectories();
-
-  // pre-park position, right arm
-  cmd.Position.Actuators.Actuator1 = 317.715;
-  cmd.Position.Actuators.Actuator2 = 293.638;
-  cmd.Position.Actuators.Actuator3 = 122.578;
-  cmd.Position.Actuators.Actuator4 = 122.033;
-  cmd.Position.Actuators.Actuator5 = 349.920;
-  cmd.Position.Actuators.Actuator6 = 289.153;
-  set_fingers_closed(cmd.Position.Fingers);
-  Kinova::SendBasicTrajectory(cmd);
-
-  // park position, right arm
-  cmd.Position.Actuators.Actuator1 = 280.864;
-  cmd.Position.Actuators.Actuator2 = 312.281;
-  cmd.Position.Actuators.Actuator3 = 119.559;
-  cmd.Position.Actuators.Actuator4 = 150.545;
-  cmd.Position.Actuators.Actuator5 = 357.204;
-  cmd.Position.Actuators.Actuator6 = 290.454;
-  Kinova::SendBasicTrajectory(cmd);
-
-  // delay a bit
-  ArUtil::sleep(5000);
-  
+  for(int a = 0; a < armCount; ++a)
+  {
+    if(parkedMSec[a] >= 0)
+      printf("Parked arm #%d in %.1f s\n", a, parkedMSec[a] / 1000.0);
+    else
+      printf("Warning: arm #%d not parked after %.1f s\n", a, started.mSecSince() / 1000.0);
+  }
+  return waiting == 0;
 }
   
 void ArmDemoTask::run_demo() 
@@ -404,16 +920,20 @@ void ArmDemoTask::run_demo()
 
   // TODO put right arm somewhere.
 
-  Kinova::SetActiveDevice(armList[LEFT]);
-  int i = LEFT;
-
   demoDone = false;
   demoTime.setToNow();
+  ArTime loopTime;  // since the last pass, for holding demoTime
+  demoRunning = true;
+  if(demoRunningFunctor)
+    demoRunningFunctor->invoke(true, demoMode);
   puts("Running...");
   while(true)
   {
     if(demoDone)
     {
+      demoRunning = false;
+      if(demoRunningFunctor)
+        demoRunningFunctor->invoke(false, demoMode);
       arm_demo_done();
       return;
     }
@@ -451,90 +971,126 @@ void ArmDemoTask::run_demo()
           demoTrajectoryCommand.Position.CartesianPosition = demoCartesianVelocities[0];
         }
 
-        Kinova::SendBasicTrajectory(demoTrajectoryCommand);
+        // slowed or stopped by set_arm_speed()
+        Kinova::TrajectoryPoint cmd = demoTrajectoryCommand;
+        const ArmSpeed speed = get_arm_speed(LEFT);
+        const float scale = speed == ArmSpeedStopped ? 0 : speed == ArmSpeedSlow ? slowVelocityScale : 1;
+        cmd.Position.CartesianPosition.X *= scale;
+        cmd.Position.CartesianPosition.Y *= scale;
+        cmd.Position.CartesianPosition.Z *= scale;
+        cmd.Position.CartesianPosition.ThetaX *= scale;
+        cmd.Position.CartesianPosition.ThetaY *= scale;
+        cmd.Position.CartesianPosition.ThetaZ *= scale;
+        ArFunctor2C<ArmDemoTask, int, const Kinova::TrajectoryPoint*> job(this, &ArmDemoTask::send_point_job, LEFT, &cmd);
+        arbiter.call(LEFT, &job);
 
       }
       else if(demoMode == CartesianPos)
       {
         if(demoWaitingToFinish)
         {
+          // done as soon as the arm is at the last pose; the timeout is
+          // for when it never gets there
+          if(trajectory_done(LEFT))
+          {
+            printf("\narm reached the last pose after %ld s\n", demoTime.secSince());
+            demoDone = true;
+            continue;
+          }
           if(demoTime.secSince() >= 40)
+          {
+            puts("\narm did not reach the last pose in 40 s");
             demoDone = true;
+            continue;
+          }
         }
         else
         {
-          for(int i = 0; i < numDemoCartesianPositions; ++i)
+          // reach for an object on the table if the Kinect sees one; it
+          // may only just have started looking
+          if(graspTargetFunctor)
+          {
+            float cx, cy, cz;
+            ArTime waiting;
+            while(!graspTargetFunctor->invokeR(&cx, &cy, &cz) && waiting.mSecSince() < graspTargetWait)
+              ArUtil::sleep(100);
+          }
+          const Kinova::CartesianInfo *positions = demoCartesianPositions;
+          int numPositions = numDemoCartesianPositions;
+          const int numGraspPositions = make_grasp_poses(graspCartesianPositions);
+          if(numGraspPositions > 0)
           {
-            demoPositionCommand.Position.CartesianPosition = demoCartesianPositions[i];
+            positions = graspCartesianPositions;
+            numPositions = numGraspPositions;
+          }
+          Kinova::TrajectoryPoint commands[12];
+          for(int i = 0; i < numPositions; ++i)
+          {
+            demoPositionCommand.Position.CartesianPosition = positions[i];
             if(i >= 2)
               set_fingers_closed(demoPositionCommand.Position.Fingers);
             else
               set_fingers_open(demoPositionCommand.Position.Fingers);
             printf("\n-> Sending position command %d: ", i);
             print_user_position(demoPositionCommand.Position);
-            Kinova::SendBasicTrajectory(demoPositionCommand);
+            commands[i] = demoPositionCommand;
             //ArUtil::sleep(1000);
           }
+          send_trajectory(LEFT, commands, numPositions);
           demoWaitingToFinish = true;
         }
       }
     }
 
-    // get data and if arm 0, point PTU at its current position.
-		//for(int i = 0; i < armCount; ++i)
-		{
-			//Kinova::SetActiveDevice(armList[i]);
-
-      currentArmPositionMutex[i].lock();
-			Kinova::GetCartesianPosition(currentArmPositions[i]);
-      const float px = currentArmPositions[i].Coordinates.X;
-      const float py = currentArmPositions[i].Coordinates.Y;
-      const float pz = currentArmPositions[i].Coordinates.Z;
-      const float ox = currentArmPositions[i].Coordinates.ThetaX;
-      const float oy = currentArmPositions[i].Coordinates.ThetaY;
-      const float oz = currentArmPositions[i].Coordinates.ThetaZ;
-      currentArmPositionMutex[i].unlock();
-
-      Kinova::AngularPosition torqueData;
-      Kinova::GetAngularForce(torqueData);
-      std::vector<float> jointTorques(6);
-      jointTorques[0] = torqueData.Actuators.Actuator1;
-      jointTorques[1] = torqueData.Actuators.Actuator2;
-      jointTorques[2] = torqueData.Actuators.Actuator3;
-      jointTorques[3] = torqueData.Actuators.Actuator4;
-      jointTorques[4] = torqueData.Actuators.Actuator5;
-      jointTorques[5] = torqueData.Actuators.Actuator6;
-      
-			printf("Arm #%d: [x=% 2.2f, y=% 2.2f, z=% 2.2f, torques=%2.1f, %2.1f, %2.1f, %2.1f, %2.1f, %2.1f]  ", 
-        i, px, py, pz, 
-        jointTorques[0], 
-        jointTorques[1], 
-        jointTorques[2], 
-        jointTorques[3], 
-        jointTorques[4], 
-        jointTorques[5]
+    // log the arms' latest samples (the sampler also points the PTU at the
+    // left arm, see arm_state_sampled())
+    for(int a = 0; a < armCount; ++a)
+    {
+      ArmState st;
+      if(!get_arm_state(a, &st))
+        continue;
+      printf("Arm #%d: [x=% 2.2f, y=% 2.2f, z=% 2.2f, torques=%2.1f, %2.1f, %2.1f, %2.1f, %2.1f, %2.1f]  ",
+        a, st.x, st.y, st.z,
+        st.torques[0],
+        st.torques[1],
+        st.torques[2],
+        st.torques[3],
+        st.torques[4],
+        st.torques[5]
       );
-      fflush(stdout);
-
-      if(i == 0 && ptu != NULL)
-      {
-        ptu_look_at(px+armOffset[i].x, py+armOffset[i].y, pz+armOffset[i].z);
-      }
-
     }
+    if(ptu != NULL)
+      printf("[ptu pan %.2f, tilt %.2f] ", ptu->getPan(), ptu->getTilt());
+    fflush(stdout);
+
+    // hold the demo's clock while any arm is slowed or stopped, for as
+    // long as it was since the last pass (which may have been woken early)
+    bool slowed = false;
+    for(int a = 0; a < armCount; ++a)
+      if(get_arm_speed(a) != ArmSpeedNormal)
+        slowed = true;
+    if(slowed)
+      demoTime.addMSec(loopTime.mSecSince());
+    loopTime.setToNow();
 
     printf(" [dt=%lds]", demoTime.secSince());
 
     printf("\r");
     fflush(stdout);
 
-    ArUtil::sleep(500);
+    // woken early when an arm finishes its trajectory
+    trajectoryDoneCondition.timedWait(500);
     
 	}
 }
  
 ArmDemoTask::~ArmDemoTask()
 {
+  // (it calls back into this, and into the Kinova API)
+  stateSampler.stopRunning();
+  stateSampler.join();
+  arbiter.stop();
+  delete armStateRing;
 
   Kinova::CloseAPI();
 
@@ -597,6 +1153,5 @@ void ArmDemoTask::ptu_look_at(float x, float y, float z)
     t = ptu->getMaxPosTilt() - 1;
   else if(t <= ptu->getMaxNegTilt() )
     t = ptu->getMaxNegTilt() + 1;
-  printf("[ptu lookat: pan %.2f, tilt %.2f] ", p, t);
   ptu->panTilt(p, t);
 }
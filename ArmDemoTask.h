@@ -1,10 +1,14 @@
 #ifndef ARMDEMOTASK_H
 #define ARMDEMOTASK_H
 
+#include <vector>
 #include "Aria.h"
 #include "ArNetworking.h"
 #include "RemoteArnlTask.h"
 #include "ArClientHandlerRobotUpdate.h"
+#include "SharedMemoryRing.h"
+#include "ArmStateSampler.h"
+#include "KinovaArbiter.h"
 
 namespace Kinova {
 #include "Kinova.API.CommLayerUbuntu.h"
@@ -19,9 +23,18 @@ typedef enum {
   Idle
 } DemoMode;
 
+/** How fast an arm may move, see ArmDemoTask::set_arm_speed() */
+typedef enum {
+  ArmSpeedNormal,
+  ArmSpeedSlow,
+  ArmSpeedStopped
+} ArmSpeed;
+
 #define MAX_ARMS 2
 #define LEFT 0
 #define RIGHT 1
+/** Points along an arm, see ArmDemoTask::getArmLinksRelativeToPTU() */
+#define ARM_LINK_POINTS 6
 
 /** Call init_arms() to connect to arms */
 class ArmDemoTask: public virtual RemoteArnlTask
@@ -45,10 +58,21 @@ private:
   Kinova::CartesianInfo demoCartesianPositions[12];
   int numDemoCartesianPositions;
   Kinova::TrajectoryPoint demoPositionCommand;
+  // Reach for an object the Kinect sees instead of demoCartesianPositions,
+  // if there is one in reach
+  ArRetFunctor3<bool, float*, float*, float*> *graspTargetFunctor;
+  int graspTargetWait;  ///< ms
+  Kinova::CartesianInfo graspCartesianPositions[12];
+  // pre-park and park joint positions for each arm
+  Kinova::TrajectoryPoint parkTrajectory[MAX_ARMS][2];
+  int parkTimeout;
 
 
   Kinova::KinovaDevice armList[MAX_ARMS];
   int armCount;
+  // Every Kinova call after init_arms() is made on the arbiter's thread,
+  // by one of the *_job() methods below with the arm already active.
+  KinovaArbiter arbiter;
 
   typedef struct {
     float x;
@@ -57,29 +81,170 @@ private:
   } PosData;
   PosData armOffset[MAX_ARMS]; // in arm coordinate system but relative to PTU
 
-  Kinova::CartesianPosition currentArmPositions[MAX_ARMS];
-  ArMutex currentArmPositionMutex[MAX_ARMS];
+  // Every arm's state, read at 100 Hz by read_arm_state() on the sampler's
+  // thread; everything else reads it from here.
+  ArRetFunctor2C<bool, ArmDemoTask, int, ArmState*> readArmStateFunctor;
+  ArFunctorC<ArmDemoTask> armStateSampledFunctor;
+  ArmStateSampler stateSampler;
+  void arm_state_sampled();
+  // GetGeneralInformations() failures in a row for each arm, and when it
+  // was last tried after too many (see read_arm_state_job()); only used by
+  // jobs
+  int generalInfoFailures[MAX_ARMS];
+  ArTime generalInfoRetryTime[MAX_ARMS];
+  // whether the Jaco model disagreed with an arm, see getArmLinksRelativeToPTU()
+  bool armModelWarned[MAX_ARMS];
+
+  // arm state for other processes, see enableSharedMemory()
+  SharedMemoryRingWriter *armStateRing;
+  void publish_arm_state();
 
   ArPTZ *ptu;
+  // point the PTU at the left arm every ptuTrackInterval ms while a demo
+  // runs (not while parking), see arm_state_sampled()
+  int ptuTrackInterval;
+  ArTime ptuTrackTime;
+  std::atomic<bool> demoRunning;
+  ArFunctor2<bool, DemoMode> *demoRunningFunctor;
+
+  // Trajectory last given to each arm by send_trajectory(). It is fed into
+  // the arm's trajectory FIFO a few points ahead of the arm (see
+  // feed_trajectory_job()), so it can be any length, and what is left of it
+  // can be sent again when the arm is slowed or resumed. Only used by jobs,
+  // on the arbiter's thread.
+  std::vector<Kinova::TrajectoryPoint> armTrajectory[MAX_ARMS];
+  int armTrajectorySent[MAX_ARMS];  ///< next point to put in the FIFO
+  int armTrajectoryNext[MAX_ARMS];  ///< first point not reached, as of the last check
+  // set while an arm has a trajectory it has not finished; cleared, and
+  // trajectoryDoneCondition signalled, once it has reached the last point
+  std::atomic<bool> armTrajectoryActive[MAX_ARMS];
+  ArCondition trajectoryDoneCondition;
+  // check the FIFOs every trajectoryCheckInterval ms, see arm_state_sampled()
+  int trajectoryCheckInterval;
+  ArTime trajectoryCheckTime;
+  std::atomic<ArmSpeed> armSpeed[MAX_ARMS];
+  float slowLinearSpeed, slowAngularSpeed, slowJointSpeed, slowVelocityScale;
 
 
 public:
+  /** Connect to the arms and start reading their state (see
+   *  getStateSampler()) */
   bool init_arms();
   void set_demo_mode(DemoMode newMode);
   void rehome_all_arms();
-  void park_arms();
+  /** Move every arm through its pre-park position to its park position,
+   *  all at once, and return when they have all got there (each joint
+   *  within a degree) or after the park timeout, printing how long each
+   *  took. @return whether they all got there */
+  bool park_arms();
+  /** Longest park_arms() waits for the arms (ms) */
+  void setParkTimeout(int ms) { parkTimeout = ms; }
   void ptu_look_at(float x, float y, float z);
   virtual ~ArmDemoTask();
   void armEENetDrawingCallback(ArServerClient *client, ArNetPacket *pkt);
+  /** Where the tracked (left) arm's end effector is relative to the Kinect
+   *  on the PTU, in metres in the depth camera frame (see KinectPoint: +x
+   *  to the camera's left, +y down, +z forward), from its last read
+   *  position and the PTU's current pan and tilt. For
+   *  KinectArVideoServer::enableROI().
+   *  @return false until the arm position has been read, or with no PTU */
+  bool getEndEffectorInCamera(float *x, float *y, float *z);
+  /** The reverse: arm @a arm's coordinates (m) of the point @a cx, @a cy,
+   *  @a cz in the depth camera frame, with the PTU's current pan and tilt.
+   *  @return false with no PTU */
+  bool cameraToArm(int arm, float cx, float cy, float cz, float *ax, float *ay, float *az);
+  /** In CartesianPos mode, reach down to the point given by @a target (in
+   *  the depth camera frame, e.g. the top of an object on the table from
+   *  KinectArVideoServer::getGraspTarget()) with the left arm and pick it
+   *  up, instead of going through the fixed demo poses, whenever it returns
+   *  true and the point is in reach. As the demo starts, it is given up to
+   *  @a waitMSec to find a target, e.g. for the Kinect to start looking
+   *  when told to by the demo-running functor (setDemoRunningFunctor()). */
+  void setGraspTargetFunctor(ArRetFunctor3<bool, float*, float*, float*> *target, int waitMSec = 2000)
+  {
+    graspTargetFunctor = target;
+    graspTargetWait = waitMSec;
+  }
+  /** Call @a functor with true and the demo mode when a demo starts, and
+   *  with false when it is done, before the arms are parked: e.g. to have
+   *  the Kinect look for the gripper only while the arm moves for a demo. */
+  void setDemoRunningFunctor(ArFunctor2<bool, DemoMode> *functor) { demoRunningFunctor = functor; }
+
+  /** Slow arm @a arm down, stop it, or let it go at full speed again, e.g.
+   *  from ArmSafetyMonitor when someone comes near. What is left of its
+   *  trajectory is erased and, unless stopping, sent again with or without
+   *  the slow speed limits; in CartesianVel mode the velocity commands are
+   *  scaled instead. The demo's clock is held while an arm is not at full
+   *  speed. Returns once the commands have been sent. */
+  void set_arm_speed(int arm, ArmSpeed speed);
+  /** Whether arm @a arm has reached the last point of the trajectory last
+   *  sent to it: its FIFO is empty and it is at that pose. Also true with
+   *  no trajectory, or once it has been erased. */
+  bool trajectory_done(int arm) const { return !armTrajectoryActive[arm]; }
+  ArmSpeed get_arm_speed(int arm);
+  /** Limits while slowed: end effector in m/s and rad/s, joints in deg/s
+   *  (for parking), and the fraction of CartesianVel velocities */
+  void setSlowSpeeds(float linear, float angular, float joint, float velocityScale)
+  { slowLinearSpeed = linear; slowAngularSpeed = angular; slowJointSpeed = joint; slowVelocityScale = velocityScale; }
+  int getArmCount() const { return armCount; }
+  /** Arm @a arm's latest state, without waiting for the arm (see
+   *  ArmStateSampler). @return false if it has not been read yet */
+  bool get_arm_state(int arm, ArmState *state) const { return stateSampler.getLatest(arm, state); }
+  /** The thread reading the arms, e.g. to change its rate or add a
+   *  callback for each new sample */
+  ArmStateSampler *getStateSampler() { return &stateSampler; }
+  /** Read arm @a arm's state from the arm now. Called by the sampler; use
+   *  get_arm_state() instead. */
+  bool read_arm_state(int arm, ArmState *state);
+  /** The thread making the Kinova calls, e.g. for its statistics */
+  KinovaArbiter *getArbiter() { return &arbiter; }
+  /** How often to point the PTU at the left arm while a demo is running
+   *  (ms), 0 not to */
+  void setPTUTrackingInterval(int ms) { ptuTrackInterval = ms; }
+  /** Publish the arms' positions and torques, each time they are read,
+   *  into a POSIX shared memory ring (see SharedMemoryRing.h and
+   *  ArmSharedState) for other processes on this computer.
+   *  @return false if the shared memory could not be created */
+  bool enableSharedMemory(const char *name = "/ArmState");
+  /** Arm @a arm as a chain of straight links through its base, shoulder,
+   *  elbow, the two wrist joints and the end effector, in metres in arm
+   *  axes relative to the PTU (as passed to ptu_look_at()). The joints are
+   *  placed from the sampled joint angles with the Jaco 2 (6 DOF, curved
+   *  wrist) DH parameters. If that model does not put the end effector
+   *  within 5 cm of where the arm says it is (a different arm), the points
+   *  are spread along the line from the base to the end effector instead.
+   *  @return false if the arm's state is not known: all points are at the
+   *  base */
+  bool getArmLinksRelativeToPTU(int arm, float points[ARM_LINK_POINTS][3]);
+  /** Rotation from the depth camera frame (see KinectPoint) to arm axes
+   *  relative to the PTU, row major, with the PTU's current pan and tilt:
+   *  subtract an arm's base to get its own coordinates.
+   *  @return false with no PTU */
+  bool getCameraRotation(float r[9]);
 
 private:
   void init_demo();
   void clear_all_arm_trajectories();
+  void send_trajectory(int arm, const Kinova::TrajectoryPoint *points, int n);
+  void top_up_trajectory(int arm);
+  bool reached_point(const ArmState& state, const Kinova::TrajectoryPoint& point);
+  // run on the arbiter's thread with the arm active
+  void erase_trajectories_job(int arm);
+  void send_trajectory_job(int arm, const Kinova::TrajectoryPoint *points, int n);
+  void feed_trajectory_job(int arm);
+  void set_arm_speed_job(int arm, ArmSpeed speed);
+  void send_point_job(int arm, const Kinova::TrajectoryPoint *point);
+  void move_home_job(int arm);
+  void force_control_job(bool start);
+  void read_arm_state_job(int arm, ArmState *state, bool *ok);
+  bool read_arm_state_separately(ArmState *state);
   void set_pose(Kinova::CartesianInfo& pos, float px, float py, float pz, float ox, float oy, float oz);
   void print_user_position(Kinova::UserPosition& p);
   void set_fingers(Kinova::FingersPosition& f, float f1, float f2, float f3);
   void set_fingers_open(Kinova::FingersPosition& f);
   void set_fingers_closed(Kinova::FingersPosition& f);
+  void set_joints(Kinova::AngularInfo& a, float a1, float a2, float a3, float a4, float a5, float a6);
+  int make_grasp_poses(Kinova::CartesianInfo *poses);
   void setup_torso_protection_zone_for_left_arm();
   void setup_torso_protection_zone_for_right_arm();
   void run_demo();
@@ -0,0 +1,301 @@
+
+#include <iostream>
+#include <stdio.h>
+#include <algorithm>
+#include "ArmSafetyMonitor.h"
+#include "KinectFramePool.h"
+
+static const char *armNames[MAX_ARMS] = { "left", "right" };
+static const char *speedNames[] = { "clear", "slow", "stop" };
+
+ArmSafetyMonitor::ArmSafetyMonitor(ArmDemoTask *arms, KinectArVideoServer *kinect, int stride) :
+  myArms(arms),
+  myKinect(kinect),
+  myStride(stride > 0 ? stride : 1),
+  myMinPoints(40),
+  myArmRadius(0.15f),
+  myClearDelay(1000),
+  myBlindTimeout(500),
+  myLatencyBudget(100),
+  myChecked(false),
+  myChecks(0),
+  myLastCheckUSec(kinectTimeUSec()),
+  myLastChecks(0),
+  myOverBudget(0),
+  myDepthFunctor(this, &ArmSafetyMonitor::check)
+{
+  // Stop anything within about half a metre in front of or beside the arm
+  // and above its base, slow down for anything within a metre. The bottom
+  // is just under the base so that the table and what is on it (about
+  // 0.2 m below) are left out.
+  const ArmSafetyVolume slow = { -0.9f, 0.9f, -1.3f, 0.1f, -0.1f, 0.9f };
+  const ArmSafetyVolume stop = { -0.5f, 0.5f, -0.8f, 0.1f, -0.1f, 0.6f };
+  for(int i = 0; i < MAX_ARMS; ++i)
+  {
+    mySlowVolumes[i] = slow;
+    myStopVolumes[i] = stop;
+    myPending[i] = ArmSpeedNormal;
+    myPendingCaptureUSec[i] = myPendingCheckUSec[i] = 0;
+    myCommanded[i] = ArmSpeedNormal;
+    myWanted[i] = ArmSpeedNormal;
+    myLowerSinceUSec[i] = 0;
+  }
+  myKinect->addDepthCallback(&myDepthFunctor);
+}
+
+ArmSafetyMonitor::~ArmSafetyMonitor()
+{
+  for(size_t i = 0; i < myInfoFunctors.size(); ++i)
+    delete myInfoFunctors[i];
+}
+
+void ArmSafetyMonitor::setVolumes(int arm, const ArmSafetyVolume& slow, const ArmSafetyVolume& stop)
+{
+  myVolumeMutex.lock();
+  mySlowVolumes[arm] = slow;
+  myStopVolumes[arm] = stop;
+  myVolumeMutex.unlock();
+}
+
+static inline bool inVolume(const ArmSafetyVolume& v, float x, float y, float z)
+{
+  return x >= v.minX && x <= v.maxX && y >= v.minY && y <= v.maxY && z >= v.minZ && z <= v.maxZ;
+}
+
+/** Whether @a p is within sqrt(@a r2) of the segment from @a a to @a b */
+static inline bool nearSegment(const float p[3], const float a[3], const float b[3], float r2)
+{
+  const float ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+  const float ap[3] = { p[0] - a[0], p[1] - a[1], p[2] - a[2] };
+  const float len2 = ab[0] * ab[0] + ab[1] * ab[1] + ab[2] * ab[2];
+  float t = len2 > 0 ? (ap[0] * ab[0] + ap[1] * ab[1] + ap[2] * ab[2]) / len2 : 0;
+  t = t < 0 ? 0 : t > 1 ? 1 : t;
+  const float d[3] = { ap[0] - t * ab[0], ap[1] - t * ab[1], ap[2] - t * ab[2] };
+  return d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <= r2;
+}
+
+/** Count the depth points in each arm's volumes and pass the result to the
+ * command thread. Called by the Kinect process stage. */
+void ArmSafetyMonitor::check(const libfreenect2::Frame *depth, long long captureUSec)
+{
+  const long long t0 = kinectTimeUSec();
+  if(myRayX.empty())
+  {
+    libfreenect2::Freenect2Device::IrCameraParams ir;
+    if(!myKinect->getCameraParams(&ir))
+      return;
+    // centre pixel of each stride x stride block, as KinectTableSegmenter
+    myRayX.resize(KINECT_DEPTH_WIDTH / myStride);
+    myRayY.resize(KINECT_DEPTH_HEIGHT / myStride);
+    for(size_t c = 0; c < myRayX.size(); ++c)
+      myRayX[c] = (c * myStride + myStride / 2 + 0.5f - ir.cx) / ir.fx;
+    for(size_t r = 0; r < myRayY.size(); ++r)
+      myRayY[r] = (r * myStride + myStride / 2 + 0.5f - ir.cy) / ir.fy;
+  }
+  float rot[9];
+  if(!myArms->getCameraRotation(rot))
+    return;
+
+  // volumes and arms relative to the PTU
+  const int arms = std::min(myArms->getArmCount(), MAX_ARMS);
+  ArmSafetyVolume slow[MAX_ARMS], stop[MAX_ARMS];
+  float links[MAX_ARMS][ARM_LINK_POINTS][3];
+  myVolumeMutex.lock();
+  for(int a = 0; a < arms; ++a)
+  {
+    myArms->getArmLinksRelativeToPTU(a, links[a]);
+    const float *base = links[a][0];
+    slow[a] = mySlowVolumes[a];
+    stop[a] = myStopVolumes[a];
+    slow[a].minX += base[0]; slow[a].maxX += base[0];
+    slow[a].minY += base[1]; slow[a].maxY += base[1];
+    slow[a].minZ += base[2]; slow[a].maxZ += base[2];
+    stop[a].minX += base[0]; stop[a].maxX += base[0];
+    stop[a].minY += base[1]; stop[a].maxY += base[1];
+    stop[a].minZ += base[2]; stop[a].maxZ += base[2];
+  }
+  myVolumeMutex.unlock();
+  const float armRadius = myArmRadius;
+  const float r2 = armRadius * armRadius;
+
+  int slowPoints[MAX_ARMS] = { 0 }, stopPoints[MAX_ARMS] = { 0 };
+  const float *data = (const float*)depth->data;
+  const int cols = myRayX.size(), rows = myRayY.size();
+  for(int r = 0; r < rows; ++r)
+  {
+    const float *d = data + (r * myStride + myStride / 2) * KINECT_DEPTH_WIDTH + myStride / 2;
+    const float ry = myRayY[r];
+    for(int c = 0; c < cols; ++c)
+    {
+      const float mm = d[c * myStride];
+      if(!(mm > 500 && mm < 4500))
+        continue;
+      const float z = mm * 0.001f, x = myRayX[c] * z, y = ry * z;
+      const float p[3] = {
+        rot[0] * x + rot[1] * y + rot[2] * z,
+        rot[3] * x + rot[4] * y + rot[5] * z,
+        rot[6] * x + rot[7] * y + rot[8] * z };
+      int self = -1;  // not yet tested
+      for(int a = 0; a < arms; ++a)
+      {
+        if(!inVolume(slow[a], p[0], p[1], p[2]))
+          continue;
+        if(self < 0)
+        {
+          self = 0;
+          for(int b = 0; b < arms && !self; ++b)
+            for(int l = 1; l < ARM_LINK_POINTS && !self; ++l)
+              self = nearSegment(p, links[b][l - 1], links[b][l], r2);
+        }
+        if(self)
+          break;
+        ++slowPoints[a];
+        if(inVolume(stop[a], p[0], p[1], p[2]))
+          ++stopPoints[a];
+      }
+    }
+  }
+
+  const int minPoints = myMinPoints;
+  const long long now = kinectTimeUSec();
+  myMutex.lock();
+  for(int a = 0; a < arms; ++a)
+  {
+    const ArmSpeed level = stopPoints[a] >= minPoints ? ArmSpeedStopped :
+      slowPoints[a] >= minPoints ? ArmSpeedSlow : ArmSpeedNormal;
+    if(myChecks == myLastChecks || level > myPending[a])
+    {
+      // first check since the command thread looked, or a higher level
+      // than any since: the latency is timed from this frame
+      myPending[a] = level;
+      myPendingCaptureUSec[a] = captureUSec;
+      myPendingCheckUSec[a] = now;
+    }
+  }
+  ++myChecks;
+  myLastCheckUSec = now;
+  myMutex.unlock();
+  myChecked = true;
+  myCondition.signal();
+  myCheckTiming.record(kinectTimeUSec() - t0);
+}
+
+void *ArmSafetyMonitor::runThread(void *)
+{
+  while(getRunning())
+  {
+    // a signal just before waiting is missed, so don't wait long
+    if(!myChecked.exchange(false))
+      myCondition.timedWait(20);
+    myChecked = false;
+
+    ArmSpeed pending[MAX_ARMS];
+    long long captureUSec[MAX_ARMS], checkUSec[MAX_ARMS];
+    myMutex.lock();
+    const bool fresh = myChecks != myLastChecks;
+    myLastChecks = myChecks;
+    const long long lastCheckUSec = myLastCheckUSec;
+    for(int a = 0; a < MAX_ARMS; ++a)
+    {
+      pending[a] = myPending[a];
+      captureUSec[a] = myPendingCaptureUSec[a];
+      checkUSec[a] = myPendingCheckUSec[a];
+    }
+    myMutex.unlock();
+
+    const long long now = kinectTimeUSec();
+    const bool blind = now - lastCheckUSec > myBlindTimeout * 1000LL;
+    const int arms = std::min(myArms->getArmCount(), MAX_ARMS);
+    for(int a = 0; a < arms; ++a)
+    {
+      if(fresh)
+        myWanted[a] = pending[a];
+      ArmSpeed want = myWanted[a];
+      if(blind && want < ArmSpeedSlow)
+        want = ArmSpeedSlow;
+      const ArmSpeed commanded = myCommanded[a];
+      if(want > commanded)
+      {
+        myLowerSinceUSec[a] = 0;
+        command(a, want, blind && want == ArmSpeedSlow && myWanted[a] < ArmSpeedSlow, captureUSec[a], checkUSec[a]);
+      }
+      else if(want < commanded)
+      {
+        if(myLowerSinceUSec[a] == 0)
+          myLowerSinceUSec[a] = now;
+        else if(now - myLowerSinceUSec[a] >= myClearDelay * 1000LL)
+        {
+          myLowerSinceUSec[a] = 0;
+          command(a, want, false, 0, 0);
+        }
+      }
+      else
+        myLowerSinceUSec[a] = 0;
+    }
+  }
+  return NULL;
+}
+
+/** Send @a speed for @a arm and, if it is a response to an intrusion
+ * first seen in the frame captured at @a captureUSec (0 if not), record the
+ * latency. */
+void ArmSafetyMonitor::command(int arm, ArmSpeed speed, bool blind, long long captureUSec, long long checkUSec)
+{
+  const bool timed = !blind && speed > myCommanded[arm] && captureUSec > 0;
+  myArms->set_arm_speed(arm, speed);
+  const long long done = kinectTimeUSec();
+  myCommanded[arm] = speed;
+  if(blind)
+  {
+    std::cout << "ArmSafetyMonitor: no depth for " << myBlindTimeout << " ms, slowing " << armNames[arm] << " arm." << std::endl;
+    return;
+  }
+  if(!timed)
+  {
+    std::cout << "ArmSafetyMonitor: " << armNames[arm] << " arm " << speedNames[speed] << "." << std::endl;
+    return;
+  }
+  const long long latency = done - captureUSec;
+  myLatency.record(latency);
+  myCommandLatency.record(done - checkUSec);
+  std::cout << "ArmSafetyMonitor: " << armNames[arm] << " arm " << speedNames[speed] << ", "
+    << latency / 1000.0 << " ms after capture." << std::endl;
+  if(latency > myLatencyBudget * 1000LL)
+  {
+    ++myOverBudget;
+    std::cout << "ArmSafetyMonitor: Warning: " << latency / 1000 << " ms from capture to command is over the "
+      << myLatencyBudget << " ms budget." << std::endl;
+  }
+}
+
+void ArmSafetyMonitor::addInfoStrings(ArStringInfoGroup *group)
+{
+  ArFunctor2<char*, ArTypes::UByte2> *f = new ArFunctor2C<ArmSafetyMonitor, char*, ArTypes::UByte2>(
+    this, &ArmSafetyMonitor::speedInfo);
+  myInfoFunctors.push_back(f);
+  group->addStringString("Arm safety", 30, f);
+  f = new ArFunctor2C<ArmSafetyMonitor, char*, ArTypes::UByte2>(this, &ArmSafetyMonitor::latencyInfo);
+  myInfoFunctors.push_back(f);
+  group->addStringString("Arm safety latency", 50, f);
+}
+
+/** Each arm's speed, e.g. "left slow, right clear" */
+void ArmSafetyMonitor::speedInfo(char *buf, ArTypes::UByte2 len)
+{
+  const int arms = std::min(myArms->getArmCount(), MAX_ARMS);
+  int n = 0;
+  buf[0] = 0;
+  for(int a = 0; a < arms && n < len; ++a)
+    n += snprintf(buf + n, len - n, "%s%s %s", a > 0 ? ", " : "", armNames[a], speedNames[myCommanded[a]]);
+}
+
+/** "p50/p99/max ms" from capture to command, and how many were over budget */
+void ArmSafetyMonitor::latencyInfo(char *buf, ArTypes::UByte2 len)
+{
+  if(myLatency.getCount() == 0)
+    snprintf(buf, len, "no commands");
+  else
+    snprintf(buf, len, "%.1f/%.1f/%.1f ms, %lu over %d ms",
+      myLatency.getPercentile(50) / 1000.0, myLatency.getPercentile(99) / 1000.0, myLatency.getMax() / 1000.0,
+      (unsigned long)myOverBudget, (int)myLatencyBudget);
+}
@@ -0,0 +1,137 @@
+#ifndef ARMSAFETYMONITOR_H
+#define ARMSAFETYMONITOR_H
+
+#include <vector>
+#include <atomic>
+#include "Aria.h"
+#include <libfreenect2/libfreenect2.hpp>
+#include "ArmDemoTask.h"
+#include "KinectArVideoServer.h"
+#include "KinectPipelineStats.h"
+
+/** Box around an arm, in metres in its own coordinates (+x left, -y
+ *  forward, +z up from its base) */
+struct ArmSafetyVolume
+{
+  float minX, maxX, minY, maxY, minZ, maxZ;
+};
+
+/** Slows or stops the arms when the Kinect sees something near them.
+ *
+ *  Each arm has two volumes: anything in the outer one slows the arm down,
+ *  anything in the inner one stops it (see ArmDemoTask::set_arm_speed()).
+ *  Every frame's raw depth is checked first thing in the Kinect's process
+ *  stage (KinectArVideoServer::addDepthCallback()): every stride'th pixel
+ *  is back-projected with ray tables from the IR intrinsics, rotated into
+ *  arm axes with the PTU's pan and tilt, and counted in the volumes it
+ *  falls in. Points near the arms themselves, within the arm radius of
+ *  their links (placed from the joint angles, see
+ *  ArmDemoTask::getArmLinksRelativeToPTU()), are not counted, and fewer than
+ *  the minimum number of points is taken as noise. Keep the volumes clear
+ *  of the table and anything else fixed: they are not told apart from
+ *  people.
+ *
+ *  The commands are sent from this task's own thread, woken by each
+ *  check, so a slow Kinova call never holds up the Kinect pipeline. An arm
+ *  is slowed or stopped as soon as a check says so, and goes back to a
+ *  lower level only once the checks have said so for the clear delay. If
+ *  no frame has been checked for the blind timeout (the Kinect stalled, or
+ *  there is no PTU to place the volumes), the arms are slowed.
+ *
+ *  The latency from capturing the frame that showed the intrusion to the
+ *  command having been sent is recorded (getLatency()), with a warning if
+ *  it is over the latency budget (100 ms by default). It is bounded by
+ *  the process queue (a frame or two), the check (well under a
+ *  millisecond at stride 2), the wake-up (at most 20 ms if the signal is
+ *  missed) and the Kinova calls (a few ms). The speed change is urgent
+ *  for the KinovaArbiter, so it waits only for the job in progress and
+ *  at most one batch for the other arm.
+ *
+ *  Call runAsync() to start it; the callback must be added before the
+ *  KinectArVideoServer is started, so construct this first.
+ */
+class ArmSafetyMonitor : public virtual ArASyncTask
+{
+public:
+  /** @param stride check every stride'th depth pixel in each direction */
+  ArmSafetyMonitor(ArmDemoTask *arms, KinectArVideoServer *kinect, int stride = 2);
+  virtual ~ArmSafetyMonitor();
+
+  // These may be changed while running and take effect from the next frame.
+
+  /** Slow the arm for anything in @a slow, stop it for anything in @a stop */
+  void setVolumes(int arm, const ArmSafetyVolume& slow, const ArmSafetyVolume& stop);
+  /** Fewest points in a volume to count as an intrusion */
+  void setMinPoints(int points) { myMinPoints = points; }
+  /** Distance from an arm's links (m) of points taken to be the arm
+   *  itself */
+  void setArmRadius(float metres) { myArmRadius = metres; }
+  /** How long a volume must be clear before the arm speeds up again (ms) */
+  void setClearDelay(int ms) { myClearDelay = ms; }
+  /** How long without a depth frame before slowing the arms (ms) */
+  void setBlindTimeout(int ms) { myBlindTimeout = ms; }
+  /** Longest acceptable latency from capture to command (ms) */
+  void setLatencyBudget(int ms) { myLatencyBudget = ms; }
+
+  /** Speed last commanded for arm @a arm */
+  ArmSpeed getSpeed(int arm) const { return myCommanded[arm]; }
+  /** Capture of the frame that showed an intrusion to the command having
+   *  been sent (us) */
+  const KinectLatencyHistogram& getLatency() const { return myLatency; }
+  /** Check of the frame to the command having been sent (us) */
+  const KinectLatencyHistogram& getCommandLatency() const { return myCommandLatency; }
+  /** Time to check one frame (us) */
+  const KinectLatencyHistogram& getCheckTiming() const { return myCheckTiming; }
+  /** Commands sent later than the latency budget */
+  unsigned long getOverBudget() const { return myOverBudget; }
+
+  /** Add "Arm safety" strings showing each arm's speed and the latency
+   *  percentiles to @a group (e.g. Aria::getInfoGroup()) */
+  void addInfoStrings(ArStringInfoGroup *group);
+
+  virtual void *runThread(void *);
+
+private:
+  ArmDemoTask *myArms;
+  KinectArVideoServer *myKinect;
+  int myStride;
+  std::vector<float> myRayX, myRayY;  ///< per subsampled column and row
+
+  ArMutex myVolumeMutex;
+  ArmSafetyVolume mySlowVolumes[MAX_ARMS], myStopVolumes[MAX_ARMS];
+  std::atomic<int> myMinPoints;
+  std::atomic<float> myArmRadius;
+  std::atomic<int> myClearDelay;
+  std::atomic<int> myBlindTimeout;
+  std::atomic<int> myLatencyBudget;
+
+  // from check() to the command thread: the highest level seen by the
+  // checks since the thread last looked, and when it was first seen
+  ArMutex myMutex;
+  ArCondition myCondition;
+  std::atomic<bool> myChecked;
+  unsigned long myChecks;
+  long long myLastCheckUSec;
+  ArmSpeed myPending[MAX_ARMS];
+  long long myPendingCaptureUSec[MAX_ARMS], myPendingCheckUSec[MAX_ARMS];
+
+  unsigned long myLastChecks;  ///< myChecks when the command thread last looked
+
+  // command thread only, except myCommanded
+  std::atomic<ArmSpeed> myCommanded[MAX_ARMS];
+  ArmSpeed myWanted[MAX_ARMS];
+  long long myLowerSinceUSec[MAX_ARMS];  ///< wanted below commanded since, or 0
+
+  KinectLatencyHistogram myLatency, myCommandLatency, myCheckTiming;
+  std::atomic<unsigned long> myOverBudget;
+
+  ArFunctor2C<ArmSafetyMonitor, const libfreenect2::Frame*, long long> myDepthFunctor;
+  std::vector<ArFunctor2<char*, ArTypes::UByte2>*> myInfoFunctors;
+
+  void check(const libfreenect2::Frame *depth, long long captureUSec);
+  void command(int arm, ArmSpeed speed, bool blind, long long captureUSec, long long checkUSec);
+  void speedInfo(char *buf, ArTypes::UByte2 len);
+  void latencyInfo(char *buf, ArTypes::UByte2 len);
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include "ArmStateSampler.h"
+
+ArmStateSampler::ArmStateSampler(ArRetFunctor2<bool, int, ArmState*> *read, int rate) :
+  myRead(read),
+  myRate(rate > 0 ? rate : 1),
+  myArmCount(0),
+  mySequence(0),
+  myOverruns(0),
+  myRateLastSequence(0),
+  myRateLastUSec(kinectTimeUSec()),
+  myAchievedRate(0)
+{
+  for(int i = 0; i < ARM_STATE_MAX_ARMS; ++i)
+  {
+    mySlots[i].seqlock = 0;
+    memset(&mySlots[i].state, 0, sizeof(ArmState));
+  }
+}
+
+ArmStateSampler::~ArmStateSampler()
+{
+  for(size_t i = 0; i < myInfoFunctors.size(); ++i)
+    delete myInfoFunctors[i];
+}
+
+void ArmStateSampler::start(int armCount)
+{
+  myArmCount = std::min(armCount, ARM_STATE_MAX_ARMS);
+  runAsync();
+}
+
+void ArmStateSampler::write(int arm, const ArmState& state)
+{
+  Slot& s = mySlots[arm];
+  s.seqlock.store(s.seqlock.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.state = state;
+  s.seqlock.store(s.seqlock.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool ArmStateSampler::getLatest(int arm, ArmState *state) const
+{
+  if(arm < 0 || arm >= ARM_STATE_MAX_ARMS)
+  {
+    state->valid = false;
+    return false;
+  }
+  const Slot& s = mySlots[arm];
+  while(true)
+  {
+    const unsigned long before = s.seqlock.load(std::memory_order_acquire);
+    if(before & 1)
+      continue;  // being written, for a few nanoseconds
+    *state = s.state;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(s.seqlock.load(std::memory_order_relaxed) == before)
+      return state->valid;
+  }
+}
+
+void *ArmStateSampler::runThread(void *)
+{
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while(getRunning())
+  {
+    const unsigned long sequence = mySequence.load(std::memory_order_relaxed) + 1;
+    for(int a = 0; a < myArmCount; ++a)
+    {
+      ArmState state;
+      const long long before = kinectTimeUSec();
+      if(!myRead->invokeR(a, &state))
+        continue;  // readers keep the last good sample, with its time
+      const long long after = kinectTimeUSec();
+      myReadTiming.record(after - before);
+      state.valid = true;
+      state.sequence = sequence;
+      state.timeUSec = before + (after - before) / 2;
+      write(a, state);
+    }
+    mySequence.store(sequence, std::memory_order_release);
+    for(size_t i = 0; i < mySampleCallbacks.size(); ++i)
+      mySampleCallbacks[i]->invoke();
+
+    // Sleep to an absolute deadline so the rate does not drift with the
+    // time taken reading; if a round overran, start the next one now.
+    const long period = 1000000000L / myRate;
+    next.tv_nsec += period;
+    while(next.tv_nsec >= 1000000000L)
+    {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+    {
+      ++myOverruns;
+      next = now;
+      continue;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+void ArmStateSampler::addInfoStrings(ArStringInfoGroup *group)
+{
+  ArFunctor2<char*, ArTypes::UByte2> *f = new ArFunctor2C<ArmStateSampler, char*, ArTypes::UByte2>(
+    this, &ArmStateSampler::stateInfo);
+  myInfoFunctors.push_back(f);
+  group->addStringString("Arm state", 50, f);
+}
+
+/** Rounds per second achieved against the rate wanted, "p50/p99/max ms"
+ * to read an arm, and overruns */
+void ArmStateSampler::stateInfo(char *buf, ArTypes::UByte2 len)
+{
+  const unsigned long sequence = getSequence();
+  const long long now = kinectTimeUSec();
+  if(now - myRateLastUSec >= 1000000)
+  {
+    myAchievedRate = (sequence - myRateLastSequence) * 1e6 / (now - myRateLastUSec);
+    myRateLastSequence = sequence;
+    myRateLastUSec = now;
+  }
+  snprintf(buf, len, "%.0f/%d Hz, read %.1f/%.1f/%.1f ms, %lu overruns",
+    myAchievedRate, (int)myRate, myReadTiming.getPercentile(50) / 1000.0,
+    myReadTiming.getPercentile(99) / 1000.0, myReadTiming.getMax() / 1000.0, (unsigned long)myOverruns);
+}
@@ -0,0 +1,101 @@
+#ifndef ARMSTATESAMPLER_H
+#define ARMSTATESAMPLER_H
+
+#include <vector>
+#include <atomic>
+#include "Aria.h"
+#include "KinectPipelineStats.h"
+
+#define ARM_STATE_MAX_ARMS 2
+
+/** One reading of an arm */
+struct ArmState
+{
+  bool valid;               ///< has been read
+  unsigned long sequence;   ///< sampler round it was read in
+  long long timeUSec;       ///< when read, kinectTimeUSec() (monotonic)
+  float x, y, z;            ///< end effector (m, arm axes: +x left, -y forward, +z up)
+  float thetaX, thetaY, thetaZ;  ///< rad
+  float fingers[3];
+  float torques[6];         ///< joint torques (Nm)
+  float angles[6];          ///< joint angles (degrees)
+};
+
+/** Reads every arm's state on its own thread, at a steady rate (100 Hz by
+ *  default), so that readers always have a recent sample and never wait
+ *  for the arms or for each other.
+ *
+ *  The reading itself is done by a functor (ArmDemoTask::read_arm_state()),
+ *  which fills in the state, in one call to the arm where it can, and
+ *  returns false if the arm could not be read; the time is the middle of the read. Each
+ *  arm's latest sample is kept behind a seqlock: the sampler bumps the
+ *  count to odd, writes, and bumps it to even again, and getLatest()
+ *  copies the sample and retries if the count was odd or changed
+ *  meanwhile. Readers never block the sampler, and the sampler only ever
+ *  waits for the arms.
+ *
+ *  After each round the sample callbacks are called on the sampler's
+ *  thread, e.g. to publish the state or point the PTU at an arm; they
+ *  should be quick, or the rate drops.
+ */
+class ArmStateSampler : public virtual ArASyncTask
+{
+public:
+  /** @param read reads one arm: called with the arm's number and the state
+   *    to fill in
+   *  @param rate rounds per second */
+  ArmStateSampler(ArRetFunctor2<bool, int, ArmState*> *read, int rate = 100);
+  virtual ~ArmStateSampler();
+
+  /** Start sampling arms 0 to @a armCount - 1 */
+  void start(int armCount);
+  /** Rounds per second (all arms are read each round) */
+  void setRate(int hz) { myRate = hz > 0 ? hz : 1; }
+  int getRate() const { return myRate; }
+
+  /** Copy arm @a arm's latest sample into @a state.
+   *  @return whether it has been read yet (state->valid) */
+  bool getLatest(int arm, ArmState *state) const;
+  /** Rounds completed, to tell whether there is a new sample */
+  unsigned long getSequence() const { return mySequence.load(std::memory_order_acquire); }
+
+  /** Called on the sampler's thread after each round */
+  void addSampleCallback(ArFunctor *f) { mySampleCallbacks.push_back(f); }
+
+  /** Time to read each arm (us) */
+  const KinectLatencyHistogram& getReadTiming() const { return myReadTiming; }
+  /** Rounds that took longer than the period */
+  unsigned long getOverruns() const { return myOverruns; }
+
+  /** Add "Arm state" strings showing the rate achieved, the read time
+   *  percentiles and overruns to @a group (e.g. Aria::getInfoGroup()) */
+  void addInfoStrings(ArStringInfoGroup *group);
+
+  virtual void *runThread(void *);
+
+private:
+  ArRetFunctor2<bool, int, ArmState*> *myRead;
+  std::atomic<int> myRate;
+  int myArmCount;
+
+  struct Slot
+  {
+    std::atomic<unsigned long> seqlock;  ///< odd while being written
+    ArmState state;
+  };
+  Slot mySlots[ARM_STATE_MAX_ARMS];
+  std::atomic<unsigned long> mySequence;
+
+  std::vector<ArFunctor*> mySampleCallbacks;
+  KinectLatencyHistogram myReadTiming;
+  std::atomic<unsigned long> myOverruns;
+  unsigned long myRateLastSequence;
+  long long myRateLastUSec;
+  double myAchievedRate;
+  std::vector<ArFunctor2<char*, ArTypes::UByte2>*> myInfoFunctors;
+
+  void write(int arm, const ArmState& state);
+  void stateInfo(char *buf, ArTypes::UByte2 len);
+};
+
+#endif
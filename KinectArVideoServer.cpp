@@ -26,124 +26,1436 @@
 
 
 #include <iostream>
+#include <stdio.h>
 #include <signal.h>
+#include <string.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <math.h>
+#include <float.h>
+#include <algorithm>
 #include <opencv2/opencv.hpp>
 #include "ArVideo.h"
 #include "ArVideoOpenCV.h"
 
 #include "KinectArVideoServer.h"
+#include "KinectDepthCodec.h"
 
-#include <libfreenect2/frame_listener_impl.h>
+// Frames are already RGB when handed to ArVideoOpenCV, so ask it not to
+// convert them. ArVideoOpenCV::updateVideoDataCopy() takes a cv::cvtColor()
+// code, and OpenCV has none meaning "no conversion"; this is not a valid
+// code, so whether ArVideo skips it is checked on the first frame (see
+// copyToVideoSource()).
+static const int NO_COLOR_CONVERSION = -1;
+
+/** Rectangle @a r of a (not mirrored) source image, in pixels of the
+ * mirrored @a dstWidth x @a dstHeight image made from it. */
+static cv::Rect mirroredRect(const cv::Rect& r, int srcWidth, int srcHeight, int dstWidth, int dstHeight)
+{
+  const int x0 = (srcWidth - r.x - r.width) * dstWidth / srcWidth;
+  const int x1 = ((srcWidth - r.x) * dstWidth + srcWidth - 1) / srcWidth;
+  const int y0 = r.y * dstHeight / srcHeight;
+  const int y1 = ((r.y + r.height) * dstHeight + srcHeight - 1) / srcHeight;
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+int KinectArVideoServer::runAsync()
+{
+  // (not in runThread(), where it could undo a close() called meanwhile)
+  closeMutex.lock();
+  shutdown = false;
+  closed = false;
+  closeMutex.unlock();
+  captureRunning = true;
+  const int ret = ArASyncTask::runAsync();
+  if(ret != 0)
+    captureRunning = false;
+  return ret;
+}
 
 void KinectArVideoServer::close()
 {
+  // The capture thread may be waiting for frames from, or reopening, the
+  // source: wait for it to notice, unless this is it. It calls close()
+  // itself on its way out.
+  shutdown = true;
+  if(!pthread_equal(pthread_self(), getThread()))
+  {
+    captureJoinMutex.lock();
+    if(captureRunning)
+    {
+      join();
+      captureRunning = false;
+    }
+    captureJoinMutex.unlock();
+  }
+
+  closeMutex.lock();
+  if(closed)
+  {
+    closeMutex.unlock();
+    return;
+  }
   std::cout << "KinectArVideoServer: closing." << std::endl;
-  // TODO: restarting ir stream doesn't work!
-  // TODO: bad things will happen, if frame listeners are freed before dev->stop() :(
-  freenect_dev->stop();
-  freenect_dev->close();
+  shutdown = true;
+  processQueue.wake();
+  cloudQueue.wake();
+  gridQueue.wake();
+  publishQueue.wake();
+  if(stagesRunning)
+  {
+    processThread.join();
+    cloudThread.join();
+    gridThread.join();
+    publishThread.join();
+    stagesRunning = false;
+  }
+  stopRecording();
+  if(frameSource)
+  {
+    if(streaming)
+      frameSource->stop();
+    streaming = false;
+    frameSource->close();
+  }
+  closed = true;
+  closeMutex.unlock();
 }
 
 KinectArVideoServer::~KinectArVideoServer()
 {
   close();
+  if(ownFrameSource)
+    delete frameSource;
+  for(std::list<ArFunctor2<char*, ArTypes::UByte2>*>::iterator i = infoFunctors.begin(); i != infoFunctors.end(); ++i)
+    delete *i;
+  delete pointCloud;
+  delete occupancyGrid;
+  delete roiRegistration;
+  delete markerTracker;
+  delete tableSegmenter;
+  delete sharedRing;
+  for(int i = DepthSource; i <= RGBSource; ++i)
+    for(int l = 0; l < pyramidLevels; ++l)
+    {
+      delete tileEncoders[i][l];
+      delete jpegCaches[i][l];
+    }
 }
 
-KinectArVideoServer::KinectArVideoServer(ArServerBase *_server, int width, int height) : 
-  server(_server), shutdown(false), freenect_dev(NULL), resize_to_width(width), resize_to_height(height)
+const char *KinectArVideoServer::stageNames[NumStages] = { "capture", "process", "cloud", "grid", "publish" };
+const char *KinectArVideoServer::timingNames[NumTimings] = {
+  "frame wait", "decode", "depth filter", "marker", "region of interest", "resize/flip", "depth normalize", "point cloud", "table", "occupancy grid", "ArVideo copy", "tile delta", "JPEG encode", "shared memory", "frame to publish", "device recovery"
+};
+
+KinectArVideoServer::KinectArVideoServer(ArServerBase *_server, int width, int height, int levels,
+    size_t queueLength, FrameRing::DropPolicy dropPolicy) : 
+  server(_server), shutdown(false), closed(false), captureRunning(false), frameSource(NULL), ownFrameSource(false), sourceFinished(false),
+  resize_to_width(width), resize_to_height(height),
+  pyramidLevels(std::max(1, std::min(levels, KINECT_MAX_PYRAMID_LEVELS))),
+  // one frame in each stage plus a full queue in front of each
+  framePool(5 + 4*queueLength, width, height, pyramidLevels), frameSequence(0),
+  colorKernel(KINECT_COLOR_WIDTH, KINECT_COLOR_HEIGHT, width, height),
+  depthKernel(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, width, height),
+  roiLowLevel(std::min(2, pyramidLevels - 1)),
+  roiColorKernel(KINECT_COLOR_WIDTH, KINECT_COLOR_HEIGHT, width >> roiLowLevel, height >> roiLowLevel),
+  roiDepthKernel(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, width >> roiLowLevel, height >> roiLowLevel),
+  depthFilter(KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT),
+  depthFilterEnabled(true),
+  depthFilterLastUSec(0),
+  processQueue(queueLength, dropPolicy),
+  cloudQueue(queueLength, dropPolicy),
+  gridQueue(queueLength, dropPolicy),
+  publishQueue(queueLength, dropPolicy),
+  kinectDepthSources(pyramidLevels, (ArVideoOpenCV*)NULL),
+  kinectRGBSources(pyramidLevels, (ArVideoOpenCV*)NULL),
+  videoCopyMode(VideoCopyUntried),
+  processFunctor(this, &KinectArVideoServer::processLoop),
+  cloudFunctor(this, &KinectArVideoServer::cloudLoop),
+  gridFunctor(this, &KinectArVideoServer::gridLoop),
+  publishFunctor(this, &KinectArVideoServer::publishLoop),
+  stagesRunning(false),
+  streaming(false),
+  idleTimeout(5000),
+  alwaysStream(false),
+  stallTimeout(300),
+  startTimeout(3000),
+  lastFrameUSec(0),
+  gotFrameSinceStart(false),
+  stallSinceUSec(0),
+  recoveries(0),
+  recoveryAttempts(0),
+  lastRecoveryUSec(0),
+  recordCompress(true),
+  recording(false),
+  pointCloud(NULL),
+  pointCloudVoxelSize(0),
+  pointCloudLatestSequence(0),
+  occupancyGrid(NULL),
+  occupancyGridInterval(200),
+  occupancyGridLastUSec(0),
+  occupancyGridWanted(false),
+  cameraPoseFunctor(NULL),
+  roiTargetFunctor(NULL),
+  roiSize(0.4f),
+  roiEnabled(false),
+  roiCropWidth(0),
+  roiCropHeight(0),
+  roiRegistration(NULL),
+  kinectROISource(NULL),
+  roiLatestValid(false),
+  markerWanted(false),
+  markerActive(true),
+  markerThreshold(30000),
+  markerMinArea(3),
+  markerMaxArea(1500),
+  markerTracker(NULL),
+  markerReferenceFunctor(NULL),
+  markerLatestValid(false),
+  markerLatestDistance(-1),
+  markerDistanceSum(0),
+  markerDistanceCount(0),
+  markerFrames(0),
+  markerFoundFrames(0),
+  tableStride(0),
+  tableActive(true),
+  tableSegmenter(NULL),
+  tablePlaneValid(false),
+  tableLatestUSec(0),
+  sharedRing(NULL),
+  sharedColor(false),
+  cameraParamsValid(false),
+  depthRVLBytesSent(0),
+  depthRVLRequestFunctor(this, &KinectArVideoServer::handleDepthRVLRequest),
+  tileRateLastBytes(0),
+  tileRate(0)
 {
+  for(int i = 0; i < NumSources; ++i)
+  {
+    sourceWanted[i] = false;
+    for(int l = 0; l < KINECT_MAX_PYRAMID_LEVELS; ++l)
+    {
+      levelWanted[i][l] = false;
+      videoRequestsMissing[i][l] = false;
+    }
+  }
+  // until told otherwise, 1 m up looking straight ahead
+  cameraPose.x = cameraPose.y = 0;
+  cameraPose.z = 1000;
+  cameraPose.pan = cameraPose.tilt = 0;
+  for(int i = 0; i < NumStages; ++i)
+  {
+    fpsLastFrames[i] = 0;
+    fps[i] = 0;
+  }
+  for(int i = DepthSource; i <= RGBSource; ++i)
+  {
+    for(int l = 0; l < KINECT_MAX_PYRAMID_LEVELS; ++l)
+    {
+      tileEncoders[i][l] = NULL;
+      tileWanted[i][l] = false;
+      jpegCaches[i][l] = NULL;
+    }
+    // about the same tile grid at every level
+    for(int l = 0; l < pyramidLevels; ++l)
+    {
+      tileEncoders[i][l] = new KinectTileEncoder(width >> l, height >> l, std::max(16, 64 >> l));
+      jpegCaches[i][l] = new KinectJpegCache(width >> l, height >> l);
+    }
+  }
+  videoRequestPrefixes.push_back("sendVideo");
+  videoRequestPrefixes.push_back("getPicture");
+  setName("Kinect");
+
+  std::cout << "KinectArVideoServer: using " << kinectKernelsInstructionSet() << " image kernels" << std::endl;
 }
 
-void *KinectArVideoServer::runThread(void*)
+/** Source and request names, and the default demand commands for them */
+void KinectArVideoServer::setName(const char *_name)
 {
-  // TODO might need to move initialization to separate function
+  name = _name;
+  levelSourceNames[DepthSource][0] = name + "_Depth|libfreenect2|OpenCV";
+  levelSourceNames[RGBSource][0] = name + "_RGB|libfreenect2|OpenCV";
+  levelSourceNames[RawDepthSource][0] = name + "_Depth|libfreenect2|RVL";
+  levelSourceNames[RGBROISource][0] = name + "_RGB_ROI|libfreenect2|OpenCV";
+  for(int l = 1; l < pyramidLevels; ++l)
+  {
+    char size[32];
+    snprintf(size, sizeof(size), "_%dx%d|", resize_to_width >> l, resize_to_height >> l);
+    levelSourceNames[DepthSource][l] = name + "_Depth" + size + "libfreenect2|OpenCV";
+    levelSourceNames[RGBSource][l] = name + "_RGB" + size + "libfreenect2|OpenCV";
+  }
+  // "getKinectDepthRVL" (KINECT_DEPTH_RVL_REQUEST) and "getKinectOccupancy"
+  // (KINECT_OCCUPANCY_REQUEST) by default
+  depthRVLRequestName = "get" + name + "DepthRVL";
+  occupancyGridRequestName = "get" + name + "Occupancy";
 
-  /* Open Kinect */
+  for(int i = 0; i < NumSources; ++i)
+    for(int l = 0; l < KINECT_MAX_PYRAMID_LEVELS; ++l)
+      demandCommands[i][l].clear();
+  for(int i = DepthSource; i <= RGBSource; ++i)
+  {
+    for(int l = 0; l < pyramidLevels; ++l)
+    {
+      for(size_t p = 0; p < videoRequestPrefixes.size(); ++p)
+        addDemandCommand((Source)i, (videoRequestPrefixes[p] + levelSourceNames[i][l]).c_str(), l);
+      tileCommands[i][l].clear();
+      tileCommands[i][l].push_back(KINECT_TILES_REQUEST_PREFIX + levelSourceNames[i][l]);
+      addDemandCommand((Source)i, tileCommands[i][l].front().c_str(), l);
+      jpegCommands[i][l].clear();
+      jpegCommands[i][l].push_back(KINECT_JPEG_REQUEST_PREFIX + levelSourceNames[i][l]);
+      addDemandCommand((Source)i, jpegCommands[i][l].front().c_str(), l);
+    }
+  }
+  addDemandCommand(RawDepthSource, depthRVLRequestName.c_str());
+  for(size_t p = 0; p < videoRequestPrefixes.size(); ++p)
+    addDemandCommand(RGBROISource, (videoRequestPrefixes[p] + levelSourceNames[RGBROISource][0]).c_str());
+}
 
-/*
-  int ndevs = freenect2.enumerateDevices();
-  printf("KinectArVideoServer: %d devices\n", ndevs);
-  std::string serial = freenect2.getDefaultDeviceSerialNumber();
-  printf("KinectArVideoServer: device serial number is %s\n", serial.c_str());
-*/
+void KinectArVideoServer::setVideoRequestPrefixes(const std::vector<std::string>& prefixes)
+{
+  videoRequestPrefixes = prefixes;
+  setName(name.c_str());
+}
+
+/** Which video sources ArVideo registered none of the video requests for,
+ * once its servers have been created. Those are streamed while any client
+ * is connected, since who is watching them can't be told. */
+void KinectArVideoServer::checkVideoRequests()
+{
+  for(int i = 0; i < NumSources; ++i)
+  {
+    const bool video = i == DepthSource || i == RGBSource || (i == RGBROISource && kinectROISource);
+    const int levels = (i == RawDepthSource || i == RGBROISource) ? 1 : pyramidLevels;
+    for(int l = 0; l < levels; ++l)
+    {
+      bool found = false;
+      for(size_t p = 0; p < videoRequestPrefixes.size() && !found; ++p)
+        found = server->findCommandFromName((videoRequestPrefixes[p] + levelSourceNames[i][l]).c_str()) != 0;
+      videoRequestsMissing[i][l] = video && !found;
+      if(videoRequestsMissing[i][l])
+        std::cout << "KinectArVideoServer: Warning: ArVideo registered none of the video requests for "
+          << levelSourceNames[i][l] << " (see setVideoRequestPrefixes()), streaming it while any client is connected" << std::endl;
+    }
+  }
+}
+
+void KinectArVideoServer::setDevice(libfreenect2::Freenect2 *freenect2, const std::string& serial)
+{
+  if(ownFrameSource)
+    delete frameSource;
+  frameSource = new KinectDeviceSource(freenect2, serial);
+  ownFrameSource = true;
+}
+
+void KinectArVideoServer::setCPUs(const std::vector<int>& _cpus)
+{
+  cpus = _cpus;
+}
+
+/** Restrict the calling stage thread to the CPUs given to setCPUs() */
+void KinectArVideoServer::pinThread()
+{
+  if(cpus.empty())
+    return;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(size_t i = 0; i < cpus.size(); ++i)
+    CPU_SET(cpus[i], &set);
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if(err != 0)
+    std::cout << "KinectArVideoServer: Warning: could not pin " << name << " thread to its CPUs: " << strerror(err) << std::endl;
+#else
+  std::cout << "KinectArVideoServer: Warning: CPU pinning is only supported on Linux" << std::endl;
+#endif
+}
+
+/** Queue @a f on @a ring for stage @a next. Whatever frame the ring drops
+ * is counted against that stage and returned to the pool. */
+void KinectArVideoServer::enqueue(FrameRing& ring, Stage next, KinectFrame *f)
+{
+  KinectFrame *dropped = NULL;
+  ring.push(f, &dropped);
+  if(dropped)
+  {
+    stageStats[next].addDropped();
+    framePool.release(dropped);
+  }
+}
+
+void KinectArVideoServer::setFrameSource(KinectFrameSource *source)
+{
+  if(ownFrameSource)
+    delete frameSource;
+  frameSource = source;
+  ownFrameSource = false;
+}
+
+bool KinectArVideoServer::startRecording(const char *filename, bool compress)
+{
+  recorderMutex.lock();
+  recorder.close();
+  recordFilename = filename;
+  recordCompress = compress;
+  recording = true;
+  recorderMutex.unlock();
+  std::cout << "KinectArVideoServer: recording to " << filename << std::endl;
+  return true;
+}
+
+void KinectArVideoServer::stopRecording()
+{
+  recorderMutex.lock();
+  recording = false;
+  recordFilename.clear();
+  recorder.close();
+  recorderMutex.unlock();
+}
+
+/** Called by the process stage for each frame while recording. */
+void KinectArVideoServer::record(KinectFrame *f)
+{
+  recorderMutex.lock();
+  if(!recordFilename.empty())
+  {
+    libfreenect2::Freenect2Device::IrCameraParams ir;
+    libfreenect2::Freenect2Device::ColorCameraParams color;
+    memset(&ir, 0, sizeof(ir));
+    memset(&color, 0, sizeof(color));
+    frameSource->getCameraParams(&ir, &color);
+    if(!recorder.open(recordFilename.c_str(), ir, color, recordCompress))
+      recording = false;
+    recordFilename.clear();
+  }
+  if(recording && !recorder.write(f->colorSource, f->depthSource, f->captureUSec))
+  {
+    std::cout << "KinectArVideoServer: Error recording frame, recording stopped." << std::endl;
+    recording = false;
+    recorder.close();
+  }
+  recorderMutex.unlock();
+}
+
+void KinectArVideoServer::enablePointCloud(float voxelSize)
+{
+  pointCloudVoxelSize = voxelSize;
+}
+
+void KinectArVideoServer::setPointCloudVoxelSize(float voxelSize)
+{
+  pointCloudVoxelSize = voxelSize;
+  if(pointCloud)
+    pointCloud->setVoxelSize(voxelSize);
+}
+
+void KinectArVideoServer::addPointCloudCallback(ArFunctor1<const KinectPoints*> *functor)
+{
+  pointCloudMutex.lock();
+  pointCloudCallbacks.push_back(functor);
+  pointCloudMutex.unlock();
+}
+
+bool KinectArVideoServer::getLatestPointCloud(KinectPoints *points, unsigned long *sequence)
+{
+  pointCloudMutex.lock();
+  const bool have = pointCloudLatestSequence != 0;
+  points->assign(pointCloudLatest.begin(), pointCloudLatest.end());
+  if(sequence)
+    *sequence = pointCloudLatestSequence;
+  pointCloudMutex.unlock();
+  return have;
+}
+
+void KinectArVideoServer::enableOccupancyGrid(ArServerInfoDrawings *drawings, int cellSize, int range,
+  unsigned int intervalMs, const char *drawingName)
+{
+  if(occupancyGrid)
+    return;
+  occupancyGrid = new KinectOccupancyGrid(cellSize, range);
+  occupancyGridInterval = intervalMs;
+  drawings->addDrawing(new ArDrawingData("polyDots", ArColor(0, 0, 255), cellSize, 45, intervalMs),
+    drawingName, occupancyGrid->getDrawingFunctor());
+  server->addData(occupancyGridRequestName.c_str(), (name + " occupancy grid: cells changed since the last request").c_str(),
+    occupancyGrid->getRequestFunctor(), "none",
+    "uByte4 sequence, uByte2 columns, uByte2 rows, uByte2 cell size, byte4 x, byte4 y, uByte2 cells, uByte last, cells of (uByte2 column, uByte2 row, uByte state, byte2 height)",
+    "Kinect", "RETURN_VIDEO");
+  server->addClientRemovedCallback(occupancyGrid->getClientRemovedFunctor());
+  occupancyGridCommands.push_back(drawingName);
+  occupancyGridCommands.push_back(occupancyGridRequestName);
+}
+
+void KinectArVideoServer::enableROI(ArRetFunctor3<bool, float*, float*, float*> *target, float size,
+  int cropWidth, int cropHeight)
+{
+  roiTargetFunctor = target;
+  roiSize = size;
+  roiCropWidth = std::min(cropWidth, KINECT_COLOR_WIDTH);
+  roiCropHeight = std::min(cropHeight, KINECT_COLOR_HEIGHT);
+  framePool.allocateROI(roiCropWidth, roiCropHeight);
+  roiEnabled = true;
+}
+
+void KinectArVideoServer::enableMarkerTracking(float threshold, int minArea, int maxArea)
+{
+  markerThreshold = threshold;
+  markerMinArea = minArea;
+  markerMaxArea = maxArea;
+  markerWanted = true;
+}
+
+void KinectArVideoServer::setMarkerTrackingActive(bool active)
+{
+  markerMutex.lock();
+  markerActive = active;
+  if(!active)
+    markerLatestValid = false;
+  markerMutex.unlock();
+}
+
+bool KinectArVideoServer::getLatestMarker(KinectMarker *marker, float *referenceDistance)
+{
+  markerMutex.lock();
+  const bool valid = markerLatestValid;
+  *marker = markerLatest;
+  if(referenceDistance)
+    *referenceDistance = markerLatestDistance;
+  markerMutex.unlock();
+  return valid;
+}
+
+double KinectArVideoServer::getMeanMarkerDistance()
+{
+  markerMutex.lock();
+  const double d = markerDistanceCount > 0 ? markerDistanceSum / markerDistanceCount : -1;
+  markerMutex.unlock();
+  return d;
+}
+
+/** Find the IR marker in @a f and compare it with the reference point */
+void KinectArVideoServer::trackMarker(KinectFrame *f)
+{
+  const long long t0 = kinectTimeUSec();
+  KinectMarker m;
+  const bool found = markerTracker->track(f->irSource, f->depthSource, &m);
+  float distance = -1;
+  float x, y, z;
+  if(found && m.depthValid && markerReferenceFunctor && markerReferenceFunctor->invokeR(&x, &y, &z))
+    distance = sqrtf((m.x - x) * (m.x - x) + (m.y - y) * (m.y - y) + (m.z - z) * (m.z - z));
+  timings[MarkerTiming].record(kinectTimeUSec() - t0);
+
+  markerMutex.lock();
+  markerLatestValid = found && markerActive;
+  markerLatest = m;
+  markerLatestDistance = distance;
+  if(distance >= 0)
+  {
+    markerDistanceSum += distance;
+    ++markerDistanceCount;
+  }
+  ++markerFrames;
+  if(found)
+    ++markerFoundFrames;
+  markerMutex.unlock();
+}
+
+void KinectArVideoServer::enableTableSegmentation(int stride)
+{
+  tableStride = std::max(1, stride);
+  // (filled in place, so that the stages never allocate for them)
+  tableWork.reserve(256);
+  tableObjects.reserve(256);
+}
+
+void KinectArVideoServer::setTableSegmentationActive(bool active)
+{
+  tableMutex.lock();
+  tableActive = active;
+  if(!active)
+    tablePlaneValid = false;
+  tableMutex.unlock();
+}
+
+bool KinectArVideoServer::getLatestTable(KinectPlane *plane, KinectObjects *objects)
+{
+  tableMutex.lock();
+  const bool valid = tablePlaneValid;
+  *plane = tablePlane;
+  objects->assign(tableObjects.begin(), tableObjects.end());
+  tableMutex.unlock();
+  return valid;
+}
+
+bool KinectArVideoServer::getGraspTarget(float *x, float *y, float *z)
+{
+  tableMutex.lock();
+  const bool have = tablePlaneValid && !tableObjects.empty() && kinectTimeUSec() - tableLatestUSec < 1000000;
+  if(have)
+  {
+    *x = tableObjects[0].topX;
+    *y = tableObjects[0].topY;
+    *z = tableObjects[0].topZ;
+  }
+  tableMutex.unlock();
+  return have;
+}
+
+bool KinectArVideoServer::enableSharedMemory(bool color, int slots)
+{
+  const size_t size = sizeof(KinectSharedFrame) + KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT * sizeof(float) +
+    (color ? KINECT_COLOR_WIDTH * KINECT_COLOR_HEIGHT * 4 : 0);
+  SharedMemoryRingWriter *ring = new SharedMemoryRingWriter("/" + name + "Frames", size, slots, KINECT_SHARED_FRAME_FORMAT);
+  if(!ring->open())
+  {
+    delete ring;
+    return false;
+  }
+  std::cout << "KinectArVideoServer: publishing frames in shared memory " << ring->getName() << " (" << slots << " x " << size / 1024 << " kB)" << std::endl;
+  sharedColor = color;
+  sharedRing = ring;
+  return true;
+}
+
+/** Copy @a f's raw depth and colour into the next slot of the shared
+ * memory ring */
+void KinectArVideoServer::publishShared(KinectFrame *f)
+{
+  unsigned char *p = (unsigned char*)sharedRing->beginWrite();
+  KinectSharedFrame *h = (KinectSharedFrame*)p;
+  memset(h, 0, sizeof(KinectSharedFrame));
+  h->sequence = f->sequence;
+  h->captureUSec = f->captureUSec;
+  size_t offset = sizeof(KinectSharedFrame);
+  const libfreenect2::Frame *depth = f->depthSource;
+  if(depth && depth->width == KINECT_DEPTH_WIDTH && depth->height == KINECT_DEPTH_HEIGHT)
+  {
+    h->depthTimestamp = depth->timestamp;
+    h->depthWidth = depth->width;
+    h->depthHeight = depth->height;
+    h->depthOffset = offset;
+    memcpy(p + offset, depth->data, depth->width * depth->height * sizeof(float));
+    offset += depth->width * depth->height * sizeof(float);
+  }
+  const libfreenect2::Frame *color = f->colorSource;
+  if(sharedColor && color && color->bytes_per_pixel == 4 &&
+     offset + color->width * color->height * 4 <= sharedRing->getSlotSize())
+  {
+    h->colorWidth = color->width;
+    h->colorHeight = color->height;
+    h->colorOffset = offset;
+    memcpy(p + offset, color->data, color->width * color->height * 4);
+    offset += color->width * color->height * 4;
+  }
+  sharedRing->endWrite(offset, f->captureUSec);
+}
+
+bool KinectArVideoServer::getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+  libfreenect2::Freenect2Device::ColorCameraParams *color)
+{
+  cameraParamsMutex.lock();
+  const bool valid = cameraParamsValid;
+  if(valid)
+  {
+    *ir = cameraIr;
+    if(color)
+      *color = cameraColor;
+  }
+  cameraParamsMutex.unlock();
+  return valid;
+}
+
+/** Find the table and objects in @a f, with "up" from the camera's tilt */
+void KinectArVideoServer::segmentTable(KinectFrame *f)
+{
+  const long long t0 = kinectTimeUSec();
+  KinectCameraPose pose;
+  cameraPoseMutex.lock();
+  pose = cameraPose;
+  cameraPoseMutex.unlock();
+  if(cameraPoseFunctor && !cameraPoseFunctor->invokeR(&pose))
+    return;
+
+  // camera y is down and z forward, so up is (0, -cos tilt, sin tilt)
+  const float tilt = ArMath::degToRad(pose.tilt);
+  const float up[3] = { 0, -cosf(tilt), sinf(tilt) };
+  KinectPlane plane;
+  const bool found = tableSegmenter->segment(f->getDepth(), up, pose.z / 1000.0f, &plane, &tableWork);
+  timings[TableTiming].record(kinectTimeUSec() - t0);
+
+  tableMutex.lock();
+  tablePlaneValid = found && tableActive;
+  tablePlane = plane;
+  tableObjects.assign(tableWork.begin(), tableWork.end());
+  tableLatestUSec = f->captureUSec;
+  tableMutex.unlock();
+}
+
+bool KinectArVideoServer::getLatestROI(cv::Rect *depthPixels)
+{
+  roiMutex.lock();
+  const bool valid = roiLatestValid;
+  *depthPixels = roiLatest;
+  roiMutex.unlock();
+  return valid;
+}
+
+/** Project the ROI target into @a f's depth and colour images, and find
+ * the top left corner of the colour crop around it. */
+bool KinectArVideoServer::findROI(KinectFrame *f, int *cropX, int *cropY)
+{
+  float x, y, z;
+  if(!roiTargetFunctor->invokeR(&x, &y, &z) || !(z > 0.1f))
+    return false;
+
+  // pixel (c, r) sees along ((c + 0.5 - cx) / fx, (r + 0.5 - cy) / fy, 1),
+  // as KinectPointCloud
+  const float u = roiIr.fx * x / z + roiIr.cx - 0.5f;
+  const float v = roiIr.fy * y / z + roiIr.cy - 0.5f;
+  const float hu = roiIr.fx * 0.5f * roiSize / z;
+  const float hv = roiIr.fy * 0.5f * roiSize / z;
+  const int c0 = (int)floorf(u - hu), r0 = (int)floorf(v - hv);
+  const int c1 = (int)ceilf(u + hu), r1 = (int)ceilf(v + hv);
+  f->roiDepth = cv::Rect(c0, r0, c1 - c0 + 1, r1 - r0 + 1) & cv::Rect(0, 0, KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT);
+  if(f->roiDepth.area() <= 0)
+    return false;
+
+  // colour pixels of its corners, and of the target, at the target's depth
+  const float mm = z * 1000.0f;
+  const cv::Rect& d = f->roiDepth;
+  float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+  for(int i = 0; i < 4; ++i)
+  {
+    float cx, cy;
+    roiRegistration->apply(i & 1 ? d.x + d.width - 1 : d.x, i & 2 ? d.y + d.height - 1 : d.y, mm, cx, cy);
+    minX = std::min(minX, cx);
+    maxX = std::max(maxX, cx);
+    minY = std::min(minY, cy);
+    maxY = std::max(maxY, cy);
+  }
+  f->roiColor = cv::Rect((int)floorf(minX), (int)floorf(minY),
+    (int)ceilf(maxX) - (int)floorf(minX) + 1, (int)ceilf(maxY) - (int)floorf(minY) + 1) &
+    cv::Rect(0, 0, KINECT_COLOR_WIDTH, KINECT_COLOR_HEIGHT);
+  float cx, cy;
+  roiRegistration->apply(std::max(d.x, std::min((int)(u + 0.5f), d.x + d.width - 1)),
+    std::max(d.y, std::min((int)(v + 0.5f), d.y + d.height - 1)), mm, cx, cy);
+  *cropX = std::max(0, std::min((int)cx - roiCropWidth / 2, KINECT_COLOR_WIDTH - roiCropWidth));
+  *cropY = std::max(0, std::min((int)cy - roiCropHeight / 2, KINECT_COLOR_HEIGHT - roiCropHeight));
+  return true;
+}
+
+void KinectArVideoServer::setCameraPose(const KinectCameraPose& pose)
+{
+  cameraPoseMutex.lock();
+  cameraPose = pose;
+  cameraPoseMutex.unlock();
+}
+
+void KinectArVideoServer::resetTimings()
+{
+  for(int i = 0; i < NumStages; ++i)
+    stageStats[i].reset();
+  for(int i = 0; i < NumTimings; ++i)
+    timings[i].reset();
+}
+
+void KinectArVideoServer::addInfoStrings(ArStringInfoGroup *group)
+{
+  for(int i = 0; i < NumStages; ++i)
+  {
+    ArFunctor2<char*, ArTypes::UByte2> *f = new ArFunctor3C<KinectArVideoServer, char*, ArTypes::UByte2, int>(
+      this, &KinectArVideoServer::stageInfo, NULL, 0, i);
+    infoFunctors.push_back(f);
+    group->addStringString((name + " " + stageNames[i]).c_str(), 40, f);
+  }
+  for(int i = 0; i < NumTimings; ++i)
+  {
+    ArFunctor2<char*, ArTypes::UByte2> *f = new ArFunctor3C<KinectArVideoServer, char*, ArTypes::UByte2, int>(
+      this, &KinectArVideoServer::timingInfo, NULL, 0, i);
+    infoFunctors.push_back(f);
+    group->addStringString((name + " " + timingNames[i]).c_str(), 40, f);
+  }
+  ArFunctor2<char*, ArTypes::UByte2> *f = new ArFunctor2C<KinectArVideoServer, char*, ArTypes::UByte2>(
+    this, &KinectArVideoServer::tileInfo);
+  infoFunctors.push_back(f);
+  group->addStringString((name + " tiles").c_str(), 40, f);
+  f = new ArFunctor2C<KinectArVideoServer, char*, ArTypes::UByte2>(this, &KinectArVideoServer::jpegInfo);
+  infoFunctors.push_back(f);
+  group->addStringString((name + " JPEG").c_str(), 40, f);
+  if(roiTargetFunctor)
+  {
+    f = new ArFunctor2C<KinectArVideoServer, char*, ArTypes::UByte2>(this, &KinectArVideoServer::roiInfo);
+    infoFunctors.push_back(f);
+    group->addStringString((name + " ROI").c_str(), 40, f);
+  }
+  f = new ArFunctor2C<KinectArVideoServer, char*, ArTypes::UByte2>(this, &KinectArVideoServer::recoveryInfo);
+  infoFunctors.push_back(f);
+  group->addStringString((name + " recoveries").c_str(), 40, f);
+  if(markerWanted)
+  {
+    f = new ArFunctor2C<KinectArVideoServer, char*, ArTypes::UByte2>(this, &KinectArVideoServer::markerInfo);
+    infoFunctors.push_back(f);
+    group->addStringString((name + " marker").c_str(), 50, f);
+  }
+  if(tableStride > 0)
+  {
+    f = new ArFunctor2C<KinectArVideoServer, char*, ArTypes::UByte2>(this, &KinectArVideoServer::tableInfo);
+    infoFunctors.push_back(f);
+    group->addStringString((name + " table").c_str(), 50, f);
+  }
+}
+
+/** "fps, dropped, p50/p99/max ms" for a stage. Called by the info string
+ * server; the frame rate is averaged over at least a second between calls. */
+void KinectArVideoServer::stageInfo(char *buf, ArTypes::UByte2 len, int stage)
+{
+  const KinectStageStats& s = stageStats[stage];
+  const unsigned long frames = s.getFrames();
+  if(fpsLastTime[stage].mSecSince() >= 1000)
+  {
+    fps[stage] = frames >= fpsLastFrames[stage] ?
+      (frames - fpsLastFrames[stage]) * 1000.0 / fpsLastTime[stage].mSecSince() : 0;
+    fpsLastFrames[stage] = frames;
+    fpsLastTime[stage].setToNow();
+  }
+  const KinectLatencyHistogram& h = s.getHistogram();
+  snprintf(buf, len, "%.1f fps %lu drop %.1f/%.1f/%.1f ms", fps[stage], s.getDropped(),
+    h.getPercentile(50) / 1000.0, h.getPercentile(99) / 1000.0, h.getMax() / 1000.0);
+}
+
+/** "p50/p99/max ms" for a timing */
+void KinectArVideoServer::timingInfo(char *buf, ArTypes::UByte2 len, int timing)
+{
+  const KinectLatencyHistogram& h = timings[timing];
+  snprintf(buf, len, "%.1f/%.1f/%.1f ms", h.getPercentile(50) / 1000.0,
+    h.getPercentile(99) / 1000.0, h.getMax() / 1000.0);
+}
+
+/** "kB/s, % of whole frames" for the delta coded streams, rate averaged as
+ * in stageInfo(). */
+void KinectArVideoServer::tileInfo(char *buf, ArTypes::UByte2 len)
+{
+  const unsigned long bytes = getTileBytesSent();
+  if(tileRateLastTime.mSecSince() >= 1000)
+  {
+    tileRate = bytes >= tileRateLastBytes ?
+      (bytes - tileRateLastBytes) * 1000.0 / tileRateLastTime.mSecSince() : 0;
+    tileRateLastBytes = bytes;
+    tileRateLastTime.setToNow();
+  }
+  const unsigned long full = getTileFullFrameBytes();
+  snprintf(buf, len, "%.1f kB/s, %.0f%% of whole frames", tileRate / 1024.0,
+    full > 0 ? 100.0 * bytes / full : 100.0);
+}
+
+/** Frames encoded against frames sent: with several viewers, far fewer */
+void KinectArVideoServer::jpegInfo(char *buf, ArTypes::UByte2 len)
+{
+  snprintf(buf, len, "%lu encoded, %lu sent", getJpegEncoded(), getJpegSent());
+}
+
+/** Depth pixels of the last region of interest */
+void KinectArVideoServer::roiInfo(char *buf, ArTypes::UByte2 len)
+{
+  cv::Rect r;
+  if(!roiEnabled)
+    snprintf(buf, len, "off");
+  else if(!getLatestROI(&r))
+    snprintf(buf, len, "no target");
+  else
+    snprintf(buf, len, "%dx%d at %d,%d (%.0f%% of depth)", r.width, r.height, r.x, r.y,
+      100.0 * r.area() / (KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT));
+}
+
+/** Number of stalls recovered from and how long the last took */
+void KinectArVideoServer::recoveryInfo(char *buf, ArTypes::UByte2 len)
+{
+  const unsigned long n = recoveries;
+  if(n == 0)
+    snprintf(buf, len, "none");
+  else
+    snprintf(buf, len, "%lu, last %.0f ms", n, lastRecoveryUSec / 1000.0);
+}
+
+/** Last marker position, its distance from the reference point and how
+ * often it is found */
+void KinectArVideoServer::markerInfo(char *buf, ArTypes::UByte2 len)
+{
+  KinectMarker m;
+  float distance;
+  const bool found = getLatestMarker(&m, &distance);
+  markerMutex.lock();
+  const double seen = markerFrames > 0 ? 100.0 * markerFoundFrames / markerFrames : 0;
+  markerMutex.unlock();
+  if(!markerActive)
+    snprintf(buf, len, "not tracking (seen in %.0f%%)", seen);
+  else if(!found)
+    snprintf(buf, len, "not found (seen in %.0f%%)", seen);
+  else if(!m.depthValid)
+    snprintf(buf, len, "at %.0f,%.0f, no depth (seen in %.0f%%)", m.u, m.v, seen);
+  else if(distance < 0)
+    snprintf(buf, len, "%.3f,%.3f,%.3f m (seen in %.0f%%)", m.x, m.y, m.z, seen);
+  else
+    snprintf(buf, len, "%.3f,%.3f,%.3f m, %.0f mm from arm (seen in %.0f%%)", m.x, m.y, m.z, distance * 1000, seen);
+}
+
+/** Table height, number of objects and the nearest one's distance */
+void KinectArVideoServer::tableInfo(char *buf, ArTypes::UByte2 len)
+{
+  tableMutex.lock();
+  if(!tableActive)
+    snprintf(buf, len, "not looking");
+  else if(!tablePlaneValid)
+    snprintf(buf, len, "not found");
+  else if(tableObjects.empty())
+    snprintf(buf, len, "%.2f m high, no objects", tablePlane.height);
+  else
+  {
+    const KinectObject& o = tableObjects[0];
+    snprintf(buf, len, "%.2f m high, %lu objects, nearest %.2f m away, %.0f cm tall", tablePlane.height,
+      (unsigned long)tableObjects.size(), sqrtf(o.x * o.x + o.y * o.y + o.z * o.z), o.height * 100);
+  }
+  tableMutex.unlock();
+}
+
+unsigned long KinectArVideoServer::getTileBytesSent() const
+{
+  unsigned long n = 0;
+  for(int i = DepthSource; i <= RGBSource; ++i)
+    for(int l = 0; l < pyramidLevels; ++l)
+      n += tileEncoders[i][l]->getBytesSent();
+  return n;
+}
+
+unsigned long KinectArVideoServer::getTileFullFrameBytes() const
+{
+  unsigned long n = 0;
+  for(int i = DepthSource; i <= RGBSource; ++i)
+    for(int l = 0; l < pyramidLevels; ++l)
+      n += tileEncoders[i][l]->getFullFrameBytes();
+  return n;
+}
+
+unsigned long KinectArVideoServer::getJpegEncoded() const
+{
+  unsigned long n = 0;
+  for(int i = DepthSource; i <= RGBSource; ++i)
+    for(int l = 0; l < pyramidLevels; ++l)
+      n += jpegCaches[i][l]->getEncoded();
+  return n;
+}
+
+unsigned long KinectArVideoServer::getJpegSent() const
+{
+  unsigned long n = 0;
+  for(int i = DepthSource; i <= RGBSource; ++i)
+    for(int l = 0; l < pyramidLevels; ++l)
+      n += jpegCaches[i][l]->getSent();
+  return n;
+}
+
+void KinectArVideoServer::addDemandCommand(Source source, const char *command, int level)
+{
+  demandCommands[source][level].push_back(command);
+}
+
+/** Copy RGB frame @a rgb to @a source. The first time, try it without
+ * conversion; if ArVideo refuses that (returns false, or cvtColor() throws)
+ * but takes the frame converted to BGR into @a bgr with CV_BGR2RGB, as the
+ * original demo gave it frames, do that from then on. */
+bool KinectArVideoServer::copyToVideoSource(ArVideoOpenCV *source, const cv::Mat& rgb, cv::Mat *bgr)
+{
+  if(videoCopyMode != VideoCopyFromBGR)
+  {
+    bool ok = false;
+    try
+    {
+      ok = source->updateVideoDataCopy(rgb, 1, NO_COLOR_CONVERSION);
+    }
+    catch(const cv::Exception&)
+    {
+    }
+    if(ok)
+      videoCopyMode = VideoCopyAsIs;
+    if(ok || videoCopyMode == VideoCopyAsIs)
+      return ok;
+  }
+  cv::cvtColor(rgb, *bgr, CV_RGB2BGR);
+  const bool ok = source->updateVideoDataCopy(*bgr, 1, CV_BGR2RGB);
+  if(ok && videoCopyMode == VideoCopyUntried)
+  {
+    std::cout << "KinectArVideoServer: ArVideo does not take frames without colour conversion; converting them to BGR for it" << std::endl;
+    videoCopyMode = VideoCopyFromBGR;
+  }
+  return ok;
+}
+
+bool KinectArVideoServer::isSubscribed(const std::list<std::string>& commands)
+{
+  bool known = false;
+  for(std::list<std::string>::const_iterator i = commands.begin(); i != commands.end(); ++i)
+  {
+    const unsigned int cmd = server->findCommandFromName(i->c_str());
+    if(cmd == 0)
+      continue;
+    known = true;
+    // -2 means no client has requested it (-1 is requestOnce only, >= 0 a
+    // standing request)
+    if(server->getFrequency(cmd) >= -1)
+      return true;
+  }
+  // If the server has none of the commands, we can't tell who is watching
+  // what, so stream while any client is connected.
+  if(!known)
+    return server->getNumClients() > 0;
+  return false;
+}
+
+void KinectArVideoServer::updateDemand()
+{
+  for(int i = 0; i < NumSources; ++i)
+  {
+    bool any = false;
+    const int levels = (i == RawDepthSource || i == RGBROISource) ? 1 : pyramidLevels;
+    for(int l = 0; l < levels; ++l)
+    {
+      const bool wanted = isSubscribed(demandCommands[i][l]) ||
+        (videoRequestsMissing[i][l] && server->getNumClients() > 0);
+      if(wanted != levelWanted[i][l])
+        std::cout << "KinectArVideoServer: " << levelSourceNames[i][l] << (wanted ? " has subscribers" : " has no subscribers") << std::endl;
+      levelWanted[i][l] = wanted;
+      any = any || wanted;
+    }
+    sourceWanted[i] = any;
+  }
+  occupancyGridWanted = occupancyGrid && isSubscribed(occupancyGridCommands);
+  for(int i = DepthSource; i <= RGBSource; ++i)
+    for(int l = 0; l < pyramidLevels; ++l)
+      tileWanted[i][l] = isSubscribed(tileCommands[i][l]);
+}
 
-  freenect_dev = freenect2.openDefaultDevice();
+void KinectArVideoServer::handleDepthRVLRequest(ArServerClient *client, ArNetPacket *)
+{
+  depthRVLMutex.lock();
+  const std::shared_ptr<const DepthRVL> rvl = depthRVLLatest;
+  depthRVLMutex.unlock();
+  if(!rvl)
+    return;
+  ArNetPacket reply;
+  for(size_t offset = 0; offset < rvl->size; offset += KINECT_DEPTH_RVL_CHUNK_SIZE)
+  {
+    const size_t chunk = std::min((size_t)KINECT_DEPTH_RVL_CHUNK_SIZE, rvl->size - offset);
+    reply.empty();
+    reply.uByte4ToBuf(rvl->sequence);
+    reply.uByte4ToBuf(rvl->timestamp);
+    reply.uByte2ToBuf(KINECT_DEPTH_WIDTH);
+    reply.uByte2ToBuf(KINECT_DEPTH_HEIGHT);
+    reply.uByte4ToBuf(rvl->size);
+    reply.uByte4ToBuf(offset);
+    reply.uByte2ToBuf(chunk);
+    reply.dataToBuf((const char*)&rvl->data[offset], chunk);
+    client->sendPacketTcp(&reply);
+  }
+  depthRVLBytesSent += rvl->size;
+}
 
-  if(!freenect_dev)
+void *KinectArVideoServer::runThread(void*)
+{
+  pinThread();
+
+  // TODO might need to move initialization to separate function
+
+  /* Open Kinect, or whatever source we were given instead */
+
+  if(!frameSource)
+  {
+    frameSource = new KinectDeviceSource(&freenect2);
+    ownFrameSource = true;
+  }
+  if(!frameSource->open())
   {
-    std::cout << "KinectArVideoServer: no kinect2 device connected or failure opening the default one!" << std::endl;
+    std::cout << "KinectArVideoServer: could not open frame source " << frameSource->getName() << std::endl;
+    captureRunning = false;
     return 0;
   }
 
-  shutdown = false;
+  sourceFinished = false;
+
+  cameraParamsMutex.lock();
+  cameraParamsValid = frameSource->getCameraParams(&cameraIr, &cameraColor);
+  cameraParamsMutex.unlock();
 
+  // Streams are started by the capture loop once a client subscribes.
 
-  /* Set up libfreenect listeners, start capturing  */
+  if(pointCloudVoxelSize > 0)
+  {
+    libfreenect2::Freenect2Device::IrCameraParams ir;
+    libfreenect2::Freenect2Device::ColorCameraParams color;
+    if(frameSource->getCameraParams(&ir, &color))
+      pointCloud = new KinectPointCloud(ir, color, pointCloudVoxelSize);
+    else
+      std::cout << "KinectArVideoServer: Warning: no camera parameters from " << frameSource->getName() << ", point cloud disabled" << std::endl;
+  }
 
-  //libfreenect2::SyncMultiFrameListener listener(libfreenect2::Frame::Color | libfreenect2::Frame::Ir | libfreenect2::Frame::Depth);
-  libfreenect2::SyncMultiFrameListener listener(libfreenect2::Frame::Color | libfreenect2::Frame::Depth);
-  libfreenect2::FrameMap frames;
+  if(occupancyGrid)
+  {
+    libfreenect2::Freenect2Device::IrCameraParams ir;
+    libfreenect2::Freenect2Device::ColorCameraParams color;
+    if(frameSource->getCameraParams(&ir, &color))
+      occupancyGrid->setCameraParams(ir);
+    else
+      std::cout << "KinectArVideoServer: Warning: no camera parameters from " << frameSource->getName() << ", occupancy grid disabled" << std::endl;
+  }
+
+  if(roiTargetFunctor)
+  {
+    libfreenect2::Freenect2Device::ColorCameraParams color;
+    if(frameSource->getCameraParams(&roiIr, &color))
+    {
+      roiRegistration = new libfreenect2::Registration(roiIr, color);
+      const char *roiName = levelSourceNames[RGBROISource][0].c_str();
+      kinectROISource = new ArVideoOpenCV(roiName);
+      ArVideo::createVideoServer(server, kinectROISource, roiName, "freenect2|RGB|OpenCV");
+    }
+    else
+      std::cout << "KinectArVideoServer: Warning: no camera parameters from " << frameSource->getName() << ", region of interest disabled" << std::endl;
+  }
 
-  freenect_dev->setColorFrameListener(&listener);
-  freenect_dev->setIrAndDepthFrameListener(&listener);
+  if(markerWanted)
+  {
+    libfreenect2::Freenect2Device::IrCameraParams ir;
+    libfreenect2::Freenect2Device::ColorCameraParams color;
+    if(frameSource->getCameraParams(&ir, &color))
+      markerTracker = new KinectMarkerTracker(ir, markerThreshold, markerMinArea, markerMaxArea);
+    else
+      std::cout << "KinectArVideoServer: Warning: no camera parameters from " << frameSource->getName() << ", marker tracking disabled" << std::endl;
+  }
 
-  assert(freenect_dev);
-  if(! freenect_dev->start() )
+  if(tableStride > 0)
   {
-    std::cout << "KinectArVideoServer: Error starting stream from kinect!" << std::endl;
-    return NULL;
+    libfreenect2::Freenect2Device::IrCameraParams ir;
+    libfreenect2::Freenect2Device::ColorCameraParams color;
+    if(frameSource->getCameraParams(&ir, &color))
+      tableSegmenter = new KinectTableSegmenter(ir, tableStride);
+    else
+      std::cout << "KinectArVideoServer: Warning: no camera parameters from " << frameSource->getName() << ", table segmentation disabled" << std::endl;
   }
 
-  std::cout << "kinect device serial: " << freenect_dev->getSerialNumber() << std::endl;
-  std::cout << "kinect device firmware: " << freenect_dev->getFirmwareVersion() << std::endl;
+  for(int l = 0; l < pyramidLevels; ++l)
+  {
+    const char *depthName = levelSourceNames[DepthSource][l].c_str();
+    kinectDepthSources[l] = new ArVideoOpenCV(depthName);
+    ArVideo::createVideoServer(server, kinectDepthSources[l], depthName, "freenect2|Depth|OpenCV");
 
-  // TODO set up registration in libfreenect2
+    const char *rgbName = levelSourceNames[RGBSource][l].c_str();
+    kinectRGBSources[l] = new ArVideoOpenCV(rgbName);
+    ArVideo::createVideoServer(server, kinectRGBSources[l], rgbName, "freenect2|RGB|OpenCV");
 
-  ArVideoOpenCV kinectDepthSource("Kinect_Depth|libfreenect2|OpenCV");
-  ArVideo::createVideoServer(server, &kinectDepthSource, "Kinect_Depth|libfreenect2|OpenCV", "freenect2|Depth|OpenCV");
+    for(int i = DepthSource; i <= RGBSource; ++i)
+    {
+      server->addData(tileCommands[i][l].front().c_str(),
+        ("Changed tiles of " + levelSourceNames[i][l] + ", JPEG compressed, with a keyframe now and then").c_str(),
+        tileEncoders[i][l]->getRequestFunctor(), "none",
+        "uByte4 sequence, uByte2 width, uByte2 height, uByte2 tile x, uByte2 tile y, uByte2 tile width, uByte2 tile height, uByte4 JPEG size, uByte4 offset, uByte2 chunk size, uByte last, chunk data",
+        "Kinect", "RETURN_VIDEO");
+      server->addClientRemovedCallback(tileEncoders[i][l]->getClientRemovedFunctor());
+      server->addData(jpegCommands[i][l].front().c_str(),
+        ("Latest frame of " + levelSourceNames[i][l] + " as JPEG, encoded once for all clients, split into chunks").c_str(),
+        jpegCaches[i][l]->getRequestFunctor(), "optional uByte quality (1-100, default 75)",
+        "uByte4 sequence, uByte2 width, uByte2 height, uByte quality, uByte4 JPEG size (0 if no new frame), uByte4 offset, uByte2 chunk size, uByte last, chunk data",
+        "Kinect", "RETURN_VIDEO");
+      server->addClientRemovedCallback(jpegCaches[i][l]->getClientRemovedFunctor());
+    }
+  }
 
-  ArVideoOpenCV kinectRGBSource("Kinect_RGB|libfreenect2|OpenCV");
-  ArVideo::createVideoServer(server, &kinectRGBSource, "Kinect_RGB|libfreenect2|OpenCV", "freenect2|RGB|OpenCV");
+  server->addData(depthRVLRequestName.c_str(), (name + " depth in mm, full resolution, RVL compressed, split into chunks").c_str(),
+    &depthRVLRequestFunctor, "none",
+    "uByte4 sequence, uByte4 timestamp, uByte2 width, uByte2 height, uByte4 total size, uByte4 offset, uByte2 chunk size, chunk data",
+    "Kinect", "RETURN_VIDEO");
 
 //  ArVideoOpenCV kinectThreshSource("Kinect_Depth|libfreenect2|OpenCV_threshold");
 //  ArVideo::createVideoServer(&server, &kinectThreshSource, "Kinect_Depth|libfreenect2|OpenCV_threshold", "Kinect depth data with basic threshold applied");
 
 
-  /* Main loop, capture images from kinect, display, copy to ArVideo sources */
+  /* Start processing and publishing stages */
+
+  // (ArThread runs these at lower priority than this capture thread)
+  processThread.create(&processFunctor);
+  cloudThread.create(&cloudFunctor);
+  gridThread.create(&gridFunctor);
+  publishThread.create(&publishFunctor);
+  stagesRunning = true;
 
-  bool first = true;
-  cv::Mat rgbm_small(resize_to_width, resize_to_height, CV_8UC3);
-  cv::Mat depthm_small(resize_to_width, resize_to_height, CV_8UC3);
-  cv::Mat rgbm_flip(resize_to_width, resize_to_height, CV_8UC3);
-  cv::Mat depthm_flip(resize_to_width, resize_to_height, CV_8UC3);
+
+  /* Capture loop: take frames from libfreenect2 and pass them on as quickly
+   * as possible, so that its buffers are released right away. */
+
+  ArTime lastWanted;
+  ArTime lastDemandCheck;
+  bool sourceClosed = false;  ///< closed while paused, see below
+  checkVideoRequests();
+  updateDemand();
 
   while(!shutdown)
   {
+    // Only stream while someone is watching. After nobody has been
+    // subscribed for idleTimeout, stop the device until a client returns.
+    if(lastDemandCheck.mSecSince() >= 250)
+    {
+      updateDemand();
+      lastDemandCheck.setToNow();
+    }
+    if(alwaysStream || recording || pointCloud || (markerTracker && markerActive) || (tableSegmenter && tableActive) || !depthCallbacks.empty() || occupancyGridWanted || sourceWanted[RGBSource] || sourceWanted[DepthSource] || sourceWanted[RawDepthSource] ||
+       sourceWanted[RGBROISource])
+    {
+      lastWanted.setToNow();
+      if(!streaming)
+      {
+        std::cout << "KinectArVideoServer: client subscribed, starting Kinect streams." << std::endl;
+        if(sourceClosed && !frameSource->open())
+        {
+          ArUtil::sleep(1000);
+          continue;
+        }
+        sourceClosed = false;
+        if(!frameSource->start())
+        {
+          ArUtil::sleep(1000);
+          continue;
+        }
+        streaming = true;
+        lastFrameUSec = kinectTimeUSec();
+        gotFrameSinceStart = false;
+      }
+    }
+    else if(streaming && lastWanted.mSecSince() >= idleTimeout)
+    {
+      std::cout << "KinectArVideoServer: no subscribers for " << idleTimeout/1000.0 << " sec, pausing Kinect streams." << std::endl;
+      frameSource->stop();
+      // The streams of an open Kinect can't be restarted (libfreenect2
+      // won't restart the IR stream), so close it while paused and open it
+      // again when a client returns, as for a stall.
+      if(!frameSource->canRestart())
+      {
+        frameSource->close();
+        sourceClosed = true;
+      }
+      streaming = false;
+    }
+    if(!streaming)
+    {
+      ArUtil::sleep(250);
+      continue;
+    }
+
 //    std::cout << "." << std::flush;
-    ArTime t;
-    listener.waitForNewFrame(frames); //, 30000);
-    if(t.secSince() >= 28) 
-    {  
-      std::cout << "KinectArVideoServer: Warning: took more than 30 seconds to receive a frame from Kinect!" << std::endl;
-      //shutdown = true;
-      //continue;
-    }
-    
-    
-//    printf("%d\n", t.secSince());
-    libfreenect2::Frame *rgb = frames[libfreenect2::Frame::Color];
-//    libfreenect2::Frame *ir = frames[libfreenect2::Frame::Ir];
-    libfreenect2::Frame *depth = frames[libfreenect2::Frame::Depth];
-
-    // todo don't recreate Mat objects each time
-    cv::Mat rgbm(rgb->height, rgb->width, CV_8UC4, rgb->data);
-    cv::resize (rgbm, rgbm_small, cv::Size(resize_to_width, resize_to_height));
-    cv::flip(rgbm_small, rgbm_flip, 1);
-
-    cv::Mat depthm(depth->height, depth->width, CV_32FC1, depth->data);
-    cv::resize(depthm, depthm_small, cv::Size(resize_to_width, resize_to_height));
-    cv::flip(depthm_small, depthm_flip, 1);
+    // Wait in short slices so that a stalled USB stream is noticed quickly
+    // and the demand checks above keep running. The source copies the
+    // frames into a pool frame's buffers; if every frame is in use
+    // downstream, they are taken anyway and dropped.
+    KinectFrame *f = framePool.acquire();
+    if(f)
+      f->allocateSources();
+    const bool trackingMarker = f && markerTracker && markerActive && frameSource->hasIr();
+    const long long waitStart = kinectTimeUSec();
+    const KinectFrameSource::WaitResult got = frameSource->waitForFrames(f ? f->colorSource : NULL,
+      f ? f->depthSource : NULL, trackingMarker ? f->irSource : NULL, 100);
+    if(got != KinectFrameSource::GotFrames)
+      framePool.release(f);
+    if(got == KinectFrameSource::NoMoreFrames)
+    {
+      std::cout << "KinectArVideoServer: no more frames from " << frameSource->getName() << std::endl;
+      sourceFinished = true;
+      break;
+    }
+    if(got == KinectFrameSource::TimedOut)
+    {
+      const unsigned int timeout = gotFrameSinceStart ? stallTimeout : startTimeout;
+      if(!shutdown && streaming && kinectTimeUSec() - lastFrameUSec >= timeout * 1000LL)
+        reopenSource();
+      continue;
+    }
+    const long long now = kinectTimeUSec();
+    if(stallSinceUSec)
+    {
+      const long long recovery = now - stallSinceUSec;
+      timings[RecoveryTiming].record(recovery);
+      lastRecoveryUSec = recovery;
+      ++recoveries;
+      stallSinceUSec = 0;
+      std::cout << "KinectArVideoServer: " << name << " recovered after " << recovery / 1000 << " ms without frames." << std::endl;
+    }
+    lastFrameUSec = now;
+    gotFrameSinceStart = true;
+    const long long decode = frameSource->getLastDecodeUSec();
+    stageStats[CaptureStage].addFrame(now - waitStart);
+    timings[FrameWaitTiming].record(now - waitStart - decode);
+    if(decode > 0)
+      timings[DecodeTiming].record(decode);
+
+    if(!f)
+    {
+      stageStats[CaptureStage].addDropped();
+      continue;
+    }
+
+    f->irReady = trackingMarker;
+    f->captureUSec = now;
+    f->captureTime.setToNow();
+    f->sequence = ++frameSequence;
+    enqueue(processQueue, ProcessStage, f);
+  }
+
+  // let the end of a recording through before stopping the stages
+  if(sourceFinished)
+  {
+    ArTime drain;
+    while(getQueuedFrames() > 0 && drain.mSecSince() < 1000)
+      ArUtil::sleep(10);
+  }
+
+  close();
+  captureRunning = false;
+
+  // TODO destroy ArVideo servers created
+
+  return 0;
+}
+
+/** Tear down and reopen the frame source after its streams have stalled.
+ * libfreenect2 cannot restart the streams of an open device, so it is closed
+ * and opened again. If that fails, the capture loop tries again after
+ * startTimeout. */
+void KinectArVideoServer::reopenSource()
+{
+  const long long start = kinectTimeUSec();
+  if(!stallSinceUSec)
+  {
+    stallSinceUSec = lastFrameUSec;
+    recoveryAttempts = 0;
+  }
+  ++recoveryAttempts;
+  std::cout << "KinectArVideoServer: Warning: no frames from " << name << " (" << frameSource->getName() << ") for "
+    << (start - stallSinceUSec) / 1000 << " ms, reopening it (attempt " << recoveryAttempts << ")." << std::endl;
+  frameSource->stop();
+  frameSource->close();
+  if(!frameSource->open() || !frameSource->start())
+    std::cout << "KinectArVideoServer: Error: could not reopen " << frameSource->getName() << ", will try again." << std::endl;
+  else
+    std::cout << "KinectArVideoServer: reopened " << frameSource->getName() << " in " << (kinectTimeUSec() - start) / 1000 << " ms." << std::endl;
+  // wait for the first frames as after starting the streams
+  lastFrameUSec = kinectTimeUSec();
+  gotFrameSinceStart = false;
+}
+
+void KinectArVideoServer::processLoop()
+{
+  pinThread();
+  while(!shutdown)
+  {
+    KinectFrame *f = processQueue.waitPop(100);
+    if(!f)
+      continue;
+    const long long start = kinectTimeUSec();
+
+    libfreenect2::Frame *rgb = f->colorSource;
+
+    for(std::list<ArFunctor2<const libfreenect2::Frame*, long long>*>::iterator i = depthCallbacks.begin(); i != depthCallbacks.end(); ++i)
+      (*i)->invoke(f->depthSource, f->captureUSec);
+
+    if(recording)
+      record(f);
+
+    // IR marker, from the raw depth: the filter would lag behind the hand
+    if(markerTracker && f->irReady)
+      trackMarker(f);
+
+    // region of interest, if the target is in view
+    const long long roiStart = kinectTimeUSec();
+    int cropX = 0, cropY = 0;
+    f->roiValid = roiRegistration && roiEnabled && findROI(f, &cropX, &cropY);
+    roiMutex.lock();
+    roiLatestValid = f->roiValid;
+    roiLatest = f->roiDepth;
+    roiMutex.unlock();
+    const long long roiFindUSec = kinectTimeUSec() - roiStart;
 
+    // Filter into the frame's own buffer; the source frame may be read-only
+    // (mapped from a recording). After a gap in the stream the old state
+    // means nothing, so start again.
+    f->depthFiltered = depthFilterEnabled;
+    if(f->depthFiltered)
+    {
+      const long long t0 = kinectTimeUSec();
+      if(f->captureUSec - depthFilterLastUSec > 500000)
+        depthFilter.reset();
+      depthFilterLastUSec = f->captureUSec;
+      const float *in = (const float*)f->depthSource->data;
+      float *out = (float*)f->depthFilteredFrame.data;
+      if(f->roiValid)
+      {
+        // just the region of interest; the rest is passed on as received
+        const cv::Rect& r = f->roiDepth;
+        memcpy(out, in, KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT * sizeof(float));
+        for(int y = r.y; y < r.y + r.height; ++y)
+          depthFilter.applyRange(in, out, y * KINECT_DEPTH_WIDTH + r.x, y * KINECT_DEPTH_WIDTH + r.x + r.width);
+      }
+      else
+        depthFilter.apply(in, out);
+      f->depthFilteredFrame.timestamp = f->depthSource->timestamp;
+      timings[DepthFilterTiming].record(kinectTimeUSec() - t0);
+    }
+    const libfreenect2::Frame *depth = f->getDepth();
+
+    // These only wrap libfreenect2's buffers, no image data is allocated.
+    const cv::Mat rgbm(rgb->height, rgb->width, CV_8UC4, rgb->data);
+    const cv::Mat depthm(depth->height, depth->width, CV_32FC1, depth->data);
+
+    // resize, mirror and convert to RGB, and build the smaller pyramid
+    // levels, in one pass each, but only for sources someone is subscribed
+    // to (at any level). With a region of interest, only it is made at full
+    // detail.
+    const bool lowRes = f->roiValid && roiLowLevel > 0;
+    f->rgbReady = alwaysStream || sourceWanted[RGBSource];
+    if(f->rgbReady)
+    {
+      const long long t0 = kinectTimeUSec();
+      if(lowRes)
+        kinectColorPyramidROI(colorKernel, roiColorKernel, rgbm, f->rgbLevels, roiLowLevel,
+          mirroredRect(f->roiColor, KINECT_COLOR_WIDTH, KINECT_COLOR_HEIGHT, resize_to_width, resize_to_height));
+      else
+        kinectColorPyramid(colorKernel, rgbm, f->rgbLevels);
+      timings[ResizeTiming].record(kinectTimeUSec() - t0);
+    }
+    f->depthReady = alwaysStream || sourceWanted[DepthSource];
+    if(f->depthReady)
+    {
+      const long long t0 = kinectTimeUSec();
+      if(lowRes)
+        kinectDepthPyramidROI(depthKernel, roiDepthKernel, depthm, f->depthLevels, roiLowLevel,
+          mirroredRect(f->roiDepth, KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, resize_to_width, resize_to_height));
+      else
+        kinectDepthPyramid(depthKernel, depthm, f->depthLevels);
+      timings[DepthNormalizeTiming].record(kinectTimeUSec() - t0);
+    }
+    f->rgbROIReady = f->roiValid && (alwaysStream || sourceWanted[RGBROISource]);
+    if(f->rgbROIReady)
+    {
+      const long long t0 = kinectTimeUSec();
+      kinectColorCrop(rgbm, cropX, cropY, f->rgbROI);
+      timings[ROITiming].record(roiFindUSec + kinectTimeUSec() - t0);
+    }
+    else if(f->roiValid)
+      timings[ROITiming].record(roiFindUSec);
+    f->depthRVLReady = alwaysStream || sourceWanted[RawDepthSource];
+    if(f->depthRVLReady)
+    {
+      // the raw depth stream is the sensor's depth as received, not filtered
+      kinectDepthToMM((const float*)f->depthSource->data, f->depthMM.size(), &f->depthMM[0]);
+      f->depthRVLSize = kinectRVLEncode(&f->depthMM[0], f->depthMM.size(), &f->depthRVL[0]);
+      f->depthTimestamp = f->depthSource->timestamp;
+    }
 
 //    cv::Mat depth_thresh(depth->height, depth->width, CV_32FC1, depth->data);
 //    cv::threshold(depthm, depth_thresh, 0.4, 1.0, CV_THRESH_BINARY_INV);
@@ -151,33 +1463,183 @@ void *KinectArVideoServer::runThread(void*)
 //    cv::imshow("rgb", rgbm_small);
 //    cv::imshow("ir", cv::Mat(ir->height, ir->width, CV_32FC1, ir->data) / 20000.0f);
 //    cv::imshow("depth", depthm / 4500.0f);
+//      cv::moveWindow("rgb",   90, 85); 
+//      cv::moveWindow("depth", 90, 599);
 
-    if(!kinectRGBSource.updateVideoDataCopy(rgbm_flip, 1, CV_BGR2RGB))
-      std::cout << "KinectArVideoServer: Warning: error copying rgb data to ArVideo source" << std::endl;
-    if(!kinectDepthSource.updateVideoDataCopy(depthm_flip/4500.0f, 255,
-/*(1/255.0),*/ CV_GRAY2RGB))
-      std::cout << "KinectArVideoServer: Warning: error copying depth data to ArVideo source" << std::endl;
-//    if(!kinectThreshSource.updateVideoDataCopy(depth_thresh, 255, CV_GRAY2RGB))
-//      std::cout << "Warning error copying depth thresholded data to ArVideo source" << std::endl;
-    
+    stageStats[ProcessStage].addFrame(kinectTimeUSec() - start);
+    enqueue(cloudQueue, CloudStage, f);
+  }
+}
 
-    listener.release(frames);
-    //libfreenect2::this_thread::sleep_for(libfreenect2::chrono::milliseconds(100));
+void KinectArVideoServer::cloudLoop()
+{
+  pinThread();
+  while(!shutdown)
+  {
+    KinectFrame *f = cloudQueue.waitPop(100);
+    if(!f)
+      continue;
+    const long long start = kinectTimeUSec();
 
-//    if(first)
-//    {
-//      first = false;
-//      cv::moveWindow("rgb",   90, 85); 
-//      cv::moveWindow("depth", 90, 599);
-//    }
+    f->cloudReady = pointCloud != NULL;
+    if(f->cloudReady)
+    {
+      if(f->roiValid)
+        pointCloud->computeROI(f->colorSource, f->getDepth(), f->roiDepth, &f->cloud);
+      else
+        pointCloud->compute(f->colorSource, f->getDepth(), &f->cloud);
+      timings[PointCloudTiming].record(kinectTimeUSec() - start);
+    }
+
+    if(tableSegmenter && tableActive)
+      segmentTable(f);
 
-    //ArUtil::sleep(1);
+    stageStats[CloudStage].addFrame(kinectTimeUSec() - start);
+    enqueue(gridQueue, GridStage, f);
   }
+}
+
+void KinectArVideoServer::gridLoop()
+{
+  pinThread();
+  while(!shutdown)
+  {
+    KinectFrame *f = gridQueue.waitPop(100);
+    if(!f)
+      continue;
+    const long long start = kinectTimeUSec();
 
+    // Only at the configured rate; clients can't use updates faster than
+    // they fetch them.
+    if(occupancyGrid && (alwaysStream || occupancyGridWanted) &&
+       f->captureUSec - occupancyGridLastUSec >= occupancyGridInterval * 1000LL)
+    {
+      KinectCameraPose pose;
+      cameraPoseMutex.lock();
+      pose = cameraPose;
+      cameraPoseMutex.unlock();
+      if(!cameraPoseFunctor || cameraPoseFunctor->invokeR(&pose))
+      {
+        occupancyGrid->update(f->getDepth(), pose, f->sequence);
+        occupancyGridLastUSec = f->captureUSec;
+        timings[OccupancyGridTiming].record(kinectTimeUSec() - start);
+      }
+    }
 
-  close();
+    stageStats[GridStage].addFrame(kinectTimeUSec() - start);
+    enqueue(publishQueue, PublishStage, f);
+  }
+}
 
-  // TODO destroy ArVideo servers created
+void KinectArVideoServer::publishLoop()
+{
+  pinThread();
+  while(!shutdown)
+  {
+    KinectFrame *f = publishQueue.waitPop(100);
+    if(!f)
+      continue;
+    const long long start = kinectTimeUSec();
 
-  return 0;
+    for(int l = 0; l < pyramidLevels; ++l)
+    {
+      if(f->rgbReady && (alwaysStream || levelWanted[RGBSource][l]) &&
+         !copyToVideoSource(kinectRGBSources[l], f->rgbLevels[l], &videoCopyBGR[l]))
+        std::cout << "KinectArVideoServer: Warning: error copying rgb data to ArVideo source" << std::endl;
+      if(f->depthReady && (alwaysStream || levelWanted[DepthSource][l]) &&
+         !copyToVideoSource(kinectDepthSources[l], f->depthLevels[l], &videoCopyBGR[l]))
+        std::cout << "KinectArVideoServer: Warning: error copying depth data to ArVideo source" << std::endl;
+    }
+    if(f->rgbROIReady && (alwaysStream || levelWanted[RGBROISource][0]) &&
+       !copyToVideoSource(kinectROISource, f->rgbROI, &videoCopyBGR[KINECT_MAX_PYRAMID_LEVELS]))
+      std::cout << "KinectArVideoServer: Warning: error copying region of interest data to ArVideo source" << std::endl;
+    if(f->rgbReady || f->depthReady)
+      timings[VideoCopyTiming].record(kinectTimeUSec() - start);
+    const long long tileStart = kinectTimeUSec();
+    bool tiled = false;
+    for(int l = 0; l < pyramidLevels; ++l)
+    {
+      if(f->rgbReady && (alwaysStream || tileWanted[RGBSource][l]))
+      {
+        tileEncoders[RGBSource][l]->update(f->rgbLevels[l], f->sequence);
+        tiled = true;
+      }
+      if(f->depthReady && (alwaysStream || tileWanted[DepthSource][l]))
+      {
+        tileEncoders[DepthSource][l]->update(f->depthLevels[l], f->sequence);
+        tiled = true;
+      }
+    }
+    if(tiled)
+      timings[TileDeltaTiming].record(kinectTimeUSec() - tileStart);
+    // (the caches know who has asked lately, so alwaysStream needn't encode for nobody)
+    const long long jpegStart = kinectTimeUSec();
+    bool encoded = false;
+    for(int l = 0; l < pyramidLevels; ++l)
+    {
+      if(f->rgbReady && jpegCaches[RGBSource][l]->isWanted())
+      {
+        jpegCaches[RGBSource][l]->update(f->rgbLevels[l], f->sequence);
+        encoded = true;
+      }
+      if(f->depthReady && jpegCaches[DepthSource][l]->isWanted())
+      {
+        jpegCaches[DepthSource][l]->update(f->depthLevels[l], f->sequence);
+        encoded = true;
+      }
+    }
+    if(encoded)
+      timings[JpegTiming].record(kinectTimeUSec() - jpegStart);
+    if(f->depthRVLReady)
+    {
+      std::shared_ptr<DepthRVL> next;
+      depthRVLMutex.lock();
+      if(depthRVLSpare && depthRVLSpare.use_count() == 1)
+        next.swap(depthRVLSpare);
+      depthRVLMutex.unlock();
+      if(!next)
+      {
+        // a slow client still has the spare
+        next = std::make_shared<DepthRVL>();
+        next->data.resize(kinectRVLMaxEncodedSize(KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT));
+      }
+      memcpy(&next->data[0], &f->depthRVL[0], f->depthRVLSize);
+      next->size = f->depthRVLSize;
+      next->sequence = f->sequence;
+      next->timestamp = f->depthTimestamp;
+      depthRVLMutex.lock();
+      depthRVLSpare = depthRVLLatest;
+      depthRVLLatest = next;
+      depthRVLMutex.unlock();
+    }
+    if(sharedRing)
+    {
+      const long long t0 = kinectTimeUSec();
+      publishShared(f);
+      timings[SharedMemoryTiming].record(kinectTimeUSec() - t0);
+    }
+    if(f->cloudReady)
+    {
+      pointCloudMutex.lock();
+      // no allocation once pointCloudLatest has grown to the largest cloud
+      pointCloudLatest.assign(f->cloud.begin(), f->cloud.end());
+      pointCloudLatestSequence = f->sequence;
+      // call back unlocked, so that a callback may add callbacks or get the
+      // latest cloud
+      pointCloudCallbacksCalled.assign(pointCloudCallbacks.begin(), pointCloudCallbacks.end());
+      pointCloudMutex.unlock();
+      for(size_t i = 0; i < pointCloudCallbacksCalled.size(); ++i)
+        pointCloudCallbacksCalled[i]->invoke(&f->cloud);
+    }
+//    if(!kinectThreshSource.updateVideoDataCopy(depth_thresh, 255, CV_GRAY2RGB))
+//      std::cout << "Warning error copying depth thresholded data to ArVideo source" << std::endl;
+
+    framePool.countAllocations(f);
+    if(f->sequence > 1 && framePool.getLastFrameAllocations() > 0)
+      std::cout << "KinectArVideoServer: Warning: " << framePool.getLastFrameAllocations() << " frame buffers were reallocated processing frame " << f->sequence << std::endl;
+    const long long end = kinectTimeUSec();
+    stageStats[PublishStage].addFrame(end - start);
+    timings[FrameToPublishTiming].record(end - f->captureUSec);
+    framePool.release(f);
+  }
 }
@@ -1,23 +1,640 @@
 #ifndef KINECTARVIDEOSERVER_H
 #define KINECTARVIDEOSERVER_H
 
+#include <list>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <memory>
 #include "Aria.h"
 #include "ArNetworking.h"
 #include <libfreenect2/libfreenect2.hpp>
+#include <libfreenect2/registration.h>
+#include "KinectFramePool.h"
+#include "KinectFrameRing.h"
+#include "KinectImageKernels.h"
+#include "KinectPipelineStats.h"
+#include "KinectFrameSource.h"
+#include "KinectCaptureFile.h"
+#include "KinectPointCloud.h"
+#include "KinectDepthFilter.h"
+#include "KinectTileDelta.h"
+#include "KinectJpegCache.h"
+#include "KinectOccupancyGrid.h"
+#include "KinectMarkerTracker.h"
+#include "KinectTableSegmenter.h"
+#include "SharedMemoryRing.h"
 
+class ArVideoOpenCV;
+
+/** Captures colour and depth from a Kinect v2 and serves them as ArVideo
+ *  sources.
+ *
+ *  Work is split into five stages, each on its own thread so that slow
+ *  processing never delays handing buffers back to libfreenect2:
+ *   - capture (runThread()): waits for frames from libfreenect2, which
+ *     are copied into a pool frame (see KinectFrameSource::waitForFrames())
+ *   - process: hands raw depth to the depth callbacks (see
+ *     addDepthCallback()), tracks the IR marker (see KinectMarkerTracker), if enabled
+ *     with enableMarkerTracking(), filters depth over time (see
+ *     KinectDepthFilter), then resizes, mirrors and converts to RGB
+ *   - cloud: registers depth to colour and makes a downsampled point cloud
+ *     (see KinectPointCloud), if enabled with enablePointCloud(), and finds
+ *     the table and the objects on it (see KinectTableSegmenter), if
+ *     enabled with enableTableSegmentation()
+ *   - grid: bins depth into an occupancy grid around the robot (see
+ *     KinectOccupancyGrid), if enabled with enableOccupancyGrid()
+ *   - publish: copies into the ArVideo sources, the delta coded streams,
+ *     the raw depth stream and the shared memory ring (if enabled with
+ *     enableSharedMemory()), and hands the point cloud to its consumers
+ *  Stages are joined by KinectFrameRing queues; when a stage falls behind
+ *  frames are dropped according to the ring DropPolicy.
+ *
+ *  Besides the ArVideo sources, full resolution depth in mm is served
+ *  losslessly, RVL compressed (see KinectDepthCodec.h), as the
+ *  KINECT_DEPTH_RVL_REQUEST ArNetworking data.
+ *
+ *  Each colour and depth ArVideo source is also served delta coded, as the
+ *  KINECT_TILES_REQUEST_PREFIX + source name ArNetworking data: only the
+ *  tiles that changed are sent, with a keyframe now and then (see
+ *  KinectTileDelta.h and KinectTileClient). This uses far less bandwidth
+ *  on a mostly static scene.
+ *
+ *  They are also served as whole JPEG frames, as the
+ *  KINECT_JPEG_REQUEST_PREFIX + source name ArNetworking data: each frame is
+ *  encoded once per quality asked for and the same buffer is sent to every
+ *  client (see KinectJpegCache.h), so more viewers of that data cost no
+ *  more encoding. ArVideo's own requests still go through ArVideo's
+ *  encoder; KinectJpegClient is a client of the cached stream.
+ *
+ *  The colour and depth images can be served at several resolutions: with
+ *  more than one pyramid level, level i is published at 1/2^i of the output
+ *  size as its own ArVideo source (see getSourceName()). All levels are built
+ *  in one pass (kinectColorPyramid(), kinectDepthPyramid()).
+ *
+ *  With enableROI(), a region of interest around a moving point (such as an
+ *  arm's end effector) is processed in full detail and the rest of each
+ *  frame at low resolution; see enableROI().
+ *
+ *  Each source is only processed while an ArNetworking client is subscribed
+ *  to it, and the Kinect streams are stopped after no client has been
+ *  subscribed to either source for the idle timeout. Subscription is checked
+ *  with ArServerBase::getFrequency() on the requests a client uses to fetch
+ *  the source (see addDemandCommand()).
+ *
+ *  Frames come from the default Kinect device unless another device is
+ *  chosen with setDevice() or another KinectFrameSource, such as a
+ *  KinectReplaySource, is given with setFrameSource(). Frames can be
+ *  recorded to a capture file with startRecording().
+ *
+ *  For several Kinects, run one server per device, each with its own
+ *  setDevice(), setName() and setCPUs(); they share nothing but the
+ *  ArServerBase and the libfreenect2 context.
+ */
 class KinectArVideoServer : public virtual ArASyncTask
 {
+public:
+  typedef enum {
+    CaptureStage,
+    ProcessStage,
+    CloudStage,
+    GridStage,
+    PublishStage,
+    NumStages
+  } Stage;
+
+  typedef enum {
+    DepthSource,
+    RGBSource,
+    RawDepthSource,  ///< lossless mm depth, KINECT_DEPTH_RVL_REQUEST
+    RGBROISource,    ///< full resolution colour around the region of interest
+    NumSources
+  } Source;
+
+  /** Steps timed within the stages, see getTiming() */
+  typedef enum {
+    FrameWaitTiming,      ///< waiting for the frame source
+    DecodeTiming,         ///< decoding in the frame source (recordings only)
+    DepthFilterTiming,    ///< temporal depth filter
+    MarkerTiming,         ///< finding the IR marker
+    ROITiming,            ///< finding the region of interest and cropping colour around it
+    ResizeTiming,         ///< colour resize, mirror and RGB conversion
+    DepthNormalizeTiming, ///< depth resize, mirror and scaling to grey
+    PointCloudTiming,     ///< registration, back-projection and voxel downsampling
+    TableTiming,          ///< finding the table plane and the objects on it
+    OccupancyGridTiming,  ///< projecting depth into the occupancy grid
+    VideoCopyTiming,      ///< copying into the ArVideo sources
+    TileDeltaTiming,      ///< finding and encoding changed tiles
+    JpegTiming,           ///< encoding whole frames for the JPEG caches
+    SharedMemoryTiming,   ///< copying into the shared memory ring
+    FrameToPublishTiming, ///< from receiving the frame to having published it
+    RecoveryTiming,       ///< from the last frame before the streams stalled to the first after reopening the device
+    NumTimings
+  } Timing;
+
+  typedef KinectFrameRing<KinectFrame> FrameRing;
+
+private:
   ArServerBase *server;
-  bool shutdown;
-  libfreenect2::Freenect2Device *freenect_dev;
+  std::atomic<bool> shutdown;
+  // close() is called by both the capture thread and the destructor
+  ArMutex closeMutex;
+  bool closed;
+  // close() from any other thread first waits for the capture thread,
+  // which may be using the frame source
+  std::atomic<bool> captureRunning;
+  ArMutex captureJoinMutex;
   libfreenect2::Freenect2 freenect2;
+  KinectFrameSource *frameSource;
+  bool ownFrameSource;
+  bool sourceFinished;
   int resize_to_width;
   int resize_to_height;
+  int pyramidLevels;
+  KinectFramePool framePool;
+  unsigned long frameSequence;
+  KinectColorKernel colorKernel;
+  KinectDepthKernel depthKernel;
+  int roiLowLevel;  ///< level the colour and depth pyramids start from outside the region of interest
+  KinectColorKernel roiColorKernel;  ///< kernels for that level
+  KinectDepthKernel roiDepthKernel;
+  KinectDepthFilter depthFilter;
+  bool depthFilterEnabled;
+  long long depthFilterLastUSec;
+
+  FrameRing processQueue;  ///< capture -> process
+  FrameRing cloudQueue;    ///< process -> cloud
+  FrameRing gridQueue;     ///< cloud -> grid
+  FrameRing publishQueue;  ///< cloud -> publish
+  KinectStageStats stageStats[NumStages];
+  KinectLatencyHistogram timings[NumTimings];
+
+  // per pyramid level
+  std::vector<ArVideoOpenCV*> kinectDepthSources;
+  std::vector<ArVideoOpenCV*> kinectRGBSources;
+  // whether ArVideo takes frames without colour conversion, see
+  // copyToVideoSource(); used by the publish stage
+  enum { VideoCopyUntried, VideoCopyAsIs, VideoCopyFromBGR } videoCopyMode;
+  cv::Mat videoCopyBGR[KINECT_MAX_PYRAMID_LEVELS + 1];
+  bool copyToVideoSource(ArVideoOpenCV *source, const cv::Mat& rgb, cv::Mat *bgr);
+
+  ArFunctorC<KinectArVideoServer> processFunctor;
+  ArFunctorC<KinectArVideoServer> cloudFunctor;
+  ArFunctorC<KinectArVideoServer> gridFunctor;
+  ArFunctorC<KinectArVideoServer> publishFunctor;
+  ArThread processThread;
+  ArThread cloudThread;
+  ArThread gridThread;
+  ArThread publishThread;
+  bool stagesRunning;
+
+  std::string name;  ///< start of the source and request names
+  std::string levelSourceNames[NumSources][KINECT_MAX_PYRAMID_LEVELS];
+  std::list<std::string> demandCommands[NumSources][KINECT_MAX_PYRAMID_LEVELS];
+  std::vector<std::string> videoRequestPrefixes;
+  /// none of the ArVideo requests for the source were registered, see checkVideoRequests()
+  bool videoRequestsMissing[NumSources][KINECT_MAX_PYRAMID_LEVELS];
+  void checkVideoRequests();
+  std::atomic<bool> levelWanted[NumSources][KINECT_MAX_PYRAMID_LEVELS];
+  std::atomic<bool> sourceWanted[NumSources];  ///< any level of the source is wanted
+  // delta coded streams of DepthSource and RGBSource, per level
+  KinectTileEncoder *tileEncoders[RGBSource+1][KINECT_MAX_PYRAMID_LEVELS];
+  std::list<std::string> tileCommands[RGBSource+1][KINECT_MAX_PYRAMID_LEVELS];
+  std::atomic<bool> tileWanted[RGBSource+1][KINECT_MAX_PYRAMID_LEVELS];
+  // whole frame JPEG of DepthSource and RGBSource, per level
+  KinectJpegCache *jpegCaches[RGBSource+1][KINECT_MAX_PYRAMID_LEVELS];
+  std::list<std::string> jpegCommands[RGBSource+1][KINECT_MAX_PYRAMID_LEVELS];
+  std::atomic<bool> streaming;
+  unsigned int idleTimeout;
+  bool alwaysStream;
+
+  // stalled stream recovery, by the capture loop
+  unsigned int stallTimeout;  ///< ms without frames before the source is reopened
+  unsigned int startTimeout;  ///< the same, before the first frame after starting
+  long long lastFrameUSec;    ///< last frame, or start of streaming
+  bool gotFrameSinceStart;
+  long long stallSinceUSec;   ///< last frame before the current stall, 0 if not stalled
+  std::atomic<unsigned long> recoveries;
+  unsigned long recoveryAttempts;
+  std::atomic<long long> lastRecoveryUSec;
+  void reopenSource();
+  bool isSubscribed(const std::list<std::string>& commands);
+
+  // recording, done by the process stage
+  ArMutex recorderMutex;
+  KinectRecorder recorder;
+  std::string recordFilename;  ///< opened by the process stage on the next frame
+  bool recordCompress;
+  std::atomic<bool> recording;
+  void record(KinectFrame *f);
+
+  // point cloud stage, created in runThread() once camera parameters are known
+  KinectPointCloud *pointCloud;
+  float pointCloudVoxelSize;  ///< 0 if disabled
+  ArMutex pointCloudMutex;
+  KinectPoints pointCloudLatest;
+  unsigned long pointCloudLatestSequence;
+  std::list<ArFunctor1<const KinectPoints*>*> pointCloudCallbacks;
+  std::vector<ArFunctor1<const KinectPoints*>*> pointCloudCallbacksCalled;  ///< publish thread's copy
+
+  // occupancy grid stage, updated every occupancyGridInterval ms while a
+  // client wants it
+  KinectOccupancyGrid *occupancyGrid;
+  unsigned int occupancyGridInterval;
+  long long occupancyGridLastUSec;
+  std::list<std::string> occupancyGridCommands;
+  std::atomic<bool> occupancyGridWanted;
+  std::string occupancyGridRequestName;
+  ArMutex cameraPoseMutex;
+  KinectCameraPose cameraPose;
+  ArRetFunctor1<bool, KinectCameraPose*> *cameraPoseFunctor;
+
+  // region of interest around the point given by roiTargetFunctor
+  ArRetFunctor3<bool, float*, float*, float*> *roiTargetFunctor;
+  std::atomic<float> roiSize;
+  std::atomic<bool> roiEnabled;
+  int roiCropWidth, roiCropHeight;
+  libfreenect2::Freenect2Device::IrCameraParams roiIr;
+  libfreenect2::Registration *roiRegistration;  ///< created in runThread() once camera parameters are known
+  ArVideoOpenCV *kinectROISource;
+  ArMutex roiMutex;
+  cv::Rect roiLatest;
+  bool roiLatestValid;
+  bool findROI(KinectFrame *f, int *cropX, int *cropY);
+
+  // IR marker tracking, by the process stage; the tracker is created in
+  // runThread() once camera parameters are known
+  bool markerWanted;
+  std::atomic<bool> markerActive;  ///< see setMarkerTrackingActive()
+  float markerThreshold;
+  int markerMinArea, markerMaxArea;
+  KinectMarkerTracker *markerTracker;
+  ArRetFunctor3<bool, float*, float*, float*> *markerReferenceFunctor;
+  ArMutex markerMutex;
+  KinectMarker markerLatest;
+  bool markerLatestValid;
+  float markerLatestDistance;  ///< from the reference point (m), or -1
+  double markerDistanceSum;
+  unsigned long markerDistanceCount;
+  unsigned long markerFrames, markerFoundFrames;
+  void trackMarker(KinectFrame *f);
+
+  // table plane and objects, by the cloud stage; the segmenter is created
+  // in runThread() once camera parameters are known
+  int tableStride;  ///< 0 if disabled
+  std::atomic<bool> tableActive;  ///< see setTableSegmentationActive()
+  KinectTableSegmenter *tableSegmenter;
+  KinectObjects tableWork;  ///< segmenter output
+  ArMutex tableMutex;
+  KinectPlane tablePlane;
+  bool tablePlaneValid;
+  KinectObjects tableObjects;
+  long long tableLatestUSec;
+  void segmentTable(KinectFrame *f);
+
+  // shared memory ring for local processes, written by the publish stage
+  SharedMemoryRingWriter *sharedRing;
+  bool sharedColor;
+  void publishShared(KinectFrame *f);
+
+  // raw depth consumers, called first thing in the process stage, and the
+  // camera parameters they may want, copied when the source is opened
+  std::list<ArFunctor2<const libfreenect2::Frame*, long long>*> depthCallbacks;
+  ArMutex cameraParamsMutex;
+  bool cameraParamsValid;
+  libfreenect2::Freenect2Device::IrCameraParams cameraIr;
+  libfreenect2::Freenect2Device::ColorCameraParams cameraColor;
+
+  // latest RVL frame, for the KINECT_DEPTH_RVL_REQUEST handler, which takes
+  // a reference to it under the mutex and sends it after unlocking. The
+  // publish stage writes the next frame into the spare, unless a slow send
+  // still has it.
+  struct DepthRVL
+  {
+    std::vector<unsigned char> data;
+    size_t size;
+    unsigned long sequence;
+    unsigned int timestamp;
+  };
+  ArMutex depthRVLMutex;
+  std::shared_ptr<DepthRVL> depthRVLLatest;
+  std::shared_ptr<DepthRVL> depthRVLSpare;
+  std::atomic<unsigned long> depthRVLBytesSent;
+  std::string depthRVLRequestName;
+  ArFunctor2C<KinectArVideoServer, ArServerClient*, ArNetPacket*> depthRVLRequestFunctor;
+  void handleDepthRVLRequest(ArServerClient *client, ArNetPacket *pkt);
+  void updateDemand();
+
+  std::vector<int> cpus;  ///< to run the stage threads on, see setCPUs()
+  void pinThread();
+
   virtual void *runThread(void*);
-  void close();
+  void processLoop();
+  void cloudLoop();
+  void gridLoop();
+  void publishLoop();
+  void enqueue(FrameRing& ring, Stage next, KinectFrame *f);
+
+  // for addInfoStrings()
+  static const char *stageNames[NumStages];
+  static const char *timingNames[NumTimings];
+  unsigned long fpsLastFrames[NumStages];
+  ArTime fpsLastTime[NumStages];
+  double fps[NumStages];
+  std::list<ArFunctor2<char*, ArTypes::UByte2>*> infoFunctors;
+  void stageInfo(char *buf, ArTypes::UByte2 len, int stage);
+  void timingInfo(char *buf, ArTypes::UByte2 len, int timing);
+  unsigned long tileRateLastBytes;
+  ArTime tileRateLastTime;
+  double tileRate;
+  void tileInfo(char *buf, ArTypes::UByte2 len);
+  void jpegInfo(char *buf, ArTypes::UByte2 len);
+  void roiInfo(char *buf, ArTypes::UByte2 len);
+  void recoveryInfo(char *buf, ArTypes::UByte2 len);
+  void markerInfo(char *buf, ArTypes::UByte2 len);
+  void tableInfo(char *buf, ArTypes::UByte2 len);
 public:
-  KinectArVideoServer(ArServerBase *server, int width=320, int height=240);
+  /** @param width, height size of the images served (pyramid level 0)
+   *  @param levels pyramid levels to serve, 1 to KINECT_MAX_PYRAMID_LEVELS
+   *  @param queueLength frames each stage may have waiting before dropping
+   *  @param dropPolicy which frame to drop when a stage falls behind
+   */
+  KinectArVideoServer(ArServerBase *server, int width=320, int height=240, int levels = 1,
+    size_t queueLength = 2, FrameRing::DropPolicy dropPolicy = FrameRing::DropOldest);
   virtual ~KinectArVideoServer();
+
+  /** Also treat a client as subscribed to pyramid level @a level of
+   *  @a source while it has requested the ArNetworking data @a command. By
+   *  default the video requests (see setVideoRequestPrefixes()) and this
+   *  server's own requests for the source are checked. If the server has
+   *  none of a source's commands, the source is streamed while any client
+   *  is connected. */
+  void addDemandCommand(Source source, const char *command, int level = 0);
+  /** Names of the ArVideo requests for a source, less the source name,
+   *  whose clients are watching it; "sendVideo" and "getPicture" by
+   *  default. These are not taken from ArVideo, so once its servers are
+   *  created the server checks which of them it has registered, and
+   *  streams a source none of them were found for while any client is
+   *  connected (with a warning). Call before setName() and
+   *  addDemandCommand(). */
+  void setVideoRequestPrefixes(const std::vector<std::string>& prefixes);
+  /** ArVideo source name of pyramid level @a level of @a source. Level 0 has
+   *  the plain source name, e.g. "Kinect_RGB|libfreenect2|OpenCV", the others
+   *  have their size added, e.g. "Kinect_RGB_160x120|libfreenect2|OpenCV". */
+  const char *getSourceName(Source source, int level = 0) const { return levelSourceNames[source][level].c_str(); }
+  int getPyramidLevels() const { return pyramidLevels; }
+  /** Stop the Kinect streams after nobody has been subscribed for this long (ms) */
+  void setIdleTimeout(unsigned int ms) { idleTimeout = ms; }
+  /** Close and reopen the Kinect if no frames arrive for @a ms while
+   *  streaming, or for @a startMs after starting the streams (the first
+   *  frames take a while). Frames are waited for in slices of 100 ms, so a
+   *  stall is noticed within about @a ms + 100 ms. */
+  void setStallTimeout(unsigned int ms, unsigned int startMs = 3000) { stallTimeout = ms; startTimeout = startMs; }
+  /** Number of times the streams stalled and came back after reopening the
+   *  source. Time to recover is in getTiming(RecoveryTiming). */
+  unsigned long getRecoveries() const { return recoveries; }
+  /** Whether the Kinect is currently streaming (false while paused for lack of subscribers) */
+  bool isStreaming() const { return streaming; }
+  bool isSourceWanted(Source source, int level = 0) const { return levelWanted[source][level]; }
+  /** Process every source and keep streaming whether or not anyone is
+   *  subscribed, e.g. to benchmark the pipeline. */
+  void setAlwaysStream(bool always) { alwaysStream = always; }
+
+  /** Use @a source instead of the default Kinect device. Must be called
+   *  before runAsync(). The server does not take ownership of @a source. */
+  void setFrameSource(KinectFrameSource *source);
+  /** Stop the capture thread and the pipeline stages, waiting for them,
+   *  and close the frame source. Also done by the destructor. A source
+   *  given to setFrameSource() may be deleted once this returns. */
+  void close();
+  /** Start the capture thread, which opens the frame source and starts the
+   *  pipeline stages */
+  virtual int runAsync();
+  /** Use the Kinect with serial number @a serial (see
+   *  KinectDeviceSource::enumerate()) instead of the default device,
+   *  through @a freenect2, which may be shared with other servers. Must be
+   *  called before runAsync(). */
+  void setDevice(libfreenect2::Freenect2 *freenect2, const std::string& serial);
+  /** Start the source, request and info string names with @a name instead
+   *  of "Kinect", e.g. "Kinect2_RGB|libfreenect2|OpenCV", "getKinect2DepthRVL",
+   *  "getKinect2Occupancy", "Kinect2 capture", so that several servers can
+   *  share an ArServerBase. Must be called before runAsync(),
+   *  addDemandCommand(), enableOccupancyGrid() and addInfoStrings(). */
+  void setName(const char *name);
+  const std::string& getName() const { return name; }
+  /** Run the stage threads only on these CPUs (Linux only), e.g. to keep
+   *  the pipelines of several Kinects from competing for the same cores.
+   *  cv::parallel_for_ workers are shared by every pipeline and are not
+   *  pinned. Must be called before runAsync(). */
+  void setCPUs(const std::vector<int>& cpus);
+  /** Whether the frame source has run out of frames (end of a recording) */
+  bool isSourceFinished() const { return sourceFinished; }
+
+  /** Record every captured frame to @a filename (see KinectCaptureFile.h)
+   *  until stopRecording(). Frames are captured while recording even if
+   *  nobody is subscribed.
+   *  @param compress store colour as JPEG and depth as RVL instead of raw
+   */
+  bool startRecording(const char *filename, bool compress = true);
+  void stopRecording();
+  bool isRecording() const { return recording; }
+
+  /** Size in bytes of the last compressed raw depth frame */
+  size_t getDepthRVLFrameSize() { depthRVLMutex.lock(); size_t n = depthRVLLatest ? depthRVLLatest->size : 0; depthRVLMutex.unlock(); return n; }
+  /** Total compressed raw depth bytes sent to clients */
+  unsigned long getDepthRVLBytesSent() const { return depthRVLBytesSent; }
+
+  /** Delta coder of pyramid level @a level of @a source (DepthSource or
+   *  RGBSource), e.g. to change its threshold or keyframe interval */
+  KinectTileEncoder *getTileEncoder(Source source, int level = 0) { return tileEncoders[source][level]; }
+  /** Total bytes of delta coded video sent to clients */
+  unsigned long getTileBytesSent() const;
+  /** What the same updates would have cost sent as whole JPEG frames */
+  unsigned long getTileFullFrameBytes() const;
+
+  /** Whole frame JPEG cache of pyramid level @a level of @a source
+   *  (DepthSource or RGBSource) */
+  KinectJpegCache *getJpegCache(Source source, int level = 0) { return jpegCaches[source][level]; }
+  /** Frames JPEG encoded for, and sent from, all the JPEG caches */
+  unsigned long getJpegEncoded() const;
+  unsigned long getJpegSent() const;
+
+  /** Heap allocations made processing the last frame (should be 0 once running) */
+  int getLastFrameAllocations() { return framePool.getLastFrameAllocations(); }
+  /** Total heap allocations made by the frame processing since startup */
+  unsigned long getTotalFrameAllocations() { return framePool.getTotalAllocations(); }
+
+  /** Frame count, drop count and time spent per frame for one stage.
+   *  Capture time is the time spent waiting for libfreenect2, for the other
+   *  stages it is the time to do their own work. Drops are frames discarded
+   *  from a stage's input queue (or, for capture, frames received while every
+   *  pool frame was in use).
+   */
+  const KinectStageStats& getStageStats(Stage s) const { return stageStats[s]; }
+  /** Filter depth over time before anything else uses it (on by default).
+   *  Recordings and the RawDepthSource RVL stream are made from the
+   *  unfiltered depth. */
+  void setDepthFilterEnabled(bool enabled) { depthFilterEnabled = enabled; }
+  bool isDepthFilterEnabled() const { return depthFilterEnabled; }
+  /** For changing the filter parameters */
+  KinectDepthFilter& getDepthFilter() { return depthFilter; }
+
+  /** Compute a point cloud from every frame, downsampled to voxels of
+   *  @a voxelSize metres. Must be called before runAsync(). While enabled,
+   *  the Kinect streams whether or not any client is subscribed. */
+  void enablePointCloud(float voxelSize = 0.02f);
+  /** Change the voxel size while running */
+  void setPointCloudVoxelSize(float voxelSize);
+  /** Call @a functor from the publish thread with each new point cloud.
+   *  The points are only valid during the call, copy what you need. */
+  void addPointCloudCallback(ArFunctor1<const KinectPoints*> *functor);
+  /** Copy the most recent point cloud to @a points.
+   *  @return false if there is none yet */
+  bool getLatestPointCloud(KinectPoints *points, unsigned long *sequence = NULL);
+
+  /** Keep an occupancy grid of @a cellSize mm cells, covering @a range mm
+   *  around the robot, updated from depth every @a intervalMs ms while
+   *  anyone is watching it. It is served as the KINECT_OCCUPANCY_REQUEST
+   *  ArNetworking data and as a drawing named @a drawingName on
+   *  @a drawings, refreshed at the same interval. Must be called before
+   *  runAsync(). The camera pose comes from setCameraPoseFunctor(), or else
+   *  setCameraPose().
+   */
+  void enableOccupancyGrid(ArServerInfoDrawings *drawings, int cellSize = 50, int range = 2000,
+    unsigned int intervalMs = 200, const char *drawingName = "kinectOccupancy");
+  void setOccupancyGridInterval(unsigned int ms) { occupancyGridInterval = ms; }
+  KinectOccupancyGrid *getOccupancyGrid() { return occupancyGrid; }
+  /** Fixed camera pose in the robot frame */
+  void setCameraPose(const KinectCameraPose& pose);
+  /** Called by the grid stage for the camera pose at each update (e.g.
+   *  from the PTU's pan and tilt); frames are skipped while it returns
+   *  false. */
+  void setCameraPoseFunctor(ArRetFunctor1<bool, KinectCameraPose*> *functor) { cameraPoseFunctor = functor; }
+
+  /** Process the region around a moving point, such as an arm's end
+   *  effector, in full detail and the rest of each frame at low resolution.
+   *  The process stage calls @a target with each frame for the point, in
+   *  metres in the depth camera frame (as KinectPoint). While it returns
+   *  true and the point is in front of the camera:
+   *   - only the depth pixels within @a size / 2 metres of the point across
+   *     the image are filtered (the rest are passed on as received) and
+   *     made into the point cloud
+   *   - the colour and depth sources are made at getROILowResLevel()'s
+   *     resolution and scaled up, except around the point
+   *   - full resolution colour around the point, @a cropWidth x
+   *     @a cropHeight, is served as the RGBROISource ArVideo source
+   *  Must be called before runAsync(). The occupancy grid still uses the
+   *  whole depth frame.
+   */
+  void enableROI(ArRetFunctor3<bool, float*, float*, float*> *target, float size = 0.4f,
+    int cropWidth = 480, int cropHeight = 360);
+  /** Turn region of interest processing off and on again while running */
+  void setROIEnabled(bool enabled) { roiEnabled = enabled; }
+  bool isROIEnabled() const { return roiEnabled; }
+  /** Width of the region of interest around the point (m) */
+  void setROISize(float metres) { roiSize = metres; }
+  float getROISize() const { return roiSize; }
+  /** Pyramid level the rest of the frame is processed at: 2 (1/4 of the
+   *  output size), or the smallest level if there are fewer. At level 0
+   *  the colour and depth sources are processed in full anyway. */
+  int getROILowResLevel() const { return roiLowLevel; }
+  /** Depth pixels (not mirrored) of the last frame's region of interest.
+   *  @return false if it had none */
+  bool getLatestROI(cv::Rect *depthPixels);
+
+  /** Find a retroreflective marker, such as one on the gripper, in the IR
+   *  image of every frame (see KinectMarkerTracker), in the process stage.
+   *  Needs a Kinect device: recordings have no IR. Must be called before
+   *  runAsync(). While tracking is active (see setMarkerTrackingActive()),
+   *  the Kinect streams whether or not any client is subscribed.
+   *  @param threshold, minArea, maxArea see KinectMarkerTracker
+   */
+  void enableMarkerTracking(float threshold = 30000, int minArea = 3, int maxArea = 1500);
+  /** Track the marker only while @a active (it is from
+   *  enableMarkerTracking()), e.g. only while the arm is moving for a demo,
+   *  so that the Kinect can still pause when nothing else wants it. There
+   *  is no latest marker while inactive. */
+  void setMarkerTrackingActive(bool active);
+  /** Compare each marker position with the point given by @a reference,
+   *  in metres in the depth camera frame (as KinectPoint), e.g. the arm's
+   *  end effector from the latest ArmStateSampler sample (as for
+   *  enableROI()).
+   *  The distance is shown in the "Kinect marker" info string. */
+  void setMarkerReferenceFunctor(ArRetFunctor3<bool, float*, float*, float*> *reference) { markerReferenceFunctor = reference; }
+  /** Marker found in the last frame, and its distance from the reference
+   *  point (m, -1 if either position is unknown).
+   *  @return false if there was none */
+  bool getLatestMarker(KinectMarker *marker, float *referenceDistance = NULL);
+  /** Mean distance between the marker and the reference point over every
+   *  frame with both (m), or -1 if there have been none */
+  double getMeanMarkerDistance();
+  /** For changing the tracker's parameters while running; NULL until the
+   *  camera parameters are known */
+  KinectMarkerTracker *getMarkerTracker() { return markerTracker; }
+
+  /** Find the table and the objects standing on it in every frame (see
+   *  KinectTableSegmenter), from every @a stride'th depth pixel, in the
+   *  cloud stage. The camera's tilt and height come from the camera pose
+   *  (setCameraPoseFunctor() or setCameraPose()). Must be called before
+   *  runAsync(). While segmentation is active (see
+   *  setTableSegmentationActive()), the Kinect streams whether or not any
+   *  client is subscribed. */
+  void enableTableSegmentation(int stride = 4);
+  /** Look for the table only while @a active (it is from
+   *  enableTableSegmentation()), e.g. only while the arm demo wants
+   *  something to pick up. There is no table or grasp target while
+   *  inactive, and for the first frame or two after: allow for the Kinect
+   *  to restart if it had paused. */
+  void setTableSegmentationActive(bool active);
+  /** Table plane and objects from the last frame.
+   *  @return false if no table was found */
+  bool getLatestTable(KinectPlane *plane, KinectObjects *objects);
+  /** Top centre of the nearest object on the table, in metres in the depth
+   *  camera frame (as KinectPoint), if one was seen in the last second:
+   *  somewhere to grasp, e.g. for ArmDemoTask::setGraspTargetFunctor(). */
+  bool getGraspTarget(float *x, float *y, float *z);
+  /** For changing the segmenter's parameters while running; NULL until
+   *  the camera parameters are known */
+  KinectTableSegmenter *getTableSegmenter() { return tableSegmenter; }
+
+  /** Call @a functor with the raw depth of every frame (float mm,
+   *  512x424, not mirrored) and its capture time (kinectTimeUSec()), first
+   *  thing in the process stage, before recording or filtering: for
+   *  anything that must react quickly, such as ArmSafetyMonitor. It delays
+   *  every frame, so must be quick. Must be called before runAsync(). While
+   *  there are any, the Kinect streams whether or not any client is
+   *  subscribed. */
+  void addDepthCallback(ArFunctor2<const libfreenect2::Frame*, long long> *functor) { depthCallbacks.push_back(functor); }
+  /** Publish every frame's raw depth and, if @a color, raw colour into a
+   *  POSIX shared memory ring named "/" + getName() + "Frames" (e.g.
+   *  /dev/shm/KinectFrames), for other processes on this computer to read
+   *  in place (see SharedMemoryRing.h and KinectSharedFrame). Costs one copy
+   *  per frame in the publish stage however many processes read it: 0.9 MB
+   *  of depth, plus 8 MB with colour. Must be called after setName() and
+   *  before runAsync(). Frames are only published while the Kinect streams
+   *  for something else (a subscriber, or setAlwaysStream()); readers are
+   *  not counted as demand.
+   *  @return false if the shared memory could not be created */
+  bool enableSharedMemory(bool color = false, int slots = 4);
+  /** Name of the shared memory ring, or "" if not enabled */
+  std::string getSharedMemoryName() const { return sharedRing ? sharedRing->getName() : std::string(); }
+
+  /** Intrinsics of the source's cameras.
+   *  @return false until the source has been opened */
+  bool getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+    libfreenect2::Freenect2Device::ColorCameraParams *color = NULL);
+
+  /** Distribution of the time taken by one step of the pipeline (us) */
+  const KinectLatencyHistogram& getTiming(Timing t) const { return timings[t]; }
+  /** Clear the stage histograms and timings, e.g. after warming up */
+  void resetTimings();
+
+  /** Add strings showing frame rate, drops and latency percentiles of each
+   *  stage to @a group (e.g. Aria::getInfoGroup(), shown by MobileEyes). */
+  void addInfoStrings(ArStringInfoGroup *group);
+
+  /** Frames queued for processing or publishing right now */
+  size_t getQueuedFrames() const { return processQueue.size() + cloudQueue.size() + gridQueue.size() + publishQueue.size(); }
 };
 
 #endif
@@ -0,0 +1,371 @@
+
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "KinectCaptureFile.h"
+#include "KinectDepthCodec.h"
+#include "KinectPipelineStats.h"
+
+static size_t align8(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+
+/* Recorder */
+
+KinectRecorder::KinectRecorder() :
+  myFile(NULL), myOffset(0), myJpegQuality(90), myJpeg(NULL), myJpegBuf(NULL), myJpegBufSize(0)
+{
+  memset(&myHeader, 0, sizeof(myHeader));
+}
+
+KinectRecorder::~KinectRecorder()
+{
+  close();
+}
+
+bool KinectRecorder::open(const char *filename,
+  const libfreenect2::Freenect2Device::IrCameraParams& irParams,
+  const libfreenect2::Freenect2Device::ColorCameraParams& colorParams,
+  bool compress, int jpegQuality)
+{
+  close();
+  myFile = fopen(filename, "wb");
+  if(!myFile)
+  {
+    std::cout << "KinectRecorder: Error: could not open " << filename << " for writing" << std::endl;
+    return false;
+  }
+  myFilename = filename;
+  myJpegQuality = jpegQuality;
+  memset(&myHeader, 0, sizeof(myHeader));
+  memcpy(myHeader.magic, KINECT_CAPTURE_MAGIC, sizeof(myHeader.magic));
+  if(compress)
+    myHeader.flags = KINECT_CAPTURE_COLOR_JPEG | KINECT_CAPTURE_DEPTH_RVL;
+  myHeader.irParamsSize = sizeof(irParams);
+  myHeader.colorParamsSize = sizeof(colorParams);
+  myOffset = 0;
+  myIndex.clear();
+  // about 15 minutes at 30 fps before the index needs to grow
+  myIndex.reserve(30 * 60 * 15);
+
+  // frame sizes are filled in from the first frame; header is rewritten on close()
+  if(!writeBytes(&myHeader, sizeof(myHeader)) ||
+     !writeBytes(&irParams, sizeof(irParams)) ||
+     !writeBytes(&colorParams, sizeof(colorParams)))
+    return false;
+  static const char zeros[8] = {0};
+  return writeBytes(zeros, align8(myOffset) - myOffset);
+}
+
+bool KinectRecorder::writeBytes(const void *data, size_t size)
+{
+  if(size > 0 && fwrite(data, 1, size, myFile) != size)
+  {
+    std::cout << "KinectRecorder: Error writing to " << myFilename << ", closing it" << std::endl;
+    close();
+    return false;
+  }
+  myOffset += size;
+  return true;
+}
+
+bool KinectRecorder::write(const libfreenect2::Frame *color, const libfreenect2::Frame *depth, long long timeUSec)
+{
+  if(!myFile)
+    return false;
+
+  if(myIndex.empty())
+  {
+    myHeader.colorWidth = color->width;
+    myHeader.colorHeight = color->height;
+    myHeader.depthWidth = depth->width;
+    myHeader.depthHeight = depth->height;
+    if(myHeader.flags & KINECT_CAPTURE_COLOR_JPEG)
+    {
+      myJpeg = tjInitCompress();
+      myJpegBufSize = tjBufSize(color->width, color->height, TJSAMP_420);
+      myJpegBuf = tjAlloc(myJpegBufSize);
+    }
+    if(myHeader.flags & KINECT_CAPTURE_DEPTH_RVL)
+    {
+      myDepthMM.resize(depth->width * depth->height);
+      myDepthRVL.resize(kinectRVLMaxEncodedSize(myDepthMM.size()));
+    }
+  }
+  if(color->width != myHeader.colorWidth || color->height != myHeader.colorHeight ||
+     depth->width != myHeader.depthWidth || depth->height != myHeader.depthHeight)
+    return false;
+
+  KinectCaptureRecord rec;
+  rec.timeUSec = timeUSec;
+  rec.colorTimestamp = color->timestamp;
+  rec.depthTimestamp = depth->timestamp;
+
+  const unsigned char *colorData = color->data;
+  rec.colorSize = color->width * color->height * 4;
+  if(myHeader.flags & KINECT_CAPTURE_COLOR_JPEG)
+  {
+    unsigned long jpegSize = myJpegBufSize;
+    if(tjCompress2(myJpeg, color->data, color->width, 0, color->height, TJPF_BGRX,
+        &myJpegBuf, &jpegSize, TJSAMP_420, myJpegQuality, TJFLAG_FASTDCT | TJFLAG_NOREALLOC) != 0)
+    {
+      std::cout << "KinectRecorder: Error compressing colour frame: " << tjGetErrorStr() << std::endl;
+      return false;
+    }
+    colorData = myJpegBuf;
+    rec.colorSize = jpegSize;
+  }
+
+  const unsigned char *depthData = depth->data;
+  rec.depthSize = depth->width * depth->height * 4;
+  if(myHeader.flags & KINECT_CAPTURE_DEPTH_RVL)
+  {
+    kinectDepthToMM((const float*)depth->data, myDepthMM.size(), &myDepthMM[0]);
+    rec.depthSize = kinectRVLEncode(&myDepthMM[0], myDepthMM.size(), &myDepthRVL[0]);
+    depthData = &myDepthRVL[0];
+  }
+
+  const uint64_t recordOffset = myOffset;
+  static const char zeros[8] = {0};
+  if(!writeBytes(&rec, sizeof(rec)) ||
+     !writeBytes(colorData, rec.colorSize) ||
+     !writeBytes(depthData, rec.depthSize) ||
+     !writeBytes(zeros, align8(myOffset) - myOffset))
+    return false;
+  myIndex.push_back(recordOffset);
+  return true;
+}
+
+void KinectRecorder::close()
+{
+  if(myFile)
+  {
+    myHeader.frameCount = myIndex.size();
+    myHeader.indexOffset = myOffset;
+    if(!myIndex.empty())
+      fwrite(&myIndex[0], sizeof(uint64_t), myIndex.size(), myFile);
+    fseek(myFile, 0, SEEK_SET);
+    fwrite(&myHeader, sizeof(myHeader), 1, myFile);
+    fclose(myFile);
+    myFile = NULL;
+    std::cout << "KinectRecorder: wrote " << myHeader.frameCount << " frames to " << myFilename << std::endl;
+  }
+  if(myJpeg)
+    tjDestroy(myJpeg);
+  myJpeg = NULL;
+  if(myJpegBuf)
+    tjFree(myJpegBuf);
+  myJpegBuf = NULL;
+}
+
+
+/* Replay */
+
+KinectReplaySource::KinectReplaySource(const char *filename, bool realTime, bool loop) :
+  myFilename(filename), myRealTime(realTime), myLoop(loop),
+  myFd(-1), myData(NULL), mySize(0), myHeader(NULL), myNext(0),
+  myStartUSec(0), myFirstUSec(0), myJpeg(NULL), myDecodeUSec(0)
+{
+}
+
+KinectReplaySource::~KinectReplaySource()
+{
+  close();
+}
+
+bool KinectReplaySource::open()
+{
+  close();
+  myFd = ::open(myFilename.c_str(), O_RDONLY);
+  struct stat st;
+  if(myFd < 0 || fstat(myFd, &st) != 0)
+  {
+    std::cout << "KinectReplaySource: Error: could not open " << myFilename << std::endl;
+    close();
+    return false;
+  }
+  mySize = st.st_size;
+  if(mySize < sizeof(KinectCaptureHeader))
+  {
+    std::cout << "KinectReplaySource: Error: " << myFilename << " is too short" << std::endl;
+    close();
+    return false;
+  }
+  void *p = mmap(NULL, mySize, PROT_READ, MAP_PRIVATE, myFd, 0);
+  if(p == MAP_FAILED)
+  {
+    std::cout << "KinectReplaySource: Error: could not map " << myFilename << std::endl;
+    close();
+    return false;
+  }
+  myData = (const unsigned char*)p;
+  // frames are read front to back
+  madvise(p, mySize, MADV_SEQUENTIAL);
+  myHeader = (const KinectCaptureHeader*)myData;
+  if(memcmp(myHeader->magic, KINECT_CAPTURE_MAGIC, sizeof(myHeader->magic)) != 0 ||
+     myHeader->irParamsSize != sizeof(libfreenect2::Freenect2Device::IrCameraParams) ||
+     myHeader->colorParamsSize != sizeof(libfreenect2::Freenect2Device::ColorCameraParams))
+  {
+    std::cout << "KinectReplaySource: Error: " << myFilename << " is not a Kinect capture file from this version" << std::endl;
+    close();
+    return false;
+  }
+  if(!buildIndex())
+  {
+    close();
+    return false;
+  }
+  if(myHeader->flags & KINECT_CAPTURE_COLOR_JPEG)
+    myJpeg = tjInitDecompress();
+  if(myHeader->flags & KINECT_CAPTURE_DEPTH_RVL)
+    myDepthMM.resize(myHeader->depthWidth * myHeader->depthHeight);
+  std::cout << "KinectReplaySource: " << myFilename << ": " << myIndex.size() << " frames" << std::endl;
+  return true;
+}
+
+bool KinectReplaySource::buildIndex()
+{
+  myIndex.clear();
+  const uint64_t n = myHeader->frameCount;
+  if(myHeader->indexOffset != 0 && myHeader->indexOffset + n * sizeof(uint64_t) <= mySize)
+  {
+    const uint64_t *index = (const uint64_t*)(myData + myHeader->indexOffset);
+    myIndex.assign(index, index + n);
+    return true;
+  }
+
+  // Recording was not closed properly: walk the records.
+  std::cout << "KinectReplaySource: " << myFilename << " has no index, rebuilding it" << std::endl;
+  size_t offset = align8(sizeof(KinectCaptureHeader) + myHeader->irParamsSize + myHeader->colorParamsSize);
+  while(offset + sizeof(KinectCaptureRecord) <= mySize)
+  {
+    const KinectCaptureRecord *rec = (const KinectCaptureRecord*)(myData + offset);
+    const size_t next = align8(offset + sizeof(KinectCaptureRecord) + rec->colorSize + rec->depthSize);
+    if(next > mySize || (rec->colorSize == 0 && rec->depthSize == 0))
+      break;
+    myIndex.push_back(offset);
+    offset = next;
+  }
+  return !myIndex.empty();
+}
+
+void KinectReplaySource::close()
+{
+  if(myData)
+    munmap((void*)myData, mySize);
+  myData = NULL;
+  myHeader = NULL;
+  if(myFd >= 0)
+    ::close(myFd);
+  myFd = -1;
+  if(myJpeg)
+    tjDestroy(myJpeg);
+  myJpeg = NULL;
+}
+
+bool KinectReplaySource::start()
+{
+  myStartUSec = 0;  // pace from the next frame served
+  return myData != NULL;
+}
+
+bool KinectReplaySource::seek(unsigned long n)
+{
+  if(!myData || n >= myIndex.size())
+    return false;
+  myNext = n;
+  myStartUSec = 0;  // restart timing from this frame
+  return true;
+}
+
+bool KinectReplaySource::getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+  libfreenect2::Freenect2Device::ColorCameraParams *color)
+{
+  if(!myData)
+    return false;
+  memcpy(ir, myData + sizeof(KinectCaptureHeader), sizeof(*ir));
+  memcpy(color, myData + sizeof(KinectCaptureHeader) + myHeader->irParamsSize, sizeof(*color));
+  return true;
+}
+
+KinectFrameSource::WaitResult KinectReplaySource::waitForFrames(libfreenect2::Frame *color, libfreenect2::Frame *depth,
+  libfreenect2::Frame *, unsigned int)
+{
+  if(!myData)
+    return NoMoreFrames;
+  if(myNext >= myIndex.size())
+  {
+    if(!myLoop || !seek(0))
+      return NoMoreFrames;
+  }
+
+  const KinectCaptureRecord *rec = (const KinectCaptureRecord*)(myData + myIndex[myNext]);
+  const unsigned char *colorData = (const unsigned char*)(rec + 1);
+  const unsigned char *depthData = colorData + rec->colorSize;
+  if(depthData + rec->depthSize > myData + mySize)
+  {
+    std::cout << "KinectReplaySource: Error: frame " << myNext << " is truncated" << std::endl;
+    return NoMoreFrames;
+  }
+
+  if(myRealTime)
+  {
+    const long long now = kinectTimeUSec();
+    if(myStartUSec == 0)
+    {
+      myStartUSec = now;
+      myFirstUSec = rec->timeUSec;
+    }
+    const long long due = myStartUSec + (long long)(rec->timeUSec - myFirstUSec);
+    if(due > now)
+      usleep(due - now);
+  }
+  ++myNext;
+
+  const size_t cw = myHeader->colorWidth, ch = myHeader->colorHeight;
+  const size_t dw = myHeader->depthWidth, dh = myHeader->depthHeight;
+  if((color && (color->width != cw || color->height != ch || color->bytes_per_pixel != 4)) ||
+     (depth && (depth->width != dw || depth->height != dh || depth->bytes_per_pixel != 4)))
+  {
+    std::cout << "KinectReplaySource: Error: " << myFilename << " has " << cw << "x" << ch << " colour and " << dw << "x" << dh
+      << " depth, not the Kinect's resolutions" << std::endl;
+    return NoMoreFrames;
+  }
+
+  const long long decodeStart = kinectTimeUSec();
+  if(color)
+  {
+    if(myHeader->flags & KINECT_CAPTURE_COLOR_JPEG)
+    {
+      if(tjDecompress2(myJpeg, colorData, rec->colorSize, color->data, cw, 0, ch, TJPF_BGRX, TJFLAG_FASTDCT) != 0)
+        std::cout << "KinectReplaySource: Warning: error decompressing colour frame: " << tjGetErrorStr() << std::endl;
+    }
+    else
+      memcpy(color->data, colorData, cw * ch * 4);
+    color->timestamp = rec->colorTimestamp;
+  }
+
+  if(depth)
+  {
+    if(myHeader->flags & KINECT_CAPTURE_DEPTH_RVL)
+    {
+      if(!kinectRVLDecode(depthData, rec->depthSize, &myDepthMM[0], myDepthMM.size()))
+        std::cout << "KinectReplaySource: Warning: error decoding depth frame" << std::endl;
+      float *out = (float*)depth->data;
+      for(size_t i = 0; i < myDepthMM.size(); ++i)
+        out[i] = myDepthMM[i];
+    }
+    else
+      memcpy(depth->data, depthData, dw * dh * 4);
+    depth->timestamp = rec->depthTimestamp;
+  }
+
+  myDecodeUSec = kinectTimeUSec() - decodeStart;
+  return GotFrames;
+}
@@ -0,0 +1,144 @@
+#ifndef KINECTCAPTUREFILE_H
+#define KINECTCAPTUREFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <turbojpeg.h>
+#include "KinectFrameSource.h"
+
+/** Kinect capture file layout (native byte order):
+ *
+ *   KinectCaptureHeader
+ *   IrCameraParams, ColorCameraParams (as raw structs, sizes in the header)
+ *   frame records, each starting on an 8-byte boundary:
+ *     KinectCaptureRecord, colour data, depth data
+ *   index: uint64_t file offset of each frame record
+ *
+ *  Colour is raw BGRX or JPEG, depth is raw float mm or RVL coded 16-bit mm
+ *  (see KinectDepthCodec.h), according to the header flags. The header's
+ *  frame count and index offset are written when recording is closed; if
+ *  they are missing (recording interrupted) KinectReplaySource rebuilds the
+ *  index by walking the records.
+ */
+
+#define KINECT_CAPTURE_MAGIC "KINREC01"
+#define KINECT_CAPTURE_COLOR_JPEG 0x1
+#define KINECT_CAPTURE_DEPTH_RVL  0x2
+
+struct KinectCaptureHeader
+{
+  char magic[8];
+  uint32_t flags;
+  uint32_t irParamsSize;
+  uint32_t colorParamsSize;
+  uint32_t colorWidth, colorHeight;
+  uint32_t depthWidth, depthHeight;
+  uint32_t reserved;
+  uint64_t frameCount;
+  uint64_t indexOffset;
+};
+
+struct KinectCaptureRecord
+{
+  uint64_t timeUSec;        ///< capture time, monotonic clock
+  uint32_t colorTimestamp;  ///< libfreenect2 frame timestamps
+  uint32_t depthTimestamp;
+  uint32_t colorSize;       ///< bytes of colour data following this record
+  uint32_t depthSize;       ///< bytes of depth data following the colour data
+};
+
+
+/** Writes colour and depth frames to a capture file. */
+class KinectRecorder
+{
+public:
+  KinectRecorder();
+  ~KinectRecorder();
+
+  /** @param compress store colour as JPEG and depth as RVL instead of raw
+   *  @param jpegQuality 1-100, if compressing
+   */
+  bool open(const char *filename,
+    const libfreenect2::Freenect2Device::IrCameraParams& irParams,
+    const libfreenect2::Freenect2Device::ColorCameraParams& colorParams,
+    bool compress = true, int jpegQuality = 90);
+  /** Append one frame pair. Both frames must have the same size as the first. */
+  bool write(const libfreenect2::Frame *color, const libfreenect2::Frame *depth, long long timeUSec);
+  /** Write the index and close the file. */
+  void close();
+
+  bool isOpen() const { return myFile != NULL; }
+  unsigned long getFrames() const { return myIndex.size(); }
+  unsigned long long getBytes() const { return myOffset; }
+
+private:
+  FILE *myFile;
+  std::string myFilename;
+  KinectCaptureHeader myHeader;
+  uint64_t myOffset;
+  std::vector<uint64_t> myIndex;
+  int myJpegQuality;
+  tjhandle myJpeg;
+  unsigned char *myJpegBuf;
+  unsigned long myJpegBufSize;
+  std::vector<unsigned short> myDepthMM;
+  std::vector<unsigned char> myDepthRVL;
+
+  bool writeBytes(const void *data, size_t size);
+};
+
+
+/** Frames from a capture file, memory-mapped, as a KinectFrameSource.
+ *  Raw frames are served straight from the mapping without copying.
+ */
+class KinectReplaySource : public virtual KinectFrameSource
+{
+public:
+  /** @param realTime serve frames at the recorded rate, otherwise as fast as
+   *    they are requested
+   *  @param loop start again from the first frame at the end of the file
+   */
+  KinectReplaySource(const char *filename, bool realTime = true, bool loop = false);
+  virtual ~KinectReplaySource();
+
+  virtual bool open();
+  virtual void close();
+  virtual bool start();
+  virtual void stop() {}
+  /** In real time, waits as long as the recorded gap between frames
+   *  whatever the timeout, so never times out. */
+  virtual WaitResult waitForFrames(libfreenect2::Frame *color, libfreenect2::Frame *depth,
+    libfreenect2::Frame *ir, unsigned int timeoutMs);
+  /** Recordings have no IR */
+  virtual bool hasIr() { return false; }
+  virtual std::string getName() { return myFilename; }
+  virtual long long getLastDecodeUSec() { return myDecodeUSec; }
+  virtual bool getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+    libfreenect2::Freenect2Device::ColorCameraParams *color);
+
+  unsigned long getFrameCount() const { return myIndex.size(); }
+  /** Make frame @a n the next one served */
+  bool seek(unsigned long n);
+
+private:
+  std::string myFilename;
+  bool myRealTime;
+  bool myLoop;
+  int myFd;
+  const unsigned char *myData;
+  size_t mySize;
+  const KinectCaptureHeader *myHeader;
+  std::vector<uint64_t> myIndex;
+  unsigned long myNext;
+  long long myStartUSec;   ///< clock time at which myFirstUSec is replayed
+  uint64_t myFirstUSec;
+  tjhandle myJpeg;
+  std::vector<unsigned short> myDepthMM;
+  long long myDecodeUSec;
+
+  bool buildIndex();
+};
+
+#endif
@@ -0,0 +1,115 @@
+
+#include "KinectDepthClient.h"
+#include "KinectDepthCodec.h"
+
+KinectDepthClient::KinectDepthClient(ArClientBase *client, const char *request) :
+  myClient(client),
+  myRequest(request),
+  myHandlePacketCB(this, &KinectDepthClient::handlePacket),
+  myFrameCB(NULL),
+  myAssemblingSequence(0),
+  myAssembled(0),
+  myWidth(0),
+  myHeight(0),
+  mySequence(0),
+  myTimestamp(0),
+  myHaveFrame(false),
+  myFramesReceived(0),
+  myBytesReceived(0),
+  myDecodeErrors(0),
+  myLastFrameSize(0)
+{
+  myClient->addHandler(myRequest.c_str(), &myHandlePacketCB);
+}
+
+KinectDepthClient::~KinectDepthClient()
+{
+  myClient->remHandler(myRequest.c_str(), &myHandlePacketCB);
+}
+
+bool KinectDepthClient::request(long intervalMs)
+{
+  if(!myClient->dataExists(myRequest.c_str()))
+  {
+    ArLog::log(ArLog::Terse, "KinectDepthClient: server does not provide %s", myRequest.c_str());
+    return false;
+  }
+  return myClient->request(myRequest.c_str(), intervalMs);
+}
+
+void KinectDepthClient::stop()
+{
+  myClient->requestStop(myRequest.c_str());
+}
+
+void KinectDepthClient::handlePacket(ArNetPacket *pkt)
+{
+  const unsigned long seq = pkt->bufToUByte4();
+  const unsigned int timestamp = pkt->bufToUByte4();
+  const int width = pkt->bufToUByte2();
+  const int height = pkt->bufToUByte2();
+  const size_t total = pkt->bufToUByte4();
+  const size_t offset = pkt->bufToUByte4();
+  const size_t chunk = pkt->bufToUByte2();
+
+  myBytesReceived += chunk;
+
+  if(offset == 0)
+  {
+    // start of a new frame; any partial frame is abandoned
+    myAssemblingSequence = seq;
+    myAssembled = 0;
+    if(myEncoded.size() < total)
+      myEncoded.resize(total);
+  }
+  if(seq != myAssemblingSequence || offset != myAssembled || offset + chunk > total || total > myEncoded.size())
+  {
+    // missed the start of this frame, or chunks out of order
+    myAssembled = 0;
+    return;
+  }
+  pkt->bufToData((char*)&myEncoded[offset], chunk);
+  myAssembled += chunk;
+  if(myAssembled < total)
+    return;
+
+  myAssembled = 0;
+  myMutex.lock();
+  myDepth.resize(width * height);
+  if(!kinectRVLDecode(&myEncoded[0], total, &myDepth[0], myDepth.size()))
+  {
+    myMutex.unlock();
+    ++myDecodeErrors;
+    ArLog::log(ArLog::Normal, "KinectDepthClient: could not decode depth frame %lu", seq);
+    return;
+  }
+  myWidth = width;
+  myHeight = height;
+  mySequence = seq;
+  myTimestamp = timestamp;
+  myHaveFrame = true;
+  myMutex.unlock();
+  ++myFramesReceived;
+  myLastFrameSize = total;
+
+  if(myFrameCB)
+    myFrameCB->invoke();
+}
+
+bool KinectDepthClient::getLatest(std::vector<unsigned short>& depth, int *width, int *height,
+  unsigned long *sequence, unsigned int *timestamp)
+{
+  myMutex.lock();
+  if(!myHaveFrame)
+  {
+    myMutex.unlock();
+    return false;
+  }
+  depth = myDepth;
+  *width = myWidth;
+  *height = myHeight;
+  if(sequence) *sequence = mySequence;
+  if(timestamp) *timestamp = myTimestamp;
+  myMutex.unlock();
+  return true;
+}
@@ -0,0 +1,71 @@
+#ifndef KINECTDEPTHCLIENT_H
+#define KINECTDEPTHCLIENT_H
+
+#include <vector>
+#include <string>
+#include "Aria.h"
+#include "ArNetworking.h"
+#include "KinectDepthCodec.h"
+
+/** Receives the lossless depth stream served by KinectArVideoServer
+ *  (KINECT_DEPTH_RVL_REQUEST, or the request of another Kinect, see
+ *  KinectArVideoServer::setDevice()), reassembles the chunks of each frame and
+ *  decodes them to 16-bit depth in mm.
+ *
+ *  Call request() after connecting the ArClientBase, then getLatest() from
+ *  any thread. A callback may be added to be notified of each new frame;
+ *  it is called in the ArClientBase thread.
+ */
+class KinectDepthClient
+{
+public:
+  KinectDepthClient(ArClientBase *client, const char *request = KINECT_DEPTH_RVL_REQUEST);
+  ~KinectDepthClient();
+
+  /** Ask the server for a depth frame every @a intervalMs ms */
+  bool request(long intervalMs = 100);
+  void stop();
+
+  /** Copy the most recently decoded frame into @a depth (row-major, mm,
+   *  0 = no data).
+   *  @return false if no frame has been received yet */
+  bool getLatest(std::vector<unsigned short>& depth, int *width, int *height,
+    unsigned long *sequence = NULL, unsigned int *timestamp = NULL);
+
+  void setFrameCallback(ArFunctor *cb) { myFrameCB = cb; }
+
+  unsigned long getFramesReceived() const { return myFramesReceived; }
+  unsigned long getBytesReceived() const { return myBytesReceived; }
+  unsigned long getDecodeErrors() const { return myDecodeErrors; }
+  /** Compressed size of the last frame received */
+  size_t getLastFrameSize() const { return myLastFrameSize; }
+
+private:
+  ArClientBase *myClient;
+  std::string myRequest;
+  ArFunctor1C<KinectDepthClient, ArNetPacket*> myHandlePacketCB;
+  ArFunctor *myFrameCB;
+
+  // frame being reassembled
+  std::vector<unsigned char> myEncoded;
+  unsigned long myAssemblingSequence;
+  size_t myAssembled;
+
+  // last complete frame
+  ArMutex myMutex;
+  std::vector<unsigned short> myDepth;
+  int myWidth;
+  int myHeight;
+  unsigned long mySequence;
+  unsigned int myTimestamp;
+  bool myHaveFrame;
+
+  unsigned long myFramesReceived;
+  unsigned long myBytesReceived;
+  unsigned long myDecodeErrors;
+  size_t myLastFrameSize;
+
+  void handlePacket(ArNetPacket *pkt);
+};
+
+#endif
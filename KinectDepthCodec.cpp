@@ -0,0 +1,166 @@
+
+#include <math.h>
+#include <stdint.h>
+#include "KinectDepthCodec.h"
+
+namespace {
+
+class NibbleWriter
+{
+  unsigned char *out;
+  unsigned int word;
+  int nibbles;
+public:
+  NibbleWriter(unsigned char *_out) : out(_out), word(0), nibbles(0) {}
+
+  void putWord(unsigned int w)
+  {
+    out[0] = w & 0xff;
+    out[1] = (w >> 8) & 0xff;
+    out[2] = (w >> 16) & 0xff;
+    out[3] = (w >> 24) & 0xff;
+    out += 4;
+  }
+
+  void putVLE(unsigned int value)
+  {
+    do
+    {
+      unsigned int nibble = value & 0x7;
+      value >>= 3;
+      if(value)
+        nibble |= 0x8;
+      word = (word << 4) | nibble;
+      if(++nibbles == 8)
+      {
+        putWord(word);
+        nibbles = 0;
+        word = 0;
+      }
+    } while(value);
+  }
+
+  unsigned char *finish()
+  {
+    if(nibbles)
+      putWord(word << (4 * (8 - nibbles)));
+    nibbles = 0;
+    return out;
+  }
+};
+
+class NibbleReader
+{
+  const unsigned char *in;
+  const unsigned char *end;
+  unsigned int word;
+  int nibbles;
+public:
+  bool error;
+
+  NibbleReader(const unsigned char *_in, size_t size) : in(_in), end(_in + size), word(0), nibbles(0), error(false) {}
+
+  unsigned int getVLE()
+  {
+    unsigned int value = 0;
+    int shift = 0;
+    unsigned int nibble;
+    do
+    {
+      if(nibbles == 0)
+      {
+        if(end - in < 4)
+        {
+          error = true;
+          return 0;
+        }
+        word = in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+        in += 4;
+        nibbles = 8;
+      }
+      nibble = word >> 28;
+      word <<= 4;
+      --nibbles;
+      value |= (nibble & 0x7) << shift;
+      shift += 3;
+      if(shift > 30)
+      {
+        error = true;
+        return 0;
+      }
+    } while(nibble & 0x8);
+    return value;
+  }
+};
+
+}
+
+size_t kinectRVLEncode(const unsigned short *input, size_t numPixels, unsigned char *output)
+{
+  NibbleWriter w(output);
+  const unsigned short *end = input + numPixels;
+  int previous = 0;
+  while(input != end)
+  {
+    unsigned int zeros = 0;
+    for(; input != end && *input == 0; ++input)
+      ++zeros;
+    w.putVLE(zeros);
+
+    unsigned int nonzeros = 0;
+    for(const unsigned short *p = input; p != end && *p != 0; ++p)
+      ++nonzeros;
+    w.putVLE(nonzeros);
+
+    for(unsigned int i = 0; i < nonzeros; ++i)
+    {
+      const int current = *input++;
+      const int delta = current - previous;
+      w.putVLE(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));  // zig-zag
+      previous = current;
+    }
+  }
+  return w.finish() - output;
+}
+
+bool kinectRVLDecode(const unsigned char *input, size_t inputSize, unsigned short *output, size_t numPixels)
+{
+  NibbleReader r(input, inputSize);
+  unsigned short *end = output + numPixels;
+  int previous = 0;
+  while(output != end)
+  {
+    const unsigned int zeros = r.getVLE();
+    if(r.error || zeros > (size_t)(end - output))
+      return false;
+    for(unsigned int i = 0; i < zeros; ++i)
+      *output++ = 0;
+    if(output == end)
+      break;
+
+    const unsigned int nonzeros = r.getVLE();
+    if(r.error || nonzeros > (size_t)(end - output))
+      return false;
+    for(unsigned int i = 0; i < nonzeros; ++i)
+    {
+      const unsigned int positive = r.getVLE();
+      if(r.error)
+        return false;
+      const int delta = (int)(positive >> 1) ^ -(int)(positive & 1);
+      const int current = previous + delta;
+      *output++ = (unsigned short)current;
+      previous = current;
+    }
+  }
+  return true;
+}
+
+void kinectDepthToMM(const float *input, size_t numPixels, unsigned short *output)
+{
+  for(size_t i = 0; i < numPixels; ++i)
+  {
+    const float d = input[i];
+    // !(d > 0) is also true for NaN
+    output[i] = !(d > 0.5f) ? 0 : (d >= 65535.0f ? 65535 : (unsigned short)(d + 0.5f));
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef KINECTDEPTHCODEC_H
+#define KINECTDEPTHCODEC_H
+
+#include <stddef.h>
+
+/** Lossless compression of 16-bit depth images, using RVL run-length and
+ *  variable-length coding (A. Wilson, "Fast Lossless Depth Image
+ *  Compression", ISS 2017).
+ *
+ *  Runs of zero (invalid) pixels and runs of valid pixels are stored as
+ *  counts; valid pixels are stored as the zig-zag coded difference from the
+ *  previous valid pixel. All numbers are written as variable-length groups
+ *  of 3-bit nibbles, packed eight to a 32-bit word, little-endian on the
+ *  wire.
+ */
+
+/** ArNetworking request for the latest RVL depth frame. A frame is larger
+ *  than one ArNetPacket, so each reply is split into several packets of:
+ *    uByte4 frame sequence number
+ *    uByte4 libfreenect2 depth timestamp
+ *    uByte2 width, uByte2 height
+ *    uByte4 total encoded size
+ *    uByte4 offset of this chunk in the encoded frame
+ *    uByte2 chunk size
+ *    chunk data
+ *  Chunks of a frame are sent in order. See KinectDepthClient.
+ */
+#define KINECT_DEPTH_RVL_REQUEST "getKinectDepthRVL"
+#define KINECT_DEPTH_RVL_CHUNK_SIZE 30000
+
+/** Worst-case encoded size in bytes for @a numPixels pixels */
+inline size_t kinectRVLMaxEncodedSize(size_t numPixels)
+{
+  return 4 * numPixels + 8;
+}
+
+/** Encode @a numPixels depth values from @a input into @a output, which must
+ *  have room for kinectRVLMaxEncodedSize(numPixels) bytes.
+ *  @return number of bytes written
+ */
+size_t kinectRVLEncode(const unsigned short *input, size_t numPixels, unsigned char *output);
+
+/** Decode @a numPixels depth values into @a output.
+ *  @return false if @a input (of @a inputSize bytes) is truncated or corrupt
+ */
+bool kinectRVLDecode(const unsigned char *input, size_t inputSize, unsigned short *output, size_t numPixels);
+
+/** Convert libfreenect2 float depth (mm) to 16-bit mm, rounding to nearest.
+ *  Invalid (NaN, negative or zero) depth becomes 0. */
+void kinectDepthToMM(const float *input, size_t numPixels, unsigned short *output);
+
+#endif
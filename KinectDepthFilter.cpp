@@ -0,0 +1,101 @@
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "KinectDepthFilter.h"
+
+KinectDepthFilter::KinectDepthFilter(size_t pixels, float alpha, float jumpThreshold, int maxHoldFrames) :
+  myState(pixels), myHeld(pixels), myAlpha(alpha), myJumpThreshold(jumpThreshold), myMaxHold(maxHoldFrames)
+{
+  reset();
+}
+
+void KinectDepthFilter::reset()
+{
+  memset(&myState[0], 0, myState.size() * sizeof(float));
+  memset(&myHeld[0], 0, myHeld.size() * sizeof(int32_t));
+}
+
+// One pixel; the vector loops below compute exactly the same thing.
+static inline float filterPixel(float in, float& s, int32_t& held, float alpha, float thr, int maxHold)
+{
+  if(in > 0.0f)  // false for NaN too
+  {
+    const float diff = in - s;
+    s = (s > 0.0f && fabsf(diff) <= thr) ? s + alpha * diff : in;
+    held = 0;
+  }
+  else if(s > 0.0f && held < maxHold)
+    ++held;
+  else
+    s = 0.0f;
+  return s;
+}
+
+void KinectDepthFilter::applyRange(const float *in, float *out, size_t begin, size_t end)
+{
+  const size_t n = std::min(end, myState.size());
+  float *state = &myState[0];
+  int32_t *held = &myHeld[0];
+  const float alpha = myAlpha, thr = myJumpThreshold;
+  const int maxHold = myMaxHold;
+  size_t i = begin;
+
+#if defined(__AVX2__)
+  const __m256 valpha = _mm256_set1_ps(alpha), vthr = _mm256_set1_ps(thr), vzero = _mm256_setzero_ps();
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256i vmaxHold = _mm256_set1_epi32(maxHold), vone = _mm256_set1_epi32(1);
+  for(; i + 8 <= n; i += 8)
+  {
+    const __m256 d = _mm256_loadu_ps(in + i);
+    const __m256 s = _mm256_loadu_ps(state + i);
+    const __m256i h = _mm256_loadu_si256((const __m256i*)(held + i));
+    const __m256 valid = _mm256_cmp_ps(d, vzero, _CMP_GT_OQ);
+    const __m256 haveState = _mm256_cmp_ps(s, vzero, _CMP_GT_OQ);
+    const __m256 diff = _mm256_sub_ps(d, s);
+    const __m256 near = _mm256_and_ps(haveState, _mm256_cmp_ps(_mm256_and_ps(diff, absMask), vthr, _CMP_LE_OQ));
+    const __m256 smoothed = _mm256_blendv_ps(d, _mm256_add_ps(s, _mm256_mul_ps(valpha, diff)), near);
+    // hole: hold while held < maxHold
+    const __m256 hold = _mm256_and_ps(haveState, _mm256_castsi256_ps(_mm256_cmpgt_epi32(vmaxHold, h)));
+    const __m256 holeValue = _mm256_and_ps(hold, s);
+    const __m256 ns = _mm256_blendv_ps(holeValue, smoothed, valid);
+    const __m256i nh = _mm256_andnot_si256(_mm256_castps_si256(valid),
+      _mm256_add_epi32(h, _mm256_and_si256(_mm256_castps_si256(hold), vone)));
+    _mm256_storeu_ps(state + i, ns);
+    _mm256_storeu_si256((__m256i*)(held + i), nh);
+    _mm256_storeu_ps(out + i, ns);
+  }
+#elif defined(__SSE2__)
+  const __m128 valpha = _mm_set1_ps(alpha), vthr = _mm_set1_ps(thr), vzero = _mm_setzero_ps();
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128i vmaxHold = _mm_set1_epi32(maxHold), vone = _mm_set1_epi32(1);
+  for(; i + 4 <= n; i += 4)
+  {
+    const __m128 d = _mm_loadu_ps(in + i);
+    const __m128 s = _mm_loadu_ps(state + i);
+    const __m128i h = _mm_loadu_si128((const __m128i*)(held + i));
+    const __m128 valid = _mm_cmpgt_ps(d, vzero);
+    const __m128 haveState = _mm_cmpgt_ps(s, vzero);
+    const __m128 diff = _mm_sub_ps(d, s);
+    const __m128 near = _mm_and_ps(haveState, _mm_cmple_ps(_mm_and_ps(diff, absMask), vthr));
+    const __m128 smoothed = _mm_or_ps(_mm_and_ps(near, _mm_add_ps(s, _mm_mul_ps(valpha, diff))), _mm_andnot_ps(near, d));
+    const __m128 hold = _mm_and_ps(haveState, _mm_castsi128_ps(_mm_cmpgt_epi32(vmaxHold, h)));
+    const __m128 holeValue = _mm_and_ps(hold, s);
+    const __m128 ns = _mm_or_ps(_mm_and_ps(valid, smoothed), _mm_andnot_ps(valid, holeValue));
+    const __m128i nh = _mm_andnot_si128(_mm_castps_si128(valid),
+      _mm_add_epi32(h, _mm_and_si128(_mm_castps_si128(hold), vone)));
+    _mm_storeu_ps(state + i, ns);
+    _mm_storeu_si128((__m128i*)(held + i), nh);
+    _mm_storeu_ps(out + i, ns);
+  }
+#endif
+  for(; i < n; ++i)
+    out[i] = filterPixel(in[i], state[i], held[i], alpha, thr, maxHold);
+}
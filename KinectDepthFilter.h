@@ -0,0 +1,61 @@
+#ifndef KINECTDEPTHFILTER_H
+#define KINECTDEPTHFILTER_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Per-pixel temporal filter for Kinect depth (float mm, 0 or NaN where
+ *  there is no measurement).
+ *
+ *  Each pixel keeps a filtered value that follows new measurements with an
+ *  exponential moving average:
+ *     state += alpha * (depth - state)
+ *  unless the measurement differs from the state by more than the jump
+ *  threshold, in which case the state jumps straight to it so that moving
+ *  objects do not leave trails. With hole filling on, a pixel that loses its
+ *  measurement keeps its last filtered value for up to maxHoldFrames frames
+ *  before going to 0.
+ *
+ *  The state is allocated once in the constructor and updated in place;
+ *  apply() does not allocate. The loop uses AVX2 or SSE2 when the compiler
+ *  targets them (see SIMD_FLAGS in the Makefile), otherwise plain C++.
+ */
+class KinectDepthFilter
+{
+public:
+  /** @param alpha weight of each new measurement, 0-1 (1 = no smoothing)
+   *  @param jumpThreshold mm; larger changes are taken as they are
+   *  @param maxHoldFrames frames to keep a value through a hole, 0 to
+   *  disable hole filling
+   */
+  KinectDepthFilter(size_t pixels, float alpha = 0.4f, float jumpThreshold = 60.0f, int maxHoldFrames = 3);
+
+  /** Filter one frame: update the state from @a in and write it to @a out.
+   *  @a in and @a out may be the same buffer. */
+  void apply(const float *in, float *out) { applyRange(in, out, 0, myState.size()); }
+  /** Filter only pixels [@a begin, @a end) of the frame at @a in and @a out
+   *  (e.g. one row of a region of interest); the rest keep their state and
+   *  are not written. */
+  void applyRange(const float *in, float *out, size_t begin, size_t end);
+
+  /** Forget the state, e.g. after a gap in the stream. */
+  void reset();
+
+  void setAlpha(float alpha) { myAlpha = alpha; }
+  void setJumpThreshold(float mm) { myJumpThreshold = mm; }
+  void setMaxHoldFrames(int frames) { myMaxHold = frames; }
+  float getAlpha() const { return myAlpha; }
+  float getJumpThreshold() const { return myJumpThreshold; }
+  int getMaxHoldFrames() const { return myMaxHold; }
+  size_t getPixels() const { return myState.size(); }
+
+private:
+  std::vector<float> myState;   ///< filtered depth, 0 where none
+  std::vector<int32_t> myHeld;  ///< frames each pixel has been held through a hole
+  float myAlpha;
+  float myJumpThreshold;
+  int myMaxHold;
+};
+
+#endif
@@ -0,0 +1,199 @@
+
+#include "KinectFramePool.h"
+#include "KinectDepthCodec.h"
+
+// Storage of each kind of buffer a KinectFrame owns, for checkAllocations()
+static const void *matData(const void *m)
+{
+  return ((const cv::Mat*)m)->data;
+}
+
+static const void *frameData(const void *f)
+{
+  return ((const libfreenect2::Frame*)f)->data;
+}
+
+template<class T> static const void *vectorData(const void *v)
+{
+  return ((const std::vector<T>*)v)->data();
+}
+
+KinectFrame::KinectFrame(int width, int height, int levels) :
+  colorSource(NULL),
+  depthSource(NULL),
+  irSource(NULL),
+  irReady(false),
+  depthFilteredFrame(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, 4),
+  depthFiltered(false),
+  // cv::Mat takes rows (height) first.
+  rgb(height, width, CV_8UC3),
+  depth(height, width, CV_8UC3),
+  depthMM(KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT),
+  depthRVL(kinectRVLMaxEncodedSize(KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT)),
+  depthRVLSize(0),
+  depthTimestamp(0),
+  rgbReady(false),
+  depthReady(false),
+  depthRVLReady(false),
+  cloudReady(false),
+  roiValid(false),
+  rgbROIReady(false),
+  captureUSec(0),
+  sequence(0)
+{
+  rgbLevels.push_back(rgb);
+  depthLevels.push_back(depth);
+  for(int i = 1; i < levels; ++i)
+  {
+    rgbLevels.push_back(cv::Mat(height >> i, width >> i, CV_8UC3));
+    depthLevels.push_back(cv::Mat(height >> i, width >> i, CV_8UC3));
+  }
+  // (the level vectors are not resized after this)
+  for(int i = 0; i < levels; ++i)
+  {
+    trackBuffer(&rgbLevels[i], matData);
+    trackBuffer(&depthLevels[i], matData);
+  }
+  trackBuffer(&rgb, matData);
+  trackBuffer(&depth, matData);
+  trackBuffer(&rgbROI, matData);
+  trackBuffer(&depthFilteredFrame, frameData);
+  trackBuffer(&depthMM, vectorData<unsigned short>);
+  trackBuffer(&depthRVL, vectorData<unsigned char>);
+  // a typical cloud at 2 cm voxels; grows if a frame has more
+  cloud.reserve(16384);
+  trackBuffer(&cloud, vectorData<KinectPoint>);
+}
+
+KinectFrame::~KinectFrame()
+{
+  delete colorSource;
+  delete depthSource;
+  delete irSource;
+}
+
+void KinectFrame::allocateSources()
+{
+  if(colorSource)
+    return;
+  colorSource = new libfreenect2::Frame(KINECT_COLOR_WIDTH, KINECT_COLOR_HEIGHT, 4);
+  depthSource = new libfreenect2::Frame(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, 4);
+  irSource = new libfreenect2::Frame(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, 4);
+}
+
+void KinectFrame::allocateROI(int width, int height)
+{
+  rgbROI.create(height, width, CV_8UC3);
+  // not an allocation while processing
+  for(size_t i = 0; i < myBuffers.size(); ++i)
+    if(myBuffers[i].buffer == &rgbROI)
+      myBuffers[i].lastData = rgbROI.data;
+}
+
+void KinectFrame::trackBuffer(const void *buffer, const void *(*data)(const void *buffer))
+{
+  TrackedBuffer b = { buffer, data, data(buffer) };
+  myBuffers.push_back(b);
+}
+
+int KinectFrame::checkAllocations()
+{
+  int n = 0;
+  for(size_t i = 0; i < myBuffers.size(); ++i)
+  {
+    const void *data = myBuffers[i].data(myBuffers[i].buffer);
+    if(data != myBuffers[i].lastData)
+    {
+      myBuffers[i].lastData = data;
+      ++n;
+    }
+  }
+  return n;
+}
+
+
+KinectFramePool::KinectFramePool(size_t numFrames, int width, int height, int levels) :
+  myWidth(width), myHeight(height), myLevels(levels),
+  myLastFrameAllocations(0), myTotalAllocations(0), myFramesCounted(0)
+{
+  myFrames.reserve(numFrames);
+  myFree.reserve(numFrames);
+  for(size_t i = 0; i < numFrames; ++i)
+  {
+    KinectFrame *f = new KinectFrame(width, height, levels);
+    myFrames.push_back(f);
+    myFree.push_back(f);
+  }
+}
+
+KinectFramePool::~KinectFramePool()
+{
+  for(size_t i = 0; i < myFrames.size(); ++i)
+    delete myFrames[i];
+}
+
+KinectFrame *KinectFramePool::acquire()
+{
+  KinectFrame *f = NULL;
+  myMutex.lock();
+  if(!myFree.empty())
+  {
+    f = myFree.back();
+    myFree.pop_back();
+  }
+  myMutex.unlock();
+  return f;
+}
+
+void KinectFramePool::release(KinectFrame *frame)
+{
+  if(!frame)
+    return;
+  myMutex.lock();
+  // capacity was reserved for every frame in the constructor, so this never
+  // reallocates.
+  myFree.push_back(frame);
+  myMutex.unlock();
+}
+
+void KinectFramePool::allocateROI(int width, int height)
+{
+  myMutex.lock();
+  for(size_t i = 0; i < myFrames.size(); ++i)
+    myFrames[i]->allocateROI(width, height);
+  myMutex.unlock();
+}
+
+void KinectFramePool::countAllocations(KinectFrame *frame)
+{
+  const int n = frame->checkAllocations();
+  myMutex.lock();
+  myLastFrameAllocations = n;
+  myTotalAllocations += n;
+  ++myFramesCounted;
+  myMutex.unlock();
+}
+
+int KinectFramePool::getLastFrameAllocations()
+{
+  myMutex.lock();
+  const int n = myLastFrameAllocations;
+  myMutex.unlock();
+  return n;
+}
+
+unsigned long KinectFramePool::getTotalAllocations()
+{
+  myMutex.lock();
+  const unsigned long n = myTotalAllocations;
+  myMutex.unlock();
+  return n;
+}
+
+unsigned long KinectFramePool::getFramesCounted()
+{
+  myMutex.lock();
+  const unsigned long n = myFramesCounted;
+  myMutex.unlock();
+  return n;
+}
@@ -0,0 +1,151 @@
+#ifndef KINECTFRAMEPOOL_H
+#define KINECTFRAMEPOOL_H
+
+#include <vector>
+#include "Aria.h"
+#include <opencv2/opencv.hpp>
+#include <libfreenect2/libfreenect2.hpp>
+#include "KinectPointCloud.h"
+
+#define KINECT_COLOR_WIDTH 1920
+#define KINECT_COLOR_HEIGHT 1080
+#define KINECT_DEPTH_WIDTH 512
+#define KINECT_DEPTH_HEIGHT 424
+
+/// Most image pyramid levels the pipeline will build (full, 1/2, 1/4, 1/8)
+#define KINECT_MAX_PYRAMID_LEVELS 4
+
+/** Working buffers for one frame in the Kinect video pipeline.
+ *  All image data is allocated once, by KinectFramePool, at the sizes the
+ *  pipeline writes into, so that OpenCV never needs to reallocate them.
+ */
+class KinectFrame
+{
+public:
+  /// Frames as received, copied in by the frame source (see
+  /// KinectFrameSource::waitForFrames()): BGRX colour, depth in mm and IR,
+  /// at the Kinect's resolutions. NULL until allocateSources().
+  libfreenect2::Frame *colorSource;
+  libfreenect2::Frame *depthSource;
+  libfreenect2::Frame *irSource;
+  bool irReady;  ///< irSource was filled in for this frame
+  /// depthSource after temporal filtering (KinectDepthFilter), if depthFiltered
+  libfreenect2::Frame depthFilteredFrame;
+  bool depthFiltered;
+  /** Depth to work from: filtered if it has been, otherwise as received */
+  const libfreenect2::Frame *getDepth() const { return depthFiltered ? &depthFilteredFrame : depthSource; }
+
+  cv::Mat rgb;    ///< colour at output size, mirrored (CV_8UC3, RGB)
+  cv::Mat depth;  ///< depth at output size, mirrored, scaled to 0-255 grey (CV_8UC3, RGB)
+  /// Pyramids of rgb and depth; level 0 shares its data with rgb/depth and
+  /// level i is (width >> i) x (height >> i)
+  std::vector<cv::Mat> rgbLevels;
+  std::vector<cv::Mat> depthLevels;
+  /// Full resolution depth in mm, not mirrored (KINECT_DEPTH_WIDTH x KINECT_DEPTH_HEIGHT)
+  std::vector<unsigned short> depthMM;
+  /// depthMM compressed with kinectRVLEncode(); only the first depthRVLSize bytes are used
+  std::vector<unsigned char> depthRVL;
+  size_t depthRVLSize;
+  unsigned int depthTimestamp; ///< libfreenect2 timestamp of the depth frame
+
+  bool rgbReady;   ///< rgb was filled in for this frame
+  bool depthReady; ///< depth was filled in for this frame
+  bool depthRVLReady; ///< depthMM and depthRVL were filled in for this frame
+  KinectPoints cloud;  ///< voxel-downsampled point cloud
+  bool cloudReady; ///< cloud was filled in for this frame
+
+  /// Region of interest of this frame, if roiValid (see
+  /// KinectArVideoServer::enableROI()), in pixels of the source images (not
+  /// mirrored): depth pixels and the colour pixels they map to
+  bool roiValid;
+  cv::Rect roiDepth;
+  cv::Rect roiColor;
+  /// Full resolution colour around the region of interest, mirrored
+  /// (CV_8UC3, RGB); only allocated by KinectFramePool::allocateROI()
+  cv::Mat rgbROI;
+  bool rgbROIReady; ///< rgbROI was filled in for this frame
+  ArTime captureTime;
+  long long captureUSec;  ///< kinectTimeUSec() when captured
+  unsigned long sequence;
+
+  KinectFrame(int width, int height, int levels = 1);
+  ~KinectFrame();
+
+  /** Allocate colorSource, depthSource and irSource, if they have not
+   *  been yet. Done by the capture thread the first time the frame is
+   *  captured into rather than for the whole pool: KinectFramePool hands
+   *  out the most recently released frame first, so only as many frames
+   *  as are ever in use at once allocate them (10 MB each). */
+  void allocateSources();
+
+  void allocateROI(int width, int height);
+
+  /** Number of buffers whose storage has been replaced since the last call
+   *  (i.e. heap allocations made by OpenCV, or by a vector growing, while
+   *  processing this frame), and remember the current storage for the next
+   *  check. Every buffer the frame owns is checked. */
+  int checkAllocations();
+
+private:
+  /// a buffer, how to get at its storage, and its storage at the last check
+  struct TrackedBuffer
+  {
+    const void *buffer;
+    const void *(*data)(const void *buffer);
+    const void *lastData;
+  };
+  std::vector<TrackedBuffer> myBuffers;
+  void trackBuffer(const void *buffer, const void *(*data)(const void *buffer));
+};
+
+/** Fixed-size set of preallocated KinectFrame objects.
+ *  Frames are taken with acquire() and returned with release(); neither
+ *  allocates memory. acquire() and release() may be called from different
+ *  threads. The pool also keeps count of allocations reported by
+ *  frames (see KinectFrame::checkAllocations()) so that the steady-state
+ *  frame path can be shown to be allocation-free.
+ */
+class KinectFramePool
+{
+public:
+  KinectFramePool(size_t numFrames, int width, int height, int levels = 1);
+  ~KinectFramePool();
+
+  /** @return the most recently released free frame, or NULL if all
+   *  frames are in use. */
+  KinectFrame *acquire();
+  void release(KinectFrame *frame);
+
+  /** Allocate every frame's rgbROI at @a width x @a height. Call before
+   *  frames are in use. */
+  void allocateROI(int width, int height);
+
+  size_t size() const { return myFrames.size(); }
+  int getWidth() const { return myWidth; }
+  int getHeight() const { return myHeight; }
+  int getLevels() const { return myLevels; }
+
+  /** Check @a frame for reallocated buffers after it has been processed and
+   *  add them to the allocation counters. Call once per frame. */
+  void countAllocations(KinectFrame *frame);
+
+  /** Allocations made while processing the most recently counted frame. */
+  int getLastFrameAllocations();
+  /** Total allocations counted since the pool was created. */
+  unsigned long getTotalAllocations();
+  /** Number of frames counted. */
+  unsigned long getFramesCounted();
+
+private:
+  int myWidth;
+  int myHeight;
+  int myLevels;
+  std::vector<KinectFrame*> myFrames;
+  std::vector<KinectFrame*> myFree;
+  ArMutex myMutex;
+  int myLastFrameAllocations;
+  unsigned long myTotalAllocations;
+  unsigned long myFramesCounted;
+};
+
+#endif
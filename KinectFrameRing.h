@@ -0,0 +1,136 @@
+#ifndef KINECTFRAMERING_H
+#define KINECTFRAMERING_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stddef.h>
+
+/** Bounded lock-free queue of pointers from one producer thread to one
+ *  consumer thread, used to hand frames between stages of the Kinect
+ *  pipeline.
+ *
+ *  When the ring is full, push() either refuses the new item (DropNewest) or
+ *  discards the oldest queued item to make room (DropOldest). Either way the
+ *  item that did not make it is handed back to the producer so it can be
+ *  returned to its pool. To support DropOldest the producer may advance the
+ *  read index, so both sides claim items with a compare-and-swap on it;
+ *  otherwise this is an ordinary single-producer/single-consumer ring.
+ *
+ *  pop() never blocks; waitPop() blocks on a condition variable for up to
+ *  the given time, and push() signals it. Only waiting takes a lock: the
+ *  consumer checks for an item and starts waiting under the condition's
+ *  mutex, and push() signals under it, so a push between the check and
+ *  the wait is never missed.
+ */
+template<class T> class KinectFrameRing
+{
+public:
+  typedef enum {
+    DropOldest,
+    DropNewest
+  } DropPolicy;
+
+  KinectFrameRing(size_t capacity, DropPolicy policy = DropOldest) :
+    mySlots(capacity), myPolicy(policy), myHead(0), myTail(0), myPushed(0), myDropped(0), myWakes(0)
+  {
+  }
+
+  /** Queue @a item.
+   *  @param dropped set to the item that was discarded because the ring was
+   *  full (the oldest queued item or @a item itself, depending on the
+   *  policy), or NULL.
+   *  @return false if @a item itself was discarded.
+   */
+  bool push(T *item, T **dropped)
+  {
+    *dropped = NULL;
+    const size_t head = myHead.load(std::memory_order_relaxed);
+    size_t tail = myTail.load(std::memory_order_acquire);
+    if(head - tail >= mySlots.size())
+    {
+      if(myPolicy == DropNewest)
+      {
+        *dropped = item;
+        myDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      // take the oldest item, unless the consumer got it first
+      T *oldest = mySlots[tail % mySlots.size()].load(std::memory_order_relaxed);
+      if(myTail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel))
+      {
+        *dropped = oldest;
+        myDropped.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    mySlots[head % mySlots.size()].store(item, std::memory_order_relaxed);
+    myHead.store(head + 1, std::memory_order_release);
+    myPushed.fetch_add(1, std::memory_order_relaxed);
+    myMutex.lock();
+    myCondition.notify_one();
+    myMutex.unlock();
+    return true;
+  }
+
+  /** @return the oldest queued item, or NULL if the ring is empty */
+  T *pop()
+  {
+    size_t tail = myTail.load(std::memory_order_relaxed);
+    while(true)
+    {
+      if(tail == myHead.load(std::memory_order_acquire))
+        return NULL;
+      T *item = mySlots[tail % mySlots.size()].load(std::memory_order_relaxed);
+      // fails (and reloads tail) if the producer dropped this item meanwhile
+      if(myTail.compare_exchange_weak(tail, tail + 1, std::memory_order_acq_rel))
+        return item;
+    }
+  }
+
+  /** Like pop(), but wait up to @a msecs for an item if the ring is empty.
+   *  Returns NULL early if wake() is called. */
+  T *waitPop(unsigned int msecs)
+  {
+    T *item = pop();
+    if(item)
+      return item;
+    const std::chrono::steady_clock::time_point until =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(msecs);
+    std::unique_lock<std::mutex> lock(myMutex);
+    const unsigned long wakes = myWakes;
+    while(!(item = pop()) && myWakes == wakes)
+      if(myCondition.wait_until(lock, until) == std::cv_status::timeout)
+        return pop();
+    return item;
+  }
+
+  /** Wake a consumer blocked in waitPop(), e.g. at shutdown. */
+  void wake()
+  {
+    myMutex.lock();
+    ++myWakes;
+    myCondition.notify_all();
+    myMutex.unlock();
+  }
+
+  size_t size() const { return myHead.load() - myTail.load(); }
+  size_t capacity() const { return mySlots.size(); }
+  DropPolicy getPolicy() const { return myPolicy; }
+  unsigned long getPushed() const { return myPushed.load(); }
+  unsigned long getDropped() const { return myDropped.load(); }
+
+private:
+  std::vector< std::atomic<T*> > mySlots;
+  const DropPolicy myPolicy;
+  std::atomic<size_t> myHead;  ///< next slot to write, only changed by producer
+  std::atomic<size_t> myTail;  ///< next slot to read
+  std::atomic<unsigned long> myPushed;
+  std::atomic<unsigned long> myDropped;
+  std::mutex myMutex;  ///< for waiting only
+  std::condition_variable myCondition;
+  unsigned long myWakes;  ///< wake() calls, under myMutex
+};
+
+#endif
@@ -0,0 +1,190 @@
+
+#include <iostream>
+#include <string.h>
+#include "KinectFrameSource.h"
+
+ArMutex KinectDeviceSource::ourContextMutex;
+
+std::vector<std::string> KinectDeviceSource::enumerate(libfreenect2::Freenect2 *freenect2)
+{
+  std::vector<std::string> serials;
+  ourContextMutex.lock();
+  const int n = freenect2->enumerateDevices();
+  for(int i = 0; i < n; ++i)
+    serials.push_back(freenect2->getDeviceSerialNumber(i));
+  ourContextMutex.unlock();
+  return serials;
+}
+
+KinectDeviceSource::KinectDeviceSource(libfreenect2::Freenect2 *_freenect2, const std::string& _serial) :
+  freenect2(_freenect2),
+  serial(_serial),
+  freenect_dev(NULL),
+  started(false),
+  waiting(false),
+  waitColor(NULL),
+  waitDepth(NULL),
+  waitIr(NULL),
+  wantIr(false),
+  gotColor(false),
+  gotDepth(false),
+  gotIr(false),
+  sizeWarned(false)
+{
+}
+
+KinectDeviceSource::~KinectDeviceSource()
+{
+  close();
+}
+
+bool KinectDeviceSource::open()
+{
+  // (openDevice() enumerates the devices if that has not been done yet)
+  ourContextMutex.lock();
+  if(serial.empty())
+    freenect_dev = freenect2->openDefaultDevice();
+  else
+    freenect_dev = freenect2->openDevice(serial);
+  ourContextMutex.unlock();
+
+  if(!freenect_dev)
+  {
+    if(serial.empty())
+      std::cout << "KinectArVideoServer: no kinect2 device connected or failure opening the default one!" << std::endl;
+    else
+      std::cout << "KinectArVideoServer: failure opening kinect2 device " << serial << "!" << std::endl;
+    return false;
+  }
+
+  // (IR is decoded along with depth anyway, so it costs little to take it)
+  freenect_dev->setColorFrameListener(this);
+  freenect_dev->setIrAndDepthFrameListener(this);
+  // reopen this device, not whichever is the default then
+  if(serial.empty())
+    serial = freenect_dev->getSerialNumber();
+
+  std::cout << "kinect device serial: " << freenect_dev->getSerialNumber() << std::endl;
+  std::cout << "kinect device firmware: " << freenect_dev->getFirmwareVersion() << std::endl;
+  return true;
+}
+
+void KinectDeviceSource::close()
+{
+  if(!freenect_dev)
+    return;
+  // Restarting the ir stream of an open device doesn't work, so a stalled
+  // device has to be closed and opened again.
+  // TODO: bad things will happen, if frame listeners are freed before dev->stop() :(
+  stop();
+  ourContextMutex.lock();
+  freenect_dev->close();
+  // libfreenect2 hands out a new device object on each open
+  delete freenect_dev;
+  ourContextMutex.unlock();
+  freenect_dev = NULL;
+}
+
+bool KinectDeviceSource::start()
+{
+  if(!freenect_dev && !open())
+    return false;
+  if(!freenect_dev->start())
+  {
+    std::cout << "KinectArVideoServer: Error starting stream from kinect!" << std::endl;
+    return false;
+  }
+  started = true;
+  return true;
+}
+
+void KinectDeviceSource::stop()
+{
+  if(started && freenect_dev)
+    freenect_dev->stop();
+  started = false;
+}
+
+KinectFrameSource::WaitResult KinectDeviceSource::waitForFrames(libfreenect2::Frame *color, libfreenect2::Frame *depth,
+  libfreenect2::Frame *ir, unsigned int timeoutMs)
+{
+  if(!started)
+  {
+    // e.g. reopening after a stall failed
+    ArUtil::sleep(timeoutMs);
+    return TimedOut;
+  }
+
+  const std::chrono::steady_clock::time_point until =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  std::unique_lock<std::mutex> lock(frameMutex);
+  waitColor = color;
+  waitDepth = depth;
+  waitIr = ir;
+  wantIr = ir != NULL;
+  gotColor = gotDepth = gotIr = false;
+  waiting = true;
+  while(!haveFrames())
+    if(frameCondition.wait_until(lock, until) == std::cv_status::timeout)
+      break;
+  waiting = false;
+  return haveFrames() ? GotFrames : TimedOut;
+}
+
+/** Copy @a from into @a to, unless @a to is NULL (the frame is dropped).
+ *  @return false if they are not the same size */
+bool KinectDeviceSource::copyFrame(const libfreenect2::Frame *from, libfreenect2::Frame *to)
+{
+  if(!to)
+    return true;
+  if(from->width != to->width || from->height != to->height || from->bytes_per_pixel != to->bytes_per_pixel)
+  {
+    if(!sizeWarned)
+      std::cout << "KinectArVideoServer: Error: " << getName() << " sent a " << from->width << "x" << from->height << "x"
+        << from->bytes_per_pixel << " frame, expected " << to->width << "x" << to->height << "x" << to->bytes_per_pixel << std::endl;
+    sizeWarned = true;
+    return false;
+  }
+  memcpy(to->data, from->data, from->width * from->height * from->bytes_per_pixel);
+  to->timestamp = from->timestamp;
+  to->sequence = from->sequence;
+  to->exposure = from->exposure;
+  to->gain = from->gain;
+  to->gamma = from->gamma;
+  to->status = from->status;
+  to->format = from->format;
+  return true;
+}
+
+/** Called by libfreenect2 in its decoding threads. Returning false leaves
+ *  @a frame with libfreenect2, to decode the next frame into. */
+bool KinectDeviceSource::onNewFrame(libfreenect2::Frame::Type type, libfreenect2::Frame *frame)
+{
+  std::lock_guard<std::mutex> lock(frameMutex);
+  if(!waiting)
+    return false;
+  if(type == libfreenect2::Frame::Color && !gotColor)
+    gotColor = copyFrame(frame, waitColor);
+  else if(type == libfreenect2::Frame::Depth && !gotDepth)
+    gotDepth = copyFrame(frame, waitDepth);
+  else if(type == libfreenect2::Frame::Ir && wantIr && !gotIr)
+    gotIr = copyFrame(frame, waitIr);
+  if(haveFrames())
+    frameCondition.notify_one();
+  return false;
+}
+
+std::string KinectDeviceSource::getName()
+{
+  return freenect_dev ? freenect_dev->getSerialNumber() : serial;
+}
+
+bool KinectDeviceSource::getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+  libfreenect2::Freenect2Device::ColorCameraParams *color)
+{
+  if(!freenect_dev)
+    return false;
+  *ir = freenect_dev->getIrCameraParams();
+  *color = freenect_dev->getColorCameraParams();
+  return true;
+}
@@ -0,0 +1,120 @@
+#ifndef KINECTFRAMESOURCE_H
+#define KINECTFRAMESOURCE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include "Aria.h"
+#include <libfreenect2/libfreenect2.hpp>
+
+/** Where KinectArVideoServer gets its colour and depth frames from: a Kinect
+ *  device (KinectDeviceSource) or a recording (KinectReplaySource).
+ */
+class KinectFrameSource
+{
+public:
+  virtual ~KinectFrameSource() {}
+
+  /** Connect to the device or file. @return false if it is not available */
+  virtual bool open() = 0;
+  virtual void close() = 0;
+  /** Start or stop streaming. Only called between open() and close(). */
+  virtual bool start() = 0;
+  virtual void stop() = 0;
+  /** Whether start() works again after stop() without closing and
+   *  opening the source in between */
+  virtual bool canRestart() { return true; }
+
+  typedef enum {
+    GotFrames,
+    TimedOut,     ///< nothing yet; the streams may have stalled
+    NoMoreFrames  ///< e.g. end of a recording
+  } WaitResult;
+
+  /** Wait up to @a timeoutMs for the next colour (BGRX), depth (float mm)
+   *  and IR (float) frames and copy them into @a color, @a depth and
+   *  @a ir, which the caller allocates at the Kinect's resolutions and
+   *  reuses, so that nothing is allocated per frame. @a ir may be NULL if
+   *  IR is not wanted, and is not filled in if the source has none (see
+   *  hasIr()). @a color and @a depth may be NULL to take the next frames
+   *  and drop them.
+   */
+  virtual WaitResult waitForFrames(libfreenect2::Frame *color, libfreenect2::Frame *depth,
+    libfreenect2::Frame *ir, unsigned int timeoutMs) = 0;
+  /** Whether waitForFrames() fills in IR */
+  virtual bool hasIr() { return true; }
+
+  /** Time spent decoding in the last waitForFrames() call (us), or 0 if the
+   *  frames arrive decoded (libfreenect2 decodes in its own threads). */
+  virtual long long getLastDecodeUSec() { return 0; }
+
+  /** Device serial number, or file name */
+  virtual std::string getName() = 0;
+
+  /** Camera intrinsics, for registration. @return false if not known */
+  virtual bool getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+    libfreenect2::Freenect2Device::ColorCameraParams *color) = 0;
+};
+
+
+/** Frames from a Kinect v2 through libfreenect2. Several devices may share
+ *  one libfreenect2::Freenect2 context, each with its own source; opening
+ *  and enumerating through the context are serialized. The source may be
+ *  closed and opened again, e.g. to recover from a stalled USB stream; it
+ *  reopens the same device it first opened. start() opens the device if it
+ *  is closed.
+ *
+ *  It is its own frame listener: each new frame is copied straight into
+ *  the caller's while waitForFrames() waits for it, and handed back to
+ *  libfreenect2 to decode the next one into, rather than libfreenect2
+ *  allocating a new frame every time (as it does when a listener keeps
+ *  them, e.g. libfreenect2::SyncMultiFrameListener). Frames arriving
+ *  between waitForFrames() calls are dropped. */
+class KinectDeviceSource : public virtual KinectFrameSource, private libfreenect2::FrameListener
+{
+public:
+  /** @param serial device to open, or empty for the default device */
+  KinectDeviceSource(libfreenect2::Freenect2 *freenect2, const std::string& serial = "");
+  virtual ~KinectDeviceSource();
+
+  /** Serial numbers of the Kinect v2 devices connected, in the order
+   *  libfreenect2 finds them (the first is the default device) */
+  static std::vector<std::string> enumerate(libfreenect2::Freenect2 *freenect2);
+
+  virtual bool open();
+  virtual void close();
+  virtual bool start();
+  virtual void stop();
+  /** libfreenect2 can't restart the IR stream of an open device */
+  virtual bool canRestart() { return false; }
+  virtual WaitResult waitForFrames(libfreenect2::Frame *color, libfreenect2::Frame *depth,
+    libfreenect2::Frame *ir, unsigned int timeoutMs);
+  virtual std::string getName();
+  virtual bool getCameraParams(libfreenect2::Freenect2Device::IrCameraParams *ir,
+    libfreenect2::Freenect2Device::ColorCameraParams *color);
+
+private:
+  libfreenect2::Freenect2 *freenect2;
+  std::string serial;
+  libfreenect2::Freenect2Device *freenect_dev;
+  bool started;
+
+  // frames waitForFrames() is waiting for, filled in by onNewFrame() in
+  // libfreenect2's threads; all under frameMutex
+  std::mutex frameMutex;
+  std::condition_variable frameCondition;
+  bool waiting;
+  libfreenect2::Frame *waitColor, *waitDepth, *waitIr;
+  bool wantIr;
+  bool gotColor, gotDepth, gotIr;
+  bool sizeWarned;
+  bool haveFrames() const { return gotColor && gotDepth && (gotIr || !wantIr); }
+  bool copyFrame(const libfreenect2::Frame *from, libfreenect2::Frame *to);
+  virtual bool onNewFrame(libfreenect2::Frame::Type type, libfreenect2::Frame *frame);
+
+  static ArMutex ourContextMutex;  ///< libfreenect2::Freenect2 is not thread safe
+};
+
+#endif
@@ -0,0 +1,404 @@
+
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "KinectImageKernels.h"
+
+const char *kinectKernelsInstructionSet()
+{
+#if defined(__AVX2__)
+  return "AVX2";
+#elif defined(__SSSE3__)
+  return "SSSE3";
+#else
+  return "scalar";
+#endif
+}
+
+static int clampi(int v, int lo, int hi)
+{
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+static inline int64_t load8(const unsigned char *p)
+{
+  int64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+// store the low 12 bytes of v
+static inline void store12(unsigned char *p, __m128i v)
+{
+  _mm_storel_epi64((__m128i*)p, v);
+  const int32_t hi = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+  memcpy(p + 8, &hi, 4);
+}
+#endif
+
+
+/* Colour */
+
+KinectColorKernel::KinectColorKernel(int srcWidth, int srcHeight, int dstWidth, int dstHeight) :
+  mySrcWidth(srcWidth), mySrcHeight(srcHeight), myDstWidth(dstWidth), myDstHeight(dstHeight),
+  myCols(dstWidth), myRows(dstHeight)
+{
+  const double sx = (double)srcWidth / dstWidth;
+  const double sy = (double)srcHeight / dstHeight;
+  for(int x = 0; x < dstWidth; ++x)
+  {
+    // output is mirrored: column x takes from source column (dstWidth-1-x)
+    const double c = (dstWidth - 1 - x + 0.5) * sx - 0.5;
+    myCols[x] = clampi((int)floor(c), 0, srcWidth - 2);
+  }
+  for(int y = 0; y < dstHeight; ++y)
+  {
+    const double r = (y + 0.5) * sy - 0.5;
+    myRows[y] = clampi((int)floor(r), 0, srcHeight - 2);
+  }
+}
+
+// Mean of a 2x2 BGRX block -> one RGB pixel. Rounds the same way as
+// _mm_avg_epu8 (vertical pair, then horizontal pair) so all code paths agree.
+static inline void colorPixel(const unsigned char *a, const unsigned char *b, unsigned char *out)
+{
+  for(int ch = 0; ch < 3; ++ch)
+  {
+    const int l = (a[ch] + b[ch] + 1) >> 1;
+    const int r = (a[ch+4] + b[ch+4] + 1) >> 1;
+    out[2-ch] = (unsigned char)((l + r + 1) >> 1);
+  }
+}
+
+void KinectColorKernel::applyRect(const cv::Mat& src, cv::Mat& dst, int rowBegin, int rowEnd, int colBegin, int colEnd) const
+{
+  const int *cols = &myCols[0];
+  for(int y = rowBegin; y < rowEnd; ++y)
+  {
+    const unsigned char *r0 = src.ptr<unsigned char>(myRows[y]);
+    const unsigned char *r1 = src.ptr<unsigned char>(myRows[y] + 1);
+    unsigned char *out = dst.ptr<unsigned char>(y);
+    int x = colBegin;
+#if defined(__AVX2__)
+    // lane 0 packs pixels 0,1 to bytes 0-5; lane 1 packs pixels 2,3 to bytes 6-11
+    const __m256i swz = _mm256_setr_epi8(
+      2, 1, 0, 10, 9, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, 2, 1, 0, 10, 9, 8, -1, -1, -1, -1);
+    // 4 output pixels per iteration; the last store writes 12 bytes so stop
+    // while a full group remains.
+    for(; x + 4 <= colEnd; x += 4)
+    {
+      const __m256i a = _mm256_set_epi64x(load8(r0 + 4*cols[x+3]), load8(r0 + 4*cols[x+2]),
+                                          load8(r0 + 4*cols[x+1]), load8(r0 + 4*cols[x]));
+      const __m256i b = _mm256_set_epi64x(load8(r1 + 4*cols[x+3]), load8(r1 + 4*cols[x+2]),
+                                          load8(r1 + 4*cols[x+1]), load8(r1 + 4*cols[x]));
+      const __m256i v = _mm256_avg_epu8(a, b);
+      const __m256i h = _mm256_avg_epu8(v, _mm256_srli_epi64(v, 32));
+      const __m256i s = _mm256_shuffle_epi8(h, swz);
+      store12(out + 3*x, _mm_or_si128(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1)));
+    }
+#elif defined(__SSSE3__)
+    const __m128i swzLo = _mm_setr_epi8(2, 1, 0, 10, 9, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i swzHi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 1, 0, 10, 9, 8, -1, -1, -1, -1);
+    for(; x + 4 <= colEnd; x += 4)
+    {
+      const __m128i a0 = _mm_set_epi64x(load8(r0 + 4*cols[x+1]), load8(r0 + 4*cols[x]));
+      const __m128i b0 = _mm_set_epi64x(load8(r1 + 4*cols[x+1]), load8(r1 + 4*cols[x]));
+      const __m128i a1 = _mm_set_epi64x(load8(r0 + 4*cols[x+3]), load8(r0 + 4*cols[x+2]));
+      const __m128i b1 = _mm_set_epi64x(load8(r1 + 4*cols[x+3]), load8(r1 + 4*cols[x+2]));
+      const __m128i v0 = _mm_avg_epu8(a0, b0);
+      const __m128i v1 = _mm_avg_epu8(a1, b1);
+      const __m128i h0 = _mm_avg_epu8(v0, _mm_srli_epi64(v0, 32));
+      const __m128i h1 = _mm_avg_epu8(v1, _mm_srli_epi64(v1, 32));
+      store12(out + 3*x, _mm_or_si128(_mm_shuffle_epi8(h0, swzLo), _mm_shuffle_epi8(h1, swzHi)));
+    }
+#endif
+    for(; x < colEnd; ++x)
+      colorPixel(r0 + 4*cols[x], r1 + 4*cols[x], out + 3*x);
+  }
+}
+
+namespace {
+class ColorBody : public cv::ParallelLoopBody
+{
+  const KinectColorKernel& k;
+  const cv::Mat& src;
+  cv::Mat& dst;
+public:
+  ColorBody(const KinectColorKernel& _k, const cv::Mat& _src, cv::Mat& _dst) : k(_k), src(_src), dst(_dst) {}
+  virtual void operator()(const cv::Range& r) const { k.applyRows(src, dst, r.start, r.end); }
+};
+}
+
+void KinectColorKernel::apply(const cv::Mat& src, cv::Mat& dst) const
+{
+  assert(src.cols == mySrcWidth && src.rows == mySrcHeight);
+  assert(dst.cols == myDstWidth && dst.rows == myDstHeight);
+  // ~8 rows per stripe keeps each worker's source rows in cache
+  cv::parallel_for_(cv::Range(0, myDstHeight), ColorBody(*this, src, dst), myDstHeight / 8.0);
+}
+
+
+/* Depth */
+
+KinectDepthKernel::KinectDepthKernel(int srcWidth, int srcHeight, int dstWidth, int dstHeight, float maxDepth) :
+  mySrcWidth(srcWidth), mySrcHeight(srcHeight), myDstWidth(dstWidth), myDstHeight(dstHeight),
+  myMaxDepth(maxDepth), myCols(dstWidth), myRows(dstHeight)
+{
+  const double sx = (double)srcWidth / dstWidth;
+  const double sy = (double)srcHeight / dstHeight;
+  for(int x = 0; x < dstWidth; ++x)
+    myCols[x] = clampi((int)floor((dstWidth - 1 - x + 0.5) * sx), 0, srcWidth - 1);
+  for(int y = 0; y < dstHeight; ++y)
+    myRows[y] = clampi((int)floor((y + 0.5) * sy), 0, srcHeight - 1);
+}
+
+void KinectDepthKernel::applyRect(const cv::Mat& src, cv::Mat& dst, int rowBegin, int rowEnd, int colBegin, int colEnd) const
+{
+  const int *cols = &myCols[0];
+  const float scale = 255.0f / myMaxDepth;
+  for(int y = rowBegin; y < rowEnd; ++y)
+  {
+    const float *s = src.ptr<float>(myRows[y]);
+    unsigned char *out = dst.ptr<unsigned char>(y);
+    int x = colBegin;
+#if defined(__SSSE3__) || defined(__AVX2__)
+    const __m128i grey0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i grey1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+#if defined(__AVX2__)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vmax = _mm256_set1_ps(255.0f);
+    const __m256 vzero = _mm256_setzero_ps();
+#else
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vmax = _mm_set1_ps(255.0f);
+    const __m128 vzero = _mm_setzero_ps();
+#endif
+    // 8 output pixels (24 bytes) per iteration
+    for(; x + 8 <= colEnd; x += 8)
+    {
+#if defined(__AVX2__)
+      __m256 f = _mm256_set_ps(s[cols[x+7]], s[cols[x+6]], s[cols[x+5]], s[cols[x+4]],
+                               s[cols[x+3]], s[cols[x+2]], s[cols[x+1]], s[cols[x]]);
+      // max first so NaN becomes 0
+      f = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(f, vscale), vzero), vmax);
+      const __m256i i = _mm256_cvtps_epi32(f);
+      const __m128i p16 = _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+#else
+      __m128 f0 = _mm_set_ps(s[cols[x+3]], s[cols[x+2]], s[cols[x+1]], s[cols[x]]);
+      __m128 f1 = _mm_set_ps(s[cols[x+7]], s[cols[x+6]], s[cols[x+5]], s[cols[x+4]]);
+      f0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f0, vscale), vzero), vmax);
+      f1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f1, vscale), vzero), vmax);
+      const __m128i p16 = _mm_packs_epi32(_mm_cvtps_epi32(f0), _mm_cvtps_epi32(f1));
+#endif
+      const __m128i p8 = _mm_packus_epi16(p16, p16);
+      _mm_storeu_si128((__m128i*)(out + 3*x), _mm_shuffle_epi8(p8, grey0));
+      _mm_storel_epi64((__m128i*)(out + 3*x + 16), _mm_shuffle_epi8(p8, grey1));
+    }
+#endif
+    for(; x < colEnd; ++x)
+    {
+      float v = s[cols[x]] * scale;
+      if(!(v > 0.0f)) v = 0.0f;
+      if(v > 255.0f) v = 255.0f;
+      const unsigned char g = (unsigned char)lrintf(v);
+      out[3*x] = out[3*x+1] = out[3*x+2] = g;
+    }
+  }
+}
+
+namespace {
+class DepthBody : public cv::ParallelLoopBody
+{
+  const KinectDepthKernel& k;
+  const cv::Mat& src;
+  cv::Mat& dst;
+public:
+  DepthBody(const KinectDepthKernel& _k, const cv::Mat& _src, cv::Mat& _dst) : k(_k), src(_src), dst(_dst) {}
+  virtual void operator()(const cv::Range& r) const { k.applyRows(src, dst, r.start, r.end); }
+};
+}
+
+void KinectDepthKernel::apply(const cv::Mat& src, cv::Mat& dst) const
+{
+  assert(src.cols == mySrcWidth && src.rows == mySrcHeight);
+  assert(dst.cols == myDstWidth && dst.rows == myDstHeight);
+  cv::parallel_for_(cv::Range(0, myDstHeight), DepthBody(*this, src, dst), myDstHeight / 8.0);
+}
+
+
+/* Pyramids */
+
+// Half-size RGB row from two rows, rounding as colorPixel() (vertical pair,
+// then horizontal pair). Plain loops; the compiler vectorizes them.
+static void halveColorRow(const unsigned char *a, const unsigned char *b, unsigned char *out, int outWidth)
+{
+  unsigned char v[6];
+  for(int x = 0; x < outWidth; ++x)
+  {
+    for(int i = 0; i < 6; ++i)
+      v[i] = (unsigned char)((a[6*x + i] + b[6*x + i] + 1) >> 1);
+    for(int ch = 0; ch < 3; ++ch)
+      out[3*x + ch] = (unsigned char)((v[ch] + v[ch + 3] + 1) >> 1);
+  }
+}
+
+static void halveDepthRow(const unsigned char *a, const unsigned char *, unsigned char *out, int outWidth)
+{
+  for(int x = 0; x < outWidth; ++x)
+  {
+    out[3*x] = a[6*x];
+    out[3*x + 1] = a[6*x + 1];
+    out[3*x + 2] = a[6*x + 2];
+  }
+}
+
+namespace {
+// Band b covers 2^(n-1) rows of level first and the rows of each smaller
+// level made from them, so a band never needs rows from another band.
+template<class Kernel> class PyramidBody : public cv::ParallelLoopBody
+{
+  const Kernel& k;
+  const cv::Mat& src;
+  std::vector<cv::Mat>& levels;
+  int first;
+  void (*halve)(const unsigned char*, const unsigned char*, unsigned char*, int);
+public:
+  PyramidBody(const Kernel& _k, const cv::Mat& _src, std::vector<cv::Mat>& _levels, int _first,
+      void (*_halve)(const unsigned char*, const unsigned char*, unsigned char*, int)) :
+    k(_k), src(_src), levels(_levels), first(_first), halve(_halve) {}
+
+  static int bandRows(size_t numLevels) { return 1 << (numLevels - 1); }
+
+  virtual void operator()(const cv::Range& r) const
+  {
+    const int n = levels.size() - first;
+    for(int band = r.start; band < r.end; ++band)
+    {
+      for(int l = 0; l < n; ++l)
+      {
+        cv::Mat& dst = levels[first + l];
+        const int rows = bandRows(n) >> l;
+        const int begin = band * rows;
+        const int end = std::min(begin + rows, dst.rows);
+        if(l == 0)
+        {
+          k.applyRows(src, dst, begin, end);
+          continue;
+        }
+        const cv::Mat& up = levels[first + l - 1];
+        for(int y = begin; y < end; ++y)
+          halve(up.ptr<unsigned char>(2*y), up.ptr<unsigned char>(2*y + 1), dst.ptr<unsigned char>(y), dst.cols);
+      }
+    }
+  }
+};
+
+template<class Kernel> void buildPyramid(const Kernel& k, const cv::Mat& src, std::vector<cv::Mat>& levels, int first,
+  void (*halve)(const unsigned char*, const unsigned char*, unsigned char*, int))
+{
+  assert(first >= 0 && first < (int)levels.size());
+  assert(levels[first].cols == k.getDstWidth() && levels[first].rows == k.getDstHeight());
+  for(size_t l = first + 1; l < levels.size(); ++l)
+    assert(levels[l].cols == levels[l-1].cols / 2 && levels[l].rows == levels[l-1].rows / 2);
+  const int rows = PyramidBody<Kernel>::bandRows(levels.size() - first);
+  const int bands = (levels[first].rows + rows - 1) / rows;
+  cv::parallel_for_(cv::Range(0, bands), PyramidBody<Kernel>(k, src, levels, first, halve), levels[first].rows / 8.0);
+}
+
+template<class Kernel> class RectBody : public cv::ParallelLoopBody
+{
+  const Kernel& k;
+  const cv::Mat& src;
+  cv::Mat& dst;
+  int colBegin, colEnd;
+public:
+  RectBody(const Kernel& _k, const cv::Mat& _src, cv::Mat& _dst, int _colBegin, int _colEnd) :
+    k(_k), src(_src), dst(_dst), colBegin(_colBegin), colEnd(_colEnd) {}
+  virtual void operator()(const cv::Range& r) const { k.applyRect(src, dst, r.start, r.end, colBegin, colEnd); }
+};
+
+template<class Kernel> void buildPyramidROI(const Kernel& k, const Kernel& low, const cv::Mat& src,
+  std::vector<cv::Mat>& levels, int lowLevel, const cv::Rect& roi,
+  void (*halve)(const unsigned char*, const unsigned char*, unsigned char*, int))
+{
+  assert(lowLevel > 0 && lowLevel < (int)levels.size());
+  buildPyramid(low, src, levels, lowLevel, halve);
+  for(int l = 0; l < lowLevel; ++l)
+    cv::resize(levels[lowLevel], levels[l], levels[l].size(), 0, 0, cv::INTER_NEAREST);
+
+  // widen the region to whole blocks of level lowLevel, so that every level
+  // in between halves exactly the pixels redone in the one above
+  const int align = 1 << lowLevel;
+  const int x0 = std::max(0, roi.x) & ~(align - 1);
+  const int y0 = std::max(0, roi.y) & ~(align - 1);
+  const int x1 = std::min(levels[0].cols, (roi.x + roi.width + align - 1) & ~(align - 1));
+  const int y1 = std::min(levels[0].rows, (roi.y + roi.height + align - 1) & ~(align - 1));
+  if(x1 <= x0 || y1 <= y0)
+    return;
+  cv::parallel_for_(cv::Range(y0, y1), RectBody<Kernel>(k, src, levels[0], x0, x1), (y1 - y0) / 8.0);
+  for(int l = 1; l < lowLevel; ++l)
+  {
+    const cv::Mat& up = levels[l - 1];
+    cv::Mat& dst = levels[l];
+    const int bx = x0 >> l, ex = x1 >> l;
+    for(int y = y0 >> l; y < (y1 >> l); ++y)
+      halve(up.ptr<unsigned char>(2*y) + 6*bx, up.ptr<unsigned char>(2*y + 1) + 6*bx, dst.ptr<unsigned char>(y) + 3*bx, ex - bx);
+  }
+}
+}
+
+void kinectColorPyramid(const KinectColorKernel& k, const cv::Mat& src, std::vector<cv::Mat>& levels)
+{
+  assert(src.cols == k.getSrcWidth() && src.rows == k.getSrcHeight());
+  buildPyramid(k, src, levels, 0, halveColorRow);
+}
+
+void kinectDepthPyramid(const KinectDepthKernel& k, const cv::Mat& src, std::vector<cv::Mat>& levels)
+{
+  buildPyramid(k, src, levels, 0, halveDepthRow);
+}
+
+void kinectColorPyramidROI(const KinectColorKernel& k, const KinectColorKernel& low, const cv::Mat& src,
+  std::vector<cv::Mat>& levels, int lowLevel, const cv::Rect& roi)
+{
+  assert(src.cols == k.getSrcWidth() && src.rows == k.getSrcHeight());
+  buildPyramidROI(k, low, src, levels, lowLevel, roi, halveColorRow);
+}
+
+void kinectDepthPyramidROI(const KinectDepthKernel& k, const KinectDepthKernel& low, const cv::Mat& src,
+  std::vector<cv::Mat>& levels, int lowLevel, const cv::Rect& roi)
+{
+  buildPyramidROI(k, low, src, levels, lowLevel, roi, halveDepthRow);
+}
+
+
+/* Crop */
+
+void kinectColorCrop(const cv::Mat& src, int x, int y, cv::Mat& dst)
+{
+  assert(x >= 0 && y >= 0 && x + dst.cols <= src.cols && y + dst.rows <= src.rows);
+  const int w = dst.cols;
+  for(int r = 0; r < dst.rows; ++r)
+  {
+    // mirrored: output column 0 is the rightmost source column
+    const unsigned char *in = src.ptr<unsigned char>(y + r) + 4 * (x + w - 1);
+    unsigned char *out = dst.ptr<unsigned char>(r);
+    for(int c = 0; c < w; ++c, in -= 4, out += 3)
+    {
+      out[0] = in[2];
+      out[1] = in[1];
+      out[2] = in[0];
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#ifndef KINECTIMAGEKERNELS_H
+#define KINECTIMAGEKERNELS_H
+
+#include <vector>
+#include <stddef.h>
+#include <opencv2/opencv.hpp>
+
+/** Fused image kernels for the Kinect video pipeline.
+ *
+ *  Each kernel downsamples, mirrors horizontally and converts to packed 8-bit
+ *  RGB in a single pass over the source, replacing the
+ *  cv::resize + cv::flip + cv::cvtColor chain. Sampling tables are computed
+ *  once in the constructor, so apply() does not allocate.
+ *
+ *  Inner loops use AVX2 or SSSE3 when the compiler targets them (see
+ *  SIMD_FLAGS in the Makefile), otherwise plain C++. Rows are split across
+ *  cores with cv::parallel_for_.
+ */
+
+/** 1920x1080 BGRX colour -> mirrored RGB. Each output pixel is the mean of
+ *  the 2x2 source block nearest its centre.
+ */
+class KinectColorKernel
+{
+public:
+  KinectColorKernel(int srcWidth, int srcHeight, int dstWidth, int dstHeight);
+
+  /** @param src CV_8UC4 BGRX image of the source size
+   *  @param dst CV_8UC3 RGB image of the destination size (must already be allocated)
+   */
+  void apply(const cv::Mat& src, cv::Mat& dst) const;
+
+  /** Process only destination rows [rowBegin, rowEnd). */
+  void applyRows(const cv::Mat& src, cv::Mat& dst, int rowBegin, int rowEnd) const
+    { applyRect(src, dst, rowBegin, rowEnd, 0, myDstWidth); }
+  /** Process only destination columns [colBegin, colEnd) of rows [rowBegin, rowEnd). */
+  void applyRect(const cv::Mat& src, cv::Mat& dst, int rowBegin, int rowEnd, int colBegin, int colEnd) const;
+
+  int getSrcWidth() const { return mySrcWidth; }
+  int getSrcHeight() const { return mySrcHeight; }
+  int getDstWidth() const { return myDstWidth; }
+  int getDstHeight() const { return myDstHeight; }
+
+private:
+  int mySrcWidth, mySrcHeight, myDstWidth, myDstHeight;
+  std::vector<int> myCols; ///< left source column of the 2x2 block for each (mirrored) output column
+  std::vector<int> myRows; ///< top source row of the 2x2 block for each output row
+};
+
+/** 512x424 float depth in mm -> mirrored grey RGB, with
+ *  value = round(depth * 255 / maxDepth) saturated to 0-255. Nearest-neighbour
+ *  sampling so that edges do not blend foreground and background depths.
+ */
+class KinectDepthKernel
+{
+public:
+  KinectDepthKernel(int srcWidth, int srcHeight, int dstWidth, int dstHeight, float maxDepth = 4500.0f);
+
+  /** @param src CV_32FC1 depth image of the source size
+   *  @param dst CV_8UC3 RGB image of the destination size (must already be allocated)
+   */
+  void apply(const cv::Mat& src, cv::Mat& dst) const;
+  void applyRows(const cv::Mat& src, cv::Mat& dst, int rowBegin, int rowEnd) const
+    { applyRect(src, dst, rowBegin, rowEnd, 0, myDstWidth); }
+  void applyRect(const cv::Mat& src, cv::Mat& dst, int rowBegin, int rowEnd, int colBegin, int colEnd) const;
+
+  int getDstWidth() const { return myDstWidth; }
+  int getDstHeight() const { return myDstHeight; }
+  float getMaxDepth() const { return myMaxDepth; }
+
+private:
+  int mySrcWidth, mySrcHeight, myDstWidth, myDstHeight;
+  float myMaxDepth;
+  std::vector<int> myCols; ///< source column for each (mirrored) output column
+  std::vector<int> myRows; ///< source row for each output row
+};
+
+/** Image pyramids. levels[0] is made from @a src by the kernel, and each
+ *  further level is half the size of the one before (rounded down): colour
+ *  by averaging 2x2 blocks, depth by taking the top-left pixel of each block
+ *  so that depth edges stay sharp. All levels are built in one pass over
+ *  bands of rows, so the rows a level is made from are still in cache, and
+ *  bands are split across cores with cv::parallel_for_.
+ *
+ *  @param levels CV_8UC3 images, level i of size (dstWidth >> i, dstHeight >> i),
+ *  already allocated
+ */
+void kinectColorPyramid(const KinectColorKernel& k, const cv::Mat& src, std::vector<cv::Mat>& levels);
+void kinectDepthPyramid(const KinectDepthKernel& k, const cv::Mat& src, std::vector<cv::Mat>& levels);
+
+/** Pyramids with full detail only in a region of interest. Levels from
+ *  @a lowLevel down are built as above, starting from @a low, a kernel of
+ *  level @a lowLevel's size; the larger levels are scaled up from level
+ *  @a lowLevel (nearest neighbour), then @a roi (in level 0 pixels) is
+ *  redone by @a k and halved into them. Outside the region this reads
+ *  1/4^lowLevel of the source pixels.
+ */
+void kinectColorPyramidROI(const KinectColorKernel& k, const KinectColorKernel& low, const cv::Mat& src,
+  std::vector<cv::Mat>& levels, int lowLevel, const cv::Rect& roi);
+void kinectDepthPyramidROI(const KinectDepthKernel& k, const KinectDepthKernel& low, const cv::Mat& src,
+  std::vector<cv::Mat>& levels, int lowLevel, const cv::Rect& roi);
+
+/** Copy the rectangle of full resolution BGRX colour @a src with top left
+ *  corner (@a x, @a y) and the size of @a dst into @a dst, mirrored and
+ *  converted to RGB like KinectColorKernel. The rectangle must lie within
+ *  @a src.
+ *  @param dst CV_8UC3, already allocated
+ */
+void kinectColorCrop(const cv::Mat& src, int x, int y, cv::Mat& dst);
+
+/** Name of the instruction set the kernels were compiled for ("AVX2",
+ *  "SSSE3" or "scalar"). */
+const char *kinectKernelsInstructionSet();
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <iostream>
+#include <algorithm>
+
+#include "KinectJpegCache.h"
+#include "KinectPipelineStats.h"
+
+KinectJpegCache::KinectJpegCache(int width, int height, int defaultQuality, int maxQualities, int idleTimeout) :
+  myWidth(width), myHeight(height),
+  myDefaultQuality(defaultQuality),
+  myMaxQualities(std::max(1, maxQualities)),
+  myIdleTimeout(idleTimeout),
+  myJpeg(tjInitCompress()),
+  myRequestFunctor(this, &KinectJpegCache::handleRequest),
+  myClientRemovedFunctor(this, &KinectJpegCache::clientRemoved),
+  myEncoded(0),
+  mySent(0),
+  myBytesSent(0)
+{
+  myQualities.reserve(myMaxQualities);
+  myEncoding.reserve(myMaxQualities);
+}
+
+KinectJpegCache::~KinectJpegCache()
+{
+  tjDestroy(myJpeg);
+}
+
+bool KinectJpegCache::isWanted()
+{
+  const long long since = kinectTimeUSec() - myIdleTimeout * 1000LL;
+  myMutex.lock();
+  bool wanted = false;
+  for(size_t i = 0; i < myQualities.size() && !wanted; ++i)
+    wanted = myQualities[i].lastRequestUSec > since;
+  myMutex.unlock();
+  return wanted;
+}
+
+void KinectJpegCache::update(const cv::Mat& image, unsigned long sequence)
+{
+  if(image.cols != myWidth || image.rows != myHeight || image.type() != CV_8UC3)
+    return;
+  const long long since = kinectTimeUSec() - myIdleTimeout * 1000LL;
+
+  // Pick the buffers to encode into under the lock, but encode outside it so
+  // requests are answered with the previous frame meanwhile.
+  myMutex.lock();
+  for(size_t i = 0; i < myQualities.size(); )
+  {
+    if(myQualities[i].lastRequestUSec <= since)
+    {
+      // nobody has asked for a while; clients still sending it hold their own reference
+      myQualities.erase(myQualities.begin() + i);
+      continue;
+    }
+    std::shared_ptr<KinectJpeg> target;
+    if(myQualities[i].spare && myQualities[i].spare.use_count() == 1)
+      target.swap(myQualities[i].spare);
+    else
+      target = std::make_shared<KinectJpeg>(myWidth, myHeight);  // a slow client still has the spare
+    target->quality = myQualities[i].quality;
+    myEncoding.push_back(target);
+    ++i;
+  }
+  myMutex.unlock();
+
+  for(size_t i = 0; i < myEncoding.size(); ++i)
+  {
+    KinectJpeg *j = myEncoding[i].get();
+    // no copy: the image is left alone until the publish stage is done with it
+    if(tjCompress2(myJpeg, image.ptr<unsigned char>(0), myWidth, image.step, myHeight, TJPF_RGB,
+        &j->data, &j->size, TJSAMP_420, j->quality, TJFLAG_FASTDCT | TJFLAG_NOREALLOC) != 0)
+    {
+      std::cout << "KinectJpegCache: Error compressing frame: " << tjGetErrorStr() << std::endl;
+      myEncoding[i].reset();
+      continue;
+    }
+    j->sequence = sequence;
+    ++myEncoded;
+  }
+
+  myMutex.lock();
+  for(size_t i = 0; i < myEncoding.size(); ++i)
+  {
+    if(!myEncoding[i])
+      continue;
+    // (a quality may have been added by a request meanwhile, but none removed)
+    for(size_t q = 0; q < myQualities.size(); ++q)
+    {
+      if(myQualities[q].quality != myEncoding[i]->quality)
+        continue;
+      myQualities[q].spare.swap(myQualities[q].latest);
+      myQualities[q].latest.swap(myEncoding[i]);
+      break;
+    }
+  }
+  myMutex.unlock();
+  myEncoding.clear();
+}
+
+KinectJpegPtr KinectJpegCache::getLatest(int quality)
+{
+  quality = std::max(1, std::min(100, quality));
+  const long long now = kinectTimeUSec();
+  myMutex.lock();
+  int found = -1, nearest = -1;
+  for(size_t q = 0; q < myQualities.size(); ++q)
+  {
+    if(myQualities[q].quality == quality)
+      found = q;
+    if(myQualities[q].latest && (nearest < 0 ||
+       abs(myQualities[q].quality - quality) < abs(myQualities[nearest].quality - quality)))
+      nearest = q;
+  }
+  if(found < 0 && (int)myQualities.size() < myMaxQualities)
+  {
+    // encoded from the next frame on; until then the nearest will do
+    Quality q;
+    q.quality = quality;
+    q.lastRequestUSec = now;
+    myQualities.push_back(q);
+  }
+  else if(found < 0)
+  {
+    found = nearest;
+  }
+  KinectJpegPtr jpeg;
+  if(found >= 0)
+  {
+    myQualities[found].lastRequestUSec = now;
+    jpeg = myQualities[found].latest;
+  }
+  if(!jpeg && nearest >= 0)
+    jpeg = myQualities[nearest].latest;
+  myMutex.unlock();
+  return jpeg;
+}
+
+void KinectJpegCache::handleRequest(ArServerClient *client, ArNetPacket *pkt)
+{
+  int quality = myDefaultQuality;
+  if(pkt && pkt->getDataReadLength() < pkt->getDataLength())
+    quality = pkt->bufToUByte();
+  KinectJpegPtr jpeg = getLatest(quality);
+
+  // (a new client is added with 0, so gets whatever there is)
+  myMutex.lock();
+  unsigned long& since = myClientSequence[client];
+  const bool fresh = jpeg && jpeg->sequence != since;
+  if(fresh)
+    since = jpeg->sequence;
+  const unsigned long sequence = since;
+  myMutex.unlock();
+
+  // Sent from the shared buffer, outside the lock: holding the reference
+  // keeps it from being reused until this client has it.
+  const unsigned char *data = fresh ? jpeg->data : NULL;
+  const unsigned long size = fresh ? jpeg->size : 0;
+  ArNetPacket reply;
+  unsigned long offset = 0;
+  do
+  {
+    const unsigned long chunk = std::min((unsigned long)KINECT_JPEG_CHUNK_SIZE, size - offset);
+    reply.empty();
+    reply.uByte4ToBuf(sequence);
+    reply.uByte2ToBuf(myWidth);
+    reply.uByte2ToBuf(myHeight);
+    reply.uByteToBuf(fresh ? jpeg->quality : 0);
+    reply.uByte4ToBuf(size);
+    reply.uByte4ToBuf(offset);
+    reply.uByte2ToBuf(chunk);
+    reply.uByteToBuf(offset + chunk >= size);
+    if(chunk > 0)
+      reply.dataToBuf((const char*)data + offset, chunk);
+    client->sendPacketTcp(&reply);
+    myBytesSent += reply.getLength();
+    offset += chunk;
+  } while(offset < size);
+  if(fresh)
+    ++mySent;
+}
+
+void KinectJpegCache::clientRemoved(ArServerClient *client)
+{
+  myMutex.lock();
+  myClientSequence.erase(client);
+  myMutex.unlock();
+}
@@ -0,0 +1,113 @@
+#ifndef KINECTJPEGCACHE_H
+#define KINECTJPEGCACHE_H
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <turbojpeg.h>
+#include <opencv2/opencv.hpp>
+#include "Aria.h"
+#include "ArNetworking.h"
+
+/** Whole frames of a Kinect video stream as JPEG, encoded once per frame
+ *  and quality however many clients are watching.
+ *
+ *  The publish stage hands each new image to update(), which encodes it
+ *  with libjpeg-turbo at every quality a client has asked for in the last
+ *  few seconds and makes that the latest frame. Requests are answered with
+ *  the latest frame from the cache, so a hundred viewers cost the robot the
+ *  same encoding as one. Frames are reference counted (KinectJpegPtr): a
+ *  client being sent one keeps it alive while the next is encoded, and
+ *  buffers nobody holds any more are reused.
+ *
+ *  ArNetworking request: KINECT_JPEG_REQUEST_PREFIX followed by the ArVideo
+ *  source name, e.g. "getKinectJpegKinect_RGB_160x120|libfreenect2|OpenCV",
+ *  with an optional uByte quality (1-100, default 75). Each request is
+ *  answered with the latest frame, unless that client has already been sent
+ *  it, as packets of:
+ *    uByte4 frame sequence number
+ *    uByte2 width, uByte2 height
+ *    uByte quality
+ *    uByte4 JPEG size (0 if there is no new frame)
+ *    uByte4 offset of this chunk in the JPEG
+ *    uByte2 chunk size
+ *    uByte 1 on the last packet of the frame, else 0
+ *    chunk data
+ */
+#define KINECT_JPEG_REQUEST_PREFIX "getKinectJpeg"
+#define KINECT_JPEG_CHUNK_SIZE 30000
+
+/** One encoded frame */
+struct KinectJpeg
+{
+  unsigned long sequence;
+  int width, height, quality;
+  unsigned char *data;  ///< tjAlloc()ed, tjBufSize() bytes
+  unsigned long size;
+
+  KinectJpeg(int w, int h) : sequence(0), width(w), height(h), quality(0),
+    data(tjAlloc(tjBufSize(w, h, TJSAMP_420))), size(0) {}
+  ~KinectJpeg() { tjFree(data); }
+};
+typedef std::shared_ptr<const KinectJpeg> KinectJpegPtr;
+
+class KinectJpegCache
+{
+public:
+  /** @param maxQualities most qualities encoded per frame; requests for
+   *    others get the nearest
+   *  @param idleTimeout ms after the last request for a quality to stop
+   *    encoding it */
+  KinectJpegCache(int width, int height, int defaultQuality = 75, int maxQualities = 3, int idleTimeout = 5000);
+  ~KinectJpegCache();
+
+  /** Encode @a image (CV_8UC3 RGB) at each quality wanted. Called by the
+   *  publish stage; does nothing if no client has asked lately. */
+  void update(const cv::Mat& image, unsigned long sequence);
+  /** Whether any client has asked lately, i.e. update() has work to do */
+  bool isWanted();
+  /** The latest frame at @a quality (or the nearest encoded), NULL if none
+   *  yet. Counts as asking for that quality. */
+  KinectJpegPtr getLatest(int quality);
+
+  ArFunctor2<ArServerClient*, ArNetPacket*> *getRequestFunctor() { return &myRequestFunctor; }
+  ArFunctor1<ArServerClient*> *getClientRemovedFunctor() { return &myClientRemovedFunctor; }
+
+  /** Frames encoded, counting each quality */
+  unsigned long getEncoded() const { return myEncoded; }
+  /** Frames sent to clients */
+  unsigned long getSent() const { return mySent; }
+  unsigned long getBytesSent() const { return myBytesSent; }
+
+private:
+  struct Quality
+  {
+    int quality;
+    long long lastRequestUSec;
+    std::shared_ptr<KinectJpeg> latest;
+    std::shared_ptr<KinectJpeg> spare;  ///< the one before, reused once nobody holds it
+  };
+
+  int myWidth, myHeight;
+  int myDefaultQuality;
+  int myMaxQualities;
+  int myIdleTimeout;
+  tjhandle myJpeg;  ///< used by update() only
+
+  ArMutex myMutex;
+  std::vector<Quality> myQualities;
+  std::vector<std::shared_ptr<KinectJpeg> > myEncoding;  ///< update() only
+  std::map<ArServerClient*, unsigned long> myClientSequence;  ///< last frame sent
+  ArFunctor2C<KinectJpegCache, ArServerClient*, ArNetPacket*> myRequestFunctor;
+  ArFunctor1C<KinectJpegCache, ArServerClient*> myClientRemovedFunctor;
+
+  std::atomic<unsigned long> myEncoded;
+  std::atomic<unsigned long> mySent;
+  std::atomic<unsigned long> myBytesSent;
+
+  void handleRequest(ArServerClient *client, ArNetPacket *pkt);
+  void clientRemoved(ArServerClient *client);
+};
+
+#endif
@@ -0,0 +1,140 @@
+
+#include "KinectJpegClient.h"
+#include "KinectJpegCache.h"
+
+KinectJpegClient::KinectJpegClient(ArClientBase *client, const char *sourceName) :
+  myClient(client),
+  myRequestName(std::string(KINECT_JPEG_REQUEST_PREFIX) + sourceName),
+  myHandlePacketCB(this, &KinectJpegClient::handlePacket),
+  myFrameCB(NULL),
+  myJpeg(tjInitDecompress()),
+  myAssemblingSequence(0),
+  myAssembled(0),
+  myWidth(0),
+  myHeight(0),
+  mySequence(0),
+  myHaveFrame(false),
+  myFramesReceived(0),
+  myEmptyReplies(0),
+  myBytesReceived(0),
+  myDecodeErrors(0),
+  myLastQuality(0)
+{
+  myClient->addHandler(myRequestName.c_str(), &myHandlePacketCB);
+}
+
+KinectJpegClient::~KinectJpegClient()
+{
+  myClient->remHandler(myRequestName.c_str(), &myHandlePacketCB);
+  tjDestroy(myJpeg);
+}
+
+bool KinectJpegClient::request(long intervalMs, int quality)
+{
+  if(!myClient->dataExists(myRequestName.c_str()))
+  {
+    ArLog::log(ArLog::Terse, "KinectJpegClient: server does not provide %s", myRequestName.c_str());
+    return false;
+  }
+  ArNetPacket pkt;
+  pkt.uByteToBuf(quality < 1 ? 1 : quality > 100 ? 100 : quality);
+  return myClient->request(myRequestName.c_str(), intervalMs, &pkt);
+}
+
+void KinectJpegClient::stop()
+{
+  myClient->requestStop(myRequestName.c_str());
+}
+
+void KinectJpegClient::handlePacket(ArNetPacket *pkt)
+{
+  const unsigned long seq = pkt->bufToUByte4();
+  const int width = pkt->bufToUByte2();
+  const int height = pkt->bufToUByte2();
+  const int quality = pkt->bufToUByte();
+  const size_t total = pkt->bufToUByte4();
+  const size_t offset = pkt->bufToUByte4();
+  const size_t chunk = pkt->bufToUByte2();
+  pkt->bufToUByte();  // last packet of the frame, implied by offset + chunk
+
+  myBytesReceived += pkt->getLength();
+
+  if(total == 0)
+  {
+    // no new frame since the last one we were sent
+    ++myEmptyReplies;
+    return;
+  }
+  if(offset == 0)
+  {
+    // start of a new frame; any partial frame is abandoned
+    myAssemblingSequence = seq;
+    myAssembled = 0;
+    if(myEncoded.size() < total)
+      myEncoded.resize(total);
+  }
+  if(seq != myAssemblingSequence || offset != myAssembled || offset + chunk > total || total > myEncoded.size())
+  {
+    // missed the start of this frame, or chunks out of order
+    myAssembled = 0;
+    return;
+  }
+  pkt->bufToData((char*)&myEncoded[offset], chunk);
+  myAssembled += chunk;
+  if(myAssembled < total)
+    return;
+
+  myAssembled = 0;
+  myMutex.lock();
+  myImage.resize(width * height * 3);
+  if(tjDecompress2(myJpeg, &myEncoded[0], total, &myImage[0], width, width * 3, height, TJPF_RGB, TJFLAG_FASTDCT) != 0)
+  {
+    myHaveFrame = false;
+    myMutex.unlock();
+    ++myDecodeErrors;
+    ArLog::log(ArLog::Normal, "KinectJpegClient: could not decode frame %lu", seq);
+    return;
+  }
+  myImageJpeg.assign(myEncoded.begin(), myEncoded.begin() + total);
+  myWidth = width;
+  myHeight = height;
+  mySequence = seq;
+  myHaveFrame = true;
+  myMutex.unlock();
+  ++myFramesReceived;
+  myLastQuality = quality;
+
+  if(myFrameCB)
+    myFrameCB->invoke();
+}
+
+bool KinectJpegClient::getLatest(std::vector<unsigned char>& rgb, int *width, int *height,
+  unsigned long *sequence)
+{
+  myMutex.lock();
+  if(!myHaveFrame)
+  {
+    myMutex.unlock();
+    return false;
+  }
+  rgb = myImage;
+  *width = myWidth;
+  *height = myHeight;
+  if(sequence) *sequence = mySequence;
+  myMutex.unlock();
+  return true;
+}
+
+bool KinectJpegClient::getLatestJpeg(std::vector<unsigned char>& jpeg, unsigned long *sequence)
+{
+  myMutex.lock();
+  if(!myHaveFrame)
+  {
+    myMutex.unlock();
+    return false;
+  }
+  jpeg = myImageJpeg;
+  if(sequence) *sequence = mySequence;
+  myMutex.unlock();
+  return true;
+}
@@ -0,0 +1,82 @@
+#ifndef KINECTJPEGCLIENT_H
+#define KINECTJPEGCLIENT_H
+
+#include <vector>
+#include <string>
+#include <turbojpeg.h>
+#include "Aria.h"
+#include "ArNetworking.h"
+
+/** Receives whole JPEG frames of a Kinect video stream from the
+ *  KinectJpegCache of KinectArVideoServer (KINECT_JPEG_REQUEST_PREFIX
+ *  followed by the ArVideo source name), reassembles the chunks of each
+ *  frame and decodes it to RGB.
+ *
+ *  Call request() after connecting the ArClientBase, then getLatest() or
+ *  getLatestJpeg() from any thread. A callback may be added to be notified
+ *  of each new frame; it is called in the ArClientBase thread.
+ */
+class KinectJpegClient
+{
+public:
+  /** @param sourceName ArVideo source name of the stream, e.g.
+   *    "Kinect_RGB|libfreenect2|OpenCV" */
+  KinectJpegClient(ArClientBase *client, const char *sourceName);
+  ~KinectJpegClient();
+
+  /** Ask the server for the latest frame at @a quality (1-100) every
+   *  @a intervalMs ms */
+  bool request(long intervalMs = 100, int quality = 75);
+  void stop();
+
+  /** Copy the most recently decoded frame into @a rgb (row-major RGB).
+   *  @return false if no frame has been received yet */
+  bool getLatest(std::vector<unsigned char>& rgb, int *width, int *height,
+    unsigned long *sequence = NULL);
+  /** Copy the most recent frame, still JPEG encoded, into @a jpeg.
+   *  @return false if no frame has been received yet */
+  bool getLatestJpeg(std::vector<unsigned char>& jpeg, unsigned long *sequence = NULL);
+
+  void setFrameCallback(ArFunctor *cb) { myFrameCB = cb; }
+
+  unsigned long getFramesReceived() const { return myFramesReceived; }
+  /** Replies with no new frame, from polling faster than the frame rate */
+  unsigned long getEmptyReplies() const { return myEmptyReplies; }
+  /** Total size of the packets received, headers included */
+  unsigned long getBytesReceived() const { return myBytesReceived; }
+  unsigned long getDecodeErrors() const { return myDecodeErrors; }
+  /** Quality the server encoded the last frame at (it may not have the
+   *  one asked for) */
+  int getLastQuality() const { return myLastQuality; }
+
+private:
+  ArClientBase *myClient;
+  std::string myRequestName;
+  ArFunctor1C<KinectJpegClient, ArNetPacket*> myHandlePacketCB;
+  ArFunctor *myFrameCB;
+  tjhandle myJpeg;
+
+  // frame being reassembled
+  std::vector<unsigned char> myEncoded;
+  unsigned long myAssemblingSequence;
+  size_t myAssembled;
+
+  // last complete frame
+  ArMutex myMutex;
+  std::vector<unsigned char> myImage;
+  std::vector<unsigned char> myImageJpeg;
+  int myWidth;
+  int myHeight;
+  unsigned long mySequence;
+  bool myHaveFrame;
+
+  unsigned long myFramesReceived;
+  unsigned long myEmptyReplies;
+  unsigned long myBytesReceived;
+  unsigned long myDecodeErrors;
+  int myLastQuality;
+
+  void handlePacket(ArNetPacket *pkt);
+};
+
+#endif
@@ -0,0 +1,205 @@
+
+#include <math.h>
+#include <algorithm>
+#include "KinectMarkerTracker.h"
+#include "KinectFramePool.h"
+
+KinectMarkerTracker::KinectMarkerTracker(const libfreenect2::Freenect2Device::IrCameraParams& ir,
+    float threshold, int minArea, int maxArea) :
+  myIr(ir),
+  myThreshold(threshold),
+  myMinArea(minArea),
+  myMaxArea(maxArea),
+  mySearchRadius(40),
+  myLabels(KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT),
+  myHaveLast(false),
+  myLastU(0),
+  myLastV(0),
+  myFullSearch(false)
+{
+  // at most one label per two pixels (a checkerboard), plus background
+  const size_t maxLabels = KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT / 2 + 2;
+  myParent.reserve(maxLabels);
+  myBlobs.reserve(maxLabels);
+  myDepths.reserve(KINECT_DEPTH_WIDTH * KINECT_DEPTH_HEIGHT);
+}
+
+int KinectMarkerTracker::findRoot(int label)
+{
+  while(myParent[label] != label)
+  {
+    myParent[label] = myParent[myParent[label]];
+    label = myParent[label];
+  }
+  return label;
+}
+
+/** Label the pixels above the threshold in columns c0..c1-1 and rows
+ * r0..r1-1 and find the brightest blob within the area range. */
+bool KinectMarkerTracker::search(const float *ir, int c0, int r0, int c1, int r1, Blob *best)
+{
+  const int w = c1 - c0, h = r1 - r0;
+  const float t = myThreshold;
+  int *labels = &myLabels[0];
+  myParent.clear();
+  myParent.push_back(0);
+
+  // first pass: provisional labels, merging where two meet
+  bool any = false;
+  for(int r = 0; r < h; ++r)
+  {
+    const float *in = ir + (r0 + r) * KINECT_DEPTH_WIDTH + c0;
+    int *out = labels + r * w;
+    const int *above = r > 0 ? out - w : NULL;
+    for(int c = 0; c < w; ++c)
+    {
+      if(!(in[c] > t))
+      {
+        out[c] = 0;
+        continue;
+      }
+      any = true;
+      const int up = above ? above[c] : 0;
+      const int left = c > 0 ? out[c - 1] : 0;
+      if(up && left)
+      {
+        const int a = findRoot(up), b = findRoot(left);
+        if(a != b)
+          myParent[std::max(a, b)] = std::min(a, b);
+        out[c] = a < b ? a : b;
+      }
+      else if(up || left)
+        out[c] = up ? up : left;
+      else
+      {
+        out[c] = myParent.size();
+        myParent.push_back(myParent.size());
+      }
+    }
+  }
+  if(!any)
+    return false;
+
+  // second pass: accumulate each component into its root's blob
+  myBlobs.assign(myParent.size(), Blob());
+  for(int r = 0; r < h; ++r)
+  {
+    const float *in = ir + (r0 + r) * KINECT_DEPTH_WIDTH + c0;
+    const int *l = labels + r * w;
+    for(int c = 0; c < w; ++c)
+    {
+      if(!l[c])
+        continue;
+      Blob& b = myBlobs[findRoot(l[c])];
+      const int col = c0 + c, row = r0 + r;
+      const float weight = in[c] - t;
+      if(b.area == 0)
+      {
+        b.c0 = b.c1 = col;
+        b.r0 = b.r1 = row;
+      }
+      b.weight += weight;
+      b.u += weight * col;
+      b.v += weight * row;
+      ++b.area;
+      b.peak = std::max(b.peak, in[c]);
+      b.c0 = std::min(b.c0, col);
+      b.c1 = std::max(b.c1, col);
+      b.r1 = row;
+    }
+  }
+
+  const int minArea = myMinArea, maxArea = myMaxArea;
+  const Blob *found = NULL;
+  for(size_t i = 1; i < myBlobs.size(); ++i)
+  {
+    const Blob& b = myBlobs[i];
+    if(b.area >= minArea && b.area <= maxArea && b.weight > 0 && (!found || b.weight > found->weight))
+      found = &b;
+  }
+  if(!found)
+    return false;
+  *best = *found;
+  return true;
+}
+
+/** Median of the valid depth in and just around @a b */
+bool KinectMarkerTracker::markerDepth(const float *depth, const Blob& b, float *mm)
+{
+  const int margin = 2;
+  const int c0 = std::max(0, b.c0 - margin), c1 = std::min(KINECT_DEPTH_WIDTH - 1, b.c1 + margin);
+  const int r0 = std::max(0, b.r0 - margin), r1 = std::min(KINECT_DEPTH_HEIGHT - 1, b.r1 + margin);
+  myDepths.clear();
+  for(int r = r0; r <= r1; ++r)
+  {
+    const float *d = depth + r * KINECT_DEPTH_WIDTH;
+    for(int c = c0; c <= c1; ++c)
+      if(d[c] > 500 && d[c] < 4500)
+        myDepths.push_back(d[c]);
+  }
+  if(myDepths.size() < 3)
+    return false;
+  std::nth_element(myDepths.begin(), myDepths.begin() + myDepths.size() / 2, myDepths.end());
+  *mm = myDepths[myDepths.size() / 2];
+  return true;
+}
+
+/** Undistorted pixel whose distortion, as libfreenect2::Registration models
+ * it, is (@a u, @a v): fixed-point iteration, which converges in a few
+ * steps for the Kinect's mild distortion. */
+void KinectMarkerTracker::undistort(float u, float v, float *uu, float *vv) const
+{
+  const float xd = (u - myIr.cx) / myIr.fx, yd = (v - myIr.cy) / myIr.fy;
+  float x = xd, y = yd;
+  for(int i = 0; i < 8; ++i)
+  {
+    const float x2 = x * x, y2 = y * y, r2 = x2 + y2, xy = x * y;
+    const float kr = 1 + ((myIr.k3 * r2 + myIr.k2) * r2 + myIr.k1) * r2;
+    x = (xd - myIr.p2 * (r2 + 2 * x2) - myIr.p1 * xy * 2) / kr;
+    y = (yd - myIr.p1 * (r2 + 2 * y2) - myIr.p2 * xy * 2) / kr;
+  }
+  *uu = myIr.fx * x + myIr.cx;
+  *vv = myIr.fy * y + myIr.cy;
+}
+
+bool KinectMarkerTracker::track(const libfreenect2::Frame *ir, const libfreenect2::Frame *depth, KinectMarker *marker)
+{
+  const float *irData = (const float*)ir->data;
+  Blob b;
+  bool found = false;
+  myFullSearch = false;
+  if(myHaveLast)
+  {
+    const int rad = mySearchRadius;
+    const int c0 = std::max(0, (int)myLastU - rad), c1 = std::min(KINECT_DEPTH_WIDTH, (int)myLastU + rad + 1);
+    const int r0 = std::max(0, (int)myLastV - rad), r1 = std::min(KINECT_DEPTH_HEIGHT, (int)myLastV + rad + 1);
+    found = c1 > c0 && r1 > r0 && search(irData, c0, r0, c1, r1, &b);
+  }
+  if(!found)
+  {
+    myFullSearch = true;
+    found = search(irData, 0, 0, KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, &b);
+  }
+  myHaveLast = found;
+  if(!found)
+    return false;
+
+  marker->u = myLastU = b.u / b.weight;
+  marker->v = myLastV = b.v / b.weight;
+  marker->area = b.area;
+  marker->peak = b.peak;
+  float mm;
+  marker->depthValid = depth && markerDepth((const float*)depth->data, b, &mm);
+  if(marker->depthValid)
+  {
+    // same pixel centres as Registration::getPointXYZ() and KinectPointCloud
+    float uu, vv;
+    undistort(marker->u, marker->v, &uu, &vv);
+    marker->z = mm * 0.001f;
+    marker->x = (uu + 0.5f - myIr.cx) / myIr.fx * marker->z;
+    marker->y = (vv + 0.5f - myIr.cy) / myIr.fy * marker->z;
+  }
+  else
+    marker->x = marker->y = marker->z = 0;
+  return true;
+}
@@ -0,0 +1,88 @@
+#ifndef KINECTMARKERTRACKER_H
+#define KINECTMARKERTRACKER_H
+
+#include <vector>
+#include <atomic>
+#include <libfreenect2/libfreenect2.hpp>
+
+/** A retroreflective marker found by KinectMarkerTracker */
+struct KinectMarker
+{
+  float u, v;        ///< sub-pixel centroid in the IR image (not mirrored, pixel centres at integers)
+  int area;          ///< pixels above the threshold
+  float peak;        ///< brightest IR value in it
+  bool depthValid;   ///< x, y, z are known
+  float x, y, z;     ///< metres in the depth camera frame, as KinectPoint
+};
+
+/** Finds a retroreflective marker (e.g. on a gripper) in the Kinect's
+ *  512x424 IR image, which is cheap compared to the 1080p colour image.
+ *
+ *  Pixels brighter than the threshold are labelled into 4-connected
+ *  components (two passes with union-find), and the blob with the most
+ *  light above the threshold whose area is within range is taken as the
+ *  marker. Its centroid is weighted by brightness above the threshold, so
+ *  is sub-pixel. Once found, only a window around the last position is
+ *  searched, falling back to the whole image if the marker is not there.
+ *
+ *  The marker itself often saturates the depth sensor, so its depth is the
+ *  median of the valid depth pixels in and just around the blob. The
+ *  centroid is undistorted (libfreenect2's IR lens model, inverted by
+ *  iteration) and back-projected through the IR camera intrinsics at that
+ *  depth, so the position matches KinectPointCloud's points.
+ *
+ *  Buffers are allocated once. Not thread safe: call track() from one
+ *  thread at a time.
+ */
+class KinectMarkerTracker
+{
+public:
+  /** @param threshold IR intensity (libfreenect2 IR frames are 0-65535)
+   *  @param minArea, maxArea pixel area of a blob to be taken as the marker
+   */
+  KinectMarkerTracker(const libfreenect2::Freenect2Device::IrCameraParams& ir,
+    float threshold = 30000, int minArea = 3, int maxArea = 1500);
+
+  /** Find the marker in @a ir (float, 512x424) and its position from
+   *  @a depth (float mm, same size, may be NULL).
+   *  @return false if there is none */
+  bool track(const libfreenect2::Frame *ir, const libfreenect2::Frame *depth, KinectMarker *marker);
+
+  /** May be changed while running; take effect from the next frame. */
+  void setThreshold(float threshold) { myThreshold = threshold; }
+  float getThreshold() const { return myThreshold; }
+  void setAreaRange(int minArea, int maxArea) { myMinArea = minArea; myMaxArea = maxArea; }
+  /** Half size of the window searched around the last position (pixels) */
+  void setSearchRadius(int pixels) { mySearchRadius = pixels; }
+
+  /** Whether the last track() searched the whole image */
+  bool wasFullSearch() const { return myFullSearch; }
+
+private:
+  struct Blob
+  {
+    double weight, u, v;
+    int area;
+    float peak;
+    int c0, r0, c1, r1;  ///< bounding box, inclusive
+  };
+
+  libfreenect2::Freenect2Device::IrCameraParams myIr;
+  std::atomic<float> myThreshold;
+  std::atomic<int> myMinArea, myMaxArea;
+  std::atomic<int> mySearchRadius;
+  std::vector<int> myLabels;    ///< per pixel of the searched window, 0 for background
+  std::vector<int> myParent;    ///< union-find over labels
+  std::vector<Blob> myBlobs;    ///< per root label
+  std::vector<float> myDepths;  ///< around the marker, for the median
+  bool myHaveLast;
+  float myLastU, myLastV;
+  bool myFullSearch;
+
+  bool search(const float *ir, int c0, int r0, int c1, int r1, Blob *best);
+  int findRoot(int label);
+  bool markerDepth(const float *depth, const Blob& b, float *mm);
+  void undistort(float u, float v, float *uu, float *vv) const;
+};
+
+#endif
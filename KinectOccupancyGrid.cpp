@@ -0,0 +1,287 @@
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+#include "KinectOccupancyGrid.h"
+#include "KinectFramePool.h"
+
+// as KinectPointCloud
+static const int NumStripes = 8;
+
+// Depth beyond this is ignored; also keeps the fixed point products in range
+static const int MaxDepthMM = 8000;
+
+static inline int32_t toQ16(float v)
+{
+  return (int32_t)lrintf(v * 65536.0f);
+}
+
+KinectOccupancyGrid::KinectOccupancyGrid(int cellSize, int range) :
+  myCellSize(cellSize),
+  myRange(range),
+  myCols(2 * range / cellSize),
+  myRows(2 * range / cellSize),
+  myHaveParams(false),
+  myRayX(KINECT_DEPTH_WIDTH),
+  myRayY(KINECT_DEPTH_HEIGHT),
+  myColRays(KINECT_DEPTH_WIDTH),
+  myRowRays(KINECT_DEPTH_HEIGHT),
+  myObstacleHeight(80),
+  myCeilingHeight(2000),
+  myMinPoints(4),
+  myHeightTolerance(50),
+  myStripeCounts(NumStripes, std::vector<uint16_t>(myCols * myRows)),
+  myStripeHeights(NumStripes, std::vector<int16_t>(myCols * myRows)),
+  myDepth(NULL),
+  myOffsetX(0), myOffsetY(0), myCameraZ(0),
+  mySequence(0),
+  myState(myCols * myRows, Unknown),
+  myHeight(myCols * myRows, 0),
+  myCellSequence(myCols * myRows, 0),
+  myDrawingDirty(true),
+  myLastChanged(0),
+  myOccupied(0),
+  myBytesSent(0),
+  myRequestFunctor(this, &KinectOccupancyGrid::handleRequest),
+  myDrawingFunctor(this, &KinectOccupancyGrid::handleDrawing),
+  myClientRemovedFunctor(this, &KinectOccupancyGrid::clientRemoved)
+{
+}
+
+KinectOccupancyGrid::~KinectOccupancyGrid()
+{
+}
+
+void KinectOccupancyGrid::setCameraParams(const libfreenect2::Freenect2Device::IrCameraParams& ir)
+{
+  // same pixel centres as KinectPointCloud
+  for(int c = 0; c < KINECT_DEPTH_WIDTH; ++c)
+    myRayX[c] = (c + 0.5f - ir.cx) / ir.fx;
+  for(int r = 0; r < KINECT_DEPTH_HEIGHT; ++r)
+    myRayY[r] = (r + 0.5f - ir.cy) / ir.fy;
+  myHaveParams = true;
+}
+
+void KinectOccupancyGrid::binStripe(int stripe, int rowBegin, int rowEnd)
+{
+  uint16_t *counts = &myStripeCounts[stripe][0];
+  int16_t *heights = &myStripeHeights[stripe][0];
+  const int cells = myCols * myRows;
+  memset(counts, 0, cells * sizeof(uint16_t));
+  std::fill(heights, heights + cells, INT16_MIN);
+  const int ceiling = myCeilingHeight;
+  const int w = KINECT_DEPTH_WIDTH;
+
+  for(int r = rowBegin; r < rowEnd; ++r)
+  {
+    const float *depth = myDepth + r * w;
+    const ColumnRay rr = myRowRays[r];
+    for(int c = 0; c < w; ++c)
+    {
+      const float v = depth[c];
+      if(!(v > 0.0f && v < MaxDepthMM))  // NaN too
+        continue;
+      const int32_t d = (int32_t)(v + 0.5f);
+      const ColumnRay& cr = myColRays[c];
+      const int32_t z = ((d * (cr.z + rr.z)) >> 16) + myCameraZ;
+      if(z > ceiling)
+        continue;
+      const int32_t ix = (d * (cr.x + rr.x) + myOffsetX) >> 16;
+      const int32_t iy = (d * (cr.y + rr.y) + myOffsetY) >> 16;
+      if((uint32_t)ix >= (uint32_t)myCols || (uint32_t)iy >= (uint32_t)myRows)
+        continue;
+      const int i = iy * myCols + ix;
+      ++counts[i];
+      if(z > heights[i])
+        heights[i] = (int16_t)std::max(z, (int32_t)INT16_MIN);
+    }
+  }
+}
+
+class KinectOccupancyGridBody : public cv::ParallelLoopBody
+{
+  KinectOccupancyGrid& grid;
+public:
+  KinectOccupancyGridBody(KinectOccupancyGrid& _grid) : grid(_grid) {}
+  virtual void operator()(const cv::Range& range) const
+  {
+    const int rows = KINECT_DEPTH_HEIGHT;
+    for(int s = range.start; s < range.end; ++s)
+      grid.binStripe(s, rows * s / NumStripes, rows * (s + 1) / NumStripes);
+  }
+};
+
+void KinectOccupancyGrid::update(const libfreenect2::Frame *depth, const KinectCameraPose& pose, unsigned long sequence)
+{
+  if(!myHaveParams)
+    return;
+
+  // Camera axes (x left, as libfreenect2's images are mirrored; y down; z
+  // forward) in the robot frame: tilt about the robot's y axis, then pan
+  // about its z axis.
+  const float t = ArMath::degToRad(pose.tilt), p = ArMath::degToRad(-pose.pan);
+  const float ct = cosf(t), st = sinf(t), cp = cosf(p), sp = sinf(p);
+  // before rotating: x left = +y, y down = -z, z forward = +x
+  const float ax = 0, ay = 1, az = 0;
+  const float bx = st, by = 0, bz = -ct;   // -z tilted
+  const float fx = ct, fy = 0, fz = st;    // +x tilted
+  const float A[3] = { ax * cp - ay * sp, ax * sp + ay * cp, az };
+  const float B[3] = { bx * cp - by * sp, bx * sp + by * cp, bz };
+  const float F[3] = { fx * cp - fy * sp, fx * sp + fy * cp, fz };
+
+  // point = depth * (A * rayX[c] + B * rayY[r] + F) + camera position
+  const float perCell = 1.0f / myCellSize;
+  for(int c = 0; c < KINECT_DEPTH_WIDTH; ++c)
+  {
+    myColRays[c].x = toQ16(A[0] * myRayX[c] * perCell);
+    myColRays[c].y = toQ16(A[1] * myRayX[c] * perCell);
+    myColRays[c].z = toQ16(A[2] * myRayX[c]);
+  }
+  for(int r = 0; r < KINECT_DEPTH_HEIGHT; ++r)
+  {
+    myRowRays[r].x = toQ16((B[0] * myRayY[r] + F[0]) * perCell);
+    myRowRays[r].y = toQ16((B[1] * myRayY[r] + F[1]) * perCell);
+    myRowRays[r].z = toQ16(B[2] * myRayY[r] + F[2]);
+  }
+  myOffsetX = toQ16((pose.x + myRange) * perCell);
+  myOffsetY = toQ16((pose.y + myRange) * perCell);
+  myCameraZ = (int32_t)pose.z;
+  myDepth = (const float*)depth->data;
+
+  cv::parallel_for_(cv::Range(0, NumStripes), KinectOccupancyGridBody(*this));
+
+  // merge stripes and find what changed
+  const int cells = myCols * myRows;
+  const int minPoints = myMinPoints, obstacle = myObstacleHeight, tolerance = myHeightTolerance;
+  size_t changed = 0, occupied = 0;
+  myMutex.lock();
+  for(int i = 0; i < cells; ++i)
+  {
+    int n = 0, h = INT16_MIN;
+    for(int s = 0; s < NumStripes; ++s)
+    {
+      n += myStripeCounts[s][i];
+      h = std::max(h, (int)myStripeHeights[s][i]);
+    }
+    unsigned char state = Unknown;
+    if(n >= minPoints)
+      state = h >= obstacle ? Occupied : Free;
+    else
+      h = 0;
+    if(state == Occupied)
+      ++occupied;
+    if(state == myState[i] && (state == Unknown || abs(h - myHeight[i]) <= tolerance))
+      continue;
+    myState[i] = state;
+    myHeight[i] = h;
+    myCellSequence[i] = sequence;
+    ++changed;
+  }
+  mySequence = sequence;
+  myLastChanged = changed;
+  myOccupied = occupied;
+  if(changed > 0)
+    myDrawingDirty = true;
+  myMutex.unlock();
+}
+
+KinectOccupancyGrid::CellState KinectOccupancyGrid::getState(int col, int row)
+{
+  myMutex.lock();
+  const CellState s = (CellState)myState[row * myCols + col];
+  myMutex.unlock();
+  return s;
+}
+
+int KinectOccupancyGrid::getHeight(int col, int row)
+{
+  myMutex.lock();
+  const int h = myHeight[row * myCols + col];
+  myMutex.unlock();
+  return h;
+}
+
+/** Header of a KINECT_OCCUPANCY_REQUEST packet, up to the cell count */
+void KinectOccupancyGrid::startPacket()
+{
+  myPacket.empty();
+  myPacket.uByte4ToBuf(mySequence);
+  myPacket.uByte2ToBuf(myCols);
+  myPacket.uByte2ToBuf(myRows);
+  myPacket.uByte2ToBuf(myCellSize);
+  myPacket.byte4ToBuf(-myRange);
+  myPacket.byte4ToBuf(-myRange);
+}
+
+void KinectOccupancyGrid::handleRequest(ArServerClient *client, ArNetPacket *)
+{
+  myMutex.lock();
+  // (a new client is added with 0, so is sent every known cell)
+  unsigned long& since = myClientSequence[client];
+  const int cells = myCols * myRows;
+  int i = 0;
+  do
+  {
+    // count the cells that fit in this packet, then write them
+    int n = 0, end = i;
+    for(; end < cells && n < KINECT_OCCUPANCY_CELLS_PER_PACKET; ++end)
+      if(myCellSequence[end] > since && (since > 0 || myState[end] != Unknown))
+        ++n;
+    startPacket();
+    myPacket.uByte2ToBuf(n);
+    myPacket.uByteToBuf(end >= cells);
+    for(; i < end; ++i)
+    {
+      if(myCellSequence[i] <= since || (since == 0 && myState[i] == Unknown))
+        continue;
+      myPacket.uByte2ToBuf(i % myCols);
+      myPacket.uByte2ToBuf(i / myCols);
+      myPacket.uByteToBuf(myState[i]);
+      myPacket.byte2ToBuf(myHeight[i]);
+    }
+    client->sendPacketTcp(&myPacket);
+    myBytesSent += myPacket.getLength();
+  } while(i < cells);
+  since = mySequence;
+  myMutex.unlock();
+}
+
+/** polyDots drawing of the occupied cells' centres; rebuilt only when the
+ * grid has changed. */
+void KinectOccupancyGrid::handleDrawing(ArServerClient *client, ArNetPacket *)
+{
+  myMutex.lock();
+  if(myDrawingDirty)
+  {
+    const int cells = myCols * myRows;
+    const int maxDots = (ArNetPacket::MAX_DATA_LENGTH - 4) / 8;
+    int n = 0;
+    for(int i = 0; i < cells; ++i)
+      if(myState[i] == Occupied)
+        ++n;
+    n = std::min(n, maxDots);
+    myDrawingPacket.empty();
+    myDrawingPacket.byte4ToBuf(n);
+    for(int i = 0; i < cells && n > 0; ++i)
+    {
+      if(myState[i] != Occupied)
+        continue;
+      myDrawingPacket.byte4ToBuf(-myRange + (i % myCols) * myCellSize + myCellSize / 2);
+      myDrawingPacket.byte4ToBuf(-myRange + (i / myCols) * myCellSize + myCellSize / 2);
+      --n;
+    }
+    myDrawingDirty = false;
+  }
+  client->sendPacketTcp(&myDrawingPacket);
+  myMutex.unlock();
+}
+
+void KinectOccupancyGrid::clientRemoved(ArServerClient *client)
+{
+  myMutex.lock();
+  myClientSequence.erase(client);
+  myMutex.unlock();
+}
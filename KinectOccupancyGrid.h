@@ -0,0 +1,153 @@
+#ifndef KINECTOCCUPANCYGRID_H
+#define KINECTOCCUPANCYGRID_H
+
+#include <vector>
+#include <map>
+#include <atomic>
+#include <stdint.h>
+#include <libfreenect2/libfreenect2.hpp>
+#include "Aria.h"
+#include "ArNetworking.h"
+
+/** Where the Kinect is, in the robot frame used by the "armEE" drawing:
+ *  origin below the PTU pan axis on the floor, x forward, y left, z up, mm.
+ */
+struct KinectCameraPose
+{
+  float x, y, z;   ///< depth camera position (mm)
+  float pan;       ///< degrees, positive to the right (as ArmDemoTask::ptu_look_at())
+  float tilt;      ///< degrees, positive up
+};
+
+/** ArNetworking request for the incremental occupancy grid. Each time it is
+ *  handled the client is sent the cells that changed since it was last
+ *  served (all known cells the first time), as a series of packets of:
+ *    uByte4 grid update sequence number
+ *    uByte2 columns (x), uByte2 rows (y), uByte2 cell size (mm)
+ *    byte4 x, byte4 y of the corner of cell (0,0) (mm, robot frame)
+ *    uByte2 number of cells in this packet
+ *    uByte 1 on the last packet of the update, else 0
+ *    for each cell: uByte2 column, uByte2 row, uByte state (CellState),
+ *      byte2 height of the highest point in it (mm above the floor)
+ */
+#define KINECT_OCCUPANCY_REQUEST "getKinectOccupancy"
+#define KINECT_OCCUPANCY_CELLS_PER_PACKET 4000
+
+/** 2D occupancy and height grid around the robot, from Kinect depth.
+ *
+ *  Each depth pixel is projected into the robot frame (see KinectCameraPose)
+ *  and binned into a square grid of cells centred on the origin, keeping
+ *  the number of points and the highest point of each cell. The projection
+ *  is done in fixed point: per-column and per-row ray tables, rotated to the
+ *  robot frame and scaled to cells once per update, so that each pixel takes
+ *  a few integer multiplies and shifts. Rows are split into stripes run with
+ *  cv::parallel_for_, each binning into its own grid, which are then merged.
+ *  Lens distortion is ignored, which is well under a cell at the grid's
+ *  range.
+ *
+ *  A cell with enough points is Occupied if its highest point is at least
+ *  the obstacle height above the floor, otherwise Free. Points above the
+ *  ceiling height are ignored.
+ *
+ *  Only cells whose state or height changed are sent to clients of
+ *  KINECT_OCCUPANCY_REQUEST. The occupied cells are also available as an
+ *  ArServerInfoDrawings "polyDots" drawing (getDrawingFunctor()), for
+ *  MobileEyes.
+ */
+class KinectOccupancyGrid
+{
+public:
+  typedef enum {
+    Unknown,   ///< too few points
+    Free,
+    Occupied
+  } CellState;
+
+  /** @param cellSize cell edge length (mm)
+   *  @param range the grid covers -range to +range in x and y (mm)
+   */
+  KinectOccupancyGrid(int cellSize = 50, int range = 2000);
+  ~KinectOccupancyGrid();
+
+  /** Depth camera intrinsics; must be set before update() */
+  void setCameraParams(const libfreenect2::Freenect2Device::IrCameraParams& ir);
+
+  /** Bin one depth frame (float mm) taken from @a pose. Not thread safe:
+   *  call from one thread at a time. */
+  void update(const libfreenect2::Frame *depth, const KinectCameraPose& pose, unsigned long sequence);
+
+  /** @param obstacle a cell is occupied if it has a point this high (mm)
+   *  @param ceiling points higher than this are ignored (mm) */
+  void setHeights(int obstacle, int ceiling) { myObstacleHeight = obstacle; myCeilingHeight = ceiling; }
+  /** Points a cell needs to be known */
+  void setMinPoints(int n) { myMinPoints = n; }
+  /** A known cell's height must change by more than this to be re-sent (mm) */
+  void setHeightTolerance(int mm) { myHeightTolerance = mm; }
+
+  int getCellSize() const { return myCellSize; }
+  int getCols() const { return myCols; }
+  int getRows() const { return myRows; }
+  /** State and height of a cell as last sent to clients */
+  CellState getState(int col, int row);
+  int getHeight(int col, int row);
+
+  ArFunctor2<ArServerClient*, ArNetPacket*> *getRequestFunctor() { return &myRequestFunctor; }
+  ArFunctor2<ArServerClient*, ArNetPacket*> *getDrawingFunctor() { return &myDrawingFunctor; }
+  ArFunctor1<ArServerClient*> *getClientRemovedFunctor() { return &myClientRemovedFunctor; }
+
+  /** Cells changed by the last update */
+  size_t getLastChangedCells() const { return myLastChanged; }
+  size_t getOccupiedCells() const { return myOccupied; }
+  /** Total bytes sent to KINECT_OCCUPANCY_REQUEST clients */
+  unsigned long getBytesSent() const { return myBytesSent; }
+
+private:
+  struct ColumnRay
+  {
+    int32_t x, y, z;  ///< Q16: x and y in cells per mm of depth, z in mm per mm
+  };
+
+  int myCellSize;
+  int myRange;
+  int myCols, myRows;
+  bool myHaveParams;
+  std::vector<float> myRayX, myRayY;
+  std::vector<ColumnRay> myColRays, myRowRays;
+  std::atomic<int> myObstacleHeight;
+  std::atomic<int> myCeilingHeight;
+  std::atomic<int> myMinPoints;
+  std::atomic<int> myHeightTolerance;
+
+  // per stripe, during update()
+  std::vector<std::vector<uint16_t> > myStripeCounts;
+  std::vector<std::vector<int16_t> > myStripeHeights;
+  const float *myDepth;
+  int32_t myOffsetX, myOffsetY, myCameraZ;
+
+  // state as sent to clients
+  ArMutex myMutex;
+  unsigned long mySequence;
+  std::vector<unsigned char> myState;
+  std::vector<int16_t> myHeight;
+  std::vector<unsigned long> myCellSequence;  ///< last change of each cell
+  std::map<ArServerClient*, unsigned long> myClientSequence;  ///< last update sent
+  ArNetPacket myPacket;
+  ArNetPacket myDrawingPacket;
+  bool myDrawingDirty;
+  size_t myLastChanged;
+  size_t myOccupied;
+  std::atomic<unsigned long> myBytesSent;
+
+  ArFunctor2C<KinectOccupancyGrid, ArServerClient*, ArNetPacket*> myRequestFunctor;
+  ArFunctor2C<KinectOccupancyGrid, ArServerClient*, ArNetPacket*> myDrawingFunctor;
+  ArFunctor1C<KinectOccupancyGrid, ArServerClient*> myClientRemovedFunctor;
+
+  friend class KinectOccupancyGridBody;
+  void binStripe(int stripe, int rowBegin, int rowEnd);
+  void handleRequest(ArServerClient *client, ArNetPacket *pkt);
+  void handleDrawing(ArServerClient *client, ArNetPacket *pkt);
+  void clientRemoved(ArServerClient *client);
+  void startPacket();
+};
+
+#endif
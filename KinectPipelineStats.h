@@ -0,0 +1,152 @@
+#ifndef KINECTPIPELINESTATS_H
+#define KINECTPIPELINESTATS_H
+
+#include <atomic>
+#include <algorithm>
+#include <time.h>
+
+/** Monotonic clock in microseconds, for timing pipeline stages. */
+inline long long kinectTimeUSec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/** Latency histogram in the style of HdrHistogram: buckets are linear
+ *  within each power of two, 16 per power, so any value is recorded to
+ *  within about 6%. Covers 0 to about 2 minutes in microseconds; longer
+ *  values go in the last bucket.
+ *
+ *  record() is lock-free and wait-free (one relaxed atomic increment), so it
+ *  can be called from the pipeline threads while another thread reads
+ *  percentiles. Readers see a consistent-enough snapshot, not an exact one.
+ */
+class KinectLatencyHistogram
+{
+public:
+  enum { SubBucketBits = 4, SubBuckets = 1 << SubBucketBits, NumBuckets = 24 * SubBuckets };
+
+  KinectLatencyHistogram() { reset(); }
+
+  void record(long long usec)
+  {
+    myCounts[bucket(usec)].fetch_add(1, std::memory_order_relaxed);
+    myCount.fetch_add(1, std::memory_order_relaxed);
+    long long max = myMax.load(std::memory_order_relaxed);
+    while(usec > max && !myMax.compare_exchange_weak(max, usec, std::memory_order_relaxed))
+      ;
+  }
+
+  /** Clear all counts. Values recorded concurrently may be lost. */
+  void reset()
+  {
+    for(int i = 0; i < NumBuckets; ++i)
+      myCounts[i].store(0, std::memory_order_relaxed);
+    myCount.store(0);
+    myMax.store(0);
+  }
+
+  /** @return the value (upper end of its bucket) below which @a percent of
+   *  recorded values fall, or 0 if nothing has been recorded */
+  long long getPercentile(double percent) const
+  {
+    const unsigned long total = myCount.load(std::memory_order_relaxed);
+    if(total == 0)
+      return 0;
+    const unsigned long wanted = (unsigned long)(total * percent / 100.0 + 0.5);
+    unsigned long seen = 0;
+    for(int i = 0; i < NumBuckets; ++i)
+    {
+      seen += myCounts[i].load(std::memory_order_relaxed);
+      if(seen >= wanted && seen > 0 && i < NumBuckets - 1)
+        return std::min(bucketTop(i), getMax());
+    }
+    return getMax();
+  }
+
+  unsigned long getCount() const { return myCount.load(); }
+  long long getMax() const { return myMax.load(); }
+
+private:
+  std::atomic<unsigned long> myCounts[NumBuckets];
+  std::atomic<unsigned long> myCount;
+  std::atomic<long long> myMax;
+
+  // Values below 2*SubBuckets have a bucket each; above that, bucket index
+  // is (shift+1)*SubBuckets + the top SubBucketBits bits after the leading 1.
+  static int bucket(long long v)
+  {
+    if(v < 2 * SubBuckets)
+      return v < 0 ? 0 : (int)v;
+    const int shift = (63 - __builtin_clzll((unsigned long long)v)) - SubBucketBits;
+    const int i = (shift + 1) * SubBuckets + (int)((v >> shift) - SubBuckets);
+    return i < NumBuckets ? i : NumBuckets - 1;
+  }
+
+  static long long bucketTop(int i)
+  {
+    if(i < 2 * SubBuckets)
+      return i;
+    const int shift = i / SubBuckets - 1;
+    return ((long long)(i % SubBuckets + SubBuckets + 1) << shift) - 1;
+  }
+};
+
+
+/** Counters for one stage of the Kinect video pipeline.
+ *  Updated by the stage's own thread, may be read from any thread.
+ */
+class KinectStageStats
+{
+public:
+  KinectStageStats() : myFrames(0), myDropped(0), myLastUSec(0), myMaxUSec(0), myTotalUSec(0) {}
+
+  /** Record one frame handled by this stage, taking @a usec microseconds. */
+  void addFrame(long long usec)
+  {
+    myFrames.fetch_add(1, std::memory_order_relaxed);
+    myLastUSec.store(usec, std::memory_order_relaxed);
+    myTotalUSec.fetch_add(usec, std::memory_order_relaxed);
+    long long max = myMaxUSec.load(std::memory_order_relaxed);
+    while(usec > max && !myMaxUSec.compare_exchange_weak(max, usec, std::memory_order_relaxed))
+      ;
+    myHistogram.record(usec);
+  }
+
+  /** Record a frame this stage had to discard. */
+  void addDropped() { myDropped.fetch_add(1, std::memory_order_relaxed); }
+
+  /** Clear all counters. Updates made concurrently may be lost. */
+  void reset()
+  {
+    myFrames.store(0);
+    myDropped.store(0);
+    myLastUSec.store(0);
+    myMaxUSec.store(0);
+    myTotalUSec.store(0);
+    myHistogram.reset();
+  }
+
+  unsigned long getFrames() const { return myFrames.load(); }
+  unsigned long getDropped() const { return myDropped.load(); }
+  long long getLastUSec() const { return myLastUSec.load(); }
+  long long getMaxUSec() const { return myMaxUSec.load(); }
+  double getMeanUSec() const
+  {
+    const unsigned long n = myFrames.load();
+    return n > 0 ? (double)myTotalUSec.load() / n : 0;
+  }
+  /** Distribution of the per-frame times passed to addFrame() */
+  const KinectLatencyHistogram& getHistogram() const { return myHistogram; }
+
+private:
+  std::atomic<unsigned long> myFrames;
+  std::atomic<unsigned long> myDropped;
+  std::atomic<long long> myLastUSec;
+  std::atomic<long long> myMaxUSec;
+  std::atomic<long long> myTotalUSec;
+  KinectLatencyHistogram myHistogram;
+};
+
+#endif
@@ -0,0 +1,287 @@
+
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "KinectPointCloud.h"
+#include "KinectFramePool.h"
+
+// Enough stripes to keep every core busy; each stripe has its own table.
+static const int NumStripes = 8;
+
+// voxel coordinates are packed into a 64-bit key, 21 bits each, biased so
+// that negative coordinates pack too (+-2^20 voxels is +-20 km at 2 cm)
+static inline uint64_t voxelKey(int ix, int iy, int iz)
+{
+  const uint64_t bias = 1 << 20, mask = (1 << 21) - 1;
+  return (((ix + bias) & mask) << 42) | (((iy + bias) & mask) << 21) | ((iz + bias) & mask);
+}
+
+
+/* Voxel table: open addressing, linear probing */
+
+KinectPointCloud::VoxelTable::VoxelTable(size_t capacity) :
+  mySlots(capacity), myMask(capacity - 1), myGen(1)
+{
+  // capacity is a power of two
+  assert((capacity & (capacity - 1)) == 0);
+  memset(&mySlots[0], 0, capacity * sizeof(Voxel));
+  myUsed.reserve(capacity / 2);
+}
+
+KinectPointCloud::Voxel *KinectPointCloud::VoxelTable::find(uint64_t key)
+{
+  if(myUsed.size() * 2 >= mySlots.size())
+    grow();
+  uint64_t i = (key * 0x9E3779B97F4A7C15ULL >> 32) & myMask;
+  while(true)
+  {
+    Voxel& v = mySlots[i];
+    if(v.gen != myGen)
+    {
+      v.key = key;
+      v.gen = myGen;
+      v.n = 0;
+      v.x = v.y = v.z = 0;
+      v.r = v.g = v.b = 0;
+      myUsed.push_back(i);
+      return &v;
+    }
+    if(v.key == key)
+      return &v;
+    i = (i + 1) & myMask;
+  }
+}
+
+void KinectPointCloud::VoxelTable::grow()
+{
+  std::vector<Voxel> old;
+  old.swap(mySlots);
+  std::vector<uint32_t> used;
+  used.swap(myUsed);
+  const uint32_t gen = myGen;
+
+  std::cout << "KinectPointCloud: growing voxel table to " << old.size() * 2 << " voxels" << std::endl;
+  mySlots.resize(old.size() * 2);
+  memset(&mySlots[0], 0, mySlots.size() * sizeof(Voxel));
+  myMask = mySlots.size() - 1;
+  myUsed.reserve(mySlots.size() / 2);
+  myGen = 1;
+  for(size_t i = 0; i < used.size(); ++i)
+  {
+    const Voxel& o = old[used[i]];
+    if(o.gen != gen)
+      continue;
+    *find(o.key) = o;
+    mySlots[myUsed.back()].gen = myGen;
+  }
+}
+
+
+/* Point cloud */
+
+KinectPointCloud::KinectPointCloud(const libfreenect2::Freenect2Device::IrCameraParams& ir,
+    const libfreenect2::Freenect2Device::ColorCameraParams& color,
+    float voxelSize, float minDepth, float maxDepth) :
+  myRegistration(ir, color),
+  myUndistorted(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, 4),
+  myRegistered(KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT, 4),
+  myRayX(KINECT_DEPTH_WIDTH),
+  myRayY(KINECT_DEPTH_HEIGHT),
+  myVoxelSize(voxelSize),
+  myMinDepth(minDepth),
+  myMaxDepth(maxDepth),
+  myStripes(NumStripes, VoxelTable(8192)),
+  myMerged(65536),
+  myStripeValid(NumStripes),
+  myLastValid(0),
+  myROIColor(NULL),
+  myROIDepth(NULL)
+{
+  // same pixel centres as Registration::getPointXYZ()
+  for(int c = 0; c < KINECT_DEPTH_WIDTH; ++c)
+    myRayX[c] = (c + 0.5f - ir.cx) / ir.fx;
+  for(int r = 0; r < KINECT_DEPTH_HEIGHT; ++r)
+    myRayY[r] = (r + 0.5f - ir.cy) / ir.fy;
+}
+
+KinectPointCloud::~KinectPointCloud()
+{
+}
+
+void KinectPointCloud::computeStripe(int stripe, int rowBegin, int rowEnd, float invVoxel, float minMM, float maxMM)
+{
+  VoxelTable& table = myStripes[stripe];
+  table.clear();
+  size_t valid = 0;
+  const int w = KINECT_DEPTH_WIDTH;
+  const int colBegin = myROI.x, colEnd = myROI.x + myROI.width;
+  // voxel coordinates of one row
+  int ix[KINECT_DEPTH_WIDTH], iy[KINECT_DEPTH_WIDTH], iz[KINECT_DEPTH_WIDTH];
+  bool ok[KINECT_DEPTH_WIDTH];
+  const float mmToVoxel = 0.001f * invVoxel;
+
+  for(int r = rowBegin; r < rowEnd; ++r)
+  {
+    if(myROIDepth)
+      registerRow(r);
+    const float *depth = (const float*)myUndistorted.data + r * w;
+    const unsigned char *color = myRegistered.data + r * w * 4;
+    const float ry = myRayY[r];
+    int c = colBegin;
+#if defined(__AVX2__)
+    const __m256 vmin = _mm256_set1_ps(minMM), vmax = _mm256_set1_ps(maxMM);
+    const __m256 vscale = _mm256_set1_ps(mmToVoxel);
+    const __m256 vry = _mm256_set1_ps(ry);
+    for(; c + 8 <= colEnd; c += 8)
+    {
+      const __m256 z = _mm256_loadu_ps(depth + c);
+      // ordered compares, so NaN is invalid
+      const int mask = _mm256_movemask_ps(_mm256_and_ps(
+        _mm256_cmp_ps(z, vmin, _CMP_GE_OQ), _mm256_cmp_ps(z, vmax, _CMP_LE_OQ)));
+      const __m256 zs = _mm256_mul_ps(z, vscale);
+      _mm256_storeu_si256((__m256i*)(ix + c), _mm256_cvtps_epi32(_mm256_floor_ps(_mm256_mul_ps(_mm256_loadu_ps(&myRayX[c]), zs))));
+      _mm256_storeu_si256((__m256i*)(iy + c), _mm256_cvtps_epi32(_mm256_floor_ps(_mm256_mul_ps(vry, zs))));
+      _mm256_storeu_si256((__m256i*)(iz + c), _mm256_cvtps_epi32(_mm256_floor_ps(zs)));
+      for(int k = 0; k < 8; ++k)
+        ok[c + k] = (mask >> k) & 1;
+    }
+#endif
+    for(; c < colEnd; ++c)
+    {
+      const float z = depth[c];
+      ok[c] = z >= minMM && z <= maxMM;
+      if(!ok[c])
+        continue;
+      const float zs = z * mmToVoxel;
+      ix[c] = (int)floorf(myRayX[c] * zs);
+      iy[c] = (int)floorf(ry * zs);
+      iz[c] = (int)floorf(zs);
+    }
+
+    // accumulate
+    for(c = colBegin; c < colEnd; ++c)
+    {
+      if(!ok[c])
+        continue;
+      ++valid;
+      const float z = depth[c] * 0.001f;
+      Voxel *v = table.find(voxelKey(ix[c], iy[c], iz[c]));
+      ++v->n;
+      v->x += myRayX[c] * z;
+      v->y += ry * z;
+      v->z += z;
+      v->b += color[4*c];
+      v->g += color[4*c + 1];
+      v->r += color[4*c + 2];
+    }
+  }
+  myStripeValid[stripe] = valid;
+}
+
+class KinectPointCloudBody : public cv::ParallelLoopBody
+{
+  KinectPointCloud& pc;
+  float invVoxel, minMM, maxMM;
+public:
+  KinectPointCloudBody(KinectPointCloud& _pc, float _invVoxel, float _minMM, float _maxMM) :
+    pc(_pc), invVoxel(_invVoxel), minMM(_minMM), maxMM(_maxMM) {}
+  virtual void operator()(const cv::Range& range) const
+  {
+    const int top = pc.myROI.y, rows = pc.myROI.height;
+    for(int s = range.start; s < range.end; ++s)
+      pc.computeStripe(s, top + rows * s / NumStripes, top + rows * (s + 1) / NumStripes, invVoxel, minMM, maxMM);
+  }
+};
+
+/** Region of interest row @a row of myUndistorted and myRegistered, from
+ * the raw frames given to computeROI(). */
+void KinectPointCloud::registerRow(int row)
+{
+  const int w = KINECT_DEPTH_WIDTH;
+  const float *in = (const float*)myROIDepth->data + row * w;
+  float *depth = (float*)myUndistorted.data + row * w;
+  uint32_t *reg = (uint32_t*)myRegistered.data + row * w;
+  const uint32_t *color = (const uint32_t*)myROIColor->data;
+  for(int c = myROI.x; c < myROI.x + myROI.width; ++c)
+  {
+    const float z = in[c];
+    depth[c] = z;
+    reg[c] = 0;
+    if(!(z > 0.0f))  // NaN too
+      continue;
+    float cx, cy;
+    myRegistration.apply(c, row, z, cx, cy);
+    const int x = (int)floorf(cx + 0.5f), y = (int)floorf(cy + 0.5f);
+    if(x >= 0 && x < KINECT_COLOR_WIDTH && y >= 0 && y < KINECT_COLOR_HEIGHT)
+      reg[c] = color[y * KINECT_COLOR_WIDTH + x];
+  }
+}
+
+void KinectPointCloud::compute(const libfreenect2::Frame *color, const libfreenect2::Frame *depth, KinectPoints *out)
+{
+  // colour registered to undistorted depth; filter out colour from pixels
+  // hidden from the colour camera
+  myRegistration.apply(color, depth, &myUndistorted, &myRegistered, true);
+  myROI = cv::Rect(0, 0, KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT);
+  computeVoxels(out);
+}
+
+void KinectPointCloud::computeROI(const libfreenect2::Frame *color, const libfreenect2::Frame *depth,
+  const cv::Rect& roi, KinectPoints *out)
+{
+  // the stripes register their own rows
+  myROI = roi & cv::Rect(0, 0, KINECT_DEPTH_WIDTH, KINECT_DEPTH_HEIGHT);
+  myROIColor = color;
+  myROIDepth = depth;
+  computeVoxels(out);
+  myROIColor = myROIDepth = NULL;
+}
+
+void KinectPointCloud::computeVoxels(KinectPoints *out)
+{
+  const float voxel = myVoxelSize;
+  cv::parallel_for_(cv::Range(0, NumStripes),
+    KinectPointCloudBody(*this, 1.0f / voxel, myMinDepth * 1000.0f, myMaxDepth * 1000.0f));
+
+  // merge stripes; voxels on stripe boundaries appear in more than one
+  myMerged.clear();
+  myLastValid = 0;
+  for(int s = 0; s < NumStripes; ++s)
+  {
+    myLastValid += myStripeValid[s];
+    VoxelTable& t = myStripes[s];
+    const std::vector<uint32_t>& used = t.getUsed();
+    for(size_t i = 0; i < used.size(); ++i)
+    {
+      const Voxel& sv = t.at(used[i]);
+      Voxel *v = myMerged.find(sv.key);
+      v->n += sv.n;
+      v->x += sv.x; v->y += sv.y; v->z += sv.z;
+      v->r += sv.r; v->g += sv.g; v->b += sv.b;
+    }
+  }
+
+  out->clear();
+  const std::vector<uint32_t>& used = myMerged.getUsed();
+  for(size_t i = 0; i < used.size(); ++i)
+  {
+    const Voxel& v = myMerged.at(used[i]);
+    const float inv = 1.0f / v.n;
+    KinectPoint p;
+    p.x = v.x * inv;
+    p.y = v.y * inv;
+    p.z = v.z * inv;
+    p.r = (unsigned char)(v.r * inv + 0.5f);
+    p.g = (unsigned char)(v.g * inv + 0.5f);
+    p.b = (unsigned char)(v.b * inv + 0.5f);
+    p.pad = 0;
+    out->push_back(p);
+  }
+}
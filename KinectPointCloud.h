@@ -0,0 +1,129 @@
+#ifndef KINECTPOINTCLOUD_H
+#define KINECTPOINTCLOUD_H
+
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <libfreenect2/libfreenect2.hpp>
+#include <libfreenect2/registration.h>
+#include <opencv2/opencv.hpp>
+
+/** One point of a Kinect point cloud, in metres in the depth camera frame
+ *  as libfreenect2's getPointXYZ(): x along the image rows, y down, z
+ *  forward. libfreenect2's images are mirrored, so +x is to the camera's
+ *  left. */
+struct KinectPoint
+{
+  float x, y, z;
+  unsigned char r, g, b;
+  unsigned char pad;
+};
+
+typedef std::vector<KinectPoint> KinectPoints;
+
+/** Turns Kinect depth and colour into a voxel-downsampled XYZRGB cloud.
+ *
+ *  Depth is undistorted and colour registered to it with
+ *  libfreenect2::Registration. Each valid depth pixel is then back-projected
+ *  using per-column and per-row ray tables computed once from the IR camera
+ *  intrinsics (the undistorted image is a pinhole image, so the ray for
+ *  pixel (r,c) is (rayX[c], rayY[r], 1)). Points are accumulated into a
+ *  hash voxel grid and each occupied voxel becomes one point at the mean
+ *  position and colour of the pixels in it.
+ *
+ *  Rows are split into stripes, each with its own voxel table, and run with
+ *  cv::parallel_for_; the stripe tables are then merged. Voxel coordinates
+ *  are computed with AVX2 when the compiler targets it. Tables are reused
+ *  from frame to frame (entries are stamped with a generation number instead
+ *  of being cleared) and only grow if a frame has more voxels than they
+ *  have ever held.
+ */
+class KinectPointCloud
+{
+public:
+  /** @param voxelSize voxel edge length (m)
+   *  @param minDepth, maxDepth depth range of points to keep (m)
+   */
+  KinectPointCloud(const libfreenect2::Freenect2Device::IrCameraParams& ir,
+    const libfreenect2::Freenect2Device::ColorCameraParams& color,
+    float voxelSize = 0.02f, float minDepth = 0.5f, float maxDepth = 4.5f);
+  ~KinectPointCloud();
+
+  /** Compute the downsampled cloud of one frame pair into @a out (cleared
+   *  first). Does not allocate once @a out and the voxel tables are big
+   *  enough. Not thread safe: call from one thread at a time. */
+  void compute(const libfreenect2::Frame *color, const libfreenect2::Frame *depth, KinectPoints *out);
+  /** As compute(), but only for the depth pixels in @a roi. Instead of
+   *  undistorting and registering the whole frame, the raw depth in @a roi
+   *  is used as it is (lens distortion is ignored, which is a pixel or two
+   *  away from the image edges) and each pixel's colour is looked up with
+   *  Registration::apply(), without the occlusion filter. */
+  void computeROI(const libfreenect2::Frame *color, const libfreenect2::Frame *depth, const cv::Rect& roi, KinectPoints *out);
+
+  /** May be changed while running; takes effect from the next frame. */
+  void setVoxelSize(float metres) { myVoxelSize = metres; }
+  float getVoxelSize() const { return myVoxelSize; }
+  void setDepthRange(float minDepth, float maxDepth) { myMinDepth = minDepth; myMaxDepth = maxDepth; }
+
+  /** Undistorted depth (float mm) and registered colour (BGRX) of the last
+   *  frame passed to compute(), both 512x424. After computeROI() only the
+   *  region of interest is filled in. */
+  const libfreenect2::Frame *getUndistorted() const { return &myUndistorted; }
+  const libfreenect2::Frame *getRegistered() const { return &myRegistered; }
+
+  /** Ray through pixel (@a row, @a col) of the undistorted depth image;
+   *  multiply by depth (z) to get the point. */
+  float getRayX(int col) const { return myRayX[col]; }
+  float getRayY(int row) const { return myRayY[row]; }
+
+  /** Points before downsampling in the last frame */
+  size_t getLastValidPixels() const { return myLastValid; }
+
+private:
+  struct Voxel
+  {
+    uint64_t key;
+    uint32_t gen;
+    uint32_t n;
+    float x, y, z;
+    float r, g, b;
+  };
+
+  class VoxelTable
+  {
+  public:
+    VoxelTable(size_t capacity);
+    void clear() { ++myGen; myUsed.clear(); }
+    Voxel *find(uint64_t key);
+    const std::vector<uint32_t>& getUsed() const { return myUsed; }
+    Voxel& at(uint32_t i) { return mySlots[i]; }
+  private:
+    std::vector<Voxel> mySlots;
+    std::vector<uint32_t> myUsed;  ///< occupied slots this generation
+    uint64_t myMask;
+    uint32_t myGen;
+    void grow();
+  };
+
+  libfreenect2::Registration myRegistration;
+  libfreenect2::Frame myUndistorted;
+  libfreenect2::Frame myRegistered;
+  std::vector<float> myRayX, myRayY;
+  std::atomic<float> myVoxelSize;
+  std::atomic<float> myMinDepth, myMaxDepth;
+  std::vector<VoxelTable> myStripes;
+  VoxelTable myMerged;
+  std::vector<size_t> myStripeValid;
+  size_t myLastValid;
+  cv::Rect myROI;  ///< depth pixels computed
+  // set during computeROI(), for registerRow()
+  const libfreenect2::Frame *myROIColor, *myROIDepth;
+
+  friend class KinectPointCloudBody;
+  void computeVoxels(KinectPoints *out);
+  void computeStripe(int stripe, int rowBegin, int rowEnd, float invVoxel, float minMM, float maxMM);
+  void registerRow(int row);
+};
+
+#endif
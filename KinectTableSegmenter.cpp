@@ -0,0 +1,351 @@
+
+#include <math.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "KinectTableSegmenter.h"
+#include "KinectFramePool.h"
+
+KinectTableSegmenter::KinectTableSegmenter(const libfreenect2::Freenect2Device::IrCameraParams& ir, int stride) :
+  myStride(std::max(1, stride)),
+  myCols(KINECT_DEPTH_WIDTH / myStride),
+  myRows(KINECT_DEPTH_HEIGHT / myStride),
+  myRayX(myCols),
+  myRayY(myRows),
+  myX(myCols * myRows),
+  myY(myCols * myRows),
+  myZ(myCols * myRows),
+  myCell(myCols * myRows),
+  myCount(0),
+  myPoint(myCols * myRows),
+  myHeight(myCols * myRows),
+  myLabels(myCols * myRows),
+  myRandom(2463534242u),
+  myLastIterations(0),
+  myPlaneTolerance(0.01f),
+  myMaxTilt(20),
+  myMinPlaneHeight(0.3f),
+  myMaxIterations(200),
+  myMinObjectHeight(0.015f),
+  myMaxObjectHeight(0.4f),
+  myClusterTolerance(0.03f),
+  myMinObjectPoints(15),
+  myMaxObjectPoints(3000),
+  myMaxObjectRadius(0.2f)
+{
+  // centre pixel of each stride x stride block, with the same pixel
+  // centres as KinectPointCloud
+  for(int c = 0; c < myCols; ++c)
+    myRayX[c] = (c * myStride + myStride / 2 + 0.5f - ir.cx) / ir.fx;
+  for(int r = 0; r < myRows; ++r)
+    myRayY[r] = (r * myStride + myStride / 2 + 0.5f - ir.cy) / ir.fy;
+  const size_t maxLabels = myCols * myRows / 2 + 2;
+  myParent.reserve(maxLabels);
+  myClusters.reserve(maxLabels);
+  myRadius.reserve(maxLabels);
+}
+
+uint32_t KinectTableSegmenter::random()
+{
+  // xorshift32
+  myRandom ^= myRandom << 13;
+  myRandom ^= myRandom >> 17;
+  myRandom ^= myRandom << 5;
+  return myRandom;
+}
+
+int KinectTableSegmenter::findRoot(int label)
+{
+  while(myParent[label] != label)
+  {
+    myParent[label] = myParent[myParent[label]];
+    label = myParent[label];
+  }
+  return label;
+}
+
+void KinectTableSegmenter::backProject(const float *depth)
+{
+  myCount = 0;
+  for(int r = 0; r < myRows; ++r)
+  {
+    const float *d = depth + (r * myStride + myStride / 2) * KINECT_DEPTH_WIDTH + myStride / 2;
+    const float ry = myRayY[r];
+    for(int c = 0; c < myCols; ++c)
+    {
+      const int cell = r * myCols + c;
+      const float mm = d[c * myStride];
+      if(!(mm > 500 && mm < 4500))
+      {
+        myPoint[cell] = -1;
+        continue;
+      }
+      const float z = mm * 0.001f;
+      myX[myCount] = myRayX[c] * z;
+      myY[myCount] = ry * z;
+      myZ[myCount] = z;
+      myCell[myCount] = cell;
+      myPoint[cell] = myCount;
+      ++myCount;
+    }
+  }
+}
+
+size_t KinectTableSegmenter::countInliers(float nx, float ny, float nz, float d, float tolerance) const
+{
+  const float *x = &myX[0], *y = &myY[0], *z = &myZ[0];
+  const size_t n = myCount;
+  size_t count = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256 vnx = _mm256_set1_ps(nx), vny = _mm256_set1_ps(ny), vnz = _mm256_set1_ps(nz);
+  const __m256 vd = _mm256_set1_ps(d), vtol = _mm256_set1_ps(tolerance);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  for(; i + 8 <= n; i += 8)
+  {
+    __m256 dist = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(vnx, _mm256_loadu_ps(x + i)), _mm256_mul_ps(vny, _mm256_loadu_ps(y + i))),
+      _mm256_add_ps(_mm256_mul_ps(vnz, _mm256_loadu_ps(z + i)), vd));
+    dist = _mm256_andnot_ps(sign, dist);
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(dist, vtol, _CMP_LT_OQ)));
+  }
+#endif
+  for(; i < n; ++i)
+    if(fabsf(nx * x[i] + ny * y[i] + nz * z[i] + d) < tolerance)
+      ++count;
+  return count;
+}
+
+/** RANSAC over planes facing up and above the floor */
+bool KinectTableSegmenter::fitPlane(const float up[3], float cameraHeight, KinectPlane *plane)
+{
+  const size_t n = myCount;
+  myLastIterations = 0;
+  if(n < 50)
+    return false;
+  const float tol = myPlaneTolerance;
+  const float minCos = cosf(myMaxTilt * (float)M_PI / 180.0f);
+  const float minHeight = myMinPlaneHeight;
+  const int maxIterations = myMaxIterations;
+  int iterations = maxIterations;
+  size_t best = 0;
+
+  int i;
+  for(i = 0; i < iterations; ++i)
+  {
+    const size_t a = random() % n, b = random() % n, c = random() % n;
+    if(a == b || b == c || a == c)
+      continue;
+    const float e1x = myX[b] - myX[a], e1y = myY[b] - myY[a], e1z = myZ[b] - myZ[a];
+    const float e2x = myX[c] - myX[a], e2y = myY[c] - myY[a], e2z = myZ[c] - myZ[a];
+    float nx = e1y * e2z - e1z * e2y, ny = e1z * e2x - e1x * e2z, nz = e1x * e2y - e1y * e2x;
+    const float len = sqrtf(nx * nx + ny * ny + nz * nz);
+    if(len < 1e-6f)
+      continue;
+    nx /= len; ny /= len; nz /= len;
+    float facing = nx * up[0] + ny * up[1] + nz * up[2];
+    if(facing < 0)
+    {
+      nx = -nx; ny = -ny; nz = -nz;
+      facing = -facing;
+    }
+    if(facing < minCos)
+      continue;
+    // d is the camera's height above the plane
+    const float d = -(nx * myX[a] + ny * myY[a] + nz * myZ[a]);
+    if(d <= 0 || cameraHeight - d < minHeight)
+      continue;
+
+    const size_t inliers = countInliers(nx, ny, nz, d, tol);
+    if(inliers <= best)
+      continue;
+    best = inliers;
+    plane->nx = nx; plane->ny = ny; plane->nz = nz; plane->d = d;
+    // enough hypotheses for a 99% chance of one of them being all inliers
+    const double w = (double)inliers / n;
+    const double k = log(0.01) / log(std::max(1e-9, 1 - w * w * w));
+    iterations = std::min(maxIterations, std::max(i + 1, (int)ceil(k)));
+  }
+  myLastIterations = i;
+  if(best < std::max((size_t)50, n / 20))
+    return false;
+
+  plane->inliers = best;
+  refinePlane(plane, tol);
+  refinePlane(plane, tol);
+  plane->height = cameraHeight - plane->d;
+  return true;
+}
+
+/** Least squares fit to the inliers of @a plane: the coordinate along the
+ * normal's largest component as a linear function of the other two. */
+bool KinectTableSegmenter::refinePlane(KinectPlane *plane, float tolerance)
+{
+  const float n0[3] = { plane->nx, plane->ny, plane->nz };
+  int k = 0;
+  for(int j = 1; j < 3; ++j)
+    if(fabsf(n0[j]) > fabsf(n0[k]))
+      k = j;
+  const int ia = (k + 1) % 3, ib = (k + 2) % 3;
+  const float *p[3] = { &myX[0], &myY[0], &myZ[0] };
+
+  double saa = 0, sab = 0, sbb = 0, sa = 0, sb = 0, sak = 0, sbk = 0, sk = 0, cnt = 0;
+  for(size_t i = 0; i < myCount; ++i)
+  {
+    if(fabsf(plane->nx * myX[i] + plane->ny * myY[i] + plane->nz * myZ[i] + plane->d) >= tolerance)
+      continue;
+    const double a = p[ia][i], b = p[ib][i], v = p[k][i];
+    saa += a * a; sab += a * b; sbb += b * b;
+    sa += a; sb += b;
+    sak += a * v; sbk += b * v; sk += v;
+    ++cnt;
+  }
+  if(cnt < 3)
+    return false;
+
+  // solve [saa sab sa; sab sbb sb; sa sb cnt] [A B C]' = [sak sbk sk]' by Cramer's rule
+  const double det = saa * (sbb * cnt - sb * sb) - sab * (sab * cnt - sb * sa) + sa * (sab * sb - sbb * sa);
+  if(fabs(det) < 1e-12)
+    return false;
+  const double A = (sak * (sbb * cnt - sb * sb) - sab * (sbk * cnt - sb * sk) + sa * (sbk * sb - sbb * sk)) / det;
+  const double B = (saa * (sbk * cnt - sk * sb) - sak * (sab * cnt - sb * sa) + sa * (sab * sk - sbk * sa)) / det;
+  const double C = (saa * (sbb * sk - sb * sbk) - sab * (sab * sk - sb * sak) + sak * (sab * sb - sbb * sa)) / det;
+
+  // v = A a + B b + C, i.e. n = (-A, -B, 1) in (a, b, v) order, d = -C
+  double n[3];
+  n[ia] = -A; n[ib] = -B; n[k] = 1;
+  double d = -C;
+  const double len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+  double s = 1 / len;
+  if(n[0] * n0[0] + n[1] * n0[1] + n[2] * n0[2] < 0)
+    s = -s;
+  plane->nx = n[0] * s; plane->ny = n[1] * s; plane->nz = n[2] * s;
+  plane->d = d * s;
+  plane->inliers = countInliers(plane->nx, plane->ny, plane->nz, plane->d, tolerance);
+  return true;
+}
+
+void KinectTableSegmenter::findObjects(const KinectPlane& plane, KinectObjects *objects)
+{
+  const float minH = myMinObjectHeight, maxH = myMaxObjectHeight;
+  const float tol = myClusterTolerance, tol2 = tol * tol;
+  const int cols = myCols;
+  for(size_t i = 0; i < myCount; ++i)
+    myHeight[i] = plane.nx * myX[i] + plane.ny * myY[i] + plane.nz * myZ[i] + plane.d;
+
+  // label neighbouring object pixels whose points are close together
+  myParent.clear();
+  myParent.push_back(0);
+  int *labels = &myLabels[0];
+  for(int r = 0; r < myRows; ++r)
+  {
+    for(int c = 0; c < cols; ++c)
+    {
+      const int cell = r * cols + c;
+      const int i = myPoint[cell];
+      labels[cell] = 0;
+      if(i < 0 || !(myHeight[i] > minH && myHeight[i] < maxH))
+        continue;
+      int label = 0;
+      const int neighbours[2] = { c > 0 ? cell - 1 : -1, r > 0 ? cell - cols : -1 };
+      for(int k = 0; k < 2; ++k)
+      {
+        const int nc = neighbours[k];
+        if(nc < 0 || !labels[nc])
+          continue;
+        const int j = myPoint[nc];
+        const float dx = myX[i] - myX[j], dy = myY[i] - myY[j], dz = myZ[i] - myZ[j];
+        if(dx * dx + dy * dy + dz * dz >= tol2)
+          continue;
+        if(!label)
+          label = labels[nc];
+        else
+        {
+          const int a = findRoot(label), b = findRoot(labels[nc]);
+          if(a != b)
+            myParent[std::max(a, b)] = std::min(a, b);
+        }
+      }
+      if(!label)
+      {
+        label = myParent.size();
+        myParent.push_back(label);
+      }
+      labels[cell] = label;
+    }
+  }
+
+  // centroid and top of each
+  const Cluster empty = { 0, 0, 0, 0, 0 };
+  myClusters.assign(myParent.size(), empty);
+  for(size_t i = 0; i < myCount; ++i)
+  {
+    const int l = labels[myCell[i]];
+    if(!l)
+      continue;
+    Cluster& cl = myClusters[findRoot(l)];
+    cl.x += myX[i]; cl.y += myY[i]; cl.z += myZ[i];
+    cl.top = std::max(cl.top, myHeight[i]);
+    ++cl.n;
+  }
+  for(size_t l = 1; l < myClusters.size(); ++l)
+  {
+    Cluster& cl = myClusters[l];
+    if(cl.n == 0)
+      continue;
+    cl.x /= cl.n; cl.y /= cl.n; cl.z /= cl.n;
+  }
+
+  // widest point from the centroid, along the plane
+  myRadius.assign(myClusters.size(), 0.0f);
+  for(size_t i = 0; i < myCount; ++i)
+  {
+    const int l = labels[myCell[i]];
+    if(!l)
+      continue;
+    const int root = findRoot(l);
+    const Cluster& cl = myClusters[root];
+    const float dx = myX[i] - cl.x, dy = myY[i] - cl.y, dz = myZ[i] - cl.z;
+    const float along = dx * plane.nx + dy * plane.ny + dz * plane.nz;
+    myRadius[root] = std::max(myRadius[root], dx * dx + dy * dy + dz * dz - along * along);
+  }
+
+  const size_t minPoints = myMinObjectPoints, maxPoints = myMaxObjectPoints;
+  const float maxRadius = myMaxObjectRadius;
+  for(size_t l = 1; l < myClusters.size(); ++l)
+  {
+    const Cluster& cl = myClusters[l];
+    if(cl.n < minPoints || cl.n > maxPoints)
+      continue;
+    const float radius = sqrtf(std::max(0.0f, myRadius[l]));
+    if(radius > maxRadius)
+      continue;
+    KinectObject o;
+    o.x = cl.x; o.y = cl.y; o.z = cl.z;
+    const float raise = cl.top - (plane.nx * o.x + plane.ny * o.y + plane.nz * o.z + plane.d);
+    o.topX = o.x + plane.nx * raise;
+    o.topY = o.y + plane.ny * raise;
+    o.topZ = o.z + plane.nz * raise;
+    o.height = cl.top;
+    o.radius = radius;
+    o.points = cl.n;
+    objects->push_back(o);
+  }
+  std::sort(objects->begin(), objects->end(), [](const KinectObject& a, const KinectObject& b) {
+    return a.x * a.x + a.y * a.y + a.z * a.z < b.x * b.x + b.y * b.y + b.z * b.z;
+  });
+}
+
+bool KinectTableSegmenter::segment(const libfreenect2::Frame *depth, const float up[3], float cameraHeight,
+  KinectPlane *plane, KinectObjects *objects)
+{
+  objects->clear();
+  backProject((const float*)depth->data);
+  if(!fitPlane(up, cameraHeight, plane))
+    return false;
+  findObjects(*plane, objects);
+  return true;
+}
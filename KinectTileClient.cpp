@@ -0,0 +1,142 @@
+
+#include "KinectTileClient.h"
+#include "KinectTileDelta.h"
+
+KinectTileClient::KinectTileClient(ArClientBase *client, const char *sourceName) :
+  myClient(client),
+  myRequestName(std::string(KINECT_TILES_REQUEST_PREFIX) + sourceName),
+  myHandlePacketCB(this, &KinectTileClient::handlePacket),
+  myFrameCB(NULL),
+  myJpeg(tjInitDecompress()),
+  myAssembled(0),
+  myWidth(0),
+  myHeight(0),
+  mySequence(0),
+  myHaveKeyframe(false),
+  myFramesReceived(0),
+  myEmptyFramesReceived(0),
+  myTilesReceived(0),
+  myKeyframesReceived(0),
+  myBytesReceived(0),
+  myDecodeErrors(0)
+{
+  myClient->addHandler(myRequestName.c_str(), &myHandlePacketCB);
+}
+
+KinectTileClient::~KinectTileClient()
+{
+  myClient->remHandler(myRequestName.c_str(), &myHandlePacketCB);
+  tjDestroy(myJpeg);
+}
+
+bool KinectTileClient::request(long intervalMs)
+{
+  if(!myClient->dataExists(myRequestName.c_str()))
+  {
+    ArLog::log(ArLog::Terse, "KinectTileClient: server does not provide %s", myRequestName.c_str());
+    return false;
+  }
+  return myClient->request(myRequestName.c_str(), intervalMs);
+}
+
+void KinectTileClient::stop()
+{
+  myClient->requestStop(myRequestName.c_str());
+}
+
+void KinectTileClient::handlePacket(ArNetPacket *pkt)
+{
+  const unsigned long seq = pkt->bufToUByte4();
+  const int width = pkt->bufToUByte2();
+  const int height = pkt->bufToUByte2();
+  const int x = pkt->bufToUByte2();
+  const int y = pkt->bufToUByte2();
+  const int w = pkt->bufToUByte2();
+  const int h = pkt->bufToUByte2();
+  const size_t total = pkt->bufToUByte4();
+  const size_t offset = pkt->bufToUByte4();
+  const size_t chunk = pkt->bufToUByte2();
+  const bool last = pkt->bufToUByte() != 0;
+
+  myBytesReceived += pkt->getLength();
+
+  if(w > 0 && h > 0)
+  {
+    if(offset == 0)
+    {
+      // start of a new tile; any partial tile is abandoned
+      myAssembled = 0;
+      if(myEncoded.size() < total)
+        myEncoded.resize(total);
+    }
+    if(offset != myAssembled || offset + chunk > total || total > myEncoded.size())
+    {
+      // missed the start of this tile, or chunks out of order
+      myAssembled = 0;
+      return;
+    }
+    pkt->bufToData((char*)&myEncoded[offset], chunk);
+    myAssembled += chunk;
+    if(myAssembled < total)
+      return;
+    myAssembled = 0;
+
+    const bool key = (x == 0 && y == 0 && w == width && h == height);
+    myMutex.lock();
+    if(key)
+    {
+      myImage.resize(width * height * 3);
+      myWidth = width;
+      myHeight = height;
+    }
+    if((!key && !myHaveKeyframe) || width != myWidth || height != myHeight || x + w > width || y + h > height)
+    {
+      // a tile of an image we don't have; wait for the next keyframe
+      myMutex.unlock();
+      return;
+    }
+    const bool ok = tjDecompress2(myJpeg, &myEncoded[0], total, &myImage[(y * width + x) * 3],
+      w, width * 3, h, TJPF_RGB, TJFLAG_FASTDCT) == 0;
+    if(ok && key)
+      myHaveKeyframe = true;
+    myMutex.unlock();
+    if(!ok)
+    {
+      ++myDecodeErrors;
+      ArLog::log(ArLog::Normal, "KinectTileClient: could not decode %dx%d tile at %d,%d of frame %lu", w, h, x, y, seq);
+      return;
+    }
+    ++myTilesReceived;
+    if(key)
+      ++myKeyframesReceived;
+  }
+  else if(last)
+    ++myEmptyFramesReceived;
+
+  if(!last)
+    return;
+  myMutex.lock();
+  mySequence = seq;
+  myMutex.unlock();
+  ++myFramesReceived;
+
+  if(myFrameCB && myHaveKeyframe)
+    myFrameCB->invoke();
+}
+
+bool KinectTileClient::getLatest(std::vector<unsigned char>& rgb, int *width, int *height,
+  unsigned long *sequence)
+{
+  myMutex.lock();
+  if(!myHaveKeyframe)
+  {
+    myMutex.unlock();
+    return false;
+  }
+  rgb = myImage;
+  *width = myWidth;
+  *height = myHeight;
+  if(sequence) *sequence = mySequence;
+  myMutex.unlock();
+  return true;
+}
@@ -0,0 +1,75 @@
+#ifndef KINECTTILECLIENT_H
+#define KINECTTILECLIENT_H
+
+#include <vector>
+#include <string>
+#include <turbojpeg.h>
+#include "Aria.h"
+#include "ArNetworking.h"
+
+/** Receives a delta coded Kinect video stream served by KinectArVideoServer
+ *  (see KinectTileDelta.h) and keeps the image up to date by decoding each
+ *  changed tile into place.
+ *
+ *  Call request() after connecting the ArClientBase, then getLatest() from
+ *  any thread. A callback may be added to be notified of each update; it is
+ *  called in the ArClientBase thread.
+ */
+class KinectTileClient
+{
+public:
+  /** @param sourceName ArVideo source name of the stream, e.g.
+   *    "Kinect_RGB|libfreenect2|OpenCV" */
+  KinectTileClient(ArClientBase *client, const char *sourceName);
+  ~KinectTileClient();
+
+  /** Ask the server for an update every @a intervalMs ms */
+  bool request(long intervalMs = 100);
+  void stop();
+
+  /** Copy the current image into @a rgb (row-major RGB).
+   *  @return false if no keyframe has been received yet */
+  bool getLatest(std::vector<unsigned char>& rgb, int *width, int *height,
+    unsigned long *sequence = NULL);
+
+  void setFrameCallback(ArFunctor *cb) { myFrameCB = cb; }
+
+  /** Updates received (each brings the image up to one new frame) */
+  unsigned long getFramesReceived() const { return myFramesReceived; }
+  /** Updates in which nothing had changed */
+  unsigned long getEmptyFramesReceived() const { return myEmptyFramesReceived; }
+  unsigned long getTilesReceived() const { return myTilesReceived; }
+  unsigned long getKeyframesReceived() const { return myKeyframesReceived; }
+  /** Total size of the packets received, headers included */
+  unsigned long getBytesReceived() const { return myBytesReceived; }
+  unsigned long getDecodeErrors() const { return myDecodeErrors; }
+
+private:
+  ArClientBase *myClient;
+  std::string myRequestName;
+  ArFunctor1C<KinectTileClient, ArNetPacket*> myHandlePacketCB;
+  ArFunctor *myFrameCB;
+  tjhandle myJpeg;
+
+  // tile being reassembled
+  std::vector<unsigned char> myEncoded;
+  size_t myAssembled;
+
+  ArMutex myMutex;
+  std::vector<unsigned char> myImage;
+  int myWidth;
+  int myHeight;
+  unsigned long mySequence;
+  bool myHaveKeyframe;
+
+  unsigned long myFramesReceived;
+  unsigned long myEmptyFramesReceived;
+  unsigned long myTilesReceived;
+  unsigned long myKeyframesReceived;
+  unsigned long myBytesReceived;
+  unsigned long myDecodeErrors;
+
+  void handlePacket(ArNetPacket *pkt);
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "KinectTileDelta.h"
+
+unsigned long kinectBlockSAD(const unsigned char *a, size_t strideA,
+  const unsigned char *b, size_t strideB, int rowBytes, int rows)
+{
+  unsigned long sum = 0;
+  for(int r = 0; r < rows; ++r, a += strideA, b += strideB)
+  {
+    int i = 0;
+#if defined(__AVX2__)
+    // psadbw gives four 64-bit partial sums per 32 bytes
+    __m256i acc = _mm256_setzero_si256();
+    for(; i + 32 <= rowBytes; i += 32)
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+        _mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+    const __m128i acc2 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum += _mm_cvtsi128_si64(acc2) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc2, acc2));
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for(; i + 16 <= rowBytes; i += 16)
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(
+        _mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+    sum += _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+    for(; i < rowBytes; ++i)
+      sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  }
+  return sum;
+}
+
+
+KinectTileEncoder::KinectTileEncoder(int width, int height, int tileSize, int keyframeInterval,
+    int threshold, int jpegQuality) :
+  myWidth(width), myHeight(height), myTileSize(tileSize),
+  myTilesX((width + tileSize - 1) / tileSize),
+  myTilesY((height + tileSize - 1) / tileSize),
+  myKeyframeInterval(keyframeInterval),
+  myThreshold(threshold),
+  myJpegQuality(jpegQuality),
+  myJpeg(tjInitCompress()),
+  myReference(width * height * 3),
+  mySequence(0),
+  myKeySequence(0),
+  myFramesSinceKey(0),
+  myKeyJpeg(tjAlloc(tjBufSize(width, height, TJSAMP_420))),
+  myKeyJpegSize(0),
+  myTileJpeg(myTilesX * myTilesY),
+  myTileJpegSize(myTilesX * myTilesY, 0),
+  myTileSequence(myTilesX * myTilesY, 0),
+  myRequestFunctor(this, &KinectTileEncoder::handleRequest),
+  myClientRemovedFunctor(this, &KinectTileEncoder::clientRemoved),
+  myBytesSent(0),
+  myFullFrameBytes(0),
+  myTilesEncoded(0),
+  myFramesUpdated(0)
+{
+  // Every buffer is allocated here so that update() never allocates.
+  for(size_t t = 0; t < myTileJpeg.size(); ++t)
+    myTileJpeg[t] = tjAlloc(tjBufSize(tileSize, tileSize, TJSAMP_420));
+  mySendList.reserve(myTileJpeg.size());
+}
+
+KinectTileEncoder::~KinectTileEncoder()
+{
+  for(size_t t = 0; t < myTileJpeg.size(); ++t)
+    tjFree(myTileJpeg[t]);
+  tjFree(myKeyJpeg);
+  tjDestroy(myJpeg);
+}
+
+/** Compress a w x h block of RGB rows myWidth*3 apart, into a buffer
+ * preallocated for at least that size. */
+bool KinectTileEncoder::encode(const unsigned char *data, int w, int h, unsigned char **jpeg, unsigned long *size)
+{
+  if(tjCompress2(myJpeg, data, w, myWidth * 3, h, TJPF_RGB, jpeg, size,
+      TJSAMP_420, myJpegQuality, TJFLAG_FASTDCT | TJFLAG_NOREALLOC) != 0)
+  {
+    std::cout << "KinectTileEncoder: Error compressing tile: " << tjGetErrorStr() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void KinectTileEncoder::update(const cv::Mat& image, unsigned long sequence)
+{
+  if(image.cols != myWidth || image.rows != myHeight || image.type() != CV_8UC3)
+    return;
+  const size_t rowBytes = myWidth * 3;
+
+  myMutex.lock();
+  mySequence = sequence;
+  ++myFramesUpdated;
+
+  if(myKeySequence == 0 || ++myFramesSinceKey >= myKeyframeInterval)
+  {
+    // keyframe: what clients have is now exactly this image
+    for(int r = 0; r < myHeight; ++r)
+      memcpy(&myReference[r * rowBytes], image.ptr<unsigned char>(r), rowBytes);
+    if(encode(&myReference[0], myWidth, myHeight, &myKeyJpeg, &myKeyJpegSize))
+    {
+      myKeySequence = sequence;
+      myFramesSinceKey = 0;
+    }
+    myMutex.unlock();
+    return;
+  }
+
+  // Compare against the reference rather than the previous frame, so that
+  // slow changes add up until the tile is sent.
+  const size_t step = image.step;
+  for(int ty = 0; ty < myTilesY; ++ty)
+  {
+    const int y = ty * myTileSize;
+    const int h = std::min(myTileSize, myHeight - y);
+    for(int tx = 0; tx < myTilesX; ++tx)
+    {
+      const int x = tx * myTileSize;
+      const int w = std::min(myTileSize, myWidth - x);
+      const unsigned char *src = image.ptr<unsigned char>(y) + x * 3;
+      unsigned char *ref = &myReference[y * rowBytes + x * 3];
+      if(kinectBlockSAD(src, step, ref, rowBytes, w * 3, h) <= (unsigned long)myThreshold * w * h * 3)
+        continue;
+      for(int r = 0; r < h; ++r)
+        memcpy(ref + r * rowBytes, src + r * step, w * 3);
+      const int t = ty * myTilesX + tx;
+      if(encode(ref, w, h, &myTileJpeg[t], &myTileJpegSize[t]))
+      {
+        myTileSequence[t] = sequence;
+        ++myTilesEncoded;
+      }
+    }
+  }
+  myMutex.unlock();
+}
+
+/** Send one tile's JPEG, in chunks. Sends a single empty packet if @a size
+ * is 0. */
+void KinectTileEncoder::sendTile(ArServerClient *client, int x, int y, int w, int h,
+  const unsigned char *jpeg, unsigned long size, bool last)
+{
+  unsigned long offset = 0;
+  do
+  {
+    const unsigned long chunk = std::min((unsigned long)KINECT_TILES_CHUNK_SIZE, size - offset);
+    myPacket.empty();
+    myPacket.uByte4ToBuf(mySequence);
+    myPacket.uByte2ToBuf(myWidth);
+    myPacket.uByte2ToBuf(myHeight);
+    myPacket.uByte2ToBuf(x);
+    myPacket.uByte2ToBuf(y);
+    myPacket.uByte2ToBuf(w);
+    myPacket.uByte2ToBuf(h);
+    myPacket.uByte4ToBuf(size);
+    myPacket.uByte4ToBuf(offset);
+    myPacket.uByte2ToBuf(chunk);
+    myPacket.uByteToBuf(last && offset + chunk >= size);
+    if(chunk > 0)
+      myPacket.dataToBuf((const char*)jpeg + offset, chunk);
+    client->sendPacketTcp(&myPacket);
+    myBytesSent += myPacket.getLength();
+    offset += chunk;
+  } while(offset < size);
+}
+
+void KinectTileEncoder::send(ArServerClient *client)
+{
+  myMutex.lock();
+  if(myKeySequence == 0)
+  {
+    // nothing captured yet
+    myMutex.unlock();
+    return;
+  }
+  // (a new client is added with 0, so starts from the keyframe)
+  unsigned long& since = myClientSequence[client];
+  if(since == mySequence)
+  {
+    sendTile(client, 0, 0, 0, 0, NULL, 0, true);
+    myMutex.unlock();
+    return;
+  }
+
+  const bool key = since < myKeySequence;
+  const unsigned long after = key ? myKeySequence : since;
+  mySendList.clear();
+  for(size_t t = 0; t < myTileSequence.size(); ++t)
+    if(myTileSequence[t] > after)
+      mySendList.push_back(t);
+
+  if(key)
+    sendTile(client, 0, 0, myWidth, myHeight, myKeyJpeg, myKeyJpegSize, mySendList.empty());
+  for(size_t i = 0; i < mySendList.size(); ++i)
+  {
+    const int t = mySendList[i];
+    const int x = (t % myTilesX) * myTileSize, y = (t / myTilesX) * myTileSize;
+    sendTile(client, x, y, std::min(myTileSize, myWidth - x), std::min(myTileSize, myHeight - y),
+      myTileJpeg[t], myTileJpegSize[t], i + 1 == mySendList.size());
+  }
+  if(!key && mySendList.empty())
+    sendTile(client, 0, 0, 0, 0, NULL, 0, true);
+
+  // what sending this update as a whole frame would have cost
+  myFullFrameBytes += myKeyJpegSize;
+  since = mySequence;
+  myMutex.unlock();
+}
+
+void KinectTileEncoder::handleRequest(ArServerClient *client, ArNetPacket *)
+{
+  send(client);
+}
+
+void KinectTileEncoder::clientRemoved(ArServerClient *client)
+{
+  myMutex.lock();
+  myClientSequence.erase(client);
+  myMutex.unlock();
+}
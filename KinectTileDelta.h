@@ -0,0 +1,121 @@
+#ifndef KINECTTILEDELTA_H
+#define KINECTTILEDELTA_H
+
+#include <vector>
+#include <map>
+#include <atomic>
+#include <stddef.h>
+#include <turbojpeg.h>
+#include <opencv2/opencv.hpp>
+#include "Aria.h"
+#include "ArNetworking.h"
+
+/** Delta coding of the Kinect video streams: only the parts of the image
+ *  that changed are sent.
+ *
+ *  Each image is split into square tiles. A tile is re-sent (as a JPEG of
+ *  just that tile) when its sum of absolute differences from what clients
+ *  last received is above a threshold. Every so often the whole image is
+ *  sent as a keyframe, which also clears any slow drift that stayed under
+ *  the threshold.
+ *
+ *  ArNetworking request: KINECT_TILES_REQUEST_PREFIX followed by the ArVideo
+ *  source name, e.g. "getKinectTilesKinect_RGB_160x120|libfreenect2|OpenCV".
+ *  The first time a client's request is handled it is sent the last keyframe
+ *  and every tile changed since; after that, only what changed since it was
+ *  last served. Each update is a series of packets of:
+ *    uByte4 frame sequence number
+ *    uByte2 image width, uByte2 image height
+ *    uByte2 tile x, uByte2 tile y, uByte2 tile width, uByte2 tile height
+ *      (0 width and height if nothing changed)
+ *    uByte4 JPEG size
+ *    uByte4 offset of this chunk in the JPEG
+ *    uByte2 chunk size
+ *    uByte 1 on the last packet of the update, else 0
+ *    chunk data
+ *  A keyframe is sent as one tile covering the whole image. See
+ *  KinectTileClient.
+ */
+#define KINECT_TILES_REQUEST_PREFIX "getKinectTiles"
+#define KINECT_TILES_CHUNK_SIZE 30000
+
+/** Sum of absolute differences between two blocks of @a rows rows of
+ *  @a rowBytes bytes, with rows @a strideA and @a strideB bytes apart. Uses
+ *  AVX2 or SSE2 when the compiler targets them. */
+unsigned long kinectBlockSAD(const unsigned char *a, size_t strideA,
+  const unsigned char *b, size_t strideB, int rowBytes, int rows);
+
+/** Server side of one delta coded stream. update() is called by the
+ *  publish stage with each new image; requests are handled by
+ *  getRequestFunctor(), registered with ArServerBase::addData(), in the
+ *  server's threads. Each client's position in the stream is kept until
+ *  getClientRemovedFunctor() is called for it.
+ */
+class KinectTileEncoder
+{
+public:
+  /** @param tileSize tile width and height in pixels
+   *  @param keyframeInterval frames between keyframes
+   *  @param threshold mean absolute difference per byte above which a tile
+   *    has changed
+   */
+  KinectTileEncoder(int width, int height, int tileSize = 64, int keyframeInterval = 150,
+    int threshold = 4, int jpegQuality = 75);
+  ~KinectTileEncoder();
+
+  /** Find and encode the changed tiles of @a image (CV_8UC3 RGB). */
+  void update(const cv::Mat& image, unsigned long sequence);
+
+  /** Send @a client what changed since it was last sent an update */
+  void send(ArServerClient *client);
+
+  ArFunctor2<ArServerClient*, ArNetPacket*> *getRequestFunctor() { return &myRequestFunctor; }
+  ArFunctor1<ArServerClient*> *getClientRemovedFunctor() { return &myClientRemovedFunctor; }
+
+  void setThreshold(int threshold) { myThreshold = threshold; }
+  void setKeyframeInterval(int frames) { myKeyframeInterval = frames; }
+
+  /** Bytes of image data sent to clients */
+  unsigned long getBytesSent() const { return myBytesSent; }
+  /** Bytes that would have been sent had every update been a whole frame */
+  unsigned long getFullFrameBytes() const { return myFullFrameBytes; }
+  unsigned long getTilesEncoded() const { return myTilesEncoded; }
+  unsigned long getFramesUpdated() const { return myFramesUpdated; }
+
+private:
+  int myWidth, myHeight, myTileSize;
+  int myTilesX, myTilesY;
+  int myKeyframeInterval;
+  int myThreshold;
+  int myJpegQuality;
+  tjhandle myJpeg;
+
+  ArMutex myMutex;
+  std::vector<unsigned char> myReference;  ///< image as clients have it (RGB)
+  unsigned long mySequence;                ///< latest update
+  unsigned long myKeySequence;             ///< latest keyframe
+  int myFramesSinceKey;
+  unsigned char *myKeyJpeg;
+  unsigned long myKeyJpegSize;
+  std::vector<unsigned char*> myTileJpeg;
+  std::vector<unsigned long> myTileJpegSize;
+  std::vector<unsigned long> myTileSequence;  ///< last change of each tile
+  std::vector<int> mySendList;
+  std::map<ArServerClient*, unsigned long> myClientSequence;  ///< last update sent
+  ArNetPacket myPacket;
+  ArFunctor2C<KinectTileEncoder, ArServerClient*, ArNetPacket*> myRequestFunctor;
+  ArFunctor1C<KinectTileEncoder, ArServerClient*> myClientRemovedFunctor;
+
+  std::atomic<unsigned long> myBytesSent;
+  std::atomic<unsigned long> myFullFrameBytes;
+  std::atomic<unsigned long> myTilesEncoded;
+  std::atomic<unsigned long> myFramesUpdated;
+
+  bool encode(const unsigned char *data, int w, int h, unsigned char **jpeg, unsigned long *size);
+  void sendTile(ArServerClient *client, int x, int y, int w, int h,
+    const unsigned char *jpeg, unsigned long size, bool last);
+  void handleRequest(ArServerClient *client, ArNetPacket *pkt);
+  void clientRemoved(ArServerClient *client);
+};
+
+#endif
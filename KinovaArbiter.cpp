@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include "KinovaArbiter.h"
+
+static const char *armNames[KINOVA_ARBITER_MAX_ARMS] = { "left", "right" };
+
+KinovaArbiter::KinovaArbiter(int maxBatch) :
+  myMaxBatch(maxBatch > 0 ? maxBatch : 1),
+  myArmCount(0),
+  myActive(-1),
+  myAccepting(false),
+  myHaveThread(false),
+  mySwitches(0),
+  myRateLastSwitches(0),
+  myRateLastUSec(kinectTimeUSec()),
+  myJobsPerSwitch(0)
+{
+  sem_init(&myWake, 0, 0);
+  for(int i = 0; i < KINOVA_ARBITER_MAX_ARMS; ++i)
+  {
+    myJobs[i] = 0;
+    myRateLastJobs[i] = 0;
+    myRate[i] = 0;
+  }
+}
+
+KinovaArbiter::~KinovaArbiter()
+{
+  stop();
+  sem_destroy(&myWake);
+  for(size_t i = 0; i < myInfoFunctors.size(); ++i)
+    delete myInfoFunctors[i];
+}
+
+void KinovaArbiter::start(const Kinova::KinovaDevice *devices, int count)
+{
+  myArmCount = std::min(count, KINOVA_ARBITER_MAX_ARMS);
+  for(int i = 0; i < myArmCount; ++i)
+    myDevices[i] = devices[i];
+  myActive = -1;
+  myMutex.lock();
+  myAccepting = true;
+  myMutex.unlock();
+  runAsync();
+}
+
+void KinovaArbiter::stop()
+{
+  myMutex.lock();
+  const bool running = myAccepting;
+  myMutex.unlock();
+  if(!running)
+    return;
+  stopRunning();
+  sem_post(&myWake);
+  join();
+}
+
+bool KinovaArbiter::onThread() const
+{
+  return myHaveThread && pthread_equal(pthread_self(), myThread);
+}
+
+bool KinovaArbiter::call(int arm, ArFunctor *job, bool urgent)
+{
+  if(arm < 0 || arm >= myArmCount || !job)
+    return false;
+  ArFunctor *jobs[KINOVA_ARBITER_MAX_ARMS] = { NULL };
+  jobs[arm] = job;
+  return callEach(jobs, arm + 1, urgent);
+}
+
+bool KinovaArbiter::callEach(ArFunctor **jobs, int count, bool urgent)
+{
+  count = std::min(count, myArmCount);
+  if(onThread())
+  {
+    // a job submitting more work: it can't wait for itself, so run it now,
+    // and give the calling job its own arm back afterwards
+    const int caller = myActive;
+    for(int a = 0; a < count; ++a)
+    {
+      if(!jobs[a])
+        continue;
+      activate(a);
+      jobs[a]->invoke();
+      ++myJobs[a];
+    }
+    if(caller >= 0)
+      activate(caller);
+    return true;
+  }
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  int queued = 0;
+  const long long now = kinectTimeUSec();
+  myMutex.lock();
+  if(!myAccepting)
+  {
+    myMutex.unlock();
+    sem_destroy(&done);
+    return false;
+  }
+  for(int a = 0; a < count; ++a)
+  {
+    if(!jobs[a])
+      continue;
+    Entry e = { jobs[a], &done, now };
+    if(urgent)
+      myQueues[a].push_front(e);
+    else
+      myQueues[a].push_back(e);
+    ++queued;
+  }
+  myMutex.unlock();
+  for(int i = 0; i < queued; ++i)
+    sem_post(&myWake);
+  for(int i = 0; i < queued; ++i)
+    while(sem_wait(&done) != 0 && errno == EINTR)
+      ;
+  sem_destroy(&done);
+  return true;
+}
+
+/** Make arm @a arm the active device, unless it already is */
+void KinovaArbiter::activate(int arm)
+{
+  if(arm == myActive)
+    return;
+  Kinova::SetActiveDevice(myDevices[arm]);
+  myActive = arm;
+  ++mySwitches;
+}
+
+/** Run queued jobs, taking the arms in turn a batch at a time, until there
+ * are none left */
+void KinovaArbiter::serve()
+{
+  int next = myActive >= 0 ? myActive : 0;
+  while(true)
+  {
+    // the active arm first if it has work, so a lone arm is never switched away from
+    int arm = -1;
+    myMutex.lock();
+    for(int i = 0; i < myArmCount && arm < 0; ++i)
+      if(!myQueues[(next + i) % myArmCount].empty())
+        arm = (next + i) % myArmCount;
+    myMutex.unlock();
+    if(arm < 0)
+      return;
+
+    for(int n = 0; n < myMaxBatch; ++n)
+    {
+      myMutex.lock();
+      if(myQueues[arm].empty())
+      {
+        myMutex.unlock();
+        break;
+      }
+      const Entry e = myQueues[arm].front();
+      myQueues[arm].pop_front();
+      myMutex.unlock();
+
+      // checked for every job, in case one left another arm active
+      activate(arm);
+      const long long start = kinectTimeUSec();
+      myWaitTiming[arm].record(start - e.queuedUSec);
+      e.job->invoke();
+      myRunTiming[arm].record(kinectTimeUSec() - start);
+      ++myJobs[arm];
+      sem_post(e.done);
+    }
+    // then the other arm, if it is waiting
+    next = (arm + 1) % myArmCount;
+  }
+}
+
+void *KinovaArbiter::runThread(void *)
+{
+  myThread = pthread_self();
+  myHaveThread = true;
+  while(getRunning())
+  {
+    // every job queued posts, so a post while serving is not lost: the
+    // next wait returns at once
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 100000000L;
+    if(until.tv_nsec >= 1000000000L)
+    {
+      until.tv_nsec -= 1000000000L;
+      ++until.tv_sec;
+    }
+    sem_timedwait(&myWake, &until);
+    serve();
+  }
+  // run whatever was queued before we stopped taking jobs
+  myMutex.lock();
+  myAccepting = false;
+  myMutex.unlock();
+  serve();
+  myHaveThread = false;
+  return NULL;
+}
+
+void KinovaArbiter::addInfoStrings(ArStringInfoGroup *group)
+{
+  ArFunctor2<char*, ArTypes::UByte2> *f = new ArFunctor2C<KinovaArbiter, char*, ArTypes::UByte2>(
+    this, &KinovaArbiter::arbiterInfo);
+  myInfoFunctors.push_back(f);
+  group->addStringString("Kinova", 60, f);
+}
+
+/** Jobs per second for each arm, jobs per device switch, and "p50/p99/max
+ * ms" waiting in the queue for the busiest arm */
+void KinovaArbiter::arbiterInfo(char *buf, ArTypes::UByte2 len)
+{
+  const long long now = kinectTimeUSec();
+  if(now - myRateLastUSec >= 1000000)
+  {
+    unsigned long jobs = 0;
+    for(int a = 0; a < myArmCount; ++a)
+    {
+      const unsigned long n = myJobs[a];
+      myRate[a] = (n - myRateLastJobs[a]) * 1e6 / (now - myRateLastUSec);
+      jobs += n - myRateLastJobs[a];
+      myRateLastJobs[a] = n;
+    }
+    const unsigned long switches = mySwitches;
+    myJobsPerSwitch = switches > myRateLastSwitches ? (double)jobs / (switches - myRateLastSwitches) : jobs;
+    myRateLastSwitches = switches;
+    myRateLastUSec = now;
+  }
+  int n = 0, busiest = 0;
+  buf[0] = 0;
+  for(int a = 0; a < myArmCount && n < len; ++a)
+  {
+    n += snprintf(buf + n, len - n, "%s %.0f/s, ", armNames[a], myRate[a]);
+    if(myRate[a] > myRate[busiest])
+      busiest = a;
+  }
+  if(n < len)
+    snprintf(buf + n, len - n, "%.1f per switch, wait %.1f/%.1f/%.1f ms", myJobsPerSwitch,
+      myWaitTiming[busiest].getPercentile(50) / 1000.0, myWaitTiming[busiest].getPercentile(99) / 1000.0,
+      myWaitTiming[busiest].getMax() / 1000.0);
+}
@@ -0,0 +1,127 @@
+#ifndef KINOVAARBITER_H
+#define KINOVAARBITER_H
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <semaphore.h>
+#include "Aria.h"
+#include "KinectPipelineStats.h"
+
+namespace Kinova {
+#include "Kinova.API.CommLayerUbuntu.h"
+#include "Kinova.API.UsbCommandLayerUbuntu.h"
+#include "KinovaTypes.h"
+};
+
+#define KINOVA_ARBITER_MAX_ARMS 2
+
+/** The one thread that talks to the Kinova arms.
+ *
+ *  The Kinova API is not thread safe and has one global active device, so
+ *  every call for an arm has to be preceded by SetActiveDevice() and kept
+ *  apart from calls for the other arm. Instead of each caller doing that
+ *  under a lock, callers on any thread hand the arbiter a job (any
+ *  ArFunctor, usually with its arguments preset) for an arm with call();
+ *  it is queued for that arm, run on the arbiter's thread with that arm
+ *  active, and call() returns once it has run. Jobs must not call
+ *  SetActiveDevice() themselves.
+ *
+ *  The arbiter serves the arms in turn, running up to the batch size of
+ *  queued jobs for one arm before moving on to the next arm with work, and
+ *  only switches device when it moves to another arm. While just one arm
+ *  has work it is never switched away from; while both do, each switch
+ *  is paid for by a batch. Batches only form when several jobs are queued
+ *  for an arm, i.e. from several callers; one synchronous caller per arm
+ *  means one job per batch and a switch per job, as without the arbiter.
+ *  The jobs all run on the one thread, so batching saves the switches,
+ *  but the total rate for both arms cannot exceed that for one. A job waits at most for the jobs ahead of it for
+ *  its arm plus one batch of the other arm's, and urgent jobs (e.g.
+ *  stopping an arm) go to the front of their arm's queue.
+ *
+ *  callEach() queues a job for every arm at once and waits for them all, so
+ *  work for both arms is done back to back rather than one caller after
+ *  the other.
+ *
+ *  Initialize the API and find the arms first, then call start(). Jobs
+ *  for arms that do not exist, or submitted once the arbiter has stopped,
+ *  are not run.
+ */
+class KinovaArbiter : public virtual ArASyncTask
+{
+public:
+  /** @param maxBatch most jobs run for one arm before serving the other */
+  KinovaArbiter(int maxBatch = 4);
+  virtual ~KinovaArbiter();
+
+  /** Start serving arms @a devices[0] to @a devices[count - 1] */
+  void start(const Kinova::KinovaDevice *devices, int count);
+  /** Stop the thread, after running what is queued */
+  void stop();
+  int getArmCount() const { return myArmCount; }
+
+  /** Run @a job with arm @a arm active, after what is queued for that arm
+   *  (or before it, if @a urgent), and return once it has run. From a job,
+   *  runs it at once and then makes the calling job's arm active again.
+   *  @return false if it was not run */
+  bool call(int arm, ArFunctor *job, bool urgent = false);
+  /** Run @a jobs[i] with arm i active, for each of the first @a count arms
+   *  that has a job (NULL for none), and return once all have run.
+   *  @return false if any was not run */
+  bool callEach(ArFunctor **jobs, int count, bool urgent = false);
+
+  /** Jobs run for arm @a arm */
+  unsigned long getJobs(int arm) const { return myJobs[arm]; }
+  /** Times the active device was changed */
+  unsigned long getSwitches() const { return mySwitches; }
+  /** Queueing a job to starting it, for arm @a arm (us) */
+  const KinectLatencyHistogram& getWaitTiming(int arm) const { return myWaitTiming[arm]; }
+  /** Running a job, for arm @a arm (us) */
+  const KinectLatencyHistogram& getRunTiming(int arm) const { return myRunTiming[arm]; }
+
+  /** Add a "Kinova" string showing jobs per second for each arm, jobs per
+   *  device switch and the wait percentiles to @a group (e.g.
+   *  Aria::getInfoGroup()) */
+  void addInfoStrings(ArStringInfoGroup *group);
+
+  virtual void *runThread(void *);
+
+private:
+  struct Entry
+  {
+    ArFunctor *job;
+    sem_t *done;
+    long long queuedUSec;
+  };
+
+  int myMaxBatch;
+  int myArmCount;
+  Kinova::KinovaDevice myDevices[KINOVA_ARBITER_MAX_ARMS];
+  int myActive;  ///< arm last made the active device, -1 for none
+
+  ArMutex myMutex;
+  std::deque<Entry> myQueues[KINOVA_ARBITER_MAX_ARMS];
+  bool myAccepting;  ///< running, and taking jobs
+  sem_t myWake;      ///< posted for every job queued
+  std::atomic<bool> myHaveThread;
+  pthread_t myThread;
+
+  std::atomic<unsigned long> myJobs[KINOVA_ARBITER_MAX_ARMS];
+  std::atomic<unsigned long> mySwitches;
+  KinectLatencyHistogram myWaitTiming[KINOVA_ARBITER_MAX_ARMS];
+  KinectLatencyHistogram myRunTiming[KINOVA_ARBITER_MAX_ARMS];
+  unsigned long myRateLastJobs[KINOVA_ARBITER_MAX_ARMS];
+  unsigned long myRateLastSwitches;
+  long long myRateLastUSec;
+  double myRate[KINOVA_ARBITER_MAX_ARMS];
+  double myJobsPerSwitch;
+  std::vector<ArFunctor2<char*, ArTypes::UByte2>*> myInfoFunctors;
+
+  bool onThread() const;
+  void activate(int arm);
+  void serve();
+  void arbiterInfo(char *buf, ArTypes::UByte2 len);
+};
+
+#endif
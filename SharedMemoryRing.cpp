@@ -0,0 +1,227 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "SharedMemoryRing.h"
+
+static const char ringMagic[8] = "SHMRING";
+static const uint32_t ringVersion = 1;
+
+static size_t roundUp(size_t n, size_t to)
+{
+  return (n + to - 1) / to * to;
+}
+
+SharedMemoryRingWriter::SharedMemoryRingWriter(const std::string& name, size_t slotSize, int slots, const char *format) :
+  myName(name),
+  mySlotSize(slotSize),
+  mySlots(slots > 1 ? slots : 2),
+  myFormat(format),
+  myStride(roundUp(sizeof(SharedMemoryRingSlot) + slotSize, 64)),
+  myMapSize(roundUp(sizeof(SharedMemoryRingHeader), 64) + mySlots * myStride),
+  myHeader(NULL),
+  myWriting(NULL),
+  mySequence(0)
+{
+}
+
+SharedMemoryRingWriter::~SharedMemoryRingWriter()
+{
+  if(myHeader)
+  {
+    munmap(myHeader, myMapSize);
+    shm_unlink(myName.c_str());
+  }
+}
+
+bool SharedMemoryRingWriter::open()
+{
+  // Start afresh: readers still mapping an old segment keep it until they
+  // reopen, and never see this one change size under them.
+  shm_unlink(myName.c_str());
+  const int fd = shm_open(myName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if(fd < 0)
+  {
+    fprintf(stderr, "SharedMemoryRingWriter: could not create %s: %s\n", myName.c_str(), strerror(errno));
+    return false;
+  }
+  if(ftruncate(fd, myMapSize) != 0)
+  {
+    fprintf(stderr, "SharedMemoryRingWriter: could not size %s to %lu bytes: %s\n", myName.c_str(), (unsigned long)myMapSize, strerror(errno));
+    ::close(fd);
+    shm_unlink(myName.c_str());
+    return false;
+  }
+  void *p = mmap(NULL, myMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(p == MAP_FAILED)
+  {
+    fprintf(stderr, "SharedMemoryRingWriter: could not map %s: %s\n", myName.c_str(), strerror(errno));
+    shm_unlink(myName.c_str());
+    return false;
+  }
+
+  // ftruncate() zeroed it: all slots are empty and even
+  myHeader = (SharedMemoryRingHeader*)p;
+  myHeader->version = ringVersion;
+  myHeader->slots = mySlots;
+  myHeader->slotSize = mySlotSize;
+  myHeader->slotStride = myStride;
+  strncpy(myHeader->format, myFormat.c_str(), sizeof(myHeader->format) - 1);
+  myHeader->sequence.store(0);
+  // magic last, so a reader that sees it sees the rest
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(myHeader->magic, ringMagic, sizeof(ringMagic));
+  mySequence = 0;
+  return true;
+}
+
+SharedMemoryRingSlot *SharedMemoryRingWriter::slot(uint64_t sequence)
+{
+  return (SharedMemoryRingSlot*)((char*)myHeader + roundUp(sizeof(SharedMemoryRingHeader), 64) +
+    ((sequence - 1) % mySlots) * myStride);
+}
+
+void *SharedMemoryRingWriter::beginWrite()
+{
+  if(!myHeader)
+    return NULL;
+  myWriting = slot(mySequence + 1);
+  myWriting->seqlock.store(myWriting->seqlock.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return myWriting + 1;
+}
+
+void SharedMemoryRingWriter::endWrite(size_t size, long long timeUSec)
+{
+  if(!myWriting)
+    return;
+  ++mySequence;
+  myWriting->sequence = mySequence;
+  myWriting->timeUSec = timeUSec;
+  myWriting->size = size < mySlotSize ? size : mySlotSize;
+  myWriting->seqlock.store(myWriting->seqlock.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  myHeader->sequence.store(mySequence, std::memory_order_release);
+  myWriting = NULL;
+}
+
+bool SharedMemoryRingWriter::write(const void *data, size_t size, long long timeUSec)
+{
+  void *p = beginWrite();
+  if(!p)
+    return false;
+  memcpy(p, data, size < mySlotSize ? size : mySlotSize);
+  endWrite(size, timeUSec);
+  return true;
+}
+
+
+SharedMemoryRingReader::SharedMemoryRingReader() :
+  myHeader(NULL),
+  myMapSize(0)
+{
+}
+
+SharedMemoryRingReader::~SharedMemoryRingReader()
+{
+  close();
+}
+
+bool SharedMemoryRingReader::open(const std::string& name, const char *format)
+{
+  close();
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0)
+    return false;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedMemoryRingHeader))
+  {
+    ::close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(p == MAP_FAILED)
+    return false;
+  SharedMemoryRingHeader *h = (SharedMemoryRingHeader*)p;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if(memcmp(h->magic, ringMagic, sizeof(ringMagic)) != 0 || h->version != ringVersion ||
+     h->slots == 0 || roundUp(sizeof(SharedMemoryRingHeader), 64) + h->slots * h->slotStride > (size_t)st.st_size ||
+     (format && strncmp(h->format, format, sizeof(h->format)) != 0))
+  {
+    munmap(p, st.st_size);
+    return false;
+  }
+  myHeader = h;
+  myMapSize = st.st_size;
+  return true;
+}
+
+void SharedMemoryRingReader::close()
+{
+  if(myHeader)
+    munmap(myHeader, myMapSize);
+  myHeader = NULL;
+  myMapSize = 0;
+}
+
+uint64_t SharedMemoryRingReader::getSequence() const
+{
+  return myHeader ? myHeader->sequence.load(std::memory_order_acquire) : 0;
+}
+
+bool SharedMemoryRingReader::latest(Snapshot *s) const
+{
+  if(!myHeader)
+    return false;
+  for(int tries = 0; tries < 4; ++tries)
+  {
+    const uint64_t sequence = myHeader->sequence.load(std::memory_order_acquire);
+    if(sequence == 0)
+      return false;
+    const SharedMemoryRingSlot *slot = (const SharedMemoryRingSlot*)((const char*)myHeader +
+      roundUp(sizeof(SharedMemoryRingHeader), 64) + ((sequence - 1) % myHeader->slots) * myHeader->slotStride);
+    const uint64_t lock = slot->seqlock.load(std::memory_order_acquire);
+    if(lock & 1)
+      continue;
+    s->data = slot + 1;
+    s->size = slot->size;
+    s->sequence = slot->sequence;
+    s->timeUSec = slot->timeUSec;
+    s->seqlock = lock;
+    s->slot = slot;
+    // the writer may have moved on to this slot since reading the sequence
+    if(s->sequence == sequence && isValid(*s))
+      return true;
+  }
+  return false;
+}
+
+bool SharedMemoryRingReader::isValid(const Snapshot& s) const
+{
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return s.slot->seqlock.load(std::memory_order_relaxed) == s.seqlock;
+}
+
+size_t SharedMemoryRingReader::copyLatest(void *buf, size_t size, Snapshot *snapshot) const
+{
+  Snapshot s;
+  for(int tries = 0; tries < 4; ++tries)
+  {
+    if(!latest(&s))
+      return 0;
+    const size_t n = s.size < size ? s.size : size;
+    memcpy(buf, s.data, n);
+    if(isValid(s))
+    {
+      if(snapshot)
+        *snapshot = s;
+      return n;
+    }
+  }
+  return 0;
+}
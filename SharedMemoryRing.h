@@ -0,0 +1,179 @@
+#ifndef SHAREDMEMORYRING_H
+#define SHAREDMEMORYRING_H
+
+#include <atomic>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Latest-value ring in POSIX shared memory, for handing Kinect frames and
+ *  arm state to other processes on the same computer without ArNetworking,
+ *  compression or socket copies.
+ *
+ *  The segment (/dev/shm/<name>) holds a header and a fixed number of
+ *  fixed-size slots. The one writer fills the slots in turn and bumps the
+ *  header's sequence number after each; readers map the segment read-only
+ *  and read the latest slot in place, without locks or copies, and never
+ *  hold up the writer.
+ *
+ *  Each slot has a seqlock: its count is odd while the writer is in it and
+ *  goes up by two with every write. A reader notes the count, reads the
+ *  payload, then checks the count again (SharedMemoryRingReader::isValid()):
+ *  if it changed, the slot was overwritten meanwhile and what was read must
+ *  be thrown away. A slot is only overwritten slots-1 writes after it was
+ *  filled, so a reader has that long to use it in place.
+ *
+ *  Only POSIX and the C++11 standard library are used, so consumers need
+ *  nothing else from this tree (link with -lrt). Payloads from this tree
+ *  are KinectSharedFrame and ArmSharedState below.
+ */
+
+/** Beginning of the segment */
+struct SharedMemoryRingHeader
+{
+  char magic[8];                  ///< "SHMRING\0"
+  uint32_t version;
+  uint32_t slots;
+  uint64_t slotSize;              ///< largest payload
+  uint64_t slotStride;            ///< bytes from one slot to the next
+  char format[48];                ///< payload type, e.g. "KinectSharedFrame 1"
+  std::atomic<uint64_t> sequence; ///< of the latest complete write, 0 before the first
+};
+
+/** Each slot starts with this, followed by the payload */
+struct SharedMemoryRingSlot
+{
+  std::atomic<uint64_t> seqlock;  ///< odd while being written
+  uint64_t sequence;              ///< write number, from 1
+  int64_t timeUSec;               ///< CLOCK_MONOTONIC, as kinectTimeUSec()
+  uint64_t size;                  ///< payload bytes
+  unsigned char pad[32];          ///< to 64 bytes, so payloads are cache line aligned
+};
+
+/** Makes the segment and writes to it. Not thread safe: one writing
+ *  thread at a time. */
+class SharedMemoryRingWriter
+{
+public:
+  /** @param name shared memory object name, starting with '/'
+   *  @param slotSize largest payload in bytes
+   *  @param format stored in the header for readers to check */
+  SharedMemoryRingWriter(const std::string& name, size_t slotSize, int slots = 4, const char *format = "");
+  /** Unmaps and removes the segment */
+  ~SharedMemoryRingWriter();
+
+  /** Create (or replace) the segment.
+   *  @return false on error, reported on stderr */
+  bool open();
+  bool isOpen() const { return myHeader != NULL; }
+  const std::string& getName() const { return myName; }
+  size_t getSlotSize() const { return mySlotSize; }
+
+  /** Start writing the next slot: fill in up to getSlotSize() bytes at the
+   *  returned pointer, then call endWrite(). NULL if not open. */
+  void *beginWrite();
+  /** Publish the slot begun by beginWrite(), with @a size bytes of payload
+   *  and the time it refers to (e.g. the capture time) */
+  void endWrite(size_t size, long long timeUSec);
+  /** beginWrite(), copy @a size bytes from @a data, endWrite() */
+  bool write(const void *data, size_t size, long long timeUSec);
+
+  uint64_t getSequence() const { return mySequence; }
+
+private:
+  std::string myName;
+  size_t mySlotSize;
+  int mySlots;
+  std::string myFormat;
+  size_t myStride;
+  size_t myMapSize;
+  SharedMemoryRingHeader *myHeader;
+  SharedMemoryRingSlot *myWriting;
+  uint64_t mySequence;
+
+  SharedMemoryRingSlot *slot(uint64_t sequence);
+};
+
+/** Maps a ring read-only and reads from it in place */
+class SharedMemoryRingReader
+{
+public:
+  /** One slot as it was when read by latest() */
+  struct Snapshot
+  {
+    const void *data;   ///< payload, in the shared memory
+    size_t size;
+    uint64_t sequence;
+    long long timeUSec;
+    uint64_t seqlock;   ///< for isValid()
+    const SharedMemoryRingSlot *slot;
+  };
+
+  SharedMemoryRingReader();
+  ~SharedMemoryRingReader();
+
+  /** Map the segment @a name made by a SharedMemoryRingWriter.
+   *  @param format if not NULL, the header's format must match it
+   *  @return false if it does not exist or is not a ring */
+  bool open(const std::string& name, const char *format = NULL);
+  void close();
+  bool isOpen() const { return myHeader != NULL; }
+  const char *getFormat() const { return myHeader ? myHeader->format : ""; }
+
+  /** Sequence number of the latest complete write, 0 if none; cheap to
+   *  poll for new data */
+  uint64_t getSequence() const;
+  /** Point @a s at the latest complete write, in place.
+   *  @return false if there is none yet, or the writer is lapping us */
+  bool latest(Snapshot *s) const;
+  /** Whether @a s has not been overwritten since latest(): check after
+   *  reading from it, and discard what was read if not */
+  bool isValid(const Snapshot& s) const;
+  /** Copy the latest write into @a buf (up to @a size bytes), retrying if
+   *  it is overwritten while copying.
+   *  @return bytes copied, 0 if none */
+  size_t copyLatest(void *buf, size_t size, Snapshot *s = NULL) const;
+
+private:
+  SharedMemoryRingHeader *myHeader;
+  size_t myMapSize;
+};
+
+
+/** Payload of a Kinect ring (KinectArVideoServer::enableSharedMemory()):
+ *  this, then depth, then colour, at the given offsets from its start. */
+struct KinectSharedFrame
+{
+  uint64_t sequence;          ///< KinectArVideoServer frame sequence
+  int64_t captureUSec;        ///< when the frame was received, as kinectTimeUSec()
+  uint32_t depthTimestamp;    ///< the device's timestamp (0.1 ms units)
+  uint32_t depthWidth, depthHeight;  ///< float mm, not mirrored; 0 for invalid
+  uint32_t depthOffset;
+  uint32_t colorWidth, colorHeight;  ///< BGRX, not mirrored; 0x0 if not published
+  uint32_t colorOffset;
+  uint32_t pad;
+};
+#define KINECT_SHARED_FRAME_FORMAT "KinectSharedFrame 1"
+
+/** Payload of the arm state ring (ArmDemoTask::enableSharedMemory()) */
+struct ArmSharedState
+{
+  enum { MaxArms = 2 };
+  uint32_t armCount;
+  uint32_t pad;
+  struct Arm
+  {
+    uint32_t valid;          ///< position has been read
+    uint32_t pad;
+    int64_t timeUSec;        ///< when it was read
+    float x, y, z;           ///< end effector (m, arm axes: +x left, -y forward, +z up)
+    float thetaX, thetaY, thetaZ;  ///< rad
+    float fingers[3];
+    float torques[6];        ///< joint torques (Nm)
+    float base[3];           ///< arm base relative to the PTU (m, arm axes)
+    float angles[6];         ///< joint angles (degrees)
+  } arms[MaxArms];
+};
+#define ARM_SHARED_STATE_FORMAT "ArmSharedState 2"
+
+#endif
@@ -0,0 +1,78 @@
+/* Micro-benchmark: fused Kinect image kernels vs. the OpenCV
+ * resize + flip + cvtColor chain they replace.
+ *
+ * Usage: bench_kinect_kernels [width height [iterations]]
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <opencv2/opencv.hpp>
+
+#include "KinectImageKernels.h"
+
+static double msPerIter(int64 start, int iterations)
+{
+  return (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  const int width = argc > 2 ? atoi(argv[1]) : 320;
+  const int height = argc > 2 ? atoi(argv[2]) : 240;
+  const int iterations = argc > 3 ? atoi(argv[3]) : 300;
+
+  // synthetic frames of the size libfreenect2 produces
+  cv::Mat rgbm(1080, 1920, CV_8UC4);
+  cv::randu(rgbm, cv::Scalar::all(0), cv::Scalar::all(255));
+  cv::Mat depthm(424, 512, CV_32FC1);
+  cv::randu(depthm, cv::Scalar::all(0), cv::Scalar::all(6000));
+
+  std::cout << "Kinect image kernels (" << kinectKernelsInstructionSet() << ", "
+    << cv::getNumThreads() << " threads), output " << width << "x" << height
+    << ", " << iterations << " iterations" << std::endl;
+
+  /* OpenCV chain, as in KinectArVideoServer before the fused kernels */
+  cv::Mat rgbSmall(height, width, CV_8UC4), rgbFlip(height, width, CV_8UC4), rgbOut(height, width, CV_8UC3);
+  cv::Mat depthSmall(height, width, CV_32FC1), depthFlip(height, width, CV_32FC1), depthGrey(height, width, CV_8UC1), depthOut(height, width, CV_8UC3);
+
+  int64 t = cv::getTickCount();
+  for(int i = 0; i < iterations; ++i)
+  {
+    cv::resize(rgbm, rgbSmall, rgbSmall.size());
+    cv::flip(rgbSmall, rgbFlip, 1);
+    cv::cvtColor(rgbFlip, rgbOut, CV_BGRA2RGB);
+  }
+  const double cvColor = msPerIter(t, iterations);
+
+  t = cv::getTickCount();
+  for(int i = 0; i < iterations; ++i)
+  {
+    cv::resize(depthm, depthSmall, depthSmall.size());
+    cv::flip(depthSmall, depthFlip, 1);
+    depthFlip.convertTo(depthGrey, CV_8U, 255.0/4500.0);
+    cv::cvtColor(depthGrey, depthOut, CV_GRAY2RGB);
+  }
+  const double cvDepth = msPerIter(t, iterations);
+
+  /* Fused kernels */
+  KinectColorKernel colorKernel(1920, 1080, width, height);
+  KinectDepthKernel depthKernel(512, 424, width, height);
+  cv::Mat fusedRGB(height, width, CV_8UC3), fusedDepth(height, width, CV_8UC3);
+
+  t = cv::getTickCount();
+  for(int i = 0; i < iterations; ++i)
+    colorKernel.apply(rgbm, fusedRGB);
+  const double fusedColor = msPerIter(t, iterations);
+
+  t = cv::getTickCount();
+  for(int i = 0; i < iterations; ++i)
+    depthKernel.apply(depthm, fusedDepth);
+  const double fusedDepthMs = msPerIter(t, iterations);
+
+  std::cout << "colour: OpenCV " << cvColor << " ms, fused " << fusedColor << " ms ("
+    << cvColor / fusedColor << "x)" << std::endl;
+  std::cout << "depth:  OpenCV " << cvDepth << " ms, fused " << fusedDepthMs << " ms ("
+    << cvDepth / fusedDepthMs << "x)" << std::endl;
+
+  return 0;
+}
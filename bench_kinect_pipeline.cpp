@@ -0,0 +1,163 @@
+/* Benchmark of the whole Kinect video pipeline (KinectArVideoServer) using a
+ * recording made with demo -kinectRecord, so no Kinect is needed. Every
+ * source is processed and published as if a client were subscribed.
+ *
+ * Usage: bench_kinect_pipeline capturefile [-realtime] [-cloud voxelsize] [-grid cellsize] [-roi size] [-table] [-shm] [width height]
+ *
+ * By default frames are replayed as fast as the pipeline takes them; with
+ * -realtime they are replayed at the recorded rate. -cloud enables the point
+ * cloud stage with the given voxel size in metres, -grid the occupancy grid
+ * stage (updated every frame) with the given cell size in mm, -roi region of
+ * interest processing of the given size in metres around a point 1 m in
+ * front of the camera (with 3 pyramid levels, so that the rest of the frame
+ * is made at 1/4 size), -table table and object segmentation with the camera
+ * 1 m above the floor, level, -shm publishing depth and colour into the
+ * shared memory ring /KinectFrames.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Aria.h"
+#include "ArNetworking.h"
+#include "ArVideo.h"
+
+#include "KinectArVideoServer.h"
+#include "KinectCaptureFile.h"
+
+// -roi target
+static bool roiTarget(float *x, float *y, float *z)
+{
+  *x = *y = 0;
+  *z = 1;
+  return true;
+}
+
+static void printStage(const char *name, const KinectStageStats& s)
+{
+  const KinectLatencyHistogram& h = s.getHistogram();
+  printf("  %-16s %6lu frames %5lu dropped   mean %7.2f  p50 %7.2f  p99 %7.2f  max %7.2f ms\n",
+    name, s.getFrames(), s.getDropped(), s.getMeanUSec() / 1000.0,
+    h.getPercentile(50) / 1000.0, h.getPercentile(99) / 1000.0, h.getMax() / 1000.0);
+}
+
+static void printTiming(const char *name, const KinectLatencyHistogram& h)
+{
+  printf("  %-16s %6lu samples                      p50 %7.2f  p99 %7.2f  max %7.2f ms\n",
+    name, h.getCount(), h.getPercentile(50) / 1000.0, h.getPercentile(99) / 1000.0, h.getMax() / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 2)
+  {
+    std::cout << "Usage: " << argv[0] << " capturefile [-realtime] [-cloud voxelsize] [-grid cellsize] [-roi size] [-table] [-shm] [width height]" << std::endl;
+    return 1;
+  }
+  int arg = 2;
+  bool realTime = false;
+  if(argc > arg && strcmp(argv[arg], "-realtime") == 0)
+  {
+    realTime = true;
+    ++arg;
+  }
+  float voxelSize = 0;
+  if(argc > arg + 1 && strcmp(argv[arg], "-cloud") == 0)
+  {
+    voxelSize = atof(argv[arg + 1]);
+    arg += 2;
+  }
+  int cellSize = 0;
+  if(argc > arg + 1 && strcmp(argv[arg], "-grid") == 0)
+  {
+    cellSize = atoi(argv[arg + 1]);
+    arg += 2;
+  }
+  float roiSize = 0;
+  if(argc > arg + 1 && strcmp(argv[arg], "-roi") == 0)
+  {
+    roiSize = atof(argv[arg + 1]);
+    arg += 2;
+  }
+  bool table = false;
+  if(argc > arg && strcmp(argv[arg], "-table") == 0)
+  {
+    table = true;
+    ++arg;
+  }
+  bool shm = false;
+  if(argc > arg && strcmp(argv[arg], "-shm") == 0)
+  {
+    shm = true;
+    ++arg;
+  }
+  const int width = argc > arg + 1 ? atoi(argv[arg]) : 320;
+  const int height = argc > arg + 1 ? atoi(argv[arg + 1]) : 240;
+
+  Aria::init();
+  ArVideo::init();
+
+  KinectReplaySource replay(argv[1], realTime);
+  if(!replay.open())
+    return 2;
+  ArServerBase server;  // not opened, just holds the ArVideo data handlers
+  KinectArVideoServer pipeline(&server, width, height, roiSize > 0 ? 3 : 1);
+  pipeline.setFrameSource(&replay);
+  pipeline.setAlwaysStream(true);
+  if(voxelSize > 0)
+    pipeline.enablePointCloud(voxelSize);
+  ArServerInfoDrawings drawings(&server);
+  if(cellSize > 0)
+    pipeline.enableOccupancyGrid(&drawings, cellSize, 2000, 0);
+  ArGlobalRetFunctor3<bool, float*, float*, float*> roiFunctor(&roiTarget);
+  if(roiSize > 0)
+    pipeline.enableROI(&roiFunctor, roiSize);
+  if(table)
+    pipeline.enableTableSegmentation();
+  if(shm && !pipeline.enableSharedMemory(true))
+    return 2;
+
+  const long long start = kinectTimeUSec();
+  pipeline.runAsync();
+  while(!pipeline.isSourceFinished())
+    ArUtil::sleep(100);
+  pipeline.join();  // runThread() drains the stages before returning
+  const double sec = (kinectTimeUSec() - start) / 1e6;
+
+  const KinectStageStats& published = pipeline.getStageStats(KinectArVideoServer::PublishStage);
+  printf("%s: %lu frames at %dx%d in %.2f sec, %.1f fps\n", argv[1],
+    published.getFrames(), width, height, sec, published.getFrames() / sec);
+  printStage("capture", pipeline.getStageStats(KinectArVideoServer::CaptureStage));
+  printStage("process", pipeline.getStageStats(KinectArVideoServer::ProcessStage));
+  printStage("cloud", pipeline.getStageStats(KinectArVideoServer::CloudStage));
+  printStage("grid", pipeline.getStageStats(KinectArVideoServer::GridStage));
+  printStage("publish", published);
+  printTiming("frame wait", pipeline.getTiming(KinectArVideoServer::FrameWaitTiming));
+  printTiming("decode", pipeline.getTiming(KinectArVideoServer::DecodeTiming));
+  printTiming("ROI", pipeline.getTiming(KinectArVideoServer::ROITiming));
+  printTiming("resize/flip", pipeline.getTiming(KinectArVideoServer::ResizeTiming));
+  printTiming("depth normalize", pipeline.getTiming(KinectArVideoServer::DepthNormalizeTiming));
+  printTiming("point cloud", pipeline.getTiming(KinectArVideoServer::PointCloudTiming));
+  printTiming("table", pipeline.getTiming(KinectArVideoServer::TableTiming));
+  printTiming("occupancy grid", pipeline.getTiming(KinectArVideoServer::OccupancyGridTiming));
+  printTiming("ArVideo copy", pipeline.getTiming(KinectArVideoServer::VideoCopyTiming));
+  printTiming("shared memory", pipeline.getTiming(KinectArVideoServer::SharedMemoryTiming));
+  printTiming("frame to publish", pipeline.getTiming(KinectArVideoServer::FrameToPublishTiming));
+  KinectPoints cloud;
+  if(pipeline.getLatestPointCloud(&cloud))
+    printf("  last point cloud: %lu points\n", (unsigned long)cloud.size());
+  KinectPlane plane;
+  KinectObjects objects;
+  if(table && pipeline.getLatestTable(&plane, &objects))
+    printf("  last table: %lu of %lu points on the plane, %lu objects\n", (unsigned long)plane.inliers,
+      (unsigned long)pipeline.getTableSegmenter()->getLastPoints(), (unsigned long)objects.size());
+  if(cellSize > 0)
+    printf("  last occupancy grid update: %lu cells changed, %lu occupied\n",
+      (unsigned long)pipeline.getOccupancyGrid()->getLastChangedCells(),
+      (unsigned long)pipeline.getOccupancyGrid()->getOccupiedCells());
+  printf("  frame buffer allocations after startup: %lu\n", pipeline.getTotalFrameAllocations());
+
+  Aria::exit(0);
+  return 0;
+}
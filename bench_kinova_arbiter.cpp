@@ -0,0 +1,171 @@
+/* Benchmark of Kinova command throughput through KinovaArbiter, with the
+ * arms connected (they are only read, not moved).
+ *
+ * Usage: bench_kinova_arbiter [seconds] [batch] [callers per arm]
+ *
+ * For the given time each (default 3 s), position reads are submitted as
+ * fast as the arbiter runs them: by one thread for the first arm alone,
+ * then by one thread per arm, then by several threads per arm (default the
+ * batch size), then from a single thread with callEach(). Prints the reads
+ * per second for each arm and in total, the device switches, and the time
+ * jobs waited in the queue.
+ *
+ * The arbiter runs every job on its one thread, so the total for several
+ * arms cannot beat that for one arm; what batching saves is the device
+ * switches between them. With one synchronous caller per arm there is never
+ * more than one job queued per arm, so every job costs a switch; with
+ * several callers per arm, batches form and the total should come close to
+ * that of one arm.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "Aria.h"
+#include "KinovaArbiter.h"
+
+static KinovaArbiter *arbiter;
+static int seconds = 3;
+static std::atomic<bool> benchRunning;
+
+static void readPosition()
+{
+  Kinova::CartesianPosition p;
+  Kinova::GetCartesianPosition(p);
+}
+
+/** Submits reads for one arm until told to stop */
+class ArmLoad : public virtual ArASyncTask
+{
+public:
+  ArmLoad(int arm) : myArm(arm), myJob(&readPosition) {}
+  virtual void *runThread(void *)
+  {
+    while(benchRunning)
+      arbiter->call(myArm, &myJob);
+    return NULL;
+  }
+private:
+  int myArm;
+  ArGlobalFunctor myJob;
+};
+
+static void printRun(const char *name, const unsigned long *before, unsigned long switchesBefore)
+{
+  unsigned long total = 0;
+  printf("  %-12s", name);
+  for(int a = 0; a < arbiter->getArmCount(); ++a)
+  {
+    const unsigned long n = arbiter->getJobs(a) - before[a];
+    total += n;
+    printf("  arm %d %7.1f/s", a, (double)n / seconds);
+  }
+  const unsigned long switches = arbiter->getSwitches() - switchesBefore;
+  printf("  total %7.1f/s  %lu switches\n", (double)total / seconds, switches);
+}
+
+static void snapshot(unsigned long *jobs, unsigned long *switches)
+{
+  for(int a = 0; a < arbiter->getArmCount(); ++a)
+    jobs[a] = arbiter->getJobs(a);
+  *switches = arbiter->getSwitches();
+}
+
+/** Load every arm from @a callers threads each */
+static void runAllArms(const char *name, int count, int callers)
+{
+  unsigned long before[KINOVA_ARBITER_MAX_ARMS], switches;
+  snapshot(before, &switches);
+  benchRunning = true;
+  std::vector<ArmLoad*> loads;
+  for(int a = 0; a < count; ++a)
+    for(int c = 0; c < callers; ++c)
+    {
+      loads.push_back(new ArmLoad(a));
+      loads.back()->runAsync();
+    }
+  ArUtil::sleep(seconds * 1000);
+  benchRunning = false;
+  for(size_t i = 0; i < loads.size(); ++i)
+  {
+    loads[i]->join();
+    delete loads[i];
+  }
+  printRun(name, before, switches);
+}
+
+int main(int argc, char **argv)
+{
+  Aria::init();
+  if(argc > 1)
+    seconds = atoi(argv[1]);
+  const int batch = argc > 2 ? atoi(argv[2]) : 4;
+  const int callers = argc > 3 ? std::max(atoi(argv[3]), 1) : std::max(batch, 1);
+
+  int result;
+  if(Kinova::InitAPI() != 1)
+  {
+    std::cout << "Error initializing Kinova API" << std::endl;
+    return 2;
+  }
+  Kinova::KinovaDevice devices[MAX_KINOVA_DEVICE];
+  int count = Kinova::GetDevices(devices, result);
+  if(count <= 0)
+  {
+    std::cout << "No arms found" << std::endl;
+    Kinova::CloseAPI();
+    return 2;
+  }
+  count = std::min(count, KINOVA_ARBITER_MAX_ARMS);
+  printf("%d arms, batches of up to %d, %d callers per arm, %d s each\n", count, batch, callers, seconds);
+
+  arbiter = new KinovaArbiter(batch);
+  arbiter->start(devices, count);
+  unsigned long before[KINOVA_ARBITER_MAX_ARMS], switches;
+
+  // first arm alone
+  snapshot(before, &switches);
+  benchRunning = true;
+  ArmLoad first(0);
+  first.runAsync();
+  ArUtil::sleep(seconds * 1000);
+  benchRunning = false;
+  first.join();
+  printRun("one arm", before, switches);
+
+  // every arm, each from its own thread, then from several threads each
+  runAllArms("all arms", count, 1);
+  if(callers > 1)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "%d per arm", callers);
+    runAllArms(name, count, callers);
+  }
+
+  // every arm from one thread
+  snapshot(before, &switches);
+  ArGlobalFunctor job(&readPosition);
+  ArFunctor *jobs[KINOVA_ARBITER_MAX_ARMS];
+  for(int a = 0; a < count; ++a)
+    jobs[a] = &job;
+  ArTime start;
+  while(start.mSecSince() < seconds * 1000)
+    arbiter->callEach(jobs, count);
+  printRun("callEach", before, switches);
+
+  for(int a = 0; a < count; ++a)
+  {
+    const KinectLatencyHistogram& w = arbiter->getWaitTiming(a);
+    const KinectLatencyHistogram& r = arbiter->getRunTiming(a);
+    printf("  arm %d: queued p50 %.2f p99 %.2f max %.2f ms, run p50 %.2f p99 %.2f ms\n", a,
+      w.getPercentile(50) / 1000.0, w.getPercentile(99) / 1000.0, w.getMax() / 1000.0,
+      r.getPercentile(50) / 1000.0, r.getPercentile(99) / 1000.0);
+  }
+
+  delete arbiter;
+  Kinova::CloseAPI();
+  return 0;
+}
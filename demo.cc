@@ -1,5 +1,7 @@
 
 #include <iostream>
+#include <vector>
+#include <unistd.h>
 
 #include "Aria.h"
 #include "ArSystemStatus.h"
@@ -7,7 +9,9 @@
 #include "ArVideo.h"
 
 #include "ArmDemoTask.h"
+#include "ArmSafetyMonitor.h"
 #include "KinectArVideoServer.h"
+#include "KinectCaptureFile.h"
 
 // Return codes:
 // 0 - Normal exit
@@ -18,6 +22,56 @@
 // 7 - Error connecting to ARNL server
 
 
+// Kinect pose for the occupancy grid: it sits on the PTU
+static ArPTZ *kinectPTU = NULL;
+static int kinectHeight = 1000;  // mm above the floor
+
+static bool getKinectCameraPose(KinectCameraPose *pose)
+{
+  if(!kinectPTU)
+    return false;
+  pose->x = pose->y = 0;
+  pose->z = kinectHeight;
+  pose->pan = kinectPTU->getPan();
+  pose->tilt = kinectPTU->getTilt();
+  return true;
+}
+
+// The main Kinect server only follows the marker on the gripper while an
+// arm demo runs, and only looks for something on the table to pick up
+// while a position demo runs, so that the Kinect can still pause between
+// demos.
+static KinectArVideoServer *kinectArmServer = NULL;
+
+static void armDemoRunning(bool running, DemoMode mode)
+{
+  kinectArmServer->setMarkerTrackingActive(running);
+  kinectArmServer->setTableSegmentationActive(running && mode == CartesianPos);
+}
+
+// Replay source of the main Kinect server, if any. Aria::exit() never
+// returns to main(), so an exit callback closes the server, which waits for
+// its capture thread, before deleting the source.
+static KinectArVideoServer *kinectServer = NULL;
+static KinectReplaySource *kinectReplay = NULL;
+
+static void closeKinectReplay()
+{
+  kinectServer->close();
+  delete kinectReplay;
+  kinectReplay = NULL;
+}
+
+// CPUs for Kinect pipeline i of n: an equal share of the cores each
+static std::vector<int> kinectCPUs(size_t i, size_t n)
+{
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<int> v;
+  for(long c = i * cpus / n; c < (long)((i + 1) * cpus / n); ++c)
+    v.push_back(c);
+  return v;
+}
+
 
 int main(int argc, char **argv)
 {
@@ -38,6 +92,19 @@ int main(int argc, char **argv)
 
   argParser.loadDefaultArguments();
 
+  // Replay Kinect frames from a capture file instead of using the device,
+  // and/or record Kinect frames to a capture file
+  const char *kinectReplayFile = NULL;
+  const char *kinectRecordFile = NULL;
+  argParser.checkParameterArgumentString("-kinectReplay", &kinectReplayFile);
+  argParser.checkParameterArgumentString("-kinectRecord", &kinectRecordFile);
+  // Height of the Kinect above the floor, in mm, for the occupancy grid
+  argParser.checkParameterArgumentInteger("-kinectHeight", &kinectHeight);
+  // Publish the arm state and raw Kinect depth (and colour) in shared
+  // memory for other processes on this computer, see sharedMemoryClient
+  const bool sharedMemory = argParser.checkArgument("-sharedMemory");
+  const bool sharedMemoryColor = argParser.checkArgument("-sharedMemoryColor");
+
   if(!Aria::parseArgs())
   {
     puts("error parsing args");
@@ -105,6 +172,9 @@ int main(int argc, char **argv)
     ArLog::log(ArLog::Terse, "Could not connect to arms.");
     Aria::exit(2);
   }
+  // arm state for other processes on this computer, see sharedMemoryClient
+  if(sharedMemory)
+    armDemoTask.enableSharedMemory();
   ArLog::log(ArLog::Normal, "Parking arms");
   armDemoTask.park_arms();
   ArLog::log(ArLog::Normal, "Starting Arm Demo monitor task");
@@ -182,8 +252,89 @@ int main(int argc, char **argv)
     new ArFunctor2C<ArmDemoTask, ArServerClient*, ArNetPacket*>(&armDemoTask, &ArmDemoTask::armEENetDrawingCallback));
 
   /* Kinect */
-  KinectArVideoServer kinectVideoServer(&server);
+  // One pipeline per Kinect, sharing a libfreenect2 context: the first
+  // device found is served as "Kinect", any others as "Kinect2",
+  // "Kinect3"..., each pipeline on its own share of the cores.
+  libfreenect2::Freenect2 freenect2;
+  std::vector<std::string> kinectSerials;
+  if(!kinectReplayFile)
+  {
+    kinectSerials = KinectDeviceSource::enumerate(&freenect2);
+    printf("Found %lu Kinects\n", kinectSerials.size());
+  }
+  // 320x240 as before, plus 160x120 and 80x60 pyramid levels
+  KinectArVideoServer kinectVideoServer(&server, 320, 240, 3);
+  if(!kinectSerials.empty())
+    kinectVideoServer.setDevice(&freenect2, kinectSerials[0]);
+  if(kinectSerials.size() > 1)
+    kinectVideoServer.setCPUs(kinectCPUs(0, kinectSerials.size()));
+  std::vector<KinectArVideoServer*> moreKinects;
+  for(size_t i = 1; i < kinectSerials.size(); ++i)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "Kinect%lu", i + 1);
+    KinectArVideoServer *k = new KinectArVideoServer(&server, 320, 240, 3);
+    k->setName(name);
+    k->setDevice(&freenect2, kinectSerials[i]);
+    k->setCPUs(kinectCPUs(i, kinectSerials.size()));
+    if(sharedMemory)
+      k->enableSharedMemory(sharedMemoryColor);
+    k->addInfoStrings(Aria::getInfoGroup());
+    moreKinects.push_back(k);
+  }
+  if(kinectReplayFile)
+  {
+    kinectReplay = new KinectReplaySource(kinectReplayFile, true, true);
+    kinectVideoServer.setFrameSource(kinectReplay);
+  }
+  if(kinectRecordFile)
+    kinectVideoServer.startRecording(kinectRecordFile);
+  // raw frames for other processes on this computer, read in place from
+  // /dev/shm/KinectFrames (Kinect2Frames...) without going through
+  // ArNetworking, while the Kinect is streaming anyway
+  if(sharedMemory)
+    kinectVideoServer.enableSharedMemory(sharedMemoryColor);
+  // 5 cm cells 2 m around the robot, 5 times a second
+  kinectPTU = ptu;
+  ArGlobalRetFunctor1<bool, KinectCameraPose*> kinectPoseFunctor(&getKinectCameraPose);
+  kinectVideoServer.setCameraPoseFunctor(&kinectPoseFunctor);
+  kinectVideoServer.enableOccupancyGrid(&drawingsServer, 50, 2000, 200);
+  // process 40 cm around the left arm's end effector in full detail, the
+  // rest at 160x120
+  ArRetFunctor3C<bool, ArmDemoTask, float*, float*, float*> armEEInCameraFunctor(
+    &armDemoTask, &ArmDemoTask::getEndEffectorInCamera);
+  kinectVideoServer.enableROI(&armEEInCameraFunctor, 0.4f);
+  // follow the retroreflective marker on the gripper in the IR image and
+  // compare it with where the arm says it is, while a demo runs
+  kinectVideoServer.enableMarkerTracking();
+  kinectVideoServer.setMarkerTrackingActive(false);
+  kinectVideoServer.setMarkerReferenceFunctor(&armEEInCameraFunctor);
+  // find objects on the table for the arm to pick up, in the position demo
+  kinectVideoServer.enableTableSegmentation();
+  kinectVideoServer.setTableSegmentationActive(false);
+  kinectArmServer = &kinectVideoServer;
+  ArGlobalFunctor2<bool, DemoMode> armDemoRunningFunctor(&armDemoRunning);
+  armDemoTask.setDemoRunningFunctor(&armDemoRunningFunctor);
+  ArRetFunctor3C<bool, KinectArVideoServer, float*, float*, float*> kinectGraspTargetFunctor(
+    &kinectVideoServer, &KinectArVideoServer::getGraspTarget);
+  armDemoTask.setGraspTargetFunctor(&kinectGraspTargetFunctor);
+  // slow the arms down when anything comes near them, stop them when it
+  // gets close
+  ArmSafetyMonitor armSafetyMonitor(&armDemoTask, &kinectVideoServer);
+  armSafetyMonitor.addInfoStrings(Aria::getInfoGroup());
+  armDemoTask.getStateSampler()->addInfoStrings(Aria::getInfoGroup());
+  armDemoTask.getArbiter()->addInfoStrings(Aria::getInfoGroup());
+  armSafetyMonitor.runAsync();
+  kinectVideoServer.addInfoStrings(Aria::getInfoGroup());
   kinectVideoServer.runAsync();
+  ArGlobalFunctor closeKinectReplayFunctor(&closeKinectReplay);
+  if(kinectReplay)
+  {
+    kinectServer = &kinectVideoServer;
+    Aria::addExitCallback(&closeKinectReplayFunctor);
+  }
+  for(size_t i = 0; i < moreKinects.size(); ++i)
+    moreKinects[i]->runAsync();
   
 
   /* Start server */
@@ -0,0 +1,67 @@
+/* Connects to the demo's ArNetworking server, receives the lossless Kinect
+ * depth stream and prints the size of each frame and the depth at its
+ * centre.
+ *
+ * Usage: kinectDepthClient -host <robot> [-port 7272] [-request getKinect2DepthRVL]
+ *
+ * -request selects another Kinect's stream when the server has several.
+ */
+
+#include <stdio.h>
+
+#include "Aria.h"
+#include "ArNetworking.h"
+
+#include "KinectDepthClient.h"
+
+KinectDepthClient *depthClient = NULL;
+
+void frameReceived()
+{
+  std::vector<unsigned short> depth;
+  int w, h;
+  unsigned long seq;
+  if(!depthClient->getLatest(depth, &w, &h, &seq))
+    return;
+  printf("frame %lu: %dx%d, %lu bytes (%.1f%% of raw), centre depth %u mm\n",
+    seq, w, h, (unsigned long)depthClient->getLastFrameSize(),
+    100.0 * depthClient->getLastFrameSize() / (2.0 * w * h),
+    depth[(h/2) * w + w/2]);
+}
+
+int main(int argc, char **argv)
+{
+  Aria::init();
+  ArArgumentParser argParser(&argc, argv);
+  ArClientBase client;
+  ArClientSimpleConnector clientConnector(&argParser);
+  argParser.loadDefaultArguments();
+  const char *request = KINECT_DEPTH_RVL_REQUEST;
+  argParser.checkParameterArgumentString("-request", &request);
+
+  if(!Aria::parseArgs() || !argParser.checkHelp())
+  {
+    Aria::logOptions();
+    Aria::exit(1);
+  }
+
+  if(!clientConnector.connectClient(&client))
+  {
+    ArLog::log(ArLog::Terse, "Could not connect to server. Specify server address or name with -host option.");
+    Aria::exit(2);
+  }
+
+  KinectDepthClient kinectDepth(&client, request);
+  depthClient = &kinectDepth;
+  ArGlobalFunctor frameCB(&frameReceived);
+  kinectDepth.setFrameCallback(&frameCB);
+  client.runAsync();
+  if(!kinectDepth.request(100))
+    Aria::exit(3);
+
+  while(client.getRunningWithLock())
+    ArUtil::sleep(1000);
+
+  Aria::exit(0);
+  return 0;
+}
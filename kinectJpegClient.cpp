@@ -0,0 +1,79 @@
+/* Connects to the demo's ArNetworking server, receives whole JPEG frames of
+ * a Kinect video stream from its JPEG cache and prints, once a second, the
+ * bandwidth and frame rate. With -save, the latest frame is also written to
+ * a file once a second, e.g. for a web page to show.
+ *
+ * Usage: kinectJpegClient -host <robot> [-port 7272] [-source <ArVideo source name>]
+ *          [-interval <ms>] [-quality <1-100>] [-save <file.jpg>]
+ */
+
+#include <stdio.h>
+
+#include "Aria.h"
+#include "ArNetworking.h"
+
+#include "KinectJpegClient.h"
+
+int main(int argc, char **argv)
+{
+  Aria::init();
+  ArArgumentParser argParser(&argc, argv);
+  ArClientBase client;
+  ArClientSimpleConnector clientConnector(&argParser);
+  argParser.loadDefaultArguments();
+
+  const char *source = "Kinect_RGB|libfreenect2|OpenCV";
+  argParser.checkParameterArgumentString("-source", &source);
+  int interval = 100;
+  argParser.checkParameterArgumentInteger("-interval", &interval);
+  int quality = 75;
+  argParser.checkParameterArgumentInteger("-quality", &quality);
+  const char *saveFile = NULL;
+  argParser.checkParameterArgumentString("-save", &saveFile);
+
+  if(!Aria::parseArgs() || !argParser.checkHelp())
+  {
+    Aria::logOptions();
+    Aria::exit(1);
+  }
+
+  if(!clientConnector.connectClient(&client))
+  {
+    ArLog::log(ArLog::Terse, "Could not connect to server. Specify server address or name with -host option.");
+    Aria::exit(2);
+  }
+
+  KinectJpegClient jpeg(&client, source);
+  client.runAsync();
+  if(!jpeg.request(interval, quality))
+    Aria::exit(3);
+
+  unsigned long lastBytes = 0, lastFrames = 0;
+  ArTime lastTime;
+  std::vector<unsigned char> frame;
+  while(client.getRunningWithLock())
+  {
+    ArUtil::sleep(1000);
+    const unsigned long bytes = jpeg.getBytesReceived();
+    const unsigned long frames = jpeg.getFramesReceived();
+    const double sec = lastTime.mSecSince() / 1000.0;
+    lastTime.setToNow();
+    printf("%.1f kB/s, %.1f frames/s at quality %d, %lu empty replies, %lu decode errors\n",
+      (bytes - lastBytes) / 1024.0 / sec, (frames - lastFrames) / sec, jpeg.getLastQuality(),
+      jpeg.getEmptyReplies(), jpeg.getDecodeErrors());
+    lastBytes = bytes;
+    lastFrames = frames;
+
+    if(saveFile && jpeg.getLatestJpeg(frame))
+    {
+      FILE *f = fopen(saveFile, "wb");
+      if(!f || fwrite(&frame[0], 1, frame.size(), f) != frame.size())
+        ArLog::log(ArLog::Terse, "Could not write %s", saveFile);
+      if(f)
+        fclose(f);
+    }
+  }
+
+  Aria::exit(0);
+  return 0;
+}
@@ -0,0 +1,67 @@
+/* Connects to the demo's ArNetworking server, receives a delta coded Kinect
+ * video stream and prints, once a second, the bandwidth it uses and how many
+ * tiles each update carried.
+ *
+ * Usage: kinectTileClient -host <robot> [-port 7272] [-source <ArVideo source name>]
+ *          [-interval <ms>]
+ */
+
+#include <stdio.h>
+
+#include "Aria.h"
+#include "ArNetworking.h"
+
+#include "KinectTileClient.h"
+
+int main(int argc, char **argv)
+{
+  Aria::init();
+  ArArgumentParser argParser(&argc, argv);
+  ArClientBase client;
+  ArClientSimpleConnector clientConnector(&argParser);
+  argParser.loadDefaultArguments();
+
+  const char *source = "Kinect_RGB|libfreenect2|OpenCV";
+  argParser.checkParameterArgumentString("-source", &source);
+  int interval = 100;
+  argParser.checkParameterArgumentInteger("-interval", &interval);
+
+  if(!Aria::parseArgs() || !argParser.checkHelp())
+  {
+    Aria::logOptions();
+    Aria::exit(1);
+  }
+
+  if(!clientConnector.connectClient(&client))
+  {
+    ArLog::log(ArLog::Terse, "Could not connect to server. Specify server address or name with -host option.");
+    Aria::exit(2);
+  }
+
+  KinectTileClient tiles(&client, source);
+  client.runAsync();
+  if(!tiles.request(interval))
+    Aria::exit(3);
+
+  unsigned long lastBytes = 0, lastFrames = 0, lastTiles = 0;
+  ArTime lastTime;
+  while(client.getRunningWithLock())
+  {
+    ArUtil::sleep(1000);
+    const unsigned long bytes = tiles.getBytesReceived();
+    const unsigned long frames = tiles.getFramesReceived();
+    const unsigned long nTiles = tiles.getTilesReceived();
+    const double sec = lastTime.mSecSince() / 1000.0;
+    lastTime.setToNow();
+    printf("%.1f kB/s, %.1f updates/s, %.1f tiles/update, %lu keyframes, %lu empty updates\n",
+      (bytes - lastBytes) / 1024.0 / sec, (frames - lastFrames) / sec,
+      frames > lastFrames ? (double)(nTiles - lastTiles) / (frames - lastFrames) : 0.0,
+      tiles.getKeyframesReceived(), tiles.getEmptyFramesReceived());
+    lastBytes = bytes;
+    lastFrames = frames;
+    lastTiles = nTiles;
+  }
+
+  Aria::exit(0);
+  return 0;
+}
@@ -0,0 +1,99 @@
+/* Reads the Kinect frames or arm state that the demo publishes in shared
+ * memory, in place, and prints each new one: how old it is, and the depth
+ * at the centre of the frame or where the arms are.
+ *
+ * Usage: sharedMemoryClient [/KinectFrames | /Kinect2Frames | /ArmState]
+ *
+ * Runs on the same computer as the demo. Needs neither Aria nor a network
+ * connection, only SharedMemoryRing.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "SharedMemoryRing.h"
+
+static long long nowUSec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void printFrame(const SharedMemoryRingReader::Snapshot& s, char *line, size_t len)
+{
+  const KinectSharedFrame *f = (const KinectSharedFrame*)s.data;
+  float centre = 0;
+  if(f->depthWidth > 0)
+  {
+    const float *depth = (const float*)((const char*)s.data + f->depthOffset);
+    centre = depth[(f->depthHeight / 2) * f->depthWidth + f->depthWidth / 2];
+  }
+  snprintf(line, len, "frame %llu: depth %ux%u, colour %ux%u, centre depth %.0f mm",
+    (unsigned long long)f->sequence, f->depthWidth, f->depthHeight, f->colorWidth, f->colorHeight, centre);
+}
+
+static void printArms(const SharedMemoryRingReader::Snapshot& s, char *line, size_t len)
+{
+  const ArmSharedState *a = (const ArmSharedState*)s.data;
+  int n = snprintf(line, len, "%u arms:", a->armCount);
+  for(unsigned int i = 0; i < a->armCount && i < ArmSharedState::MaxArms && n < (int)len; ++i)
+  {
+    if(a->arms[i].valid)
+      n += snprintf(line + n, len - n, " #%u (%.3f, %.3f, %.3f)", i, a->arms[i].x, a->arms[i].y, a->arms[i].z);
+    else
+      n += snprintf(line + n, len - n, " #%u unknown", i);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = argc > 1 ? argv[1] : "/KinectFrames";
+  SharedMemoryRingReader reader;
+  while(!reader.open(name))
+  {
+    printf("waiting for %s...\n", name);
+    sleep(1);
+  }
+  const bool frames = strcmp(reader.getFormat(), KINECT_SHARED_FRAME_FORMAT) == 0;
+  const bool arms = strcmp(reader.getFormat(), ARM_SHARED_STATE_FORMAT) == 0;
+  if(!frames && !arms)
+  {
+    printf("%s holds %s, which I don't know how to show\n", name, reader.getFormat());
+    return 1;
+  }
+
+  uint64_t last = 0;
+  unsigned long missed = 0, torn = 0;
+  while(true)
+  {
+    const uint64_t seq = reader.getSequence();
+    if(seq == last)
+    {
+      usleep(1000);
+      continue;
+    }
+    SharedMemoryRingReader::Snapshot s;
+    if(!reader.latest(&s))
+      continue;
+    if(last > 0 && s.sequence > last + 1)
+      missed += s.sequence - last - 1;
+    last = s.sequence;
+    char line[256];
+    if(frames)
+      printFrame(s, line, sizeof(line));
+    else
+      printArms(s, line, sizeof(line));
+    // what was read may have been overwritten meanwhile
+    if(!reader.isValid(s))
+    {
+      ++torn;
+      continue;
+    }
+    printf("%s, %.1f ms old (%lu skipped, %lu overwritten while reading)\n",
+      line, (nowUSec() - s.timeUSec) / 1000.0, missed, torn);
+  }
+  return 0;
+}